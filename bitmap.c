@@ -3,51 +3,178 @@
 #include "io.h"
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include "ibfs.h"  
 
-#define INODE_BITMAP_BLOCK 1
-#define DATA_BITMAP_BLOCK 2
-
-int alloc_inode_num(IBFS_Context* ctx)
+static int bitmap_alloc_bits(IBFS_Context* ctx, uint32_t bitmap_block, uint32_t first_bit, uint32_t num_bits, bool near,
+                             uint32_t* bit_out, uint32_t* count_inout)
 {
-    char block_buffer[BLOCK_SIZE];
-    if (read_block(ctx, INODE_BITMAP_BLOCK, block_buffer) != 0)
-    {
-        fprintf(stderr, "alloc_inode_num: Failed to read inode bitmap block\n");
+    IBFS_BLOCK_ALIGNED unsigned char block_buffer[ctx->sb.block_size];
+    if (read_meta_block(ctx, bitmap_block, block_buffer) != 0) {
+        fprintf(stderr, "bitmap_alloc_bits: Failed to read bitmap block %u\n", bitmap_block);
         return -1;
     }
 
-    if (ctx->sb.inode_count == 0) {
-        fprintf(stderr, "alloc_inode_num: Error - inode_count in context is zero.\n");
-        return -1;
+    /* When the goal is taken, prefer the start of an empty byte so the caller
+       gets room to grow contiguously instead of a one-block hole. */
+    if (near && first_bit < num_bits && ((block_buffer[first_bit / 8] >> (first_bit % 8)) & 1)) {
+        for (uint32_t byte_index = (first_bit + 7) / 8; (byte_index + 1) * 8 <= num_bits; byte_index++) {
+            if (block_buffer[byte_index] == 0) {
+                first_bit = byte_index * 8;
+                break;
+            }
+        }
     }
 
-    for (uint32_t i = 0; i < ctx->sb.inode_count; ++i)
+    for (uint32_t i = first_bit; i < num_bits; i++)
     {
         uint32_t byte_index = i / 8;
         uint32_t bit_index = i % 8;
 
-        if (byte_index >= BLOCK_SIZE) {
-            fprintf(stderr, "alloc_inode_num: Error - inode_count %u exceeds bitmap block size.\n", ctx->sb.inode_count);
-            return -1; 
+        if (bit_index == 0 && block_buffer[byte_index] == 0xFF && i + 8 <= num_bits) {
+            i += 7;
+            continue;
         }
-
         if (!((block_buffer[byte_index] >> bit_index) & 1))
         {
-            block_buffer[byte_index] |= (1 << bit_index); 
-
-            if (write_block(ctx, INODE_BITMAP_BLOCK, block_buffer) != 0) {
-                fprintf(stderr, "alloc_inode_num: failed to write updated inode bitmap block\n");
-                block_buffer[byte_index] &= ~(1 << bit_index);
+            /* Take up to *count_inout free bits in a row starting here. */
+            uint32_t count = 0;
+            while (count < *count_inout && i + count < num_bits &&
+                   !((block_buffer[(i + count) / 8] >> ((i + count) % 8)) & 1)) {
+                block_buffer[(i + count) / 8] |= (1 << ((i + count) % 8));
+                count++;
+            }
+            if (write_meta_block(ctx, bitmap_block, block_buffer) != 0) {
+                fprintf(stderr, "bitmap_alloc_bits: Failed to write updated bitmap block %u\n", bitmap_block);
                 return -1;
             }
-            return i; 
+            *bit_out = i;
+            *count_inout = count;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int bitmap_clear_bit(IBFS_Context* ctx, uint32_t bitmap_block, uint32_t bit, int* was_set)
+{
+    IBFS_BLOCK_ALIGNED unsigned char block_buffer[ctx->sb.block_size];
+    if (read_meta_block(ctx, bitmap_block, block_buffer) != 0) {
+        fprintf(stderr, "bitmap_clear_bit: Failed to read bitmap block %u\n", bitmap_block);
+        return -1;
+    }
+    uint32_t byte_index = bit / 8;
+    uint32_t bit_index = bit % 8;
+
+    *was_set = (block_buffer[byte_index] >> bit_index) & 1;
+    block_buffer[byte_index] &= ~(1 << bit_index); 
+    if (write_meta_block(ctx, bitmap_block, block_buffer) != 0) {
+        fprintf(stderr, "bitmap_clear_bit: Failed to write updated bitmap block %u\n", bitmap_block);
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t bitmap_group_count(IBFS_Context* ctx)
+{
+    if (ctx->sb.blocks_per_group == 0 || ctx->sb.block_count <= ctx->sb.first_data_block) return 0;
+    uint32_t data_blocks = ctx->sb.block_count - ctx->sb.first_data_block;
+    return (data_blocks + ctx->sb.blocks_per_group - 1) / ctx->sb.blocks_per_group;
+}
+
+uint32_t bitmap_group_start(IBFS_Context* ctx, uint32_t group)
+{
+    return ctx->sb.first_data_block + group * ctx->sb.blocks_per_group;
+}
+
+uint32_t bitmap_group_length(IBFS_Context* ctx, uint32_t group)
+{
+    uint32_t start = bitmap_group_start(ctx, group);
+    uint32_t remaining = ctx->sb.block_count - start;
+    return remaining < ctx->sb.blocks_per_group ? remaining : ctx->sb.blocks_per_group;
+}
+
+int alloc_inode_num(IBFS_Context* ctx)
+{
+    if (ctx->sb.inode_count == 0) {
+        fprintf(stderr, "alloc_inode_num: Error - inode_count in context is zero.\n");
+        return -1;
+    }
+    if (ctx->sb.free_inodes_count == 0) {
+        fprintf(stderr, "Error: No free inodes available.\n");
+        return -1;
+    }
+
+    uint32_t bits_per_block = IBFS_BITMAP_BITS(ctx->sb.block_size);
+    for (uint32_t b = 0; b < ctx->sb.inode_bitmap_blocks; b++)
+    {
+        uint32_t first_inode = b * bits_per_block;
+        if (first_inode >= ctx->sb.inode_count) break;
+        uint32_t num_bits = ctx->sb.inode_count - first_inode;
+        if (num_bits > bits_per_block) num_bits = bits_per_block;
+
+        uint32_t bit;
+        uint32_t count = 1;
+        int rc = bitmap_alloc_bits(ctx, ctx->sb.inode_bitmap_start + b, 0, num_bits, false, &bit, &count);
+        if (rc < 0) {
+            fprintf(stderr, "alloc_inode_num: Failed to update inode bitmap block %u\n", b);
+            return -1;
+        }
+        if (rc == 0) {
+            ctx->sb.free_inodes_count--;
+            ctx->sb_dirty = true;
+            return (int)(first_inode + bit);
         }
     }
     fprintf(stderr, "Error: No free inodes available.\n");
     return -1; 
 }
 
+int alloc_inode_nums(IBFS_Context* ctx, uint32_t count, uint32_t* inode_nums_out)
+{
+    if (count > ctx->sb.free_inodes_count) {
+        fprintf(stderr, "Error: %u inodes requested, only %u free.\n", count, ctx->sb.free_inodes_count);
+        return -1;
+    }
+
+    /* One read-modify-write per bitmap block instead of one per inode. */
+    IBFS_BLOCK_ALIGNED unsigned char block_buffer[ctx->sb.block_size];
+    uint32_t bits_per_block = IBFS_BITMAP_BITS(ctx->sb.block_size);
+    uint32_t done = 0;
+    for (uint32_t b = 0; b < ctx->sb.inode_bitmap_blocks && done < count; b++)
+    {
+        uint32_t first_inode = b * bits_per_block;
+        if (first_inode >= ctx->sb.inode_count) break;
+        uint32_t num_bits = ctx->sb.inode_count - first_inode;
+        if (num_bits > bits_per_block) num_bits = bits_per_block;
+        if (read_meta_block(ctx, ctx->sb.inode_bitmap_start + b, block_buffer) != 0) break;
+
+        uint32_t taken = 0;
+        for (uint32_t i = 0; i < num_bits && done < count; i++) {
+            if (i % 8 == 0 && block_buffer[i / 8] == 0xFF && i + 8 <= num_bits) {
+                i += 7;
+                continue;
+            }
+            if ((block_buffer[i / 8] >> (i % 8)) & 1) continue;
+            block_buffer[i / 8] |= (1 << (i % 8));
+            inode_nums_out[done++] = first_inode + i;
+            taken++;
+        }
+        if (taken > 0 && write_meta_block(ctx, ctx->sb.inode_bitmap_start + b, block_buffer) != 0) {
+            done -= taken;
+            break;
+        }
+        ctx->sb.free_inodes_count -= taken;
+        ctx->sb_dirty = true;
+    }
+    if (done < count) {
+        fprintf(stderr, "alloc_inode_nums: Failed to allocate %u inodes.\n", count);
+        free_inode_nums(ctx, inode_nums_out, done);
+        return -1;
+    }
+    return 0;
+}
+
 void free_inode_num(IBFS_Context* ctx, uint32_t inode_num) {
      if (inode_num >= ctx->sb.inode_count) {
         fprintf(stderr, "free_inode_num: Error - inode number %u out of range (max %u).\n",
@@ -55,60 +182,72 @@ void free_inode_num(IBFS_Context* ctx, uint32_t inode_num) {
         return;
     }
 
-    char block_buffer[BLOCK_SIZE];
-    if (read_block(ctx, INODE_BITMAP_BLOCK, block_buffer) != 0)
+    uint32_t bits_per_block = IBFS_BITMAP_BITS(ctx->sb.block_size);
+    int was_set;
+    if (bitmap_clear_bit(ctx, ctx->sb.inode_bitmap_start + inode_num / bits_per_block,
+                         inode_num % bits_per_block, &was_set) != 0)
     {
-        fprintf(stderr, "free_inode_num: Failed to read inode bitmap block\n");
+        fprintf(stderr, "free_inode_num: failed to update inode bitmap\n");
         return;
     }
-    uint32_t byte_index = inode_num / 8;
-    uint32_t bit_index = inode_num % 8;
-
-    if (!((block_buffer[byte_index] >> bit_index) & 1)) {
+    if (!was_set) {
        fprintf(stderr, "Warning: Attempt to free already free inode %u.\n", inode_num);
+       return;
     }
+    ctx->sb.free_inodes_count++;
+    ctx->sb_dirty = true;
+}
 
-    block_buffer[byte_index] &= ~(1 << bit_index); 
-    if (write_block(ctx, INODE_BITMAP_BLOCK, block_buffer) != 0)
-    {
-        fprintf(stderr, "free_inode_num: failed to write updated inode bitmap\n");
-    }
+uint32_t alloc_data_block(IBFS_Context* ctx, uint32_t goal)
+{
+    uint32_t count;
+    return alloc_data_extent(ctx, goal, 1, &count);
 }
 
-uint32_t alloc_data_block(IBFS_Context* ctx)
+uint32_t alloc_data_extent(IBFS_Context* ctx, uint32_t goal, uint32_t max_count, uint32_t* count_out)
 {
-    char block_buffer[BLOCK_SIZE];
-    if (read_block(ctx, DATA_BITMAP_BLOCK, block_buffer) != 0)
-    {
-        fprintf(stderr, "alloc_data_block: Failed to read data bitmap block\n");
+    *count_out = 0;
+    if (ctx->sb.block_count == 0) {
+        fprintf(stderr, "alloc_data_extent: Error - block_count in context is zero.\n");
         return 0;
     }
-
-    if (ctx->sb.block_count == 0) {
-        fprintf(stderr, "alloc_data_block: Error - block_count in context is zero.\n");
+    if (ctx->sb.free_blocks_count == 0) {
+        fprintf(stderr, "Error: No free data blocks available.\n");
         return 0;
     }
 
-    for (uint32_t i = 3; i < ctx->sb.block_count; i++)
-    {
-        uint32_t byte_index = i / 8;
-        uint32_t bit_index = i % 8;
+    uint32_t groups = bitmap_group_count(ctx);
+    uint32_t first_group = ctx->sb.last_alloc_group < groups ? ctx->sb.last_alloc_group : 0;
+    uint32_t goal_bit = 1;
+    if (goal >= ctx->sb.first_data_block && goal < ctx->sb.block_count) {
+        first_group = (goal - ctx->sb.first_data_block) / ctx->sb.blocks_per_group;
+        goal_bit = (goal - ctx->sb.first_data_block) % ctx->sb.blocks_per_group;
+        if (goal_bit == 0) goal_bit = 1;
+    }
 
-        if (byte_index >= BLOCK_SIZE) {
-            fprintf(stderr, "alloc_data_block: Error - block_count %u exceeds bitmap block size.\n", ctx->sb.block_count);
+    /* Goal group from the goal onwards, the other groups, then the goal group's head. */
+    for (uint32_t n = 0; n <= groups; n++)
+    {
+        uint32_t g = (first_group + n) % groups;
+        uint32_t from = (n == 0) ? goal_bit : 1;
+        uint32_t to = bitmap_group_length(ctx, g);
+        if (n == groups) {
+            if (goal_bit == 1) break;
+            to = goal_bit;
+        }
+        uint32_t bit;
+        uint32_t count = max_count;
+        int rc = bitmap_alloc_bits(ctx, bitmap_group_start(ctx, g), from, to, n == 0 && goal != 0, &bit, &count);
+        if (rc < 0) {
+            fprintf(stderr, "alloc_data_extent: Failed to update bitmap of group %u\n", g);
             return 0;
         }
-
-        if (!((block_buffer[byte_index] >> bit_index) & 1))
-        {
-            block_buffer[byte_index] |= (1 << bit_index); 
-            if (write_block(ctx, DATA_BITMAP_BLOCK, block_buffer) != 0)
-            {
-                fprintf(stderr, "alloc_data_block: Failed to write updated data bitmap\n");
-                 block_buffer[byte_index] &= ~(1 << bit_index);
-                return 0;
-            }
-            return i;
+        if (rc == 0) {
+            *count_out = count;
+            ctx->sb.free_blocks_count -= count;
+            ctx->sb.last_alloc_group = g;
+            ctx->sb_dirty = true;
+            return bitmap_group_start(ctx, g) + bit;
         }
     }
     fprintf(stderr, "Error: No free data blocks available.\n");
@@ -116,28 +255,197 @@ uint32_t alloc_data_block(IBFS_Context* ctx)
 }
 
 void free_data_block(IBFS_Context* ctx, uint32_t block_num){
-    if (block_num < 3 || block_num >= ctx->sb.block_count) {
-        fprintf(stderr, "free_data_block: Error - block number %u out of valid range (3-%u).\n",
-                block_num, ctx->sb.block_count - 1);
+    if (block_num < ctx->sb.first_data_block || block_num >= ctx->sb.block_count) {
+        fprintf(stderr, "free_data_block: Error - block number %u out of valid range (%u-%u).\n",
+                block_num, ctx->sb.first_data_block, ctx->sb.block_count - 1);
         return;
     }
 
-    char block_buffer[BLOCK_SIZE];
-    if (read_block(ctx, DATA_BITMAP_BLOCK, block_buffer) != 0)
+    uint32_t group = (block_num - ctx->sb.first_data_block) / ctx->sb.blocks_per_group;
+    uint32_t bit = (block_num - ctx->sb.first_data_block) % ctx->sb.blocks_per_group;
+    if (bit == 0) {
+        fprintf(stderr, "free_data_block: Error - block %u is the bitmap of group %u.\n", block_num, group);
+        return;
+    }
+    int was_set;
+    if (bitmap_clear_bit(ctx, bitmap_group_start(ctx, group), bit, &was_set) != 0)
     {
-        fprintf(stderr, "free_data_block: Failed to read data bitmap block\n");
+        fprintf(stderr, "free_data_block: failed to update data bitmap\n");
         return;
     }
-    uint32_t byte_index = block_num / 8;
-    uint32_t bit_index = block_num % 8;
-
-    if (!((block_buffer[byte_index] >> bit_index) & 1)) {
+    if (!was_set) {
        fprintf(stderr, "Warning: Attempt to free already free data block %u.\n", block_num);
+       return;
     }
+    ctx->sb.free_blocks_count++;
+    ctx->sb_dirty = true;
+}
 
-    block_buffer[byte_index] &= ~(1 << bit_index); 
-    if (write_block(ctx, DATA_BITMAP_BLOCK, block_buffer) != 0)
+uint32_t alloc_data_run(IBFS_Context* ctx, uint32_t count)
+{
+    if (count == 0 || count >= ctx->sb.blocks_per_group || count > ctx->sb.free_blocks_count) return 0;
+
+    IBFS_BLOCK_ALIGNED unsigned char block_buffer[ctx->sb.block_size];
+    uint32_t groups = bitmap_group_count(ctx);
+    for (uint32_t g = 0; g < groups; g++)
     {
-        fprintf(stderr, "free_data_block: failed to write update data bitmap\n");
+        uint32_t length = bitmap_group_length(ctx, g);
+        if (length <= count) continue;
+        if (read_meta_block(ctx, bitmap_group_start(ctx, g), block_buffer) != 0) {
+            fprintf(stderr, "alloc_data_run: Failed to read bitmap of group %u\n", g);
+            return 0;
+        }
+
+        uint32_t run_start = 1, run_length = 0;
+        for (uint32_t i = 1; i < length; i++)
+        {
+            if ((block_buffer[i / 8] >> (i % 8)) & 1) {
+                run_start = i + 1;
+                run_length = 0;
+                continue;
+            }
+            if (++run_length < count) continue;
+
+            for (uint32_t b = run_start; b < run_start + count; b++) {
+                block_buffer[b / 8] |= (1 << (b % 8));
+            }
+            if (write_meta_block(ctx, bitmap_group_start(ctx, g), block_buffer) != 0) {
+                fprintf(stderr, "alloc_data_run: Failed to write bitmap of group %u\n", g);
+                return 0;
+            }
+            ctx->sb.free_blocks_count -= count;
+            ctx->sb_dirty = true;
+            return bitmap_group_start(ctx, g) + run_start;
+        }
+    }
+    return 0;
+}
+
+static uint32_t bitmap_count_clear(const unsigned char* bits, uint32_t first_bit, uint32_t num_bits)
+{
+    uint32_t count = 0;
+    for (uint32_t i = first_bit; i < num_bits; i++) {
+        if (!((bits[i / 8] >> (i % 8)) & 1)) count++;
     }
-}
\ No newline at end of file
+    return count;
+}
+
+int bitmap_read_inodes(IBFS_Context* ctx, unsigned char* bits)
+{
+    if (read_meta_blocks(ctx, ctx->sb.inode_bitmap_start, ctx->sb.inode_bitmap_blocks, bits) != 0) return -1;
+    uint32_t payload = IBFS_META_PAYLOAD(ctx->sb.block_size);
+    for (uint32_t b = 1; b < ctx->sb.inode_bitmap_blocks; b++) {
+        memmove(bits + (size_t)b * payload, bits + (size_t)b * ctx->sb.block_size, payload);
+    }
+    return 0;
+}
+
+int bitmap_count_free(IBFS_Context* ctx, uint32_t* free_blocks, uint32_t* free_inodes)
+{
+    IBFS_BLOCK_ALIGNED unsigned char block_buffer[ctx->sb.block_size];
+    uint32_t bits_per_block = IBFS_BITMAP_BITS(ctx->sb.block_size);
+
+    *free_inodes = 0;
+    for (uint32_t b = 0; b < ctx->sb.inode_bitmap_blocks; b++)
+    {
+        uint32_t first_inode = b * bits_per_block;
+        if (first_inode >= ctx->sb.inode_count) break;
+        uint32_t num_bits = ctx->sb.inode_count - first_inode;
+        if (num_bits > bits_per_block) num_bits = bits_per_block;
+        if (read_meta_block(ctx, ctx->sb.inode_bitmap_start + b, block_buffer) != 0) return -1;
+        *free_inodes += bitmap_count_clear(block_buffer, 0, num_bits);
+    }
+
+    *free_blocks = 0;
+    uint32_t groups = bitmap_group_count(ctx);
+    for (uint32_t g = 0; g < groups; g++)
+    {
+        if (read_meta_block(ctx, bitmap_group_start(ctx, g), block_buffer) != 0) return -1;
+        *free_blocks += bitmap_count_clear(block_buffer, 1, bitmap_group_length(ctx, g));
+    }
+    return 0;
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int bitmap_clear_bits(IBFS_Context* ctx, uint32_t bitmap_block, uint32_t base, const uint32_t* values,
+                             uint32_t count, uint32_t* cleared)
+{
+    IBFS_BLOCK_ALIGNED unsigned char block_buffer[ctx->sb.block_size];
+    if (read_meta_block(ctx, bitmap_block, block_buffer) != 0) {
+        fprintf(stderr, "bitmap_clear_bits: Failed to read bitmap block %u\n", bitmap_block);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t bit = values[i] - base;
+        if (!((block_buffer[bit / 8] >> (bit % 8)) & 1)) {
+            fprintf(stderr, "Warning: Attempt to free already free bit %u of bitmap block %u.\n", bit, bitmap_block);
+            continue;
+        }
+        block_buffer[bit / 8] &= ~(1 << (bit % 8));
+        (*cleared)++;
+    }
+    if (write_meta_block(ctx, bitmap_block, block_buffer) != 0) {
+        fprintf(stderr, "bitmap_clear_bits: Failed to write bitmap block %u\n", bitmap_block);
+        return -1;
+    }
+    return 0;
+}
+
+int free_inode_nums(IBFS_Context* ctx, uint32_t* inode_nums, uint32_t count)
+{
+    qsort(inode_nums, count, sizeof(uint32_t), compare_u32);
+    uint32_t bits_per_block = IBFS_BITMAP_BITS(ctx->sb.block_size);
+    uint32_t cleared = 0;
+    int result = 0;
+
+    uint32_t i = 0;
+    while (i < count && inode_nums[i] < ctx->sb.inode_count) {
+        uint32_t b = inode_nums[i] / bits_per_block;
+        uint32_t j = i;
+        while (j < count && inode_nums[j] < ctx->sb.inode_count && inode_nums[j] / bits_per_block == b) j++;
+        if (bitmap_clear_bits(ctx, ctx->sb.inode_bitmap_start + b, b * bits_per_block, inode_nums + i, j - i, &cleared) != 0) {
+            result = -1;
+        }
+        i = j;
+    }
+    if (i < count) {
+        fprintf(stderr, "free_inode_nums: Error - %u inode numbers out of range.\n", count - i);
+        result = -1;
+    }
+    ctx->sb.free_inodes_count += cleared;
+    ctx->sb_dirty = true;
+    return result;
+}
+
+int free_data_blocks(IBFS_Context* ctx, uint32_t* blocks, uint32_t count)
+{
+    qsort(blocks, count, sizeof(uint32_t), compare_u32);
+    uint32_t cleared = 0;
+    int result = 0;
+
+    uint32_t i = 0;
+    while (i < count) {
+        if (blocks[i] < ctx->sb.first_data_block || blocks[i] >= ctx->sb.block_count ||
+            (blocks[i] - ctx->sb.first_data_block) % ctx->sb.blocks_per_group == 0) {
+            fprintf(stderr, "free_data_blocks: Error - block %u is not a data block.\n", blocks[i]);
+            result = -1;
+            i++;
+            continue;
+        }
+        uint32_t group = (blocks[i] - ctx->sb.first_data_block) / ctx->sb.blocks_per_group;
+        uint32_t start = bitmap_group_start(ctx, group);
+        uint32_t end = start + bitmap_group_length(ctx, group);
+        uint32_t j = i;
+        while (j < count && blocks[j] < end) j++;
+        if (bitmap_clear_bits(ctx, start, start, blocks + i, j - i, &cleared) != 0) result = -1;
+        i = j;
+    }
+    ctx->sb.free_blocks_count += cleared;
+    ctx->sb_dirty = true;
+    return result;
+}
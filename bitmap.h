@@ -2,4 +2,9 @@
 #include "ibfs.h"
 
 int alloc_inode_num(IBFS_Context* ctx);
-void free_inode_num(IBFS_Context* ctx, uint32_t inode_num);
\ No newline at end of file
+int alloc_inode_nums(IBFS_Context* ctx, uint32_t count, uint32_t* inode_nums_out);
+void free_inode_num(IBFS_Context* ctx, uint32_t inode_num);
+int free_inode_nums(IBFS_Context* ctx, uint32_t* inode_nums, uint32_t count);
+/* Reads the whole inode bitmap into bits, packed so that bit i is inode i. */
+int bitmap_read_inodes(IBFS_Context* ctx, unsigned char* bits);
+int bitmap_count_free(IBFS_Context* ctx, uint32_t* free_blocks, uint32_t* free_inodes);
\ No newline at end of file
@@ -1,5 +1,11 @@
 #pragma once
 #include "ibfs.h"
 
-uint32_t alloc_data_block(IBFS_Context* ctx);
-void free_data_block(IBFS_Context* ctx, uint32_t block_num);
\ No newline at end of file
+uint32_t alloc_data_block(IBFS_Context* ctx, uint32_t goal);
+uint32_t alloc_data_extent(IBFS_Context* ctx, uint32_t goal, uint32_t max_count, uint32_t* count_out);
+uint32_t alloc_data_run(IBFS_Context* ctx, uint32_t count);
+void free_data_block(IBFS_Context* ctx, uint32_t block_num);
+int free_data_blocks(IBFS_Context* ctx, uint32_t* blocks, uint32_t count);
+uint32_t bitmap_group_count(IBFS_Context* ctx);
+uint32_t bitmap_group_start(IBFS_Context* ctx, uint32_t group);
+uint32_t bitmap_group_length(IBFS_Context* ctx, uint32_t group);
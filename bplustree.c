@@ -6,14 +6,54 @@
 #include <stdbool.h>
 #include <stdlib.h> 
 
-static void bpt_insert_into_internal(BPlusTreeNode* internal_node, BPlusTreeKey* key, uint32_t child_block_num);
+static void bpt_insert_into_internal(IBFS_Context* ctx, BPlusTreeNode* internal_node, BPlusTreeKey* key, uint32_t child_block_num);
 static int compare_keys(BPlusTreeKey* key1, BPlusTreeKey* key2);
-static void bpt_insert_into_leaf(BPlusTreeNode* leaf, BPlusTreeKey* key, uint32_t value);
+static void bpt_insert_into_leaf(IBFS_Context* ctx, BPlusTreeNode* leaf, BPlusTreeKey* key, uint32_t value);
 static int bpt_insert_internal(IBFS_Context* ctx, uint32_t current_block_num, BPlusTreeKey* key, uint32_t value, BPlusTreeKey* promoted_key_out, uint32_t* promoted_child_out);
 static uint32_t find_first_leaf_for_parent(IBFS_Context* ctx, uint32_t root_block_num, uint32_t target_parent_inode_id);
 static int bpt_delete_internal(IBFS_Context* ctx, uint32_t current_block_num, BPlusTreeKey* key, bool* root_needs_update);
 
 
+uint32_t bpt_order(IBFS_Context* ctx) {
+    return (uint32_t)BPT_ORDER_FOR(ctx->sb.block_size);
+}
+
+uint32_t* bpt_children(IBFS_Context* ctx, BPlusTreeNode* node) {
+    return (uint32_t*)&node->keys[bpt_order(ctx)];
+}
+
+uint32_t* bpt_next_leaf(IBFS_Context* ctx, BPlusTreeNode* node) {
+    return &bpt_children(ctx, node)[bpt_order(ctx) + 1];
+}
+
+/* Nodes are little-endian on disk and native in memory; converting twice restores a node. */
+static void bpt_node_convert(IBFS_Context* ctx, BPlusTreeNode* node) {
+    uint32_t order = bpt_order(ctx);
+    uint32_t* children = bpt_children(ctx, node);
+    node->is_leaf = ibfs_le32(node->is_leaf);
+    node->num_keys = ibfs_le32(node->num_keys);
+    for (uint32_t i = 0; i < order; i++) {
+        node->keys[i].parent_inode_id = ibfs_le32(node->keys[i].parent_inode_id);
+        node->keys[i].name_hash = ibfs_le32(node->keys[i].name_hash);
+    }
+    for (uint32_t i = 0; i <= order + 1; i++) {
+        children[i] = ibfs_le32(children[i]);
+    }
+}
+
+int bpt_read_node(IBFS_Context* ctx, uint32_t block_num, void* buffer) {
+    if (read_meta_block(ctx, block_num, buffer) != 0) return -1;
+    bpt_node_convert(ctx, (BPlusTreeNode*)buffer);
+    return 0;
+}
+
+static int bpt_write_node(IBFS_Context* ctx, uint32_t block_num, const void* buffer) {
+    IBFS_BLOCK_ALIGNED char disk_buffer[ctx->sb.block_size];
+    memcpy(disk_buffer, buffer, ctx->sb.block_size);
+    bpt_node_convert(ctx, (BPlusTreeNode*)disk_buffer);
+    return write_meta_block(ctx, block_num, disk_buffer);
+}
+
 uint32_t hash_name(const char* name) {
     uint32_t hash = 5381;
     int c;
@@ -40,16 +80,16 @@ int bpt_search(IBFS_Context* ctx, uint32_t root_block_num, BPlusTreeKey* key, ui
     if (root_block_num == 0) return -1;
     if (!ctx || !key || !value_out) return -1;
 
-    char block_buffer[BLOCK_SIZE];
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
     BPlusTreeNode* node = (BPlusTreeNode*)block_buffer;
     uint32_t current_block_num = root_block_num;
 
     while (true) {
-        if (read_block(ctx, current_block_num, block_buffer) != 0) {
+        if (bpt_read_node(ctx, current_block_num, block_buffer) != 0) {
             fprintf(stderr, "bpt_search: Failed to read block %u\n", current_block_num);
             return -1;
         }
-        if (node->num_keys > BPTREE_ORDER) {
+        if (node->num_keys > bpt_order(ctx)) {
             fprintf(stderr, "bpt_search: Corrupt node %u, num_keys=%u\n", current_block_num, node->num_keys);
             return -1;
         }
@@ -58,19 +98,19 @@ int bpt_search(IBFS_Context* ctx, uint32_t root_block_num, BPlusTreeKey* key, ui
         bool found_path = false;
         for (int i = 0; i < node->num_keys; i++) {
             if (compare_keys(key, &node->keys[i]) == -1) {
-                current_block_num = node->children[i];
+                current_block_num = bpt_children(ctx, node)[i];
                 found_path = true;
                 break;
             }
         }
         if (!found_path) {
-            current_block_num = node->children[node->num_keys];
+            current_block_num = bpt_children(ctx, node)[node->num_keys];
         }
     }
 
     for (int i = 0; i < node->num_keys; i++) {
         if (compare_keys(key, &node->keys[i]) == 0) {
-            *value_out = node->children[i];
+            *value_out = bpt_children(ctx, node)[i];
             return 0;
         }
         if (compare_keys(key, &node->keys[i]) == -1) {
@@ -84,21 +124,21 @@ int bpt_insert(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeKey* ke
     if (!ctx || !root_block_num_ptr || !key) return -1;
 
     if (*root_block_num_ptr == 0) {
-        uint32_t new_root_block = alloc_data_block(ctx);
+        uint32_t new_root_block = alloc_data_block(ctx, 0);
         if (new_root_block == 0) {
             fprintf(stderr, "bpt_insert: Failed to allocate block for new root\n");
             return -1;
         }
-        char block_buffer[BLOCK_SIZE];
+        IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
         BPlusTreeNode* root_node = (BPlusTreeNode*)block_buffer;
-        memset(root_node, 0, BLOCK_SIZE);
+        memset(root_node, 0, ctx->sb.block_size);
         root_node->is_leaf = 1;
         root_node->num_keys = 1;
         root_node->keys[0] = *key;
-        root_node->children[0] = value;
-        root_node->next_leaf_block = 0;
+        bpt_children(ctx, root_node)[0] = value;
+        *bpt_next_leaf(ctx, root_node) = 0;
 
-        if (write_block(ctx, new_root_block, root_node) != 0) {
+        if (bpt_write_node(ctx, new_root_block, root_node) != 0) {
             fprintf(stderr, "bpt_insert: Failed to write new root block\n");
             free_data_block(ctx, new_root_block);
             return -1;
@@ -114,21 +154,21 @@ int bpt_insert(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeKey* ke
     if (split == -1) return -1;
 
     if (split == 1) {
-        uint32_t new_root_block = alloc_data_block(ctx);
+        uint32_t new_root_block = alloc_data_block(ctx, promoted_child_block_num + 1);
         if (new_root_block == 0) {
              fprintf(stderr, "bpt_insert: Failed to allocate new root after split\n");
              return -1;
         }
-        char block_buffer[BLOCK_SIZE];
+        IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
         BPlusTreeNode* new_root = (BPlusTreeNode*)block_buffer;
-        memset(new_root, 0, BLOCK_SIZE);
+        memset(new_root, 0, ctx->sb.block_size);
         new_root->is_leaf = 0;
         new_root->num_keys = 1;
         new_root->keys[0] = promoted_key;
-        new_root->children[0] = *root_block_num_ptr; 
-        new_root->children[1] = promoted_child_block_num; 
+        bpt_children(ctx, new_root)[0] = *root_block_num_ptr; 
+        bpt_children(ctx, new_root)[1] = promoted_child_block_num; 
 
-        if (write_block(ctx, new_root_block, new_root) != 0) {
+        if (bpt_write_node(ctx, new_root_block, new_root) != 0) {
              fprintf(stderr, "bpt_insert: Failed to write new root after split\n");
              free_data_block(ctx, new_root_block);
              return -1;
@@ -138,46 +178,46 @@ int bpt_insert(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeKey* ke
     return 0; 
 }
 
-static void bpt_insert_into_leaf(BPlusTreeNode* leaf, BPlusTreeKey* key, uint32_t value) {
+static void bpt_insert_into_leaf(IBFS_Context* ctx, BPlusTreeNode* leaf, BPlusTreeKey* key, uint32_t value) {
     int i;
     for (i = 0; i < leaf->num_keys; i++) {
         if (compare_keys(key, &leaf->keys[i]) == -1) break;
     }
     memmove(&leaf->keys[i + 1], &leaf->keys[i], (leaf->num_keys - i) * sizeof(BPlusTreeKey));
-    memmove(&leaf->children[i + 1], &leaf->children[i], (leaf->num_keys - i) * sizeof(uint32_t));
+    memmove(&bpt_children(ctx, leaf)[i + 1], &bpt_children(ctx, leaf)[i], (leaf->num_keys - i) * sizeof(uint32_t));
     leaf->keys[i] = *key;
-    leaf->children[i] = value;
+    bpt_children(ctx, leaf)[i] = value;
     leaf->num_keys++;
 }
 
 static int bpt_insert_internal(IBFS_Context* ctx, uint32_t current_block_num, BPlusTreeKey* key, uint32_t value, BPlusTreeKey* promoted_key_out, uint32_t* promoted_child_out) {
-    static BPlusTreeKey temp_keys[BPTREE_ORDER + 1];
-    static uint32_t temp_children[BPTREE_ORDER + 2];
+    static BPlusTreeKey temp_keys[BPT_MAX_ORDER + 1];
+    static uint32_t temp_children[BPT_MAX_ORDER + 2];
 
-    char block_buffer[BLOCK_SIZE];
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
     BPlusTreeNode* node = (BPlusTreeNode*)block_buffer;
-    if (read_block(ctx, current_block_num, node) != 0) return -1;
+    if (bpt_read_node(ctx, current_block_num, node) != 0) return -1;
 
-    if (node->num_keys > BPTREE_ORDER) { 
+    if (node->num_keys > bpt_order(ctx)) { 
         fprintf(stderr, "bpt_insert_internal: Corrupt node %u, num_keys=%u\n", current_block_num, node->num_keys);
         return -1;
     }
 
     if (node->is_leaf) {
-        if (node->num_keys < BPTREE_ORDER) {
-            bpt_insert_into_leaf(node, key, value);
-            return write_block(ctx, current_block_num, node) == 0 ? 0 : -1;
+        if (node->num_keys < bpt_order(ctx)) {
+            bpt_insert_into_leaf(ctx, node, key, value);
+            return bpt_write_node(ctx, current_block_num, node) == 0 ? 0 : -1;
         }
         else {
-            uint32_t new_leaf_block_num = alloc_data_block(ctx);
+            uint32_t new_leaf_block_num = alloc_data_block(ctx, current_block_num + 1);
             if (new_leaf_block_num == 0) return -1;
-            char new_leaf_buffer[BLOCK_SIZE];
+            IBFS_BLOCK_ALIGNED char new_leaf_buffer[ctx->sb.block_size];
             BPlusTreeNode* new_leaf = (BPlusTreeNode*)new_leaf_buffer;
-            memset(new_leaf, 0, BLOCK_SIZE);
+            memset(new_leaf, 0, ctx->sb.block_size);
             new_leaf->is_leaf = 1;
 
             memcpy(temp_keys, node->keys, node->num_keys * sizeof(BPlusTreeKey));
-            memcpy(temp_children, node->children, node->num_keys * sizeof(uint32_t));
+            memcpy(temp_children, bpt_children(ctx, node), node->num_keys * sizeof(uint32_t));
             int i;
             for (i = 0; i < node->num_keys; i++) {
                 if (compare_keys(key, &temp_keys[i]) == -1) break;
@@ -189,22 +229,22 @@ static int bpt_insert_internal(IBFS_Context* ctx, uint32_t current_block_num, BP
             int total_keys = node->num_keys + 1;
 
             int split_point = (total_keys + 1) / 2;
-            memset(node->keys, 0, BPTREE_ORDER * sizeof(BPlusTreeKey));
-            memset(node->children, 0, (BPTREE_ORDER + 1) * sizeof(uint32_t));
+            memset(node->keys, 0, bpt_order(ctx) * sizeof(BPlusTreeKey));
+            memset(bpt_children(ctx, node), 0, (bpt_order(ctx) + 1) * sizeof(uint32_t));
 
             memcpy(node->keys, temp_keys, split_point * sizeof(BPlusTreeKey));
-            memcpy(node->children, temp_children, split_point * sizeof(uint32_t));
+            memcpy(bpt_children(ctx, node), temp_children, split_point * sizeof(uint32_t));
             node->num_keys = split_point;
 
             memcpy(new_leaf->keys, &temp_keys[split_point], (total_keys - split_point) * sizeof(BPlusTreeKey));
-            memcpy(new_leaf->children, &temp_children[split_point], (total_keys - split_point) * sizeof(uint32_t));
+            memcpy(bpt_children(ctx, new_leaf), &temp_children[split_point], (total_keys - split_point) * sizeof(uint32_t));
             new_leaf->num_keys = total_keys - split_point;
 
-            new_leaf->next_leaf_block = node->next_leaf_block;
-            node->next_leaf_block = new_leaf_block_num;
+            *bpt_next_leaf(ctx, new_leaf) = *bpt_next_leaf(ctx, node);
+            *bpt_next_leaf(ctx, node) = new_leaf_block_num;
 
-            if (write_block(ctx, current_block_num, node) != 0) return -1;
-            if (write_block(ctx, new_leaf_block_num, new_leaf) != 0) return -1;
+            if (bpt_write_node(ctx, current_block_num, node) != 0) return -1;
+            if (bpt_write_node(ctx, new_leaf_block_num, new_leaf) != 0) return -1;
 
             *promoted_key_out = new_leaf->keys[0];
             *promoted_child_out = new_leaf_block_num;
@@ -216,27 +256,27 @@ static int bpt_insert_internal(IBFS_Context* ctx, uint32_t current_block_num, BP
         for (child_index = 0; child_index < node->num_keys; child_index++) {
             if (compare_keys(key, &node->keys[child_index]) == -1) break;
         }
-        uint32_t child_block_num = node->children[child_index];
+        uint32_t child_block_num = bpt_children(ctx, node)[child_index];
 
         int split = bpt_insert_internal(ctx, child_block_num, key, value, promoted_key_out, promoted_child_out);
 
         if (split == -1) return -1;
         if (split == 0) return 0;
 
-        if (node->num_keys < BPTREE_ORDER) {
-            bpt_insert_into_internal(node, promoted_key_out, *promoted_child_out);
-            return write_block(ctx, current_block_num, node) == 0 ? 0 : -1;
+        if (node->num_keys < bpt_order(ctx)) {
+            bpt_insert_into_internal(ctx, node, promoted_key_out, *promoted_child_out);
+            return bpt_write_node(ctx, current_block_num, node) == 0 ? 0 : -1;
         }
         else { 
-            uint32_t new_internal_block_num = alloc_data_block(ctx);
+            uint32_t new_internal_block_num = alloc_data_block(ctx, current_block_num + 1);
             if (new_internal_block_num == 0) return -1;
-            char new_node_buffer[BLOCK_SIZE];
+            IBFS_BLOCK_ALIGNED char new_node_buffer[ctx->sb.block_size];
             BPlusTreeNode* new_node = (BPlusTreeNode*)new_node_buffer;
-            memset(new_node, 0, BLOCK_SIZE);
+            memset(new_node, 0, ctx->sb.block_size);
             new_node->is_leaf = 0;
 
             memcpy(temp_keys, node->keys, node->num_keys * sizeof(BPlusTreeKey));
-            memcpy(temp_children, node->children, (node->num_keys + 1) * sizeof(uint32_t));
+            memcpy(temp_children, bpt_children(ctx, node), (node->num_keys + 1) * sizeof(uint32_t));
             int i;
             for (i = 0; i < node->num_keys; i++) {
                 if (compare_keys(promoted_key_out, &temp_keys[i]) == -1) break;
@@ -250,19 +290,19 @@ static int bpt_insert_internal(IBFS_Context* ctx, uint32_t current_block_num, BP
             int split_point = total_keys / 2;
             BPlusTreeKey key_to_promote = temp_keys[split_point];
 
-            memset(node->keys, 0, BPTREE_ORDER * sizeof(BPlusTreeKey));
-            memset(node->children, 0, (BPTREE_ORDER + 1) * sizeof(uint32_t));
+            memset(node->keys, 0, bpt_order(ctx) * sizeof(BPlusTreeKey));
+            memset(bpt_children(ctx, node), 0, (bpt_order(ctx) + 1) * sizeof(uint32_t));
 
             memcpy(node->keys, temp_keys, split_point * sizeof(BPlusTreeKey));
-            memcpy(node->children, temp_children, (split_point + 1) * sizeof(uint32_t));
+            memcpy(bpt_children(ctx, node), temp_children, (split_point + 1) * sizeof(uint32_t));
             node->num_keys = split_point;
 
             memcpy(new_node->keys, &temp_keys[split_point + 1], (total_keys - split_point - 1) * sizeof(BPlusTreeKey));
-            memcpy(new_node->children, &temp_children[split_point + 1], (total_keys - split_point) * sizeof(uint32_t));
+            memcpy(bpt_children(ctx, new_node), &temp_children[split_point + 1], (total_keys - split_point) * sizeof(uint32_t));
             new_node->num_keys = total_keys - split_point - 1;
 
-            if (write_block(ctx, current_block_num, node) != 0) return -1;
-            if (write_block(ctx, new_internal_block_num, new_node) != 0) return -1;
+            if (bpt_write_node(ctx, current_block_num, node) != 0) return -1;
+            if (bpt_write_node(ctx, new_internal_block_num, new_node) != 0) return -1;
 
             *promoted_key_out = key_to_promote;
             *promoted_child_out = new_internal_block_num;
@@ -271,15 +311,15 @@ static int bpt_insert_internal(IBFS_Context* ctx, uint32_t current_block_num, BP
     }
 }
 
-static void bpt_insert_into_internal(BPlusTreeNode* internal_node, BPlusTreeKey* key, uint32_t child_block_num) {
+static void bpt_insert_into_internal(IBFS_Context* ctx, BPlusTreeNode* internal_node, BPlusTreeKey* key, uint32_t child_block_num) {
     int i;
     for (i = 0; i < internal_node->num_keys; i++) {
         if (compare_keys(key, &internal_node->keys[i]) == -1) break;
     }
     memmove(&internal_node->keys[i + 1], &internal_node->keys[i], (internal_node->num_keys - i) * sizeof(BPlusTreeKey));
-    memmove(&internal_node->children[i + 2], &internal_node->children[i + 1], (internal_node->num_keys - i) * sizeof(uint32_t));
+    memmove(&bpt_children(ctx, internal_node)[i + 2], &bpt_children(ctx, internal_node)[i + 1], (internal_node->num_keys - i) * sizeof(uint32_t));
     internal_node->keys[i] = *key;
-    internal_node->children[i + 1] = child_block_num;
+    bpt_children(ctx, internal_node)[i + 1] = child_block_num;
     internal_node->num_keys++;
 }
 
@@ -297,16 +337,16 @@ int bpt_delete(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeKey* ke
     }
 
     if (root_needs_update) {
-        char block_buffer[BLOCK_SIZE];
+        IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
         BPlusTreeNode* root_node = (BPlusTreeNode*)block_buffer;
-        if (read_block(ctx, *root_block_num_ptr, block_buffer) != 0) {
+        if (bpt_read_node(ctx, *root_block_num_ptr, block_buffer) != 0) {
             fprintf(stderr, "bpt_delete: Failed to read root node after potential merge.\n");
             return -1; 
         }
 
         if (!root_node->is_leaf && root_node->num_keys == 0) {
             uint32_t old_root_block = *root_block_num_ptr;
-            *root_block_num_ptr = root_node->children[0];
+            *root_block_num_ptr = bpt_children(ctx, root_node)[0];
             printf("B+ Tree root changed due to merge: %u -> %u\n", old_root_block, *root_block_num_ptr);
             free_data_block(ctx, old_root_block); 
         }
@@ -322,16 +362,16 @@ int bpt_delete(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeKey* ke
 
 static int bpt_delete_internal(IBFS_Context* ctx, uint32_t current_block_num, BPlusTreeKey* key, bool* root_needs_update) {
 
-    char block_buffer[BLOCK_SIZE];
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
     BPlusTreeNode* node = (BPlusTreeNode*)block_buffer;
     int key_index = -1;
     int child_descend_index = 0;
 
-    if (read_block(ctx, current_block_num, block_buffer) != 0) {
+    if (bpt_read_node(ctx, current_block_num, block_buffer) != 0) {
         fprintf(stderr, "bpt_delete_internal: Failed read block %u\n", current_block_num);
         return -1;
     }
-     if (node->num_keys > BPTREE_ORDER) { 
+     if (node->num_keys > bpt_order(ctx)) { 
         fprintf(stderr, "bpt_delete_internal: Corrupt node %u, num_keys=%u\n", current_block_num, node->num_keys);
         return -1;
     }
@@ -358,15 +398,15 @@ static int bpt_delete_internal(IBFS_Context* ctx, uint32_t current_block_num, BP
 
         printf("Deleting key '%s' from leaf node %u at index %d\n", key->name, current_block_num, key_index);
         memmove(&node->keys[key_index], &node->keys[key_index + 1], (node->num_keys - key_index - 1) * sizeof(BPlusTreeKey));
-        memmove(&node->children[key_index], &node->children[key_index + 1], (node->num_keys - key_index - 1) * sizeof(uint32_t));
+        memmove(&bpt_children(ctx, node)[key_index], &bpt_children(ctx, node)[key_index + 1], (node->num_keys - key_index - 1) * sizeof(uint32_t));
         node->num_keys--;
         memset(&node->keys[node->num_keys], 0, sizeof(BPlusTreeKey));
-        memset(&node->children[node->num_keys], 0, sizeof(uint32_t));
+        memset(&bpt_children(ctx, node)[node->num_keys], 0, sizeof(uint32_t));
 
-        if (write_block(ctx, current_block_num, node) != 0) return -1;
+        if (bpt_write_node(ctx, current_block_num, node) != 0) return -1;
 
         bool is_root = (current_block_num == ctx->sb.root_bpt_block);
-        int min_leaf_keys = is_root ? 0 : (BPTREE_ORDER + 1) / 2;
+        int min_leaf_keys = is_root ? 0 : (bpt_order(ctx) + 1) / 2;
 
         if (node->num_keys < min_leaf_keys) {
             fprintf(stderr, "Warning: Leaf node %u underflowed (%u keys, min %d). Merge/redistribute needed!\n",
@@ -377,7 +417,7 @@ static int bpt_delete_internal(IBFS_Context* ctx, uint32_t current_block_num, BP
         return 0; 
 
     } else {
-        uint32_t child_block_num = node->children[child_descend_index];
+        uint32_t child_block_num = bpt_children(ctx, node)[child_descend_index];
         int child_result = bpt_delete_internal(ctx, child_block_num, key, root_needs_update);
 
         if (child_result == -1) return -1;
@@ -386,7 +426,7 @@ static int bpt_delete_internal(IBFS_Context* ctx, uint32_t current_block_num, BP
             fprintf(stderr, "Warning: Child node %u underflowed. Need to handle at parent %u. Not implemented!\n",
                     child_block_num, current_block_num);
             *root_needs_update = true; 
-             int min_internal_keys = BPTREE_ORDER / 2; 
+             int min_internal_keys = bpt_order(ctx) / 2; 
              if (node->num_keys < min_internal_keys) {
                  return 1; 
              } else {
@@ -399,15 +439,150 @@ static int bpt_delete_internal(IBFS_Context* ctx, uint32_t current_block_num, BP
 }
 
 
+static int compare_keys_qsort(const void* a, const void* b) {
+    return compare_keys((BPlusTreeKey*)a, (BPlusTreeKey*)b);
+}
+
+static uint32_t find_leaf_for_key(IBFS_Context* ctx, uint32_t root_block_num, BPlusTreeKey* key,
+                                  BPlusTreeKey* upper_out, bool* bounded_out) {
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    BPlusTreeNode* node = (BPlusTreeNode*)block_buffer;
+    uint32_t current_block_num = root_block_num;
+
+    while (current_block_num != 0) {
+        if (bpt_read_node(ctx, current_block_num, block_buffer) != 0 || node->num_keys > bpt_order(ctx)) {
+            fprintf(stderr, "find_leaf_for_key: Failed to read or corrupt block %u\n", current_block_num);
+            return 0;
+        }
+        if (node->is_leaf) return current_block_num;
+
+        uint32_t child_index;
+        for (child_index = 0; child_index < node->num_keys; child_index++) {
+            if (compare_keys(key, &node->keys[child_index]) == -1) break;
+        }
+        if (upper_out && child_index < node->num_keys) {
+            *upper_out = node->keys[child_index];
+            *bounded_out = true;
+        }
+        current_block_num = bpt_children(ctx, node)[child_index];
+    }
+    return 0;
+}
+
+int bpt_delete_batch(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeKey* keys, uint32_t count, uint32_t* deleted_out) {
+    *deleted_out = 0;
+    if (count == 0 || *root_block_num_ptr == 0) return 0;
+    qsort(keys, count, sizeof(BPlusTreeKey), compare_keys_qsort);
+
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    BPlusTreeNode* leaf = (BPlusTreeNode*)block_buffer;
+    uint32_t k = 0;
+
+    while (k < count) {
+        uint32_t leaf_block = find_leaf_for_key(ctx, *root_block_num_ptr, &keys[k], NULL, NULL);
+        if (leaf_block == 0 || bpt_read_node(ctx, leaf_block, block_buffer) != 0) return -1;
+
+        uint32_t first_k = k;
+        uint32_t* children = bpt_children(ctx, leaf);
+        uint32_t original_keys = leaf->num_keys;
+        BPlusTreeKey last_key;
+        if (original_keys > 0) last_key = leaf->keys[original_keys - 1];
+
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < original_keys; i++) {
+            while (k < count && compare_keys(&keys[k], &leaf->keys[i]) < 0) k++;
+            if (k < count && compare_keys(&keys[k], &leaf->keys[i]) == 0) {
+                k++;
+                continue;
+            }
+            leaf->keys[kept] = leaf->keys[i];
+            children[kept] = children[i];
+            kept++;
+        }
+        if (original_keys > 0) {
+            while (k < count && compare_keys(&keys[k], &last_key) <= 0) k++;
+        }
+        if (k == first_k) k++;
+
+        if (kept != original_keys) {
+            memset(&leaf->keys[kept], 0, (original_keys - kept) * sizeof(BPlusTreeKey));
+            memset(&children[kept], 0, (original_keys - kept) * sizeof(uint32_t));
+            leaf->num_keys = kept;
+            if (bpt_write_node(ctx, leaf_block, block_buffer) != 0) return -1;
+            *deleted_out += original_keys - kept;
+        }
+    }
+
+    if (bpt_read_node(ctx, *root_block_num_ptr, block_buffer) == 0 && leaf->is_leaf && leaf->num_keys == 0) {
+        free_data_block(ctx, *root_block_num_ptr);
+        *root_block_num_ptr = 0;
+    }
+    return 0;
+}
+
+static int compare_entries_qsort(const void* a, const void* b) {
+    return compare_keys(&((BPlusTreeEntry*)a)->key, &((BPlusTreeEntry*)b)->key);
+}
+
+int bpt_insert_batch(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeEntry* entries, uint32_t count) {
+    if (!ctx || !root_block_num_ptr || (!entries && count > 0)) return -1;
+    qsort(entries, count, sizeof(BPlusTreeEntry), compare_entries_qsort);
+
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    BPlusTreeNode* leaf = (BPlusTreeNode*)block_buffer;
+    uint32_t order = bpt_order(ctx);
+    uint32_t k = 0;
+
+    while (k < count) {
+        /* Every sorted entry that falls into the same leaf and still fits is merged
+           with one write; an entry that would overflow the leaf splits it via bpt_insert. */
+        BPlusTreeKey upper;
+        bool bounded = false;
+        uint32_t leaf_block = 0;
+        if (*root_block_num_ptr != 0) {
+            leaf_block = find_leaf_for_key(ctx, *root_block_num_ptr, &entries[k].key, &upper, &bounded);
+            if (leaf_block == 0 || bpt_read_node(ctx, leaf_block, block_buffer) != 0) return -1;
+        }
+        if (leaf_block == 0 || leaf->num_keys >= order) {
+            if (bpt_insert(ctx, root_block_num_ptr, &entries[k].key, entries[k].value) != 0) return -1;
+            k++;
+            continue;
+        }
+
+        uint32_t n = 0;
+        while (k + n < count && leaf->num_keys + n < order &&
+               (!bounded || compare_keys(&entries[k + n].key, &upper) < 0)) {
+            n++;
+        }
+        uint32_t* children = bpt_children(ctx, leaf);
+        int i = (int)leaf->num_keys - 1;
+        for (int j = (int)n - 1, dst = (int)(leaf->num_keys + n) - 1; j >= 0; dst--) {
+            if (i >= 0 && compare_keys(&leaf->keys[i], &entries[k + j].key) > 0) {
+                leaf->keys[dst] = leaf->keys[i];
+                children[dst] = children[i];
+                i--;
+            } else {
+                leaf->keys[dst] = entries[k + j].key;
+                children[dst] = entries[k + j].value;
+                j--;
+            }
+        }
+        leaf->num_keys += n;
+        if (bpt_write_node(ctx, leaf_block, block_buffer) != 0) return -1;
+        k += n;
+    }
+    return 0;
+}
+
 static uint32_t find_first_leaf_for_parent(IBFS_Context* ctx, uint32_t root_block_num, uint32_t target_parent_inode_id) {
      if (root_block_num == 0) return 0;
 
-    char block_buffer[BLOCK_SIZE];
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
     BPlusTreeNode* node = (BPlusTreeNode*)block_buffer;
     uint32_t current_block_num = root_block_num;
 
     while (true) {
-        if (read_block(ctx, current_block_num, block_buffer) != 0) {
+        if (bpt_read_node(ctx, current_block_num, block_buffer) != 0) {
             fprintf(stderr, "find_first_leaf_for_parent: Failed to read block %u\n", current_block_num);
             return 0;
         }
@@ -419,7 +594,7 @@ static uint32_t find_first_leaf_for_parent(IBFS_Context* ctx, uint32_t root_bloc
                 break;
             }
         }
-        current_block_num = node->children[child_index];
+        current_block_num = bpt_children(ctx, node)[child_index];
     }
 }
 
@@ -433,12 +608,12 @@ int bpt_iterate(IBFS_Context* ctx, uint32_t root_block_num,
         return (root_block_num == 0) ? 0 : -1;
     }
 
-    char block_buffer[BLOCK_SIZE];
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
     BPlusTreeNode* leaf = (BPlusTreeNode*)block_buffer;
     bool keep_iterating = true;
 
     while (keep_iterating && current_leaf_block != 0) {
-        if (read_block(ctx, current_leaf_block, block_buffer) != 0) {
+        if (bpt_read_node(ctx, current_leaf_block, block_buffer) != 0) {
             fprintf(stderr, "bpt_iterate: Failed to read leaf block %u\n", current_leaf_block);
             return -1;
         }
@@ -446,7 +621,7 @@ int bpt_iterate(IBFS_Context* ctx, uint32_t root_block_num,
              fprintf(stderr, "bpt_iterate: Error - expected leaf node at block %u\n", current_leaf_block);
              return -1;
         }
-        if (leaf->num_keys > BPTREE_ORDER) {
+        if (leaf->num_keys > bpt_order(ctx)) {
              fprintf(stderr, "bpt_iterate: Corrupt leaf node %u, num_keys=%u\n", current_leaf_block, leaf->num_keys);
              return -1;
         }
@@ -454,7 +629,7 @@ int bpt_iterate(IBFS_Context* ctx, uint32_t root_block_num,
 
         for (int i = 0; i < leaf->num_keys; i++) {
             if (leaf->keys[i].parent_inode_id == target_parent_inode_id) {
-                callback(&leaf->keys[i], leaf->children[i], user_data);
+                callback(&leaf->keys[i], bpt_children(ctx, leaf)[i], user_data);
             } else if (leaf->keys[i].parent_inode_id > target_parent_inode_id) {
                 keep_iterating = false;
                 break;
@@ -462,8 +637,295 @@ int bpt_iterate(IBFS_Context* ctx, uint32_t root_block_num,
         }
 
         if (keep_iterating) {
-            current_leaf_block = leaf->next_leaf_block;
+            current_leaf_block = *bpt_next_leaf(ctx, leaf);
+        }
+    }
+    return 0;
+}
+
+int bpt_scan(IBFS_Context* ctx, uint32_t root_block_num, BPlusTreeKey* start,
+             int (*callback)(BPlusTreeKey* key, uint32_t value, void* user_data), void* user_data) {
+    if (root_block_num == 0) return 0;
+    uint32_t current_leaf_block = find_leaf_for_key(ctx, root_block_num, start, NULL, NULL);
+    if (current_leaf_block == 0) return -1;
+
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    BPlusTreeNode* leaf = (BPlusTreeNode*)block_buffer;
+    while (current_leaf_block != 0) {
+        if (bpt_read_node(ctx, current_leaf_block, block_buffer) != 0 || !leaf->is_leaf ||
+            leaf->num_keys > bpt_order(ctx)) {
+            fprintf(stderr, "bpt_scan: Failed to read or corrupt leaf %u\n", current_leaf_block);
+            return -1;
+        }
+        for (uint32_t i = 0; i < leaf->num_keys; i++) {
+            if (compare_keys(&leaf->keys[i], start) < 0) continue;
+            if (callback(&leaf->keys[i], bpt_children(ctx, leaf)[i], user_data) != 0) return 0;
+        }
+        current_leaf_block = *bpt_next_leaf(ctx, leaf);
+    }
+    return 0;
+}
+
+static int bpt_stats_internal(IBFS_Context* ctx, uint32_t block_num, uint32_t depth, BPlusTreeStats* stats) {
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    BPlusTreeNode* node = (BPlusTreeNode*)block_buffer;
+    if (bpt_read_node(ctx, block_num, block_buffer) != 0) {
+        fprintf(stderr, "bpt_stats: Failed to read block %u\n", block_num);
+        return -1;
+    }
+    if (node->num_keys > bpt_order(ctx)) {
+        fprintf(stderr, "bpt_stats: Corrupt node %u, num_keys=%u\n", block_num, node->num_keys);
+        return -1;
+    }
+    if (depth > stats->height) stats->height = depth;
+
+    if (node->is_leaf) {
+        uint32_t next = *bpt_next_leaf(ctx, node);
+        stats->leaf_nodes++;
+        stats->entries += node->num_keys;
+        if (next != 0 && next != block_num + 1) stats->leaf_jumps++;
+        return 0;
+    }
+
+    stats->internal_nodes++;
+    uint32_t* children = bpt_children(ctx, node);
+    for (uint32_t i = 0; i <= node->num_keys; i++) {
+        if (bpt_stats_internal(ctx, children[i], depth + 1, stats) != 0) return -1;
+    }
+    return 0;
+}
+
+int bpt_stats(IBFS_Context* ctx, uint32_t root_block_num, BPlusTreeStats* stats) {
+    memset(stats, 0, sizeof(BPlusTreeStats));
+    if (root_block_num == 0) return 0;
+    return bpt_stats_internal(ctx, root_block_num, 1, stats);
+}
+
+int bpt_free_tree(IBFS_Context* ctx, uint32_t root_block_num) {
+    if (root_block_num == 0) return 0;
+
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    BPlusTreeNode* node = (BPlusTreeNode*)block_buffer;
+    if (bpt_read_node(ctx, root_block_num, block_buffer) != 0) {
+        fprintf(stderr, "bpt_free_tree: Failed to read block %u\n", root_block_num);
+        return -1;
+    }
+    int result = 0;
+    if (!node->is_leaf && node->num_keys <= bpt_order(ctx)) {
+        uint32_t* children = bpt_children(ctx, node);
+        for (uint32_t i = 0; i <= node->num_keys; i++) {
+            if (bpt_free_tree(ctx, children[i]) != 0) result = -1;
+        }
+    }
+    free_data_block(ctx, root_block_num);
+    return result;
+}
+
+static int bpt_alloc_blocks(IBFS_Context* ctx, uint32_t count, uint32_t* blocks_out) {
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t want = count - done;
+        if (want > ctx->sb.blocks_per_group - 1) want = ctx->sb.blocks_per_group - 1;
+
+        uint32_t start = 0;
+        while (want > 1 && (start = alloc_data_run(ctx, want)) == 0) want /= 2;
+        if (start == 0) {
+            want = 1;
+            start = alloc_data_block(ctx, done > 0 ? blocks_out[done - 1] + 1 : 0);
+        }
+        if (start == 0) {
+            for (uint32_t i = 0; i < done; i++) free_data_block(ctx, blocks_out[i]);
+            return -1;
         }
+        for (uint32_t i = 0; i < want; i++) blocks_out[done++] = start + i;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+static uint32_t find_leftmost_leaf(IBFS_Context* ctx, uint32_t root_block_num) {
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    BPlusTreeNode* node = (BPlusTreeNode*)block_buffer;
+    uint32_t current_block_num = root_block_num;
+
+    while (current_block_num != 0) {
+        if (bpt_read_node(ctx, current_block_num, block_buffer) != 0) return 0;
+        if (node->is_leaf) return current_block_num;
+        current_block_num = bpt_children(ctx, node)[0];
+    }
+    return 0;
+}
+
+/* Stacks internal levels over the leaves in level_blocks until one root is left in level_blocks[0]. */
+static int bpt_build_levels(IBFS_Context* ctx, uint32_t* level_blocks, BPlusTreeKey* level_keys, uint32_t level_count,
+                            uint32_t per_node, uint32_t* all_blocks, uint32_t* allocated) {
+    IBFS_BLOCK_ALIGNED char new_buffer[ctx->sb.block_size];
+    BPlusTreeNode* new_node = (BPlusTreeNode*)new_buffer;
+    uint32_t max_children = per_node + 1;
+    while (level_count > 1) {
+        uint32_t parents = (level_count + max_children - 1) / max_children;
+        uint32_t parent_blocks[parents];
+        if (bpt_alloc_blocks(ctx, parents, parent_blocks) != 0) {
+            fprintf(stderr, "bpt_build_levels: Failed to allocate %u internal blocks\n", parents);
+            return -1;
+        }
+        memcpy(all_blocks + *allocated, parent_blocks, parents * sizeof(uint32_t));
+        *allocated += parents;
+
+        uint32_t child = 0;
+        for (uint32_t p = 0; p < parents; p++) {
+            uint32_t count = level_count / parents + (p < level_count % parents ? 1 : 0);
+            memset(new_buffer, 0, ctx->sb.block_size);
+            new_node->is_leaf = 0;
+            new_node->num_keys = count - 1;
+            for (uint32_t c = 0; c < count; c++) {
+                bpt_children(ctx, new_node)[c] = level_blocks[child + c];
+                if (c > 0) new_node->keys[c - 1] = level_keys[child + c];
+            }
+            if (bpt_write_node(ctx, parent_blocks[p], new_buffer) != 0) return -1;
+            level_blocks[p] = parent_blocks[p];
+            level_keys[p] = level_keys[child];
+            child += count;
+        }
+        level_count = parents;
+    }
+    return 0;
+}
+
+static uint32_t bpt_per_node(IBFS_Context* ctx, uint32_t fill_percent) {
+    uint32_t order = bpt_order(ctx);
+    if (fill_percent < 50 || fill_percent > 100) fill_percent = 100;
+    uint32_t per_node = order * fill_percent / 100;
+    return per_node < 2 ? 2 : per_node;
+}
+
+int bpt_rebuild(IBFS_Context* ctx, uint32_t root_block_num, uint32_t fill_percent, uint32_t* new_root_out) {
+    *new_root_out = 0;
+    if (root_block_num == 0) return 0;
+
+    uint32_t order = bpt_order(ctx);
+    uint32_t per_node = bpt_per_node(ctx, fill_percent);
+
+    BPlusTreeStats stats;
+    if (bpt_stats(ctx, root_block_num, &stats) != 0) return -1;
+    if (stats.entries == 0) return 0;
+
+    uint32_t level_count = (uint32_t)((stats.entries + per_node - 1) / per_node);
+    uint32_t* level_blocks = malloc(level_count * sizeof(uint32_t));
+    BPlusTreeKey* level_keys = malloc(level_count * sizeof(BPlusTreeKey));
+    uint32_t* all_blocks = malloc(level_count * 2 * sizeof(uint32_t));
+    uint32_t allocated = 0;
+    if (!level_blocks || !level_keys || !all_blocks) {
+        fprintf(stderr, "bpt_rebuild: Out of memory for %u leaves\n", level_count);
+        free(level_blocks); free(level_keys); free(all_blocks);
+        return -1;
+    }
+
+    IBFS_BLOCK_ALIGNED char old_buffer[ctx->sb.block_size];
+    IBFS_BLOCK_ALIGNED char new_buffer[ctx->sb.block_size];
+    BPlusTreeNode* old_leaf = (BPlusTreeNode*)old_buffer;
+    BPlusTreeNode* new_node = (BPlusTreeNode*)new_buffer;
+    int result = -1;
+
+    if (bpt_alloc_blocks(ctx, level_count, level_blocks) != 0) {
+        fprintf(stderr, "bpt_rebuild: Failed to allocate %u leaf blocks\n", level_count);
+        goto out;
+    }
+    memcpy(all_blocks, level_blocks, level_count * sizeof(uint32_t));
+    allocated = level_count;
+
+    uint32_t old_block = find_leftmost_leaf(ctx, root_block_num);
+    uint32_t old_index = 0;
+    if (old_block == 0 || bpt_read_node(ctx, old_block, old_buffer) != 0) goto out;
+
+    for (uint32_t leaf = 0; leaf < level_count; leaf++) {
+        uint32_t target = (uint32_t)(stats.entries / level_count) + (leaf < stats.entries % level_count ? 1 : 0);
+        memset(new_buffer, 0, ctx->sb.block_size);
+        new_node->is_leaf = 1;
+        while (new_node->num_keys < target) {
+            while (old_index >= old_leaf->num_keys) {
+                old_block = *bpt_next_leaf(ctx, old_leaf);
+                old_index = 0;
+                if (old_block == 0 || bpt_read_node(ctx, old_block, old_buffer) != 0 ||
+                    !old_leaf->is_leaf || old_leaf->num_keys > order) {
+                    fprintf(stderr, "bpt_rebuild: Leaf chain ended early or is corrupt at block %u\n", old_block);
+                    goto out;
+                }
+            }
+            new_node->keys[new_node->num_keys] = old_leaf->keys[old_index];
+            bpt_children(ctx, new_node)[new_node->num_keys] = bpt_children(ctx, old_leaf)[old_index];
+            new_node->num_keys++;
+            old_index++;
+        }
+        *bpt_next_leaf(ctx, new_node) = (leaf + 1 < level_count) ? level_blocks[leaf + 1] : 0;
+        level_keys[leaf] = new_node->keys[0];
+        if (bpt_write_node(ctx, level_blocks[leaf], new_buffer) != 0) goto out;
+    }
+
+    if (bpt_build_levels(ctx, level_blocks, level_keys, level_count, per_node, all_blocks, &allocated) != 0) goto out;
+
+    *new_root_out = level_blocks[0];
+    result = 0;
+
+out:
+    if (result != 0) {
+        for (uint32_t i = 0; i < allocated; i++) free_data_block(ctx, all_blocks[i]);
+    }
+    free(level_blocks);
+    free(level_keys);
+    free(all_blocks);
+    return result;
+}
+
+int bpt_build(IBFS_Context* ctx, BPlusTreeEntry* entries, uint32_t count, uint32_t fill_percent, uint32_t* new_root_out) {
+    *new_root_out = 0;
+    if (count == 0) return 0;
+    qsort(entries, count, sizeof(BPlusTreeEntry), compare_entries_qsort);
+
+    uint32_t per_node = bpt_per_node(ctx, fill_percent);
+    uint32_t level_count = (count + per_node - 1) / per_node;
+    uint32_t* level_blocks = malloc(level_count * sizeof(uint32_t));
+    BPlusTreeKey* level_keys = malloc(level_count * sizeof(BPlusTreeKey));
+    uint32_t* all_blocks = malloc(level_count * 2 * sizeof(uint32_t));
+    uint32_t allocated = 0;
+    IBFS_BLOCK_ALIGNED char new_buffer[ctx->sb.block_size];
+    BPlusTreeNode* new_node = (BPlusTreeNode*)new_buffer;
+    int result = -1;
+    if (!level_blocks || !level_keys || !all_blocks) {
+        fprintf(stderr, "bpt_build: Out of memory for %u leaves\n", level_count);
+        goto out;
+    }
+    if (bpt_alloc_blocks(ctx, level_count, level_blocks) != 0) {
+        fprintf(stderr, "bpt_build: Failed to allocate %u leaf blocks\n", level_count);
+        goto out;
+    }
+    memcpy(all_blocks, level_blocks, level_count * sizeof(uint32_t));
+    allocated = level_count;
+
+    uint32_t next = 0;
+    for (uint32_t leaf = 0; leaf < level_count; leaf++) {
+        uint32_t target = count / level_count + (leaf < count % level_count ? 1 : 0);
+        memset(new_buffer, 0, ctx->sb.block_size);
+        new_node->is_leaf = 1;
+        for (uint32_t i = 0; i < target; i++, next++) {
+            new_node->keys[i] = entries[next].key;
+            bpt_children(ctx, new_node)[i] = entries[next].value;
+        }
+        new_node->num_keys = target;
+        *bpt_next_leaf(ctx, new_node) = (leaf + 1 < level_count) ? level_blocks[leaf + 1] : 0;
+        level_keys[leaf] = new_node->keys[0];
+        if (bpt_write_node(ctx, level_blocks[leaf], new_buffer) != 0) goto out;
+    }
+    if (bpt_build_levels(ctx, level_blocks, level_keys, level_count, per_node, all_blocks, &allocated) != 0) goto out;
+
+    *new_root_out = level_blocks[0];
+    result = 0;
+
+out:
+    if (result != 0) {
+        for (uint32_t i = 0; i < allocated; i++) free_data_block(ctx, all_blocks[i]);
+    }
+    free(level_blocks);
+    free(level_keys);
+    free(all_blocks);
+    return result;
+}
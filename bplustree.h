@@ -9,21 +9,54 @@ typedef struct BPlusTreeKey {
     char name[MAX_FILENAME_LENGTH];
 } BPlusTreeKey;
 
-#define BPTREE_ORDER 102
+/*
+ * Node layout inside one block of sb.block_size bytes:
+ *   is_leaf, num_keys, keys[order], children[order + 1], next_leaf_block, ..., checksum
+ * where order = (block_size - 20) / 40, i.e. 101 for 4 KiB blocks.
+ */
+#define BPT_ORDER_FOR(block_size) (((block_size) - 16 - IBFS_CHECKSUM_SIZE) / (sizeof(BPlusTreeKey) + sizeof(uint32_t)))
+#define BPT_MAX_ORDER BPT_ORDER_FOR(IBFS_MAX_BLOCK_SIZE)
 
 typedef struct BPlusTreeNode {
     uint32_t is_leaf;
     uint32_t num_keys;
-    BPlusTreeKey keys[BPTREE_ORDER];
-    uint32_t children[BPTREE_ORDER + 1];
-    uint32_t next_leaf_block; 
+    BPlusTreeKey keys[];
 } BPlusTreeNode;
 
+typedef struct BPlusTreeEntry {
+    BPlusTreeKey key;
+    uint32_t value;
+} BPlusTreeEntry;
+
+typedef struct BPlusTreeStats {
+    uint32_t height;
+    uint32_t internal_nodes;
+    uint32_t leaf_nodes;
+    uint64_t entries;
+    uint32_t leaf_jumps;
+} BPlusTreeStats;
+
+uint32_t bpt_order(IBFS_Context* ctx);
+uint32_t* bpt_children(IBFS_Context* ctx, BPlusTreeNode* node);
+uint32_t* bpt_next_leaf(IBFS_Context* ctx, BPlusTreeNode* node);
+/* Reads and verifies a node and converts it to host byte order. */
+int bpt_read_node(IBFS_Context* ctx, uint32_t block_num, void* buffer);
+
 int bpt_search(IBFS_Context* ctx, uint32_t root_block_num, BPlusTreeKey* key, uint32_t* value_out);
 int bpt_insert(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeKey* key, uint32_t value);
 int bpt_delete(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeKey* key);
+int bpt_insert_batch(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeEntry* entries, uint32_t count);
+int bpt_delete_batch(IBFS_Context* ctx, uint32_t* root_block_num_ptr, BPlusTreeKey* keys, uint32_t count, uint32_t* deleted_out);
 uint32_t hash_name(const char* name);
 int bpt_iterate(IBFS_Context* ctx, uint32_t root_block_num,
                 uint32_t target_parent_inode_id,
                 void (*callback)(BPlusTreeKey* key, uint32_t value, void* user_data),
-                void* user_data);
\ No newline at end of file
+                void* user_data);
+int bpt_stats(IBFS_Context* ctx, uint32_t root_block_num, BPlusTreeStats* stats);
+/* Visits entries in key order from the first key >= start until the callback returns nonzero. */
+int bpt_scan(IBFS_Context* ctx, uint32_t root_block_num, BPlusTreeKey* start,
+             int (*callback)(BPlusTreeKey* key, uint32_t value, void* user_data), void* user_data);
+int bpt_rebuild(IBFS_Context* ctx, uint32_t root_block_num, uint32_t fill_percent, uint32_t* new_root_out);
+/* Bulk-loads a new tree from entries, which are sorted in place. */
+int bpt_build(IBFS_Context* ctx, BPlusTreeEntry* entries, uint32_t count, uint32_t fill_percent, uint32_t* new_root_out);
+int bpt_free_tree(IBFS_Context* ctx, uint32_t root_block_num);
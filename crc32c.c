@@ -0,0 +1,230 @@
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char* p, size_t length);
+static const char* crc32c_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Slice-by-8: eight table lookups per 8 input bytes. Little-endian loads only. */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t length) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (length >= 8) {
+        uint32_t low, high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+        low ^= crc;
+        crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+              crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][high & 0xFF] ^ crc32c_table[2][(high >> 8) & 0xFF] ^
+              crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+        p += 8;
+        length -= 8;
+    }
+#endif
+    while (length--) crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+/*
+ * The crc32 instruction has a latency of three cycles but can issue every
+ * cycle, so the hardware path runs three independent lanes over adjacent
+ * CRC32C_LANE_BYTES chunks and joins them: crc32c_shift advances a CRC over
+ * CRC32C_LANE_BYTES zero bytes, which is a linear map stored as four tables.
+ * Three lanes cover the 4092-byte payload of a 4 KiB metadata block.
+ */
+#define CRC32C_LANE_BYTES 1360
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_HW_TARGET __attribute__((target("sse4.2")))
+#define CRC32C_HW_WORD(crc, word) __builtin_ia32_crc32di((crc), (word))
+#define CRC32C_HW_BYTE(crc, byte) __builtin_ia32_crc32qi((crc), (byte))
+#define CRC32C_HW_NAME "sse4.2"
+#define CRC32C_HW_AVAILABLE() __builtin_cpu_supports("sse4.2")
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#define CRC32C_HW_TARGET __attribute__((target("+crc")))
+#define CRC32C_HW_WORD(crc, word) __builtin_aarch64_crc32cx((uint32_t)(crc), (word))
+#define CRC32C_HW_BYTE(crc, byte) __builtin_aarch64_crc32cb((crc), (byte))
+#define CRC32C_HW_NAME "armv8-crc"
+#define CRC32C_HW_AVAILABLE() ((getauxval(AT_HWCAP) & HWCAP_CRC32) != 0)
+#endif
+
+#ifdef CRC32C_HW_NAME
+static uint32_t crc32c_lane_shift[4][256];
+
+static uint32_t crc32c_shift(uint32_t crc) {
+    return crc32c_lane_shift[0][crc & 0xFF] ^ crc32c_lane_shift[1][(crc >> 8) & 0xFF] ^
+           crc32c_lane_shift[2][(crc >> 16) & 0xFF] ^ crc32c_lane_shift[3][crc >> 24];
+}
+
+CRC32C_HW_TARGET
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t length) {
+    /* 64-bit lanes save a zero extension per step on x86, where it would lengthen the dependency chain. */
+    uint64_t crc0 = crc;
+    while (length >= 3 * CRC32C_LANE_BYTES) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE_BYTES; i += 8) {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, p + i, 8);
+            memcpy(&word1, p + CRC32C_LANE_BYTES + i, 8);
+            memcpy(&word2, p + 2 * CRC32C_LANE_BYTES + i, 8);
+            crc0 = CRC32C_HW_WORD(crc0, word0);
+            crc1 = CRC32C_HW_WORD(crc1, word1);
+            crc2 = CRC32C_HW_WORD(crc2, word2);
+        }
+        crc0 = crc32c_shift(crc32c_shift((uint32_t)crc0) ^ (uint32_t)crc1) ^ (uint32_t)crc2;
+        p += 3 * CRC32C_LANE_BYTES;
+        length -= 3 * CRC32C_LANE_BYTES;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc0 = CRC32C_HW_WORD(crc0, word);
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc0;
+    while (length--) crc = CRC32C_HW_BYTE(crc, *p++);
+    return crc;
+}
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * With VPCLMULQDQ, carry-less multiplication folds 128 bytes per step into
+ * four 256-bit accumulators, about twice the rate of the crc32 instruction.
+ * Folding a 16-byte chunk A forward by n bits replaces it with
+ * A.lo * (x^(n+64) mod P) ^ A.hi * (x^n mod P), which keeps the CRC of the
+ * whole message; the folded 16 bytes are then fed to the crc32 instruction.
+ * The constants are bit-reflected like the data, so the product comes out
+ * multiplied by x^33, which the constants divide out in advance.
+ */
+#define CRC32C_FOLD_BYTES 128
+#define CRC32C_FOLD_TARGET __attribute__((target("avx2,vpclmulqdq,pclmul,sse4.2")))
+
+static uint64_t crc32c_fold_by_128[2], crc32c_fold_by_32[2], crc32c_fold_by_16[2];
+
+/* x^n mod P, bit-reflected as the CRC register holds it. */
+static uint32_t crc32c_xpow(uint32_t n) {
+    uint32_t value = 0x80000000u;
+    while (n--) value = (value >> 1) ^ (CRC32C_POLY & (0u - (value & 1)));
+    return value;
+}
+
+static void crc32c_fold_constants(uint64_t constants[2], uint32_t bytes) {
+    constants[0] = crc32c_xpow(8 * bytes + 64 - 33);
+    constants[1] = crc32c_xpow(8 * bytes - 33);
+}
+
+CRC32C_FOLD_TARGET
+static __m256i crc32c_fold256(__m256i x, __m256i k, __m256i next) {
+    return _mm256_xor_si256(_mm256_xor_si256(_mm256_clmulepi64_epi128(x, k, 0x00), _mm256_clmulepi64_epi128(x, k, 0x11)), next);
+}
+
+CRC32C_FOLD_TARGET
+static __m128i crc32c_fold128(__m128i x, __m128i k, __m128i next) {
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), next);
+}
+
+CRC32C_FOLD_TARGET
+static uint32_t crc32c_fold(uint32_t crc, const unsigned char* p, size_t length) {
+    if (length < 2 * CRC32C_FOLD_BYTES) return crc32c_hw(crc, p, length);
+    const __m256i k128 = _mm256_set_epi64x(crc32c_fold_by_128[1], crc32c_fold_by_128[0], crc32c_fold_by_128[1], crc32c_fold_by_128[0]);
+    const __m256i k32 = _mm256_set_epi64x(crc32c_fold_by_32[1], crc32c_fold_by_32[0], crc32c_fold_by_32[1], crc32c_fold_by_32[0]);
+    const __m128i k16 = _mm_set_epi64x(crc32c_fold_by_16[1], crc32c_fold_by_16[0]);
+
+    __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)p), _mm256_set_epi64x(0, 0, 0, crc));
+    __m256i x1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+    __m256i x2 = _mm256_loadu_si256((const __m256i*)(p + 64));
+    __m256i x3 = _mm256_loadu_si256((const __m256i*)(p + 96));
+    p += CRC32C_FOLD_BYTES;
+    length -= CRC32C_FOLD_BYTES;
+    while (length >= CRC32C_FOLD_BYTES) {
+        x0 = crc32c_fold256(x0, k128, _mm256_loadu_si256((const __m256i*)p));
+        x1 = crc32c_fold256(x1, k128, _mm256_loadu_si256((const __m256i*)(p + 32)));
+        x2 = crc32c_fold256(x2, k128, _mm256_loadu_si256((const __m256i*)(p + 64)));
+        x3 = crc32c_fold256(x3, k128, _mm256_loadu_si256((const __m256i*)(p + 96)));
+        p += CRC32C_FOLD_BYTES;
+        length -= CRC32C_FOLD_BYTES;
+    }
+    x1 = crc32c_fold256(x0, k32, x1);
+    x2 = crc32c_fold256(x1, k32, x2);
+    x3 = crc32c_fold256(x2, k32, x3);
+    __m128i x = crc32c_fold128(_mm256_castsi256_si128(x3), k16, _mm256_extracti128_si256(x3, 1));
+    /* Dirty upper halves would slow down the SSE code that runs after us. */
+    _mm256_zeroupper();
+    while (length >= 16) {
+        x = crc32c_fold128(x, k16, _mm_loadu_si128((const __m128i*)p));
+        p += 16;
+        length -= 16;
+    }
+    uint64_t crc0 = _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(x));
+    crc0 = _mm_crc32_u64(crc0, (uint64_t)_mm_extract_epi64(x, 1));
+    return crc32c_hw((uint32_t)crc0, p, length);
+}
+#define CRC32C_FOLD_NAME "vpclmulqdq"
+#define CRC32C_FOLD_AVAILABLE() (__builtin_cpu_supports("vpclmulqdq") && __builtin_cpu_supports("avx2") && \
+                                 __builtin_cpu_supports("sse4.2"))
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xFF];
+        }
+    }
+    crc32c_impl = crc32c_sw;
+    crc32c_name = "slice-by-8";
+#ifdef CRC32C_HW_NAME
+    uint32_t bit_shift[32];
+    for (int bit = 0; bit < 32; bit++) {
+        uint32_t crc = 1u << bit;
+        for (int k = 0; k < CRC32C_LANE_BYTES; k++) crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+        bit_shift[bit] = crc;
+    }
+    for (int b = 0; b < 4; b++) {
+        crc32c_lane_shift[b][0] = 0;
+        for (uint32_t i = 1; i < 256; i++) {
+            crc32c_lane_shift[b][i] = crc32c_lane_shift[b][i & (i - 1)] ^ bit_shift[8 * b + __builtin_ctz(i)];
+        }
+    }
+    if (CRC32C_HW_AVAILABLE()) {
+        crc32c_impl = crc32c_hw;
+        crc32c_name = CRC32C_HW_NAME;
+    }
+#endif
+#ifdef CRC32C_FOLD_NAME
+    crc32c_fold_constants(crc32c_fold_by_128, CRC32C_FOLD_BYTES);
+    crc32c_fold_constants(crc32c_fold_by_32, 32);
+    crc32c_fold_constants(crc32c_fold_by_16, 16);
+    if (CRC32C_FOLD_AVAILABLE()) {
+        crc32c_impl = crc32c_fold;
+        crc32c_name = CRC32C_FOLD_NAME;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, (const unsigned char*)data, length);
+}
+
+const char* crc32c_implementation(void) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_name;
+}
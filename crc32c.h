@@ -0,0 +1,8 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli). Pass 0 to start, or a previous result to continue over more data. */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+/* Name of the implementation picked for this CPU, for benchmarks and diagnostics. */
+const char* crc32c_implementation(void);
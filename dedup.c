@@ -0,0 +1,417 @@
+#include "dedup.h"
+#include "bitmap.h"
+#include "block.h"
+#include "file.h"
+#include "inode.h"
+#include "io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define DEDUP_READ_CHUNK_BLOCKS 64
+
+typedef struct DedupRef {
+    uint64_t hash;
+    uint32_t block;
+    uint32_t inode_num;
+    uint32_t logical;
+    uint32_t target;
+} DedupRef;
+
+typedef struct DedupRefList {
+    DedupRef* items;
+    uint32_t count;
+    uint32_t capacity;
+} DedupRefList;
+
+static uint64_t dedup_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t dedup_round(uint64_t acc, uint64_t word) {
+    acc += word * 0xC2B2AE3D27D4EB4FULL;
+    return dedup_rotl(acc, 31) * 0x9E3779B185EBCA87ULL;
+}
+
+/* Four independent lanes over 32-byte stripes, so the multiplies of one stripe overlap. */
+uint64_t dedup_hash(const void* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t lanes[4] = { 0x60EA27EEADC0B5D6ULL, 0xC2B2AE3D27D4EB4FULL, 0, 0x61C8864E7A143579ULL };
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t word;
+            memcpy(&word, bytes + i + l * 8, sizeof(word));
+            lanes[l] = dedup_round(lanes[l], ibfs_le64(word));
+        }
+    }
+    uint64_t h = dedup_rotl(lanes[0], 1) + dedup_rotl(lanes[1], 7) + dedup_rotl(lanes[2], 12) + dedup_rotl(lanes[3], 18);
+    h += length;
+    for (; i < length; i++) h = dedup_rotl(h ^ (bytes[i] * 0x27D4EB2F165667C5ULL), 11) * 0x9E3779B185EBCA87ULL;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint32_t dedup_entries_per_block(IBFS_Context* ctx) {
+    return ctx->sb.block_size / sizeof(DedupEntry);
+}
+
+static uint32_t dedup_index_block(IBFS_Context* ctx, uint64_t hash) {
+    return ctx->sb.dedup_index_start + (uint32_t)(hash % ctx->sb.dedup_index_blocks);
+}
+
+static bool dedup_is_data_block(IBFS_Context* ctx, uint32_t block) {
+    if (block < ctx->sb.first_data_block || block >= ctx->sb.block_count) return false;
+    return (block - ctx->sb.first_data_block) % ctx->sb.blocks_per_group != 0;
+}
+
+int dedup_lookup(IBFS_Context* ctx, const void* block_data, uint64_t hash, uint32_t* block_out) {
+    *block_out = 0;
+    if (ctx->sb.dedup_index_start == 0) return 0;
+
+    uint32_t per_block = dedup_entries_per_block(ctx);
+    IBFS_BLOCK_ALIGNED DedupEntry entries[per_block];
+    IBFS_BLOCK_ALIGNED char candidate[ctx->sb.block_size];
+    if (read_block(ctx, dedup_index_block(ctx, hash), entries) != 0) return -1;
+    for (uint32_t i = 0; i < per_block; i++) {
+        uint32_t block = ibfs_le32(entries[i].block);
+        if (block == 0 || ibfs_le64(entries[i].hash) != hash || !dedup_is_data_block(ctx, block)) continue;
+        if (read_block(ctx, block, candidate) != 0) return -1;
+        if (memcmp(candidate, block_data, ctx->sb.block_size) == 0) {
+            *block_out = block;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/* The index is a cache: a full index block evicts the entry the hash points at. */
+int dedup_insert(IBFS_Context* ctx, uint64_t hash, uint32_t block_num) {
+    if (ctx->sb.dedup_index_start == 0) return 0;
+
+    uint32_t per_block = dedup_entries_per_block(ctx);
+    uint32_t index_block = dedup_index_block(ctx, hash);
+    IBFS_BLOCK_ALIGNED DedupEntry entries[per_block];
+    if (read_block(ctx, index_block, entries) != 0) return -1;
+    uint32_t first = (uint32_t)((hash >> 40) % per_block);
+    uint32_t slot = first;
+    for (uint32_t i = 0; i < per_block; i++) {
+        uint32_t s = (first + i) % per_block;
+        if (entries[s].block == 0) {
+            slot = s;
+            break;
+        }
+    }
+    entries[slot].hash = ibfs_le64(hash);
+    entries[slot].block = ibfs_le32(block_num);
+    entries[slot].reserved = 0;
+    return write_block(ctx, index_block, entries);
+}
+
+int dedup_forget(IBFS_Context* ctx, const uint32_t* blocks, uint32_t count) {
+    if (ctx->sb.dedup_index_start == 0) return 0;
+
+    uint32_t per_block = dedup_entries_per_block(ctx);
+    IBFS_BLOCK_ALIGNED DedupEntry entries[per_block];
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    int result = 0;
+    for (uint32_t b = 0; b < count; b++) {
+        if (read_block(ctx, blocks[b], block_buffer) != 0) {
+            result = -1;
+            continue;
+        }
+        uint32_t index_block = dedup_index_block(ctx, dedup_hash(block_buffer, ctx->sb.block_size));
+        if (read_block(ctx, index_block, entries) != 0) {
+            result = -1;
+            continue;
+        }
+        bool dirty = false;
+        for (uint32_t i = 0; i < per_block; i++) {
+            if (ibfs_le32(entries[i].block) != blocks[b]) continue;
+            memset(&entries[i], 0, sizeof(DedupEntry));
+            dirty = true;
+        }
+        if (dirty && write_block(ctx, index_block, entries) != 0) result = -1;
+    }
+    return result;
+}
+
+int dedup_enable(IBFS_Context* ctx) {
+    if (ctx->sb.dedup_index_start != 0) {
+        printf("Dedup is already enabled (%u index blocks).\n", ctx->sb.dedup_index_blocks);
+        return 0;
+    }
+    /* One slot for every second block; the hit rate degrades gracefully once it fills up. */
+    uint32_t index_blocks = ctx->sb.block_count / (dedup_entries_per_block(ctx) * 2);
+    if (index_blocks == 0) index_blocks = 1;
+    uint32_t start = alloc_data_run(ctx, index_blocks);
+    if (start == 0) {
+        fprintf(stderr, "dedup Error: No free run of %u blocks for the index.\n", index_blocks);
+        return -1;
+    }
+    IBFS_BLOCK_ALIGNED char zero[ctx->sb.block_size];
+    memset(zero, 0, ctx->sb.block_size);
+    for (uint32_t i = 0; i < index_blocks; i++) {
+        if (write_block(ctx, start + i, zero) != 0) {
+            for (uint32_t j = 0; j < index_blocks; j++) free_data_block(ctx, start + j);
+            return -1;
+        }
+    }
+    ctx->sb.dedup_index_start = start;
+    ctx->sb.dedup_index_blocks = index_blocks;
+    if (write_superblock(ctx) != 0 || sync_disk(ctx) != 0) return -1;
+    printf("Dedup enabled with %u index blocks (%u entries).\n", index_blocks, index_blocks * dedup_entries_per_block(ctx));
+    return 0;
+}
+
+int dedup_disable(IBFS_Context* ctx) {
+    uint32_t start = ctx->sb.dedup_index_start;
+    uint32_t index_blocks = ctx->sb.dedup_index_blocks;
+    if (start == 0) {
+        printf("Dedup is not enabled.\n");
+        return 0;
+    }
+    ctx->sb.dedup_index_start = 0;
+    ctx->sb.dedup_index_blocks = 0;
+    if (write_superblock(ctx) != 0) return -1;
+    for (uint32_t i = 0; i < index_blocks; i++) free_data_block(ctx, start + i);
+    if (write_superblock(ctx) != 0 || sync_disk(ctx) != 0) return -1;
+    printf("Dedup disabled, %u index blocks freed.\n", index_blocks);
+    return 0;
+}
+
+static int dedup_push(DedupRefList* list, uint32_t block, uint32_t inode_num, uint32_t logical) {
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 4096;
+        DedupRef* grown = realloc(list->items, (size_t)capacity * sizeof(DedupRef));
+        if (!grown) return -1;
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    DedupRef* ref = &list->items[list->count++];
+    memset(ref, 0, sizeof(DedupRef));
+    ref->block = block;
+    ref->inode_num = inode_num;
+    ref->logical = logical;
+    return 0;
+}
+
+/* Pushes the data blocks under an indirect block; height 1 points at data, `logical` is its first block. */
+static int dedup_collect_tree(IBFS_Context* ctx, uint32_t inode_num, uint32_t node, int height, uint32_t logical,
+                              DedupRefList* list) {
+    uint32_t ptrs_per_block = ctx->sb.block_size / sizeof(uint32_t);
+    uint32_t span = 1;
+    for (int level = 1; level < height; level++) span *= ptrs_per_block;
+    uint32_t* indirect = alloc_block_buffer(ctx, 1);
+    int result = 0;
+    if (!indirect || read_block(ctx, node, indirect) != 0) result = -1;
+    for (uint32_t i = 0; i < ptrs_per_block && result == 0; i++) {
+        uint32_t entry = ibfs_le32(indirect[i]);
+        if (entry == 0) continue;
+        if (height > 1) result = dedup_collect_tree(ctx, inode_num, entry, height - 1, logical + i * span, list);
+        else result = dedup_push(list, entry, inode_num, logical + i);
+    }
+    free(indirect);
+    return result;
+}
+
+static int dedup_collect_inode(IBFS_Context* ctx, uint32_t inode_num, Inode* inode, DedupRefList* list) {
+    /* Blocks of a compressed cluster do not map one to one onto logical blocks. */
+    if ((inode->flags & (IBFS_INODE_INLINE | IBFS_INODE_COMPRESSED)) || (inode->mode & S_IFDIR) == S_IFDIR) return 0;
+    for (uint32_t i = 0; i < 12; i++) {
+        if (inode->direct_blocks[i] != 0 && dedup_push(list, inode->direct_blocks[i], inode_num, i) != 0) return -1;
+    }
+
+    uint64_t ptrs_per_block = ctx->sb.block_size / sizeof(uint32_t);
+    uint32_t roots[3] = { inode->single_indirect, inode->double_indirect, inode->triple_indirect };
+    uint64_t logical = 12, span = ptrs_per_block;
+    for (int levels = 1; levels <= 3; levels++) {
+        if (roots[levels - 1] != 0 &&
+            dedup_collect_tree(ctx, inode_num, roots[levels - 1], levels, (uint32_t)logical, list) != 0) {
+            return -1;
+        }
+        logical += span;
+        span *= ptrs_per_block;
+    }
+    return 0;
+}
+
+static int dedup_collect(IBFS_Context* ctx, DedupRefList* list) {
+    uint32_t per_block = inodes_per_block(ctx);
+    uint32_t table_blocks = (ctx->sb.inode_count + per_block - 1) / per_block;
+    unsigned char* inode_bitmap = alloc_block_buffer(ctx, ctx->sb.inode_bitmap_blocks);
+    char* chunk = alloc_block_buffer(ctx, DEDUP_READ_CHUNK_BLOCKS);
+    int result = -1;
+
+    if (!inode_bitmap || !chunk ||
+        bitmap_read_inodes(ctx, inode_bitmap) != 0) {
+        goto out;
+    }
+    for (uint32_t block = 0; block < table_blocks; block += DEDUP_READ_CHUNK_BLOCKS) {
+        uint32_t count = table_blocks - block;
+        if (count > DEDUP_READ_CHUNK_BLOCKS) count = DEDUP_READ_CHUNK_BLOCKS;
+        if (read_meta_blocks(ctx, ctx->sb.inode_table_start + block, count, chunk) != 0) goto out;
+        for (uint32_t b = 0; b < count; b++) {
+            for (uint32_t i = 0; i < per_block; i++) {
+                uint32_t inode_num = (block + b) * per_block + i;
+                if (inode_num >= ctx->sb.inode_count) break;
+                if (!((inode_bitmap[inode_num / 8] >> (inode_num % 8)) & 1)) continue;
+                Inode inode;
+                inode_unpack(ctx, chunk + (size_t)b * ctx->sb.block_size, i, &inode);
+                if (dedup_collect_inode(ctx, inode_num, &inode, list) != 0) goto out;
+            }
+        }
+    }
+    result = 0;
+
+out:
+    free(inode_bitmap);
+    free(chunk);
+    return result;
+}
+
+static int dedup_compare_block(const void* a, const void* b) {
+    const DedupRef* x = (const DedupRef*)a;
+    const DedupRef* y = (const DedupRef*)b;
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+static int dedup_compare_hash(const void* a, const void* b) {
+    const DedupRef* x = (const DedupRef*)a;
+    const DedupRef* y = (const DedupRef*)b;
+    if (x->hash != y->hash) return (x->hash > y->hash) - (x->hash < y->hash);
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+static int dedup_compare_inode(const void* a, const void* b) {
+    const DedupRef* x = (const DedupRef*)a;
+    const DedupRef* y = (const DedupRef*)b;
+    if (x->inode_num != y->inode_num) return (x->inode_num > y->inode_num) - (x->inode_num < y->inode_num);
+    return (x->logical > y->logical) - (x->logical < y->logical);
+}
+
+/* Hashes every referenced block once, reading in block order so the scan stays sequential. */
+static int dedup_hash_blocks(IBFS_Context* ctx, DedupRefList* list) {
+    qsort(list->items, list->count, sizeof(DedupRef), dedup_compare_block);
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    for (uint32_t i = 0; i < list->count; i++) {
+        if (i > 0 && list->items[i].block == list->items[i - 1].block) {
+            list->items[i].hash = list->items[i - 1].hash;
+            continue;
+        }
+        if (read_block(ctx, list->items[i].block, block_buffer) != 0) return -1;
+        list->items[i].hash = dedup_hash(block_buffer, ctx->sb.block_size);
+    }
+    return 0;
+}
+
+/* Within each run of equal hashes every byte-identical block is pointed at the lowest one. */
+static int dedup_pick_targets(IBFS_Context* ctx, DedupRefList* list, uint32_t* duplicates_out) {
+    qsort(list->items, list->count, sizeof(DedupRef), dedup_compare_hash);
+    IBFS_BLOCK_ALIGNED char canonical[ctx->sb.block_size];
+    IBFS_BLOCK_ALIGNED char candidate[ctx->sb.block_size];
+    uint32_t duplicates = 0;
+    uint32_t i = 0;
+    while (i < list->count) {
+        uint32_t j = i + 1;
+        while (j < list->count && list->items[j].hash == list->items[i].hash) j++;
+        if (ctx->sb.dedup_index_start != 0) dedup_insert(ctx, list->items[i].hash, list->items[i].block);
+        if (list->items[j - 1].block == list->items[i].block) {
+            i = j;
+            continue;
+        }
+
+        uint32_t canonical_block = list->items[i].block;
+        if (read_block(ctx, canonical_block, canonical) != 0) return -1;
+        bool same = false;
+        for (uint32_t k = i; k < j; k++) {
+            DedupRef* ref = &list->items[k];
+            if (ref->block == canonical_block) continue;
+            if (ref->block != list->items[k - 1].block) {
+                if (read_block(ctx, ref->block, candidate) != 0) return -1;
+                same = memcmp(candidate, canonical, ctx->sb.block_size) == 0;
+                if (same) duplicates++;
+            }
+            if (same) ref->target = canonical_block;
+        }
+        i = j;
+    }
+    *duplicates_out = duplicates;
+    return 0;
+}
+
+static int dedup_remap(IBFS_Context* ctx, DedupRefList* list) {
+    qsort(list->items, list->count, sizeof(DedupRef), dedup_compare_inode);
+    int result = 0;
+    uint32_t i = 0;
+    while (i < list->count) {
+        uint32_t j = i;
+        bool any = false;
+        while (j < list->count && list->items[j].inode_num == list->items[i].inode_num) {
+            if (list->items[j].target != 0) any = true;
+            j++;
+        }
+        if (!any) {
+            i = j;
+            continue;
+        }
+
+        uint32_t inode_num = list->items[i].inode_num;
+        Inode inode;
+        if (inode_read(ctx, inode_num, &inode) != 0) {
+            result = -1;
+            i = j;
+            continue;
+        }
+        uint32_t home = inode_goal_block(ctx, inode_num);
+        for (uint32_t k = i; k < j; k++) {
+            DedupRef* ref = &list->items[k];
+            if (ref->target == 0) continue;
+            if (file_replace_block(ctx, &inode, ref->logical, ref->target, true, home) != 0) {
+                fprintf(stderr, "dedup: Failed to remap block %u of inode %u.\n", ref->logical, inode_num);
+                result = -1;
+                break;
+            }
+        }
+        if (inode_write(ctx, inode_num, &inode) != 0) result = -1;
+        i = j;
+    }
+    return result;
+}
+
+int dedup_run(IBFS_Context* ctx, uint32_t* freed_out) {
+    DedupRefList list;
+    memset(&list, 0, sizeof(DedupRefList));
+    uint32_t free_before = ctx->sb.free_blocks_count;
+    uint32_t duplicates = 0;
+    int result = -1;
+    *freed_out = 0;
+
+    printf("Scanning inode table...\n");
+    if (dedup_collect(ctx, &list) != 0) {
+        fprintf(stderr, "dedup Error: Failed to scan the inode table.\n");
+        goto out;
+    }
+    printf("Hashing %u block references...\n", list.count);
+    if (dedup_hash_blocks(ctx, &list) != 0 || dedup_pick_targets(ctx, &list, &duplicates) != 0) {
+        fprintf(stderr, "dedup Error: Failed to read data blocks.\n");
+        goto out;
+    }
+    printf("Sharing %u duplicate blocks...\n", duplicates);
+    if (dedup_remap(ctx, &list) != 0) {
+        fprintf(stderr, "Warning: Some blocks could not be remapped, run fsck.\n");
+        goto out;
+    }
+    result = 0;
+
+out:
+    free(list.items);
+    if (write_superblock(ctx) != 0 || sync_disk(ctx) != 0) result = -1;
+    if (ctx->sb.free_blocks_count > free_before) *freed_out = ctx->sb.free_blocks_count - free_before;
+    return result;
+}
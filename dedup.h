@@ -0,0 +1,14 @@
+#pragma once
+#include "ibfs.h"
+#include <stddef.h>
+
+uint64_t dedup_hash(const void* data, size_t length);
+int dedup_lookup(IBFS_Context* ctx, const void* block_data, uint64_t hash, uint32_t* block_out);
+int dedup_insert(IBFS_Context* ctx, uint64_t hash, uint32_t block_num);
+/* Drops the index entries of blocks that are about to be freed. */
+int dedup_forget(IBFS_Context* ctx, const uint32_t* blocks, uint32_t count);
+
+int dedup_enable(IBFS_Context* ctx);
+int dedup_disable(IBFS_Context* ctx);
+/* Offline pass: shares identical data blocks of all files and returns the number of blocks freed. */
+int dedup_run(IBFS_Context* ctx, uint32_t* freed_out);
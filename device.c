@@ -0,0 +1,519 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "device.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define ibfs_fseek _fseeki64
+#define ibfs_fsync _commit
+#define ibfs_ftruncate _chsize_s
+#define ibfs_ftell _ftelli64
+#else
+#include <sys/types.h>
+#include <unistd.h>
+#define ibfs_fseek fseeko
+#define ibfs_fsync fsync
+#define ibfs_ftruncate ftruncate
+#define ibfs_ftell ftello
+#endif
+
+/* ---- buffered file ---- */
+
+typedef struct FileDevice {
+    IBFS_Device base;
+    FILE* file;
+    char* path;
+} FileDevice;
+
+static long long file_dev_read(IBFS_Device* dev, uint64_t offset, void* buffer, size_t length) {
+    FileDevice* f = (FileDevice*)dev;
+    if (ibfs_fseek(f->file, (int64_t)offset, SEEK_SET) != 0) return -1;
+    size_t n = fread(buffer, 1, length, f->file);
+    if (n < length && ferror(f->file)) return -1;
+    return (long long)n;
+}
+
+static int file_dev_write(IBFS_Device* dev, uint64_t offset, const void* buffer, size_t length) {
+    FileDevice* f = (FileDevice*)dev;
+    if (ibfs_fseek(f->file, (int64_t)offset, SEEK_SET) != 0) return -1;
+    return fwrite(buffer, 1, length, f->file) == length ? 0 : -1;
+}
+
+static int file_dev_flush(IBFS_Device* dev) {
+    return fflush(((FileDevice*)dev)->file) == 0 ? 0 : -1;
+}
+
+static int file_dev_sync(IBFS_Device* dev) {
+    FileDevice* f = (FileDevice*)dev;
+    return (fflush(f->file) == 0 && ibfs_fsync(fileno(f->file)) == 0) ? 0 : -1;
+}
+
+static int file_dev_resize(IBFS_Device* dev, uint64_t size) {
+    FileDevice* f = (FileDevice*)dev;
+    if (fflush(f->file) != 0) return -1;
+    return ibfs_ftruncate(fileno(f->file), (int64_t)size) == 0 ? 0 : -1;
+}
+
+static int file_dev_fd(IBFS_Device* dev) {
+    FileDevice* f = (FileDevice*)dev;
+    return fflush(f->file) == 0 ? fileno(f->file) : -1;
+}
+
+static IBFS_Device* file_dev_open(const char* path, const char* mode);
+
+static IBFS_Device* file_dev_dup(IBFS_Device* dev) {
+    return file_dev_open(((FileDevice*)dev)->path, "rb");
+}
+
+static void file_dev_close(IBFS_Device* dev) {
+    FileDevice* f = (FileDevice*)dev;
+    fclose(f->file);
+    free(f->path);
+    free(f);
+}
+
+static const IBFS_DeviceOps file_dev_ops = {
+    "file", file_dev_read, file_dev_write, file_dev_flush, file_dev_sync, file_dev_resize, file_dev_fd, file_dev_flush, file_dev_dup, file_dev_close
+};
+
+static IBFS_Device* file_dev_open(const char* path, const char* mode) {
+    FileDevice* f = calloc(1, sizeof(FileDevice));
+    if (!f) return NULL;
+    f->file = fopen(path, mode);
+    f->path = malloc(strlen(path) + 1);
+    if (!f->file || !f->path) {
+        perror("Error opening disk file");
+        if (f->file) fclose(f->file);
+        free(f->path);
+        free(f);
+        return NULL;
+    }
+    strcpy(f->path, path);
+    f->base.ops = &file_dev_ops;
+    return &f->base;
+}
+
+/* ---- O_DIRECT ---- */
+
+#if defined(O_DIRECT) && !defined(_WIN32)
+/* The descriptor is shared by every handle; pread and pwrite need no shared position. */
+typedef struct DirectFile {
+    int fd;
+    int refs;
+} DirectFile;
+
+typedef struct DirectDevice {
+    IBFS_Device base;
+    DirectFile* file;
+} DirectDevice;
+
+static bool direct_aligned(uint64_t offset, const void* buffer, size_t length) {
+    return offset % IBFS_DIRECT_ALIGNMENT == 0 && length % IBFS_DIRECT_ALIGNMENT == 0 &&
+           (uintptr_t)buffer % IBFS_DIRECT_ALIGNMENT == 0;
+}
+
+static long long direct_pread(int fd, uint64_t offset, void* buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, (char*)buffer + done, length - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    return (long long)done;
+}
+
+static int direct_pwrite(int fd, uint64_t offset, const void* buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fd, (const char*)buffer + done, length - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/* Aligned span covering [offset, offset + length), read into a fresh bounce buffer. */
+static char* direct_bounce(int fd, uint64_t offset, size_t length, uint64_t* span_start, size_t* span_length, long long* got) {
+    *span_start = offset - offset % IBFS_DIRECT_ALIGNMENT;
+    uint64_t end = offset + length;
+    end += (IBFS_DIRECT_ALIGNMENT - end % IBFS_DIRECT_ALIGNMENT) % IBFS_DIRECT_ALIGNMENT;
+    *span_length = (size_t)(end - *span_start);
+    void* bounce = NULL;
+    if (posix_memalign(&bounce, IBFS_DIRECT_ALIGNMENT, *span_length) != 0) return NULL;
+    *got = direct_pread(fd, *span_start, bounce, *span_length);
+    if (*got < 0) {
+        free(bounce);
+        return NULL;
+    }
+    memset((char*)bounce + *got, 0, *span_length - (size_t)*got);
+    return bounce;
+}
+
+static long long direct_dev_read(IBFS_Device* dev, uint64_t offset, void* buffer, size_t length) {
+    int fd = ((DirectDevice*)dev)->file->fd;
+    if (direct_aligned(offset, buffer, length)) return direct_pread(fd, offset, buffer, length);
+
+    uint64_t span_start;
+    size_t span_length;
+    long long got;
+    char* bounce = direct_bounce(fd, offset, length, &span_start, &span_length, &got);
+    if (!bounce) return -1;
+    size_t skip = (size_t)(offset - span_start);
+    long long available = got > (long long)skip ? got - (long long)skip : 0;
+    if (available > (long long)length) available = (long long)length;
+    memcpy(buffer, bounce + skip, (size_t)available);
+    free(bounce);
+    return available;
+}
+
+static int direct_dev_write(IBFS_Device* dev, uint64_t offset, const void* buffer, size_t length) {
+    int fd = ((DirectDevice*)dev)->file->fd;
+    if (direct_aligned(offset, buffer, length)) return direct_pwrite(fd, offset, buffer, length);
+
+    if (offset % IBFS_DIRECT_ALIGNMENT == 0 && length % IBFS_DIRECT_ALIGNMENT == 0) {
+        void* aligned = NULL;
+        if (posix_memalign(&aligned, IBFS_DIRECT_ALIGNMENT, length) != 0) return -1;
+        memcpy(aligned, buffer, length);
+        int result = direct_pwrite(fd, offset, aligned, length);
+        free(aligned);
+        return result;
+    }
+
+    /* Only partial sectors, such as the superblock, need the rest of the span read back in first. */
+    uint64_t span_start;
+    size_t span_length;
+    long long got;
+    char* bounce = direct_bounce(fd, offset, length, &span_start, &span_length, &got);
+    if (!bounce) return -1;
+    memcpy(bounce + (offset - span_start), buffer, length);
+    int result = direct_pwrite(fd, span_start, bounce, span_length);
+    free(bounce);
+    return result;
+}
+
+static int direct_dev_flush(IBFS_Device* dev) {
+    (void)dev;
+    return 0;
+}
+
+static int direct_dev_sync(IBFS_Device* dev) {
+    return fsync(((DirectDevice*)dev)->file->fd) == 0 ? 0 : -1;
+}
+
+static int direct_dev_resize(IBFS_Device* dev, uint64_t size) {
+    return ftruncate(((DirectDevice*)dev)->file->fd, (off_t)size) == 0 ? 0 : -1;
+}
+
+static int direct_dev_fd(IBFS_Device* dev) {
+    return ((DirectDevice*)dev)->file->fd;
+}
+
+static IBFS_Device* direct_dev_wrap(DirectFile* file);
+
+static IBFS_Device* direct_dev_dup(IBFS_Device* dev) {
+    return direct_dev_wrap(((DirectDevice*)dev)->file);
+}
+
+static void direct_dev_close(IBFS_Device* dev) {
+    DirectFile* file = ((DirectDevice*)dev)->file;
+    if (--file->refs == 0) {
+        close(file->fd);
+        free(file);
+    }
+    free(dev);
+}
+
+static const IBFS_DeviceOps direct_dev_ops = {
+    "direct", direct_dev_read, direct_dev_write, direct_dev_flush, direct_dev_sync, direct_dev_resize, direct_dev_fd, direct_dev_flush, direct_dev_dup, direct_dev_close
+};
+
+static IBFS_Device* direct_dev_wrap(DirectFile* file) {
+    DirectDevice* d = calloc(1, sizeof(DirectDevice));
+    if (!d) return NULL;
+    d->base.ops = &direct_dev_ops;
+    d->file = file;
+    file->refs++;
+    return &d->base;
+}
+
+static IBFS_Device* direct_dev_open(const char* path, bool writable) {
+    int fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_DIRECT);
+    if (fd < 0) {
+        perror(errno == EINVAL ? "Error opening disk file (O_DIRECT is not supported by this filesystem)" : "Error opening disk file");
+        return NULL;
+    }
+    DirectFile* file = calloc(1, sizeof(DirectFile));
+    IBFS_Device* dev = file ? direct_dev_wrap(file) : NULL;
+    if (!dev) {
+        close(fd);
+        free(file);
+        return NULL;
+    }
+    file->fd = fd;
+    return dev;
+}
+#else
+static IBFS_Device* direct_dev_open(const char* path, bool writable) {
+    (void)path;
+    (void)writable;
+    fprintf(stderr, "Error: The direct backend is not supported on this platform.\n");
+    return NULL;
+}
+#endif
+
+/* ---- memory and RAM-resident ---- */
+
+/* Dirty tracking granularity of a RAM-resident image. */
+#define RAM_PAGE_SIZE 4096
+
+typedef struct MemoryImage {
+    const IBFS_DeviceOps* ops;
+    unsigned char* data;
+    uint64_t size;
+    int refs;
+    /* RAM-resident images only: the file checkpoints go to and one dirty bit per page. */
+    IBFS_Device* backing;
+    uint64_t backing_size;
+    unsigned char* dirty;
+    bool modified;
+    unsigned sync_checkpoint_interval;
+    time_t last_checkpoint;
+} MemoryImage;
+
+typedef struct MemoryDevice {
+    IBFS_Device base;
+    MemoryImage* image;
+} MemoryDevice;
+
+static uint64_t ram_page_count(uint64_t size) {
+    return (size + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE;
+}
+
+static long long memory_dev_read(IBFS_Device* dev, uint64_t offset, void* buffer, size_t length) {
+    MemoryImage* image = ((MemoryDevice*)dev)->image;
+    if (offset >= image->size) return 0;
+    if (length > image->size - offset) length = (size_t)(image->size - offset);
+    memcpy(buffer, image->data + offset, length);
+    return (long long)length;
+}
+
+static int memory_dev_write(IBFS_Device* dev, uint64_t offset, const void* buffer, size_t length) {
+    MemoryImage* image = ((MemoryDevice*)dev)->image;
+    if (offset > image->size || length > image->size - offset) {
+        errno = ENOSPC;
+        return -1;
+    }
+    memcpy(image->data + offset, buffer, length);
+    if (image->dirty && length > 0) {
+        image->modified = true;
+        for (uint64_t page = offset / RAM_PAGE_SIZE; page <= (offset + length - 1) / RAM_PAGE_SIZE; page++) {
+            image->dirty[page / 8] |= (unsigned char)(1u << (page % 8));
+        }
+    }
+    return 0;
+}
+
+static int memory_dev_flush(IBFS_Device* dev) {
+    (void)dev;
+    return 0;
+}
+
+static int memory_dev_resize(IBFS_Device* dev, uint64_t size) {
+    MemoryImage* image = ((MemoryDevice*)dev)->image;
+    if (size != (size_t)size) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (image->dirty) {
+        size_t old_bytes = (size_t)((ram_page_count(image->size) + 7) / 8);
+        size_t new_bytes = (size_t)((ram_page_count(size) + 7) / 8);
+        unsigned char* dirty = realloc(image->dirty, new_bytes ? new_bytes : 1);
+        if (!dirty) return -1;
+        if (new_bytes > old_bytes) memset(dirty + old_bytes, 0, new_bytes - old_bytes);
+        image->dirty = dirty;
+        image->modified = true;
+    }
+    unsigned char* data = realloc(image->data, size ? (size_t)size : 1);
+    if (!data) return -1;
+    if (size > image->size) memset(data + image->size, 0, (size_t)(size - image->size));
+    image->data = data;
+    image->size = size;
+    return 0;
+}
+
+static int memory_dev_fd(IBFS_Device* dev) {
+    (void)dev;
+    return -1;
+}
+
+/* Writes every run of dirty pages back to the file, matches its size and makes it durable. */
+static int ram_checkpoint(MemoryImage* image) {
+    if (!image->modified) return 0;
+    uint64_t pages = ram_page_count(image->size);
+    uint64_t page = 0;
+    while (page < pages) {
+        if (!(image->dirty[page / 8] & (1u << (page % 8)))) {
+            page++;
+            continue;
+        }
+        uint64_t run = page;
+        while (run < pages && (image->dirty[run / 8] & (1u << (run % 8)))) run++;
+        uint64_t offset = page * RAM_PAGE_SIZE;
+        uint64_t end = run * RAM_PAGE_SIZE < image->size ? run * RAM_PAGE_SIZE : image->size;
+        if (image->backing->ops->write(image->backing, offset, image->data + offset, (size_t)(end - offset)) != 0) return -1;
+        for (uint64_t p = page; p < run; p++) image->dirty[p / 8] &= (unsigned char)~(1u << (p % 8));
+        page = run;
+    }
+    if (image->backing_size != image->size) {
+        if (image->backing->ops->resize(image->backing, image->size) != 0) return -1;
+        image->backing_size = image->size;
+    }
+    if (image->backing->ops->sync(image->backing) != 0) return -1;
+    image->modified = false;
+    image->last_checkpoint = time(NULL);
+    return 0;
+}
+
+static int memory_dev_checkpoint(IBFS_Device* dev) {
+    MemoryImage* image = ((MemoryDevice*)dev)->image;
+    return image->backing ? ram_checkpoint(image) : 0;
+}
+
+/*
+ * Sync points double as checkpoint points once the interval has elapsed; otherwise changes stay in RAM.
+ * There is no timer: an idle mount checkpoints only at its next sync point or on close.
+ */
+static int memory_dev_sync(IBFS_Device* dev) {
+    MemoryImage* image = ((MemoryDevice*)dev)->image;
+    if (!image->backing || image->sync_checkpoint_interval == 0) return 0;
+    if (time(NULL) - image->last_checkpoint < (time_t)image->sync_checkpoint_interval) return 0;
+    return ram_checkpoint(image);
+}
+
+static IBFS_Device* memory_dev_wrap(MemoryImage* image);
+
+static IBFS_Device* memory_dev_dup(IBFS_Device* dev) {
+    return memory_dev_wrap(((MemoryDevice*)dev)->image);
+}
+
+static void memory_dev_close(IBFS_Device* dev) {
+    MemoryImage* image = ((MemoryDevice*)dev)->image;
+    if (--image->refs == 0) {
+        if (image->backing) {
+            if (ram_checkpoint(image) != 0) perror("Error writing the final checkpoint");
+            image->backing->ops->close(image->backing);
+        }
+        free(image->dirty);
+        free(image->data);
+        free(image);
+    }
+    free(dev);
+}
+
+static const IBFS_DeviceOps memory_dev_ops = {
+    "memory", memory_dev_read, memory_dev_write, memory_dev_flush, memory_dev_flush, memory_dev_resize, memory_dev_fd,
+    memory_dev_flush, memory_dev_dup, memory_dev_close
+};
+
+static const IBFS_DeviceOps ram_dev_ops = {
+    "ram", memory_dev_read, memory_dev_write, memory_dev_flush, memory_dev_sync, memory_dev_resize, memory_dev_fd,
+    memory_dev_checkpoint, memory_dev_dup, memory_dev_close
+};
+
+static IBFS_Device* memory_dev_wrap(MemoryImage* image) {
+    MemoryDevice* m = calloc(1, sizeof(MemoryDevice));
+    if (!m) return NULL;
+    m->base.ops = image->ops;
+    m->image = image;
+    image->refs++;
+    return &m->base;
+}
+
+IBFS_Device* device_create_memory(uint64_t size) {
+    MemoryImage* image = calloc(1, sizeof(MemoryImage));
+    if (!image) return NULL;
+    image->ops = &memory_dev_ops;
+    image->data = size == (size_t)size ? calloc(1, size ? (size_t)size : 1) : NULL;
+    IBFS_Device* dev = image->data ? memory_dev_wrap(image) : NULL;
+    if (!dev) {
+        fprintf(stderr, "Error: Not enough memory for a %llu-byte image.\n", (unsigned long long)size);
+        free(image->data);
+        free(image);
+        return NULL;
+    }
+    image->size = size;
+    return dev;
+}
+
+/* Loads the whole image; a RAM-resident image keeps the file open for checkpoints. */
+static IBFS_Device* memory_dev_load(const char* path, bool resident, bool writable) {
+    IBFS_Device* file = file_dev_open(path, resident && writable ? "rb+" : "rb");
+    if (!file) return NULL;
+    FILE* f = ((FileDevice*)file)->file;
+    IBFS_Device* dev = NULL;
+    long long size = -1;
+    if (ibfs_fseek(f, 0, SEEK_END) == 0) {
+        size = ibfs_ftell(f);
+        if (size >= 0) dev = device_create_memory((uint64_t)size);
+        if (dev && file_dev_read(file, 0, ((MemoryDevice*)dev)->image->data, (size_t)size) != size) {
+            fprintf(stderr, "Error: Failed to load '%s' into memory.\n", path);
+            memory_dev_close(dev);
+            dev = NULL;
+        }
+    }
+    if (!dev || !resident || !writable) {
+        file_dev_close(file);
+        return dev;
+    }
+    MemoryImage* image = ((MemoryDevice*)dev)->image;
+    image->dirty = calloc((size_t)((ram_page_count(image->size) + 7) / 8) + 1, 1);
+    if (!image->dirty) {
+        fprintf(stderr, "Error: Not enough memory for the dirty page map.\n");
+        file_dev_close(file);
+        memory_dev_close(dev);
+        return NULL;
+    }
+    image->ops = &ram_dev_ops;
+    dev->ops = &ram_dev_ops;
+    image->backing = file;
+    image->backing_size = (uint64_t)size;
+    image->last_checkpoint = time(NULL);
+    return dev;
+}
+
+int device_set_sync_checkpoint_interval(IBFS_Device* dev, unsigned seconds) {
+    if (dev->ops != &ram_dev_ops) {
+        fprintf(stderr, "Error: Sync checkpoint intervals apply only to the ram backend.\n");
+        return -1;
+    }
+    ((MemoryDevice*)dev)->image->sync_checkpoint_interval = seconds;
+    return 0;
+}
+
+IBFS_Device* device_open(const char* path, IBFS_Backend backend, bool writable) {
+    switch (backend) {
+        case IBFS_BACKEND_FILE: return file_dev_open(path, writable ? "rb+" : "rb");
+        case IBFS_BACKEND_DIRECT: return direct_dev_open(path, writable);
+        case IBFS_BACKEND_MEMORY: return memory_dev_load(path, false, writable);
+        case IBFS_BACKEND_RAM: return memory_dev_load(path, true, writable);
+    }
+    return NULL;
+}
+
+int device_parse_backend(const char* name, IBFS_Backend* backend_out) {
+    if (strcmp(name, "file") == 0) *backend_out = IBFS_BACKEND_FILE;
+    else if (strcmp(name, "direct") == 0) *backend_out = IBFS_BACKEND_DIRECT;
+    else if (strcmp(name, "memory") == 0) *backend_out = IBFS_BACKEND_MEMORY;
+    else if (strcmp(name, "ram") == 0) *backend_out = IBFS_BACKEND_RAM;
+    else return -1;
+    return 0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Block-device backends behind io.c. A device is a byte-addressed image;
+ * io.c turns block numbers into offsets and the backend moves the bytes.
+ *   file    buffered stdio file (the default)
+ *   direct  O_DIRECT file, bypassing the kernel page cache; unaligned
+ *           requests go through an aligned bounce buffer
+ *   memory  the whole image in RAM, loaded from a file or created empty;
+ *           nothing is ever written back
+ *   ram     the whole image in RAM, with dirty pages checkpointed back to the
+ *           file on demand, on close and, once an interval has passed, at the
+ *           next sync point; nothing is written between sync points
+ */
+typedef enum IBFS_Backend {
+    IBFS_BACKEND_FILE,
+    IBFS_BACKEND_DIRECT,
+    IBFS_BACKEND_MEMORY,
+    IBFS_BACKEND_RAM
+} IBFS_Backend;
+
+#define IBFS_DIRECT_ALIGNMENT 4096
+
+typedef struct IBFS_Device IBFS_Device;
+
+typedef struct IBFS_DeviceOps {
+    const char* name;
+    /* Returns the number of bytes read, short only at the end of the image, or -1. */
+    long long (*read)(IBFS_Device* dev, uint64_t offset, void* buffer, size_t length);
+    int (*write)(IBFS_Device* dev, uint64_t offset, const void* buffer, size_t length);
+    /* Hands buffered writes to the OS; sync also makes them durable. */
+    int (*flush)(IBFS_Device* dev);
+    int (*sync)(IBFS_Device* dev);
+    int (*resize)(IBFS_Device* dev, uint64_t size);
+    /* Descriptor for kernel-side copies, or -1 when the image is not a file. */
+    int (*fd)(IBFS_Device* dev);
+    /* Brings the backing file up to date with everything written so far. */
+    int (*checkpoint)(IBFS_Device* dev);
+    /* A handle another thread can read through at the same time. */
+    IBFS_Device* (*dup)(IBFS_Device* dev);
+    void (*close)(IBFS_Device* dev);
+} IBFS_DeviceOps;
+
+struct IBFS_Device {
+    const IBFS_DeviceOps* ops;
+};
+
+IBFS_Device* device_open(const char* path, IBFS_Backend backend, bool writable);
+IBFS_Device* device_create_memory(uint64_t size);
+int device_parse_backend(const char* name, IBFS_Backend* backend_out);
+/* Minimum gap between checkpoints taken at sync points; 0 checkpoints only on demand and on close. */
+int device_set_sync_checkpoint_interval(IBFS_Device* dev, unsigned seconds);
@@ -0,0 +1,1328 @@
+#include "file.h"
+#include "inode.h"
+#include "block.h"
+#include "io.h"
+#include "refcount.h"
+#include "dedup.h"
+#include "lz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+uint32_t file_inline_capacity(IBFS_Context* ctx)
+{
+    return IBFS_INLINE_CAPACITY(ctx->sb.inode_size);
+}
+
+int file_unref_blocks(IBFS_Context* ctx, uint32_t* blocks, uint32_t count)
+{
+    if (refcount_release(ctx, blocks, &count) != 0) {
+        fprintf(stderr, "file_unref_blocks: Failed to update reference counts.\n");
+        return -1;
+    }
+    dedup_forget(ctx, blocks, count);
+    return free_data_blocks(ctx, blocks, count);
+}
+
+/* Copy-on-write: gives the inode its own copy of a block that clones or snapshots still reference. */
+static int file_unshare(IBFS_Context* ctx, uint32_t* block_num, bool* copied_out)
+{
+    uint32_t extra;
+    if (copied_out) *copied_out = false;
+    if (refcount_get(ctx, *block_num, &extra) != 0) return -1;
+    if (extra == 0) return 0;
+
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    uint32_t copy = alloc_data_block(ctx, *block_num + 1);
+    if (copy == 0) return -1;
+    if (read_block(ctx, *block_num, block_buffer) != 0 || write_block(ctx, copy, block_buffer) != 0) {
+        free_data_block(ctx, copy);
+        return -1;
+    }
+    uint32_t shared = *block_num;
+    if (file_unref_blocks(ctx, &shared, 1) != 0) {
+        free_data_block(ctx, copy);
+        return -1;
+    }
+    *block_num = copy;
+    if (copied_out) *copied_out = true;
+    return 0;
+}
+
+#define FILE_DIRECT_BLOCKS 12
+#define FILE_MAP_LEVELS 3
+
+/*
+ * The indirect blocks on the path to the last block looked up, one per level, so
+ * sequential access reads each of them once. Entries stay little-endian; changed
+ * blocks are written back when another block takes their level and on release.
+ */
+typedef struct FileMapCache {
+    uint32_t block[FILE_MAP_LEVELS];
+    uint32_t* entries[FILE_MAP_LEVELS];
+    bool dirty[FILE_MAP_LEVELS];
+    bool owned[FILE_MAP_LEVELS];
+} FileMapCache;
+
+/* A block pointer: an inode field when host is set, otherwise entry `index` of the cached block at `level`. */
+typedef struct FileSlot {
+    uint32_t* host;
+    int level;
+    uint32_t index;
+} FileSlot;
+
+typedef enum FileMapMode {
+    FILE_MAP_LOOKUP,  /* read only; a missing indirect block is a hole */
+    FILE_MAP_MODIFY,  /* copies shared indirect blocks on the path; a missing one is a hole */
+    FILE_MAP_CREATE   /* as MODIFY, and allocates missing indirect blocks */
+} FileMapMode;
+
+static uint32_t file_ptrs_per_block(IBFS_Context* ctx)
+{
+    return ctx->sb.block_size / sizeof(uint32_t);
+}
+
+static void file_cache_init(FileMapCache* cache)
+{
+    memset(cache, 0, sizeof(FileMapCache));
+}
+
+static int file_cache_flush(IBFS_Context* ctx, FileMapCache* cache)
+{
+    int result = 0;
+    for (int level = 0; level < FILE_MAP_LEVELS; level++) {
+        if (!cache->dirty[level]) continue;
+        if (write_block(ctx, cache->block[level], cache->entries[level]) != 0) result = -1;
+        else cache->dirty[level] = false;
+    }
+    return result;
+}
+
+static int file_cache_release(IBFS_Context* ctx, FileMapCache* cache)
+{
+    int result = file_cache_flush(ctx, cache);
+    for (int level = 0; level < FILE_MAP_LEVELS; level++) free(cache->entries[level]);
+    file_cache_init(cache);
+    return result;
+}
+
+/* Makes `block` the cached indirect block of `level`; a fresh block starts zeroed and private to the inode. */
+static int file_cache_load(IBFS_Context* ctx, FileMapCache* cache, int level, uint32_t block, bool fresh)
+{
+    if (!fresh && cache->entries[level] && cache->block[level] == block) return 0;
+    if (cache->dirty[level]) {
+        if (write_block(ctx, cache->block[level], cache->entries[level]) != 0) return -1;
+        cache->dirty[level] = false;
+    }
+    if (!cache->entries[level]) {
+        cache->entries[level] = alloc_block_buffer(ctx, 1);
+        if (!cache->entries[level]) return -1;
+    }
+    cache->block[level] = 0;
+    if (fresh) {
+        memset(cache->entries[level], 0, ctx->sb.block_size);
+        cache->dirty[level] = true;
+    } else if (read_block(ctx, block, cache->entries[level]) != 0) {
+        fprintf(stderr, "file_bmap: Failed to read indirect block %u\n", block);
+        return -1;
+    }
+    cache->block[level] = block;
+    cache->owned[level] = fresh;
+    return 0;
+}
+
+static uint32_t file_slot_get(const FileMapCache* cache, FileSlot slot)
+{
+    return slot.host ? *slot.host : ibfs_le32(cache->entries[slot.level][slot.index]);
+}
+
+static void file_slot_set(FileMapCache* cache, FileSlot slot, uint32_t value)
+{
+    if (slot.host) {
+        *slot.host = value;
+        return;
+    }
+    cache->entries[slot.level][slot.index] = ibfs_le32(value);
+    cache->dirty[slot.level] = true;
+}
+
+static uint32_t file_max_blocks(IBFS_Context* ctx)
+{
+    uint64_t ptrs = file_ptrs_per_block(ctx);
+    uint64_t max_blocks = FILE_DIRECT_BLOCKS + ptrs + ptrs * ptrs + ptrs * ptrs * ptrs;
+    return max_blocks > UINT32_MAX ? UINT32_MAX : (uint32_t)max_blocks;
+}
+
+uint64_t file_max_size(IBFS_Context* ctx)
+{
+    return (uint64_t)file_max_blocks(ctx) * ctx->sb.block_size;
+}
+
+/* Indirect blocks needed to map `blocks` logical blocks from the start of a file without holes. */
+uint64_t file_indirect_blocks(IBFS_Context* ctx, uint64_t blocks)
+{
+    uint64_t ptrs = file_ptrs_per_block(ctx);
+    uint64_t rest = blocks > FILE_DIRECT_BLOCKS ? blocks - FILE_DIRECT_BLOCKS : 0;
+    uint64_t span = ptrs, count = 0;
+    for (int levels = 1; levels <= FILE_MAP_LEVELS && rest > 0; levels++) {
+        uint64_t in_tree = rest < span ? rest : span;
+        uint64_t cover = 1;
+        for (int level = 0; level < levels; level++) {
+            cover *= ptrs;
+            count += (in_tree + cover - 1) / cover;
+        }
+        rest -= in_tree;
+        span *= ptrs;
+    }
+    return count;
+}
+
+static uint32_t* file_map_root(Inode* inode, int levels)
+{
+    if (levels == 1) return &inode->single_indirect;
+    if (levels == 2) return &inode->double_indirect;
+    return &inode->triple_indirect;
+}
+
+/* Splits a logical block past the direct blocks into the tree holding it and the entry index at each level. */
+static int file_map_path(IBFS_Context* ctx, uint32_t logical, uint32_t* index)
+{
+    uint64_t ptrs = file_ptrs_per_block(ctx);
+    uint64_t rest = logical - FILE_DIRECT_BLOCKS;
+    uint64_t span = ptrs;
+    int levels = 1;
+    while (rest >= span) {
+        rest -= span;
+        span *= ptrs;
+        levels++;
+    }
+    for (int level = levels - 1; level >= 0; level--) {
+        index[level] = (uint32_t)(rest % ptrs);
+        rest /= ptrs;
+    }
+    return levels;
+}
+
+/*
+ * Finds the pointer to logical block `logical`. Returns 1 for a hole above the block,
+ * which only CREATE fills; slot_out->level is then the level of the missing block.
+ */
+static int file_map_walk(IBFS_Context* ctx, Inode* inode, FileMapCache* cache, uint32_t logical, FileMapMode mode,
+                         uint32_t home, FileSlot* slot_out)
+{
+    if (logical < FILE_DIRECT_BLOCKS) {
+        *slot_out = (FileSlot){ &inode->direct_blocks[logical], 0, 0 };
+        return 0;
+    }
+    if (logical >= file_max_blocks(ctx)) {
+        fprintf(stderr, "file_bmap: Error - block %u beyond maximum file size.\n", logical);
+        return -1;
+    }
+
+    uint32_t index[FILE_MAP_LEVELS];
+    int levels = file_map_path(ctx, logical, index);
+    FileSlot slot = { file_map_root(inode, levels), 0, 0 };
+    for (int level = 0; level < levels; level++) {
+        uint32_t node = file_slot_get(cache, slot);
+        if (node == 0) {
+            if (mode != FILE_MAP_CREATE) {
+                slot_out->level = level;
+                return 1;
+            }
+            uint32_t goal = slot.host ? home : cache->block[slot.level] + 1;
+            node = alloc_data_block(ctx, goal);
+            if (node == 0) return -1;
+            if (file_cache_load(ctx, cache, level, node, true) != 0) {
+                free_data_block(ctx, node);
+                return -1;
+            }
+            file_slot_set(cache, slot, node);
+        } else {
+            if (file_cache_load(ctx, cache, level, node, false) != 0) return -1;
+            /* A shared indirect block means everything under it is shared too; it is copied before an entry changes. */
+            if (mode != FILE_MAP_LOOKUP && !cache->owned[level]) {
+                bool copied;
+                if (file_unshare(ctx, &node, &copied) != 0) return -1;
+                if (copied) {
+                    cache->block[level] = node;
+                    file_slot_set(cache, slot, node);
+                }
+                cache->owned[level] = true;
+            }
+        }
+        slot = (FileSlot){ NULL, level, index[level] };
+    }
+    *slot_out = slot;
+    return 0;
+}
+
+/* With allocate set the returned block is private to the inode and may be written. */
+static int file_bmap(IBFS_Context* ctx, Inode* inode, FileMapCache* cache, uint32_t logical, bool allocate, uint32_t home,
+                     uint32_t* block_out)
+{
+    *block_out = 0;
+    FileSlot slot;
+    int found = file_map_walk(ctx, inode, cache, logical, allocate ? FILE_MAP_CREATE : FILE_MAP_LOOKUP, home, &slot);
+    if (found != 0) return found < 0 ? -1 : 0;
+
+    uint32_t entry = file_slot_get(cache, slot);
+    if (entry == 0 && allocate) {
+        uint32_t previous = 0;
+        if (slot.host) previous = logical > 0 ? inode->direct_blocks[logical - 1] : 0;
+        else previous = slot.index > 0 ? ibfs_le32(cache->entries[slot.level][slot.index - 1]) : cache->block[slot.level];
+        entry = alloc_data_block(ctx, previous != 0 && !IBFS_IS_CLUSTER_MARK(previous) ? previous + 1 : home);
+        if (entry == 0) return -1;
+        file_slot_set(cache, slot, entry);
+    } else if (allocate) {
+        bool copied;
+        if (file_unshare(ctx, &entry, &copied) != 0) return -1;
+        if (copied) file_slot_set(cache, slot, entry);
+    }
+    *block_out = entry;
+    return 0;
+}
+
+static int file_replace_cached(IBFS_Context* ctx, Inode* inode, FileMapCache* cache, uint32_t logical, uint32_t new_block,
+                               bool share, uint32_t home)
+{
+    FileSlot slot;
+    if (file_map_walk(ctx, inode, cache, logical, FILE_MAP_CREATE, home, &slot) != 0) return -1;
+    uint32_t old_block = file_slot_get(cache, slot);
+    if (old_block == new_block) return 0;
+    if (share && refcount_share(ctx, &new_block, 1) != 0) return -1;
+    file_slot_set(cache, slot, new_block);
+    if (old_block != 0) file_unref_blocks(ctx, &old_block, 1);
+    return 0;
+}
+
+/*
+ * Points logical block `logical` at new_block and releases the block it replaces.
+ * With share set new_block already belongs to another file and gains a reference.
+ */
+int file_replace_block(IBFS_Context* ctx, Inode* inode, uint32_t logical, uint32_t new_block, bool share, uint32_t home)
+{
+    FileMapCache cache;
+    file_cache_init(&cache);
+    int result = file_replace_cached(ctx, inode, &cache, logical, new_block, share, home);
+    if (file_cache_release(ctx, &cache) != 0) result = -1;
+    return result;
+}
+
+/* Maps `count` logical blocks from `logical` onto the physical run starting at first_block. */
+int file_map_extent(IBFS_Context* ctx, Inode* inode, uint32_t logical, uint32_t first_block, uint32_t count, uint32_t home)
+{
+    FileMapCache cache;
+    file_cache_init(&cache);
+    int result = 0;
+    for (uint32_t i = 0; i < count && result == 0; i++) {
+        FileSlot slot;
+        result = file_map_walk(ctx, inode, &cache, logical + i, FILE_MAP_CREATE, home, &slot);
+        if (result == 0) file_slot_set(&cache, slot, first_block + i);
+    }
+    if (file_cache_release(ctx, &cache) != 0) result = -1;
+    return result;
+}
+
+/* First logical block past the hole that file_map_walk found at `level` above `logical`. */
+static uint64_t file_hole_end(IBFS_Context* ctx, uint32_t logical, int level)
+{
+    uint64_t ptrs = file_ptrs_per_block(ctx);
+    uint64_t base = FILE_DIRECT_BLOCKS, span = ptrs;
+    while (logical - base >= span) {
+        base += span;
+        span *= ptrs;
+    }
+    for (int i = 0; i < level; i++) span /= ptrs;
+    return base + ((logical - base) / span + 1) * span;
+}
+
+/* Advances *logical to the next block below `end` with a non-zero pointer; returns 1 when there is none. */
+static int file_next_mapped(IBFS_Context* ctx, Inode* inode, FileMapCache* cache, uint64_t* logical, uint64_t end,
+                            uint32_t* entry_out)
+{
+    while (*logical < end) {
+        FileSlot slot;
+        int found = file_map_walk(ctx, inode, cache, (uint32_t)*logical, FILE_MAP_LOOKUP, 0, &slot);
+        if (found < 0) return -1;
+        if (found > 0) {
+            *logical = file_hole_end(ctx, (uint32_t)*logical, slot.level);
+            continue;
+        }
+        *entry_out = file_slot_get(cache, slot);
+        if (*entry_out != 0) return 0;
+        (*logical)++;
+    }
+    return 1;
+}
+
+/*
+ * Dedup on write: the finished block is shared with an existing copy when the index
+ * has one. Blocks are never overwritten in place while dedup is on, so every indexed
+ * block keeps the content it was hashed with until it is freed.
+ * Returns 1 when the block was handled here, 0 when the caller writes it as usual.
+ */
+static int file_write_dedup(IBFS_Context* ctx, Inode* inode, FileMapCache* cache, uint32_t logical, uint32_t block_num,
+                            uint32_t home, const char* block_buffer, uint64_t hash)
+{
+    uint32_t existing;
+    if (dedup_lookup(ctx, block_buffer, hash, &existing) != 0) return -1;
+    if (existing != 0) {
+        if (existing != block_num && file_replace_cached(ctx, inode, cache, logical, existing, true, home) != 0) return -1;
+        return 1;
+    }
+    if (block_num == 0) return 0;
+
+    uint32_t copy = alloc_data_block(ctx, block_num + 1);
+    if (copy == 0) return -1;
+    if (write_block(ctx, copy, block_buffer) != 0 || file_replace_cached(ctx, inode, cache, logical, copy, false, home) != 0) {
+        free_data_block(ctx, copy);
+        return -1;
+    }
+    dedup_insert(ctx, hash, copy);
+    return 1;
+}
+
+static int file_uninline(IBFS_Context* ctx, Inode* inode, uint32_t home)
+{
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    memset(block_buffer, 0, ctx->sb.block_size);
+    memcpy(block_buffer, inode->inline_data, (size_t)inode->size);
+
+    memset(inode->inline_data, 0, sizeof(inode->inline_data));
+    inode->flags &= ~IBFS_INODE_INLINE;
+    if (inode->size == 0) return 0;
+
+    /* Block 0 is a direct block, so the cache is never filled. */
+    FileMapCache cache;
+    uint32_t block_num;
+    file_cache_init(&cache);
+    if (file_bmap(ctx, inode, &cache, 0, true, home, &block_num) != 0) {
+        fprintf(stderr, "file_uninline: Failed to allocate block for inline data.\n");
+        memcpy(inode->inline_data, block_buffer, (size_t)inode->size);
+        inode->flags |= IBFS_INODE_INLINE;
+        return -1;
+    }
+    return write_block(ctx, block_num, block_buffer);
+}
+
+static bool file_has_blocks(Inode* inode)
+{
+    if (inode->single_indirect != 0 || inode->double_indirect != 0 || inode->triple_indirect != 0) return true;
+    for (int i = 0; i < 12; i++) {
+        if (inode->direct_blocks[i] != 0) return true;
+    }
+    return false;
+}
+
+static bool file_is_block(uint32_t slot)
+{
+    return slot != 0 && !IBFS_IS_CLUSTER_MARK(slot);
+}
+
+static bool file_is_zero(const char* data, size_t length)
+{
+    return length == 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+}
+
+/* Clusters start at multiples of IBFS_CLUSTER_BLOCKS; the last one ends with the block map. */
+static uint32_t file_cluster_length(IBFS_Context* ctx, uint32_t first)
+{
+    uint32_t max_blocks = file_max_blocks(ctx);
+    return max_blocks - first < IBFS_CLUSTER_BLOCKS ? max_blocks - first : IBFS_CLUSTER_BLOCKS;
+}
+
+static int file_get_slots(IBFS_Context* ctx, Inode* inode, FileMapCache* cache, uint32_t first, uint32_t count, uint32_t* slots)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        FileSlot slot;
+        int found = file_map_walk(ctx, inode, cache, first + i, FILE_MAP_LOOKUP, 0, &slot);
+        if (found < 0) return -1;
+        slots[i] = found == 0 ? file_slot_get(cache, slot) : 0;
+    }
+    return 0;
+}
+
+static int file_set_slots(IBFS_Context* ctx, Inode* inode, FileMapCache* cache, uint32_t first, uint32_t count,
+                          const uint32_t* slots, uint32_t home)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        FileSlot slot;
+        int found = file_map_walk(ctx, inode, cache, first + i, slots[i] != 0 ? FILE_MAP_CREATE : FILE_MAP_MODIFY, home, &slot);
+        if (found < 0) return -1;
+        if (found == 0) file_slot_set(cache, slot, slots[i]);
+    }
+    return 0;
+}
+
+/* Reads the blocks in slots into consecutive buffer blocks, one request per physically contiguous run. */
+static int file_read_slots(IBFS_Context* ctx, const uint32_t* slots, uint32_t count, char* buffer)
+{
+    uint32_t i = 0;
+    while (i < count) {
+        if (!file_is_block(slots[i])) {
+            memset(buffer + (size_t)i * ctx->sb.block_size, 0, ctx->sb.block_size);
+            i++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (i + run < count && slots[i + run] == slots[i] + run) run++;
+        if (read_blocks(ctx, slots[i], run, buffer + (size_t)i * ctx->sb.block_size) != 0) return -1;
+        i += run;
+    }
+    return 0;
+}
+
+/* Fills buffer with the cluster starting at logical block `first`, decompressing it if needed. */
+static int file_load_cluster(IBFS_Context* ctx, Inode* inode, FileMapCache* cache, uint32_t first, char* buffer, char* stream)
+{
+    uint32_t block_size = ctx->sb.block_size;
+    uint32_t length = file_cluster_length(ctx, first);
+    uint32_t slots[IBFS_CLUSTER_BLOCKS];
+    if (file_get_slots(ctx, inode, cache, first, length, slots) != 0) return -1;
+    if (!IBFS_IS_CLUSTER_MARK(slots[length - 1])) return file_read_slots(ctx, slots, length, buffer);
+
+    uint32_t stream_length = IBFS_CLUSTER_LENGTH(slots[length - 1]);
+    uint32_t stream_blocks = (stream_length + block_size - 1) / block_size;
+    size_t bytes = (size_t)length * block_size;
+    if (stream_blocks == 0 || stream_blocks >= length || file_read_slots(ctx, slots, stream_blocks, stream) != 0 ||
+        lz_decompress(stream, stream_length, buffer, bytes) != 0) {
+        fprintf(stderr, "file_load_cluster: Compressed cluster at block %u is corrupt.\n", first);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes a cluster to freshly allocated blocks and releases the blocks it replaces, so
+ * shared clusters are never modified in place. The cluster is stored compressed when
+ * that saves at least one block; a raw cluster only allocates its first `used` blocks.
+ */
+static int file_store_cluster(IBFS_Context* ctx, Inode* inode, FileMapCache* cache, uint32_t first, const char* buffer,
+                              uint32_t used, bool compress, char* stream, uint32_t home)
+{
+    uint32_t block_size = ctx->sb.block_size;
+    uint32_t length = file_cluster_length(ctx, first);
+    uint32_t old_slots[IBFS_CLUSTER_BLOCKS], new_slots[IBFS_CLUSTER_BLOCKS];
+    if (file_get_slots(ctx, inode, cache, first, length, old_slots) != 0) return -1;
+
+    /* An all-zero cluster becomes a hole. */
+    if (file_is_zero(buffer, (size_t)length * block_size)) used = 0;
+    size_t stream_length = 0;
+    if (compress && used > 1) {
+        stream_length = lz_compress(buffer, (size_t)length * block_size, stream, (size_t)(used - 1) * block_size);
+    }
+    uint32_t count = stream_length ? (uint32_t)((stream_length + block_size - 1) / block_size) : used;
+    const char* data = buffer;
+    if (stream_length) {
+        memset(stream + stream_length, 0, (size_t)count * block_size - stream_length);
+        data = stream;
+    }
+
+    memset(new_slots, 0, sizeof(new_slots));
+    uint32_t goal = file_is_block(old_slots[0]) ? old_slots[0] : home;
+    uint32_t allocated = 0;
+    while (allocated < count) {
+        uint32_t got;
+        uint32_t start = alloc_data_extent(ctx, goal, count - allocated, &got);
+        if (start == 0) break;
+        for (uint32_t i = 0; i < got; i++) new_slots[allocated + i] = start + i;
+        if (write_blocks(ctx, start, got, data + (size_t)allocated * block_size) != 0) {
+            allocated += got;
+            break;
+        }
+        allocated += got;
+        goal = start + got;
+    }
+    if (allocated == count && stream_length) new_slots[length - 1] = IBFS_CLUSTER_MARK | (uint32_t)stream_length;
+    if (allocated != count || file_set_slots(ctx, inode, cache, first, length, new_slots, home) != 0) {
+        if (allocated > 0) file_unref_blocks(ctx, new_slots, allocated);
+        file_set_slots(ctx, inode, cache, first, length, old_slots, home);
+        return -1;
+    }
+
+    uint32_t released[IBFS_CLUSTER_BLOCKS];
+    uint32_t released_count = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        if (file_is_block(old_slots[i])) released[released_count++] = old_slots[i];
+    }
+    return file_unref_blocks(ctx, released, released_count);
+}
+
+static int file_read_compressed(IBFS_Context* ctx, Inode* inode, uint64_t offset, void* buffer, size_t length)
+{
+    uint32_t block_size = ctx->sb.block_size;
+    char* cluster = alloc_block_buffer(ctx, (size_t)IBFS_CLUSTER_BLOCKS * 2);
+    if (!cluster) return -1;
+    char* stream = cluster + (size_t)IBFS_CLUSTER_BLOCKS * block_size;
+    FileMapCache cache;
+    file_cache_init(&cache);
+
+    size_t done = 0;
+    while (done < length) {
+        uint64_t pos = offset + done;
+        uint32_t logical = (uint32_t)(pos / block_size);
+        uint32_t first = logical - logical % IBFS_CLUSTER_BLOCKS;
+        uint64_t in_cluster = pos - (uint64_t)first * block_size;
+        size_t chunk = (size_t)((uint64_t)file_cluster_length(ctx, first) * block_size - in_cluster);
+        if (chunk > length - done) chunk = length - done;
+        if (file_load_cluster(ctx, inode, &cache, first, cluster, stream) != 0) break;
+        memcpy((char*)buffer + done, cluster + in_cluster, chunk);
+        done += chunk;
+    }
+    file_cache_release(ctx, &cache);
+    free(cluster);
+    return done == length ? (int)done : -1;
+}
+
+/* Read-modify-write of every cluster the range touches; returns the number of bytes written. */
+static size_t file_write_compressed(IBFS_Context* ctx, Inode* inode, uint64_t offset, const void* buffer, size_t length,
+                                    uint32_t home)
+{
+    uint32_t block_size = ctx->sb.block_size;
+    uint64_t new_size = offset + length > inode->size ? offset + length : inode->size;
+    char* cluster = alloc_block_buffer(ctx, (size_t)IBFS_CLUSTER_BLOCKS * 2);
+    if (!cluster) return 0;
+    char* stream = cluster + (size_t)IBFS_CLUSTER_BLOCKS * block_size;
+    FileMapCache cache;
+    file_cache_init(&cache);
+
+    size_t done = 0;
+    while (done < length) {
+        uint64_t pos = offset + done;
+        uint32_t logical = (uint32_t)(pos / block_size);
+        if (logical >= file_max_blocks(ctx)) {
+            fprintf(stderr, "file_write: Error - block %u beyond maximum file size.\n", logical);
+            break;
+        }
+        uint32_t first = logical - logical % IBFS_CLUSTER_BLOCKS;
+        uint32_t cluster_length = file_cluster_length(ctx, first);
+        uint64_t cluster_start = (uint64_t)first * block_size;
+        uint64_t in_cluster = pos - cluster_start;
+        size_t chunk = (size_t)((uint64_t)cluster_length * block_size - in_cluster);
+        if (chunk > length - done) chunk = length - done;
+
+        bool whole = in_cluster == 0 && chunk == (size_t)cluster_length * block_size;
+        if (!whole && cluster_start < inode->size) {
+            if (file_load_cluster(ctx, inode, &cache, first, cluster, stream) != 0) break;
+        } else {
+            memset(cluster, 0, (size_t)cluster_length * block_size);
+        }
+        memcpy(cluster + in_cluster, (const char*)buffer + done, chunk);
+
+        uint64_t used = (new_size - cluster_start + block_size - 1) / block_size;
+        if (used > cluster_length) used = cluster_length;
+        if (file_store_cluster(ctx, inode, &cache, first, cluster, (uint32_t)used, true, stream, home) != 0) {
+            fprintf(stderr, "file_write: Failed to store cluster at block %u.\n", first);
+            break;
+        }
+        done += chunk;
+    }
+    /* The indirect blocks of the clusters written last are still only in the cache. */
+    if (file_cache_release(ctx, &cache) != 0) done = 0;
+    free(cluster);
+    return done;
+}
+
+/* Rewrites every cluster of the file compressed or raw and updates the inode flag to match. */
+int file_set_compressed(IBFS_Context* ctx, uint32_t inode_num, Inode* inode, bool compress)
+{
+    if ((inode->mode & S_IFDIR) == S_IFDIR) {
+        fprintf(stderr, "file_set_compressed: Inode %u is a directory.\n", inode_num);
+        return -1;
+    }
+    uint32_t block_size = ctx->sb.block_size;
+    uint32_t home = inode_goal_block(ctx, inode_num);
+    uint64_t total_blocks = (inode->size + block_size - 1) / block_size;
+    int result = 0;
+
+    if (!(inode->flags & IBFS_INODE_INLINE)) {
+        char* cluster = alloc_block_buffer(ctx, (size_t)IBFS_CLUSTER_BLOCKS * 2);
+        if (!cluster) return -1;
+        char* stream = cluster + (size_t)IBFS_CLUSTER_BLOCKS * block_size;
+        FileMapCache cache;
+        file_cache_init(&cache);
+        for (uint32_t first = 0; first < total_blocks; first += IBFS_CLUSTER_BLOCKS) {
+            uint32_t length = file_cluster_length(ctx, first);
+            uint64_t used = total_blocks - first < length ? total_blocks - first : length;
+            if (file_load_cluster(ctx, inode, &cache, first, cluster, stream) != 0 ||
+                file_store_cluster(ctx, inode, &cache, first, cluster, (uint32_t)used, compress, stream, home) != 0) {
+                result = -1;
+                break;
+            }
+        }
+        if (file_cache_release(ctx, &cache) != 0) result = -1;
+        free(cluster);
+    }
+    /* A failed conversion leaves a mix of raw and compressed clusters, which only compressed files can describe. */
+    if (compress || result != 0) inode->flags |= IBFS_INODE_COMPRESSED;
+    else inode->flags &= ~IBFS_INODE_COMPRESSED;
+    if (inode_write(ctx, inode_num, inode) != 0) return -1;
+    return result;
+}
+
+int file_read(IBFS_Context* ctx, Inode* inode, uint64_t offset, void* buffer, size_t length)
+{
+    if (!ctx || !inode || !buffer) return -1;
+    if (offset >= inode->size) return 0;
+    if (length > inode->size - offset) length = (size_t)(inode->size - offset);
+
+    if (inode->flags & IBFS_INODE_INLINE) {
+        memcpy(buffer, inode->inline_data + offset, length);
+        return (int)length;
+    }
+    if (inode->flags & IBFS_INODE_COMPRESSED) return file_read_compressed(ctx, inode, offset, buffer, length);
+
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    FileMapCache cache;
+    file_cache_init(&cache);
+    size_t done = 0;
+    while (done < length) {
+        uint64_t pos = offset + done;
+        uint32_t logical = (uint32_t)(pos / ctx->sb.block_size);
+        uint32_t in_block = (uint32_t)(pos % ctx->sb.block_size);
+        size_t chunk = ctx->sb.block_size - in_block;
+        if (chunk > length - done) chunk = length - done;
+
+        uint32_t block_num;
+        if (file_bmap(ctx, inode, &cache, logical, false, 0, &block_num) != 0) break;
+        if (block_num == 0) {
+            memset((char*)buffer + done, 0, chunk);
+        } else {
+            if (read_block(ctx, block_num, block_buffer) != 0) break;
+            memcpy((char*)buffer + done, block_buffer + in_block, chunk);
+        }
+        done += chunk;
+    }
+    file_cache_release(ctx, &cache);
+    return done == length ? (int)done : -1;
+}
+
+int file_map_load(IBFS_Context* ctx, Inode* inode, FileBlockMap* map)
+{
+    map->blocks = NULL;
+    map->count = 0;
+    if (inode->flags & (IBFS_INODE_INLINE | IBFS_INODE_COMPRESSED)) return 0;
+    uint64_t count = (inode->size + ctx->sb.block_size - 1) / ctx->sb.block_size;
+    if (count > file_max_blocks(ctx)) count = file_max_blocks(ctx);
+    if (count == 0) return 0;
+    map->blocks = malloc((size_t)count * sizeof(uint32_t));
+    if (!map->blocks) return -1;
+    FileMapCache cache;
+    file_cache_init(&cache);
+    int result = file_get_slots(ctx, inode, &cache, 0, (uint32_t)count, map->blocks);
+    file_cache_release(ctx, &cache);
+    if (result != 0) {
+        free(map->blocks);
+        map->blocks = NULL;
+        return -1;
+    }
+    map->count = (uint32_t)count;
+    return 0;
+}
+
+void file_map_free(FileBlockMap* map)
+{
+    free(map->blocks);
+    map->blocks = NULL;
+    map->count = 0;
+}
+
+/* file_read through a loaded map: no indirect block lookups, and whole blocks go straight into buffer. */
+int file_read_mapped(IBFS_Context* ctx, Inode* inode, const FileBlockMap* map, uint64_t offset, void* buffer, size_t length)
+{
+    if (inode->flags & (IBFS_INODE_INLINE | IBFS_INODE_COMPRESSED)) return file_read(ctx, inode, offset, buffer, length);
+    if (offset >= inode->size) return 0;
+    if (length > inode->size - offset) length = (size_t)(inode->size - offset);
+
+    uint32_t block_size = ctx->sb.block_size;
+    IBFS_BLOCK_ALIGNED char block_buffer[block_size];
+    char* out = (char*)buffer;
+    size_t done = 0;
+    while (done < length) {
+        uint64_t pos = offset + done;
+        uint32_t logical = (uint32_t)(pos / block_size);
+        uint32_t in_block = (uint32_t)(pos % block_size);
+        uint32_t block_num = logical < map->count ? map->blocks[logical] : 0;
+        size_t chunk = block_size - in_block;
+        if (chunk > length - done) chunk = length - done;
+
+        if (chunk == block_size && block_num != 0) {
+            uint32_t run = 1;
+            while (logical + run < map->count && map->blocks[logical + run] == block_num + run &&
+                   length - done >= (size_t)(run + 1) * block_size) {
+                run++;
+            }
+            if (read_blocks(ctx, block_num, run, out + done) != 0) return -1;
+            done += (size_t)run * block_size;
+            continue;
+        }
+        if (block_num == 0) {
+            memset(out + done, 0, chunk);
+        } else {
+            if (read_block(ctx, block_num, block_buffer) != 0) return -1;
+            memcpy(out + done, block_buffer + in_block, chunk);
+        }
+        done += chunk;
+    }
+    return (int)done;
+}
+
+int file_write(IBFS_Context* ctx, uint32_t inode_num, Inode* inode, uint64_t offset, const void* buffer, size_t length)
+{
+    if (!ctx || !inode || (!buffer && length > 0)) return -1;
+    uint64_t end = offset + length;
+    uint32_t home = inode_goal_block(ctx, inode_num);
+
+    if (!(inode->flags & IBFS_INODE_INLINE) && inode->size == 0 && !file_has_blocks(inode) &&
+        end <= file_inline_capacity(ctx)) {
+        memset(inode->inline_data, 0, sizeof(inode->inline_data));
+        inode->flags |= IBFS_INODE_INLINE;
+    }
+
+    if ((inode->flags & IBFS_INODE_INLINE) && end > file_inline_capacity(ctx)) {
+        if (file_uninline(ctx, inode, home) != 0) return -1;
+    }
+
+    size_t done = 0;
+    if (inode->flags & IBFS_INODE_INLINE) {
+        memcpy(inode->inline_data + offset, buffer, length);
+        done = length;
+    } else if (inode->flags & IBFS_INODE_COMPRESSED) {
+        done = file_write_compressed(ctx, inode, offset, buffer, length, home);
+    } else {
+        IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+        FileMapCache cache;
+        file_cache_init(&cache);
+        while (done < length) {
+            uint64_t pos = offset + done;
+            uint32_t logical = (uint32_t)(pos / ctx->sb.block_size);
+            uint32_t in_block = (uint32_t)(pos % ctx->sb.block_size);
+            size_t chunk = ctx->sb.block_size - in_block;
+            if (chunk > length - done) chunk = length - done;
+
+            uint32_t block_num;
+            if (file_bmap(ctx, inode, &cache, logical, false, home, &block_num) != 0) break;
+            bool fresh = (block_num == 0);
+            if (chunk < ctx->sb.block_size) {
+                if (!fresh) {
+                    if (read_block(ctx, block_num, block_buffer) != 0) break;
+                } else {
+                    memset(block_buffer, 0, ctx->sb.block_size);
+                }
+            }
+            memcpy(block_buffer + in_block, (const char*)buffer + done, chunk);
+            /* Zeros written over a hole leave it a hole. */
+            if (fresh && file_is_zero(block_buffer, ctx->sb.block_size)) {
+                done += chunk;
+                continue;
+            }
+
+            uint64_t hash = 0;
+            if (ctx->sb.dedup_index_start != 0) {
+                hash = dedup_hash(block_buffer, ctx->sb.block_size);
+                int handled = file_write_dedup(ctx, inode, &cache, logical, block_num, home, block_buffer, hash);
+                if (handled < 0) {
+                    fprintf(stderr, "file_write: Failed to deduplicate block %u of inode %u.\n", logical, inode_num);
+                    break;
+                }
+                if (handled) {
+                    done += chunk;
+                    continue;
+                }
+            }
+            if ((fresh || ctx->sb.refcount_table_start != 0) &&
+                file_bmap(ctx, inode, &cache, logical, true, home, &block_num) != 0) {
+                fprintf(stderr, "file_write: Failed to map block %u of inode %u.\n", logical, inode_num);
+                break;
+            }
+            if (write_block(ctx, block_num, block_buffer) != 0) break;
+            if (ctx->sb.dedup_index_start != 0) dedup_insert(ctx, hash, block_num);
+            done += chunk;
+        }
+        if (file_cache_release(ctx, &cache) != 0) done = 0;
+    }
+
+    if (offset + done > inode->size) inode->size = offset + done;
+    inode_now(&inode->mtime);
+    inode->ctime = inode->mtime;
+    if (inode_write(ctx, inode_num, inode) != 0) return -1;
+    return (done == length) ? (int)done : -1;
+}
+
+/*
+ * Frees the blocks under the indirect block *node (height 1 points at data blocks) from
+ * logical block `keep` of the subtree on, and the node itself once nothing is left in it.
+ * Data blocks go in one batch per indirect block, so shared blocks cost one reference
+ * count update per leaf.
+ */
+static int file_trim_tree(IBFS_Context* ctx, uint32_t* node, int height, uint64_t keep)
+{
+    uint32_t ptrs = file_ptrs_per_block(ctx);
+    uint64_t span = 1;
+    for (int level = 1; level < height; level++) span *= ptrs;
+    uint32_t* entries = alloc_block_buffer(ctx, 1);
+    uint32_t* released = malloc((size_t)(ptrs + 1) * sizeof(uint32_t));
+    uint32_t count = 0;
+    int result = 0;
+    if (!entries || !released) {
+        free(entries);
+        free(released);
+        return -1;
+    }
+
+    if (read_block(ctx, *node, entries) != 0) {
+        fprintf(stderr, "file_free_blocks: Failed to read indirect block %u, the blocks under it leak.\n", *node);
+        result = -1;
+        if (keep > 0) goto out;
+        memset(entries, 0, ctx->sb.block_size);
+    }
+    uint32_t start = (uint32_t)(keep / span);
+    bool remaining = false;
+    for (uint32_t i = start; i < ptrs && !remaining; i++) remaining = entries[i] != 0;
+    if (!remaining && keep > 0) goto out;
+    /* The node is about to change; a shared one is copied first, its children stay shared. */
+    if (keep > 0 && file_unshare(ctx, node, NULL) != 0) {
+        result = -1;
+        goto out;
+    }
+
+    for (uint32_t i = start; i < ptrs; i++) {
+        uint32_t entry = ibfs_le32(entries[i]);
+        if (entry == 0) continue;
+        if (height == 1) {
+            if (file_is_block(entry)) released[count++] = entry;
+            entries[i] = 0;
+            continue;
+        }
+        uint64_t base = (uint64_t)i * span;
+        uint32_t child = entry;
+        if (file_trim_tree(ctx, &child, height - 1, keep > base ? keep - base : 0) != 0) result = -1;
+        entries[i] = ibfs_le32(child);
+    }
+
+    bool empty = true;
+    for (uint32_t i = 0; i < ptrs && empty; i++) empty = entries[i] == 0;
+    if (empty) {
+        released[count++] = *node;
+        *node = 0;
+    } else if (write_block(ctx, *node, entries) != 0) {
+        result = -1;
+    }
+    if (file_unref_blocks(ctx, released, count) != 0) result = -1;
+out:
+    free(entries);
+    free(released);
+    return result;
+}
+
+/* Frees every block from logical block `keep` on: the direct blocks in one batch, then whole indirect subtrees. */
+static int file_release_blocks(IBFS_Context* ctx, Inode* inode, uint64_t keep)
+{
+    uint32_t released[FILE_DIRECT_BLOCKS];
+    uint32_t count = 0;
+    int result = 0;
+    for (uint64_t i = keep; i < FILE_DIRECT_BLOCKS; i++) {
+        if (file_is_block(inode->direct_blocks[i])) released[count++] = inode->direct_blocks[i];
+        inode->direct_blocks[i] = 0;
+    }
+    if (file_unref_blocks(ctx, released, count) != 0) result = -1;
+
+    uint64_t ptrs = file_ptrs_per_block(ctx);
+    uint64_t base = FILE_DIRECT_BLOCKS, span = ptrs;
+    for (int levels = 1; levels <= FILE_MAP_LEVELS; levels++) {
+        uint32_t* root = file_map_root(inode, levels);
+        if (*root != 0 && keep < base + span && file_trim_tree(ctx, root, levels, keep > base ? keep - base : 0) != 0) {
+            result = -1;
+        }
+        base += span;
+        span *= ptrs;
+    }
+    return result;
+}
+
+void file_free_blocks(IBFS_Context* ctx, Inode* inode)
+{
+    if (inode->flags & IBFS_INODE_INLINE) {
+        memset(inode->inline_data, 0, sizeof(inode->inline_data));
+        inode->flags &= ~IBFS_INODE_INLINE;
+        inode->size = 0;
+        return;
+    }
+    if (file_release_blocks(ctx, inode, 0) != 0) {
+        fprintf(stderr, "file_free_blocks: Some blocks could not be freed.\n");
+    }
+    inode->size = 0;
+}
+
+/*
+ * Shrinking frees the blocks past the new end, whole indirect subtrees at a time, and
+ * zeroes the rest of the last block so growing the file again reads zeros. Blocks
+ * preallocated past the end go too. Growing leaves a hole. A compressed file keeps
+ * the whole cluster holding the new end.
+ */
+int file_truncate(IBFS_Context* ctx, uint32_t inode_num, Inode* inode, uint64_t size)
+{
+    uint32_t block_size = ctx->sb.block_size;
+    if ((inode->mode & S_IFDIR) == S_IFDIR) {
+        fprintf(stderr, "file_truncate: Inode %u is a directory.\n", inode_num);
+        return -1;
+    }
+    if (size > file_max_size(ctx)) {
+        fprintf(stderr, "file_truncate: Error - size %llu beyond maximum file size.\n", (unsigned long long)size);
+        return -1;
+    }
+
+    int result = 0;
+    if (inode->flags & IBFS_INODE_INLINE) {
+        if (size < inode->size) memset(inode->inline_data + size, 0, (size_t)(inode->size - size));
+        if (size > file_inline_capacity(ctx) && file_uninline(ctx, inode, inode_goal_block(ctx, inode_num)) != 0) return -1;
+    } else if (size <= inode->size) {
+        uint64_t keep = (size + block_size - 1) / block_size;
+        if (inode->flags & IBFS_INODE_COMPRESSED) keep = (keep + IBFS_CLUSTER_BLOCKS - 1) / IBFS_CLUSTER_BLOCKS * IBFS_CLUSTER_BLOCKS;
+        uint64_t tail_end = keep * block_size < inode->size ? keep * block_size : inode->size;
+        uint32_t last = 0;
+        if (tail_end > size && !(inode->flags & IBFS_INODE_COMPRESSED)) {
+            FileMapCache cache;
+            file_cache_init(&cache);
+            if (file_get_slots(ctx, inode, &cache, (uint32_t)(size / block_size), 1, &last) != 0) result = -1;
+            file_cache_release(ctx, &cache);
+        }
+        if (tail_end > size && (last != 0 || (inode->flags & IBFS_INODE_COMPRESSED))) {
+            char* zeros = calloc(1, (size_t)(tail_end - size));
+            if (!zeros || file_write(ctx, inode_num, inode, size, zeros, (size_t)(tail_end - size)) < 0) result = -1;
+            free(zeros);
+        }
+        if (result == 0 && file_release_blocks(ctx, inode, keep) != 0) result = -1;
+    }
+
+    if (result == 0) inode->size = size;
+    inode_now(&inode->mtime);
+    inode->ctime = inode->mtime;
+    if (inode_write(ctx, inode_num, inode) != 0) return -1;
+    return result;
+}
+
+#define FILE_PREALLOC_RUN 256
+
+/*
+ * Allocates blocks for the holes in [offset, offset + length), in runs as contiguous as
+ * the free space allows. A block pointer cannot say "allocated but never written", so the
+ * blocks are zeroed as they are allocated. Unless keep_size is set the file grows to
+ * cover the range; blocks kept past the end are freed by the next truncate.
+ */
+int file_preallocate(IBFS_Context* ctx, uint32_t inode_num, Inode* inode, uint64_t offset, uint64_t length, bool keep_size)
+{
+    uint32_t block_size = ctx->sb.block_size;
+    uint64_t end = offset + length;
+    if ((inode->mode & S_IFDIR) == S_IFDIR) {
+        fprintf(stderr, "file_preallocate: Inode %u is a directory.\n", inode_num);
+        return -1;
+    }
+    if (inode->flags & IBFS_INODE_COMPRESSED) {
+        fprintf(stderr, "file_preallocate: Inode %u is compressed; its clusters move on every write.\n", inode_num);
+        return -1;
+    }
+    if (end < offset || end > file_max_size(ctx)) {
+        fprintf(stderr, "file_preallocate: Error - range ends beyond maximum file size.\n");
+        return -1;
+    }
+
+    uint32_t home = inode_goal_block(ctx, inode_num);
+    int result = 0;
+    if ((inode->flags & IBFS_INODE_INLINE) && end > file_inline_capacity(ctx)) {
+        if (file_uninline(ctx, inode, home) != 0) return -1;
+    }
+    if (!(inode->flags & IBFS_INODE_INLINE) && length > 0) {
+        char* zeros = alloc_block_buffer(ctx, FILE_PREALLOC_RUN);
+        if (!zeros) return -1;
+        memset(zeros, 0, (size_t)FILE_PREALLOC_RUN * block_size);
+        FileMapCache cache;
+        file_cache_init(&cache);
+        uint64_t logical = offset / block_size;
+        uint64_t last = (end + block_size - 1) / block_size;
+        uint32_t goal = home;
+        while (logical < last && result == 0) {
+            uint32_t entry;
+            if (file_get_slots(ctx, inode, &cache, (uint32_t)logical, 1, &entry) != 0) {
+                result = -1;
+                break;
+            }
+            if (entry != 0) {
+                goal = entry + 1;
+                logical++;
+                continue;
+            }
+
+            /* Indirect blocks for the run come first, so the data after them stays in one piece. */
+            uint32_t run = 0;
+            while (logical + run < last && run < FILE_PREALLOC_RUN && result == 0) {
+                FileSlot slot;
+                if (file_map_walk(ctx, inode, &cache, (uint32_t)(logical + run), FILE_MAP_CREATE, goal, &slot) != 0) result = -1;
+                else if (file_slot_get(&cache, slot) != 0) break;
+                else run++;
+            }
+            if (result != 0) break;
+
+            uint32_t got;
+            uint32_t start = alloc_data_extent(ctx, goal, run, &got);
+            if (start == 0) {
+                result = -1;
+                break;
+            }
+            if (write_blocks(ctx, start, got, zeros) != 0) {
+                for (uint32_t i = 0; i < got; i++) free_data_block(ctx, start + i);
+                result = -1;
+                break;
+            }
+            for (uint32_t i = 0; i < got && result == 0; i++) {
+                FileSlot slot;
+                if (file_map_walk(ctx, inode, &cache, (uint32_t)(logical + i), FILE_MAP_CREATE, goal, &slot) != 0) result = -1;
+                else file_slot_set(&cache, slot, start + i);
+            }
+            goal = start + got;
+            logical += got;
+        }
+        if (file_cache_release(ctx, &cache) != 0) result = -1;
+        free(zeros);
+
+        /* A failed request gives back the blocks it reserved past the end of the file. */
+        if (result != 0) {
+            uint64_t keep = (inode->size + block_size - 1) / block_size;
+            if (keep < offset / block_size) keep = offset / block_size;
+            file_release_blocks(ctx, inode, keep);
+        }
+    }
+
+    if (result == 0 && !keep_size && end > inode->size) inode->size = end;
+    inode_now(&inode->mtime);
+    inode->ctime = inode->mtime;
+    if (inode_write(ctx, inode_num, inode) != 0) return -1;
+    return result;
+}
+
+/*
+ * SEEK_DATA and SEEK_HOLE: the first offset at or after `offset` that holds data, or that
+ * lies in a hole, where the end of the file counts as a hole. A compressed cluster is
+ * data if any block of it is allocated. Returns 1 when there is no data after offset.
+ */
+int file_seek_data(IBFS_Context* ctx, Inode* inode, uint64_t offset, bool hole, uint64_t* offset_out)
+{
+    uint32_t block_size = ctx->sb.block_size;
+    if (offset >= inode->size) return 1;
+    if (inode->flags & IBFS_INODE_INLINE) {
+        *offset_out = hole ? inode->size : offset;
+        return 0;
+    }
+
+    bool compressed = (inode->flags & IBFS_INODE_COMPRESSED) != 0;
+    uint32_t unit = compressed ? IBFS_CLUSTER_BLOCKS : 1;
+    uint64_t total = (inode->size + block_size - 1) / block_size;
+    uint64_t logical = offset / block_size / unit * unit;
+    FileMapCache cache;
+    file_cache_init(&cache);
+    int result = 0;
+    uint64_t found;
+    if (!hole) {
+        uint32_t entry;
+        result = file_next_mapped(ctx, inode, &cache, &logical, total, &entry);
+        found = logical / unit * unit * block_size;
+    } else {
+        while (logical < total) {
+            uint32_t slots[IBFS_CLUSTER_BLOCKS];
+            uint32_t length = compressed ? file_cluster_length(ctx, (uint32_t)logical) : 1;
+            if (file_get_slots(ctx, inode, &cache, (uint32_t)logical, length, slots) != 0) {
+                result = -1;
+                break;
+            }
+            bool empty = true;
+            for (uint32_t i = 0; i < length && empty; i++) empty = slots[i] == 0;
+            if (empty) break;
+            logical += length;
+        }
+        found = logical < total ? logical * block_size : inode->size;
+    }
+    file_cache_release(ctx, &cache);
+    if (result == 0) *offset_out = found > offset ? found : offset;
+    return result;
+}
+
+/* Calls back once per run of physically contiguous blocks, in logical order; holes are the gaps between runs. */
+int file_for_each_extent(IBFS_Context* ctx, Inode* inode,
+                         void (*callback)(uint64_t logical, uint32_t block_num, uint32_t count, void* user_data), void* user_data)
+{
+    if (inode->flags & IBFS_INODE_INLINE) return 0;
+    FileMapCache cache;
+    file_cache_init(&cache);
+    uint64_t logical = 0, run_logical = 0;
+    uint32_t run_start = 0, run_count = 0;
+    int result = 0;
+    /* Blocks preallocated past the end of the file are listed too. */
+    uint64_t end = file_max_blocks(ctx);
+    for (;;) {
+        uint32_t entry;
+        int found = file_next_mapped(ctx, inode, &cache, &logical, end, &entry);
+        if (found < 0) result = -1;
+        if (found == 0 && file_is_block(entry) && run_count > 0 && logical == run_logical + run_count &&
+            entry == run_start + run_count) {
+            run_count++;
+        } else {
+            if (run_count > 0) callback(run_logical, run_start, run_count, user_data);
+            run_count = 0;
+            if (found != 0) break;
+            if (file_is_block(entry)) {
+                run_logical = logical;
+                run_start = entry;
+                run_count = 1;
+            }
+        }
+        logical++;
+    }
+    file_cache_release(ctx, &cache);
+    return result;
+}
+
+/* Calls callback for every block under the indirect block `node`, then for the node itself. */
+static int file_walk_tree(IBFS_Context* ctx, uint32_t node, int height, void (*callback)(uint32_t block_num, void* user_data),
+                          void* user_data)
+{
+    uint32_t ptrs = file_ptrs_per_block(ctx);
+    uint32_t* entries = alloc_block_buffer(ctx, 1);
+    if (!entries) return -1;
+    if (read_block(ctx, node, entries) != 0) {
+        fprintf(stderr, "file_for_each_block: Failed to read indirect block %u\n", node);
+        free(entries);
+        return -1;
+    }
+    int result = 0;
+    for (uint32_t i = 0; i < ptrs && result == 0; i++) {
+        uint32_t entry = ibfs_le32(entries[i]);
+        if (height > 1 && entry != 0) result = file_walk_tree(ctx, entry, height - 1, callback, user_data);
+        else if (height == 1 && file_is_block(entry)) callback(entry, user_data);
+    }
+    free(entries);
+    if (result == 0) callback(node, user_data);
+    return result;
+}
+
+int file_for_each_block(IBFS_Context* ctx, Inode* inode, void (*callback)(uint32_t block_num, void* user_data), void* user_data)
+{
+    if (inode->flags & IBFS_INODE_INLINE) return 0;
+
+    for (int i = 0; i < FILE_DIRECT_BLOCKS; i++) {
+        if (file_is_block(inode->direct_blocks[i])) callback(inode->direct_blocks[i], user_data);
+    }
+    for (int levels = 1; levels <= FILE_MAP_LEVELS; levels++) {
+        uint32_t root = *file_map_root(inode, levels);
+        if (root != 0 && file_walk_tree(ctx, root, levels, callback, user_data) != 0) return -1;
+    }
+    return 0;
+}
+
+typedef struct FileBlockList {
+    uint32_t* items;
+    uint32_t count;
+    uint32_t capacity;
+    bool failed;
+} FileBlockList;
+
+static void file_collect_block(uint32_t block_num, void* user_data)
+{
+    FileBlockList* list = (FileBlockList*)user_data;
+    if (list->failed) return;
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 256;
+        uint32_t* items = realloc(list->items, (size_t)capacity * sizeof(uint32_t));
+        if (!items) {
+            list->failed = true;
+            return;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = block_num;
+}
+
+/* Adds a reference to every block of the inode, for a clone that copies its block pointers. */
+int file_share_blocks(IBFS_Context* ctx, Inode* inode)
+{
+    FileBlockList list = { NULL, 0, 0, false };
+    int result = -1;
+    if (file_for_each_block(ctx, inode, file_collect_block, &list) == 0 && !list.failed) {
+        result = refcount_share(ctx, list.items, list.count);
+    }
+    free(list.items);
+    return result;
+}
+
+/* Compressed data has to pass through memory, one cluster at a time. */
+static int file_export_compressed(IBFS_Context* ctx, Inode* inode, int out_fd)
+{
+    size_t cluster_bytes = (size_t)IBFS_CLUSTER_BLOCKS * ctx->sb.block_size;
+    char* buffer = malloc(cluster_bytes);
+    if (!buffer) return -1;
+    int result = 0;
+    for (uint64_t offset = 0; offset < inode->size; offset += cluster_bytes) {
+        size_t length = inode->size - offset < cluster_bytes ? (size_t)(inode->size - offset) : cluster_bytes;
+        if (file_read_compressed(ctx, inode, offset, buffer, length) != (int)length || write_fd(out_fd, buffer, length) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+int file_export(IBFS_Context* ctx, Inode* inode, int out_fd)
+{
+    if (inode->flags & IBFS_INODE_INLINE) return write_fd(out_fd, inode->inline_data, (size_t)inode->size);
+    if (inode->flags & IBFS_INODE_COMPRESSED) return file_export_compressed(ctx, inode, out_fd);
+
+    uint32_t block_size = ctx->sb.block_size;
+    uint64_t total_blocks = (inode->size + block_size - 1) / block_size;
+    FileMapCache cache;
+    file_cache_init(&cache);
+    int result = 0;
+
+    /* Physically contiguous blocks are handed to the kernel as one extent, and a run of holes is one gap. */
+    uint64_t logical = 0;
+    while (logical < total_blocks) {
+        uint32_t block_num;
+        uint64_t next = logical;
+        int found = file_next_mapped(ctx, inode, &cache, &next, total_blocks, &block_num);
+        if (found < 0) {
+            result = -1;
+            break;
+        }
+        if (next > logical) {
+            uint64_t hole_end = next * block_size < inode->size ? next * block_size : inode->size;
+            if (zero_fill_fd(out_fd, hole_end - logical * block_size) != 0) {
+                result = -1;
+                break;
+            }
+            logical = next;
+        }
+        if (found > 0) break;
+
+        uint32_t run = 1;
+        while (logical + run < total_blocks) {
+            uint32_t following;
+            if (file_get_slots(ctx, inode, &cache, (uint32_t)(logical + run), 1, &following) != 0) {
+                result = -1;
+                break;
+            }
+            if (following != block_num + run) break;
+            run++;
+        }
+        uint64_t offset = logical * block_size;
+        uint64_t length = (uint64_t)run * block_size;
+        if (length > inode->size - offset) length = inode->size - offset;
+        if (result != 0 || copy_blocks_to_fd(ctx, block_num, length, out_fd) != 0) {
+            result = -1;
+            break;
+        }
+        logical += run;
+    }
+    file_cache_release(ctx, &cache);
+    return result;
+}
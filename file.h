@@ -0,0 +1,32 @@
+#pragma once
+#include "ibfs.h"
+#include <stddef.h>
+
+/* Logical-to-physical block numbers of a file, read once and valid until the file is written. */
+typedef struct FileBlockMap {
+    uint32_t* blocks;
+    uint32_t count;
+} FileBlockMap;
+
+int file_read(IBFS_Context* ctx, Inode* inode, uint64_t offset, void* buffer, size_t length);
+int file_map_load(IBFS_Context* ctx, Inode* inode, FileBlockMap* map);
+void file_map_free(FileBlockMap* map);
+int file_read_mapped(IBFS_Context* ctx, Inode* inode, const FileBlockMap* map, uint64_t offset, void* buffer, size_t length);
+int file_write(IBFS_Context* ctx, uint32_t inode_num, Inode* inode, uint64_t offset, const void* buffer, size_t length);
+void file_free_blocks(IBFS_Context* ctx, Inode* inode);
+/* Drops one reference from each data block; blocks nothing else shares leave the dedup index and are freed. */
+int file_unref_blocks(IBFS_Context* ctx, uint32_t* blocks, uint32_t count);
+int file_truncate(IBFS_Context* ctx, uint32_t inode_num, Inode* inode, uint64_t size);
+int file_preallocate(IBFS_Context* ctx, uint32_t inode_num, Inode* inode, uint64_t offset, uint64_t length, bool keep_size);
+int file_seek_data(IBFS_Context* ctx, Inode* inode, uint64_t offset, bool hole, uint64_t* offset_out);
+int file_export(IBFS_Context* ctx, Inode* inode, int out_fd);
+int file_replace_block(IBFS_Context* ctx, Inode* inode, uint32_t logical, uint32_t new_block, bool share, uint32_t home);
+int file_map_extent(IBFS_Context* ctx, Inode* inode, uint32_t logical, uint32_t first_block, uint32_t count, uint32_t home);
+uint64_t file_max_size(IBFS_Context* ctx);
+uint64_t file_indirect_blocks(IBFS_Context* ctx, uint64_t blocks);
+int file_set_compressed(IBFS_Context* ctx, uint32_t inode_num, Inode* inode, bool compress);
+int file_share_blocks(IBFS_Context* ctx, Inode* inode);
+int file_for_each_block(IBFS_Context* ctx, Inode* inode, void (*callback)(uint32_t block_num, void* user_data), void* user_data);
+int file_for_each_extent(IBFS_Context* ctx, Inode* inode,
+                         void (*callback)(uint64_t logical, uint32_t block_num, uint32_t count, void* user_data), void* user_data);
+uint32_t file_inline_capacity(IBFS_Context* ctx);
@@ -0,0 +1,548 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ibfs.h"
+#include "libibfs.h"
+#include "fsck.h"
+#include "io.h"
+#include "inode.h"
+#include "file.h"
+#include "refcount.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "nameindex.h"
+#include "path.h"
+
+/* Runs against a fresh image made by ./mkfs, so build mkfs first. */
+#define TEST_DISK "fs_test.disk"
+#ifdef _WIN32
+#define TEST_NULL "NUL"
+#else
+#define TEST_NULL "/dev/null"
+#endif
+
+static int failures = 0;
+
+static void expect(int condition, const char* what) {
+    if (!condition) {
+        fprintf(stderr, "TEST FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+/* The call must fail with the given errno value. */
+static void expect_errno(long long rc, int error, const char* what) {
+    if (rc != -1 || errno != error) {
+        fprintf(stderr, "TEST FAILED: %s (returned %lld, errno %d '%s', expected '%s')\n", what, rc, errno,
+                strerror(errno), strerror(error));
+        failures++;
+    }
+}
+
+static IBFS_FS* make_image(const char* size) {
+    char command[128];
+    snprintf(command, sizeof(command), "./mkfs -n -s %s " TEST_DISK " > " TEST_NULL, size);
+    remove(TEST_DISK);
+    if (system(command) != 0) {
+        fprintf(stderr, "TEST FAILED: ./mkfs could not create %s\n", TEST_DISK);
+        return NULL;
+    }
+    IBFS_FS* fs = ibfs_fs_mount(TEST_DISK, IBFS_BACKEND_FILE);
+    if (!fs) fprintf(stderr, "TEST FAILED: Could not mount %s\n", TEST_DISK);
+    return fs;
+}
+
+static uint32_t free_blocks(IBFS_FS* fs) {
+    return ibfs_fs_context(fs)->sb.free_blocks_count;
+}
+
+static int put_file(IBFS_FS* fs, const char* path, const void* data, size_t length) {
+    int fd = ibfs_fs_open(fs, path, IBFS_O_WRONLY | IBFS_O_CREAT | IBFS_O_TRUNC);
+    if (fd < 0) return -1;
+    int result = ibfs_fs_write(fs, fd, data, length) == (long long)length ? 0 : -1;
+    if (ibfs_fs_close(fs, fd) != 0) result = -1;
+    return result;
+}
+
+static int file_equals(IBFS_FS* fs, const char* path, const void* data, size_t length) {
+    char back[length + 1];
+    int fd = ibfs_fs_open(fs, path, IBFS_O_RDONLY);
+    if (fd < 0) return 0;
+    int equal = ibfs_fs_read(fs, fd, back, length + 1) == (long long)length && memcmp(back, data, length) == 0;
+    ibfs_fs_close(fs, fd);
+    return equal;
+}
+
+/* Physical block behind logical block `logical` of a file, 0 for a hole or on failure. */
+static uint32_t file_block(IBFS_FS* fs, const char* path, uint32_t logical) {
+    IBFS_Stat st;
+    Inode inode;
+    FileBlockMap map;
+    if (ibfs_fs_stat(fs, path, &st) != 0 || inode_read(ibfs_fs_context(fs), st.ino, &inode) != 0 ||
+        file_map_load(ibfs_fs_context(fs), &inode, &map) != 0) {
+        return 0;
+    }
+    uint32_t block = logical < map.count ? map.blocks[logical] : 0;
+    file_map_free(&map);
+    return block;
+}
+
+static uint32_t extra_refs(IBFS_FS* fs, uint32_t block) {
+    uint32_t extra = 0;
+    if (refcount_get(ibfs_fs_context(fs), block, &extra) != 0) return UINT32_MAX;
+    return extra;
+}
+
+static void test_file_io(IBFS_FS* fs) {
+    printf("--- Running file I/O test ---\n");
+    char data[10000], back[10000];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (char)(i * 7);
+
+    expect_errno(ibfs_fs_open(fs, "/missing", IBFS_O_RDONLY), ENOENT, "open of a missing file");
+    expect_errno(ibfs_fs_open(fs, "relative", IBFS_O_RDONLY), EINVAL, "open of a relative path");
+    expect_errno(ibfs_fs_open(fs, "/missing/f", IBFS_O_RDWR | IBFS_O_CREAT), ENOENT, "create in a missing directory");
+    int fd = ibfs_fs_open(fs, "/f", IBFS_O_RDWR | IBFS_O_CREAT | IBFS_O_EXCL);
+    expect(fd >= 0, "create /f");
+    expect_errno(ibfs_fs_open(fs, "/f", IBFS_O_RDWR | IBFS_O_CREAT | IBFS_O_EXCL), EEXIST, "exclusive create of /f");
+
+    expect(ibfs_fs_write(fs, fd, data, sizeof(data)) == (long long)sizeof(data), "write 10000 bytes");
+    expect(ibfs_fs_lseek(fs, fd, 0, SEEK_SET) == 0, "seek to the start");
+    expect(ibfs_fs_read(fs, fd, back, sizeof(back)) == (long long)sizeof(back) && memcmp(data, back, sizeof(data)) == 0,
+           "read back what was written");
+    expect(ibfs_fs_read(fs, fd, back, sizeof(back)) == 0, "read at the end returns 0");
+    expect(ibfs_fs_lseek(fs, fd, -100, SEEK_END) == 9900, "seek from the end");
+    expect(ibfs_fs_read(fs, fd, back, sizeof(back)) == 100 && memcmp(back, data + 9900, 100) == 0, "short read near the end");
+    expect_errno(ibfs_fs_lseek(fs, fd, -1, SEEK_SET), EINVAL, "seek before the start");
+    expect_errno(ibfs_fs_lseek(fs, fd, 0, 42), EINVAL, "seek with an unknown whence");
+    expect_errno(ibfs_fs_lseek(fs, fd, 20000, IBFS_SEEK_DATA), ENXIO, "SEEK_DATA past the end");
+
+    expect(ibfs_fs_ftruncate(fs, fd, 100) == 0, "truncate to 100 bytes");
+    IBFS_Stat st;
+    expect(ibfs_fs_fstat(fs, fd, &st) == 0 && st.size == 100, "size after truncate");
+    expect_errno(ibfs_fs_ftruncate(fs, fd, -1), EINVAL, "truncate to a negative length");
+    expect(ibfs_fs_ftruncate(fs, fd, 5000) == 0 && ibfs_fs_lseek(fs, fd, 100, SEEK_SET) == 100, "grow to 5000 bytes");
+    memset(back, 1, sizeof(back));
+    expect(ibfs_fs_read(fs, fd, back, 4900) == 4900 && back[0] == 0 && back[4899] == 0, "grown range reads as zeros");
+    expect(ibfs_fs_close(fs, fd) == 0, "close /f");
+    expect_errno(ibfs_fs_close(fs, fd), EBADF, "close of a closed handle");
+    expect_errno(ibfs_fs_read(fs, 99, back, 1), EBADF, "read from an unknown handle");
+
+    fd = ibfs_fs_open(fs, "/f", IBFS_O_RDONLY);
+    expect_errno(ibfs_fs_write(fs, fd, data, 1), EBADF, "write through a read-only handle");
+    expect_errno(ibfs_fs_ftruncate(fs, fd, 0), EINVAL, "truncate through a read-only handle");
+    ibfs_fs_close(fs, fd);
+    fd = ibfs_fs_open(fs, "/f", IBFS_O_WRONLY | IBFS_O_TRUNC);
+    expect_errno(ibfs_fs_read(fs, fd, back, 1), EBADF, "read through a write-only handle");
+    expect(ibfs_fs_fstat(fs, fd, &st) == 0 && st.size == 0, "O_TRUNC empties the file");
+    ibfs_fs_close(fs, fd);
+    expect(ibfs_fs_unlink(fs, "/f") == 0, "unlink /f");
+}
+
+/* The first block behind the triple indirect pointer, past 12 direct blocks and the single and double trees. */
+static void test_triple_indirect(IBFS_FS* fs) {
+    printf("--- Running triple indirect test ---\n");
+    IBFS_Context* ctx = ibfs_fs_context(fs);
+    uint64_t ptrs = ctx->sb.block_size / sizeof(uint32_t);
+    long long offset = (long long)((12 + ptrs + ptrs * ptrs) * ctx->sb.block_size) + 100;
+    uint32_t start = free_blocks(fs);
+    const char data[] = "triple indirect";
+    char back[sizeof(data)];
+
+    int fd = ibfs_fs_open(fs, "/deep", IBFS_O_RDWR | IBFS_O_CREAT | IBFS_O_EXCL);
+    expect(fd >= 0, "create /deep");
+    expect(ibfs_fs_lseek(fs, fd, offset, SEEK_SET) == offset, "seek into the triple indirect range");
+    expect(ibfs_fs_write(fs, fd, data, sizeof(data)) == (long long)sizeof(data), "write past the double indirect range");
+    expect(free_blocks(fs) == start - 4, "one data block and three levels of indirect blocks");
+    expect(ibfs_fs_lseek(fs, fd, offset, SEEK_SET) == offset &&
+           ibfs_fs_read(fs, fd, back, sizeof(back)) == (long long)sizeof(back) && memcmp(back, data, sizeof(data)) == 0,
+           "read back through the triple indirect block");
+    expect(ibfs_fs_lseek(fs, fd, offset - 100, SEEK_SET) == offset - 100 && ibfs_fs_read(fs, fd, back, 1) == 1 && back[0] == 0,
+           "the start of the block reads as zeros");
+    expect(ibfs_fs_lseek(fs, fd, 0, IBFS_SEEK_DATA) == offset - 100, "SEEK_DATA finds the triple indirect block");
+
+    expect(ibfs_fs_ftruncate(fs, fd, 0) == 0, "truncate /deep to 0");
+    expect(free_blocks(fs) == start, "truncate frees the data and every indirect block");
+    expect(ibfs_fs_close(fs, fd) == 0 && ibfs_fs_unlink(fs, "/deep") == 0, "remove /deep");
+    expect(ibfs_fsck(ctx, 1, false) == 0, "fsck is clean after the triple indirect file");
+}
+
+/* Holes read as zeros and take no blocks; preallocation takes blocks without touching the size unless asked to. */
+static void test_sparse(IBFS_FS* fs) {
+    printf("--- Running sparse file test ---\n");
+    IBFS_Context* ctx = ibfs_fs_context(fs);
+    long long bs = ctx->sb.block_size;
+    char block[bs], back[bs];
+    memset(block, 'S', (size_t)bs);
+    uint32_t start = free_blocks(fs);
+
+    int fd = ibfs_fs_open(fs, "/sparse", IBFS_O_RDWR | IBFS_O_CREAT | IBFS_O_EXCL);
+    expect(fd >= 0, "create /sparse");
+    expect(ibfs_fs_write(fs, fd, block, (size_t)bs) == bs, "write the first block");
+    expect(ibfs_fs_lseek(fs, fd, 8 * bs, SEEK_SET) == 8 * bs && ibfs_fs_write(fs, fd, block, (size_t)bs) == bs,
+           "write the ninth block past a gap");
+    expect(free_blocks(fs) == start - 2, "the gap takes no blocks");
+    memset(back, 1, (size_t)bs);
+    expect(ibfs_fs_lseek(fs, fd, 3 * bs, SEEK_SET) == 3 * bs && ibfs_fs_read(fs, fd, back, (size_t)bs) == bs &&
+           back[0] == 0 && memcmp(back, back + 1, (size_t)bs - 1) == 0, "the gap reads as zeros");
+
+    expect(ibfs_fs_lseek(fs, fd, 0, IBFS_SEEK_HOLE) == bs, "SEEK_HOLE finds the end of the first block");
+    expect(ibfs_fs_lseek(fs, fd, bs / 2, IBFS_SEEK_DATA) == bs / 2, "SEEK_DATA inside data stays put");
+    expect(ibfs_fs_lseek(fs, fd, bs, IBFS_SEEK_DATA) == 8 * bs, "SEEK_DATA skips the gap");
+    expect(ibfs_fs_lseek(fs, fd, 4 * bs + 1, IBFS_SEEK_HOLE) == 4 * bs + 1, "SEEK_HOLE inside the gap stays put");
+    expect(ibfs_fs_lseek(fs, fd, 8 * bs, IBFS_SEEK_HOLE) == 9 * bs, "the end of the file counts as a hole");
+    expect_errno(ibfs_fs_lseek(fs, fd, 9 * bs, IBFS_SEEK_HOLE), ENXIO, "SEEK_HOLE at the end of the file");
+
+    IBFS_Stat st;
+    expect(ibfs_fs_fallocate(fs, fd, IBFS_FALLOC_KEEP_SIZE, 9 * bs, 3 * bs) == 0, "preallocate past the end");
+    expect(ibfs_fs_fstat(fs, fd, &st) == 0 && st.size == (uint64_t)(9 * bs), "KEEP_SIZE leaves the size alone");
+    expect(free_blocks(fs) == start - 5, "KEEP_SIZE still reserves the blocks");
+    expect(ibfs_fs_fallocate(fs, fd, 0, 2 * bs, bs) == 0 && ibfs_fs_fstat(fs, fd, &st) == 0 &&
+           st.size == (uint64_t)(9 * bs) && free_blocks(fs) == start - 6, "preallocate inside the gap");
+    expect(ibfs_fs_lseek(fs, fd, 2 * bs, SEEK_SET) == 2 * bs && ibfs_fs_read(fs, fd, back, (size_t)bs) == bs &&
+           back[0] == 0 && memcmp(back, back + 1, (size_t)bs - 1) == 0, "a preallocated block reads as zeros");
+
+    uint32_t before = free_blocks(fs);
+    expect_errno(ibfs_fs_fallocate(fs, fd, IBFS_FALLOC_KEEP_SIZE, 16 * bs, (long long)(before + 1) * bs), ENOSPC,
+                 "preallocating more than is free");
+    expect(free_blocks(fs) == before, "a failed preallocation gives its blocks back");
+    expect(ibfs_fs_fstat(fs, fd, &st) == 0 && st.size == (uint64_t)(9 * bs), "a failed preallocation keeps the size");
+
+    expect(ibfs_fs_close(fs, fd) == 0 && ibfs_fs_unlink(fs, "/sparse") == 0, "remove /sparse");
+    expect(free_blocks(fs) == start, "removing /sparse frees every block");
+    expect(ibfs_fsck(ctx, 1, false) == 0, "fsck is clean after the sparse file");
+}
+
+static void test_unlink_open(IBFS_FS* fs) {
+    printf("--- Running unlink-while-open test ---\n");
+    char data[64 * 1024], back[64 * 1024];
+    memset(data, 'u', sizeof(data));
+    uint32_t before = free_blocks(fs);
+    int fd = ibfs_fs_open(fs, "/open", IBFS_O_RDWR | IBFS_O_CREAT);
+    expect(ibfs_fs_write(fs, fd, data, sizeof(data)) == (long long)sizeof(data), "write /open");
+    int reader = ibfs_fs_open(fs, "/open", IBFS_O_RDONLY);
+    uint32_t in_use = free_blocks(fs);
+
+    expect(ibfs_fs_unlink(fs, "/open") == 0, "unlink /open while it is open");
+    IBFS_Stat st;
+    expect_errno(ibfs_fs_stat(fs, "/open", &st), ENOENT, "stat of the unlinked name");
+    expect(free_blocks(fs) == in_use, "blocks stay allocated while handles are open");
+    expect(ibfs_fs_read(fs, reader, back, sizeof(back)) == (long long)sizeof(back) && memcmp(data, back, sizeof(data)) == 0,
+           "read through a handle after unlink");
+    ibfs_fs_close(fs, fd);
+    expect(free_blocks(fs) == in_use, "blocks stay allocated while one handle is open");
+    ibfs_fs_close(fs, reader);
+    expect(free_blocks(fs) == before, "last close frees the blocks");
+}
+
+static void test_unnamed(IBFS_FS* fs) {
+    printf("--- Running unnamed file test ---\n");
+    uint32_t before = free_blocks(fs);
+    char data[20000];
+    memset(data, 't', sizeof(data));
+    expect_errno(ibfs_fs_open(fs, "/", IBFS_O_RDONLY | IBFS_O_TMPFILE), EINVAL, "read-only unnamed file");
+    int fd = ibfs_fs_open(fs, "/", IBFS_O_WRONLY | IBFS_O_TMPFILE);
+    expect(fd >= 0 && ibfs_fs_write(fs, fd, data, sizeof(data)) == (long long)sizeof(data), "write an unnamed file");
+    ibfs_fs_close(fs, fd);
+    expect(free_blocks(fs) == before, "closing an unnamed file frees it");
+
+    fd = ibfs_fs_open(fs, "/", IBFS_O_WRONLY | IBFS_O_TMPFILE);
+    ibfs_fs_write(fs, fd, data, sizeof(data));
+    int other = ibfs_fs_open(fs, "/x", IBFS_O_WRONLY | IBFS_O_CREAT);
+    expect_errno(ibfs_fs_link(fs, fd, "/x"), EEXIST, "link onto an existing name");
+    expect_errno(ibfs_fs_link(fs, other, "/y"), EMLINK, "link of a file that has a name");
+    expect(ibfs_fs_link(fs, fd, "/named") == 0, "link the unnamed file");
+    ibfs_fs_close(fs, fd);
+    ibfs_fs_close(fs, other);
+    IBFS_Stat st;
+    expect(ibfs_fs_stat(fs, "/named", &st) == 0 && st.size == sizeof(data), "linked file keeps its data");
+    ibfs_fs_unlink(fs, "/named");
+    ibfs_fs_unlink(fs, "/x");
+}
+
+static void test_directories(IBFS_FS* fs) {
+    printf("--- Running directory and rename test ---\n");
+    IBFS_Stat st;
+    expect(ibfs_fs_mkdir(fs, "/d1") == 0 && ibfs_fs_mkdir(fs, "/d2") == 0, "mkdir /d1 and /d2");
+    expect_errno(ibfs_fs_mkdir(fs, "/d1"), EEXIST, "mkdir of an existing directory");
+    int fd = ibfs_fs_open(fs, "/d1/f", IBFS_O_WRONLY | IBFS_O_CREAT);
+    expect(ibfs_fs_write(fs, fd, "rename me", 9) == 9, "write /d1/f");
+    ibfs_fs_close(fs, fd);
+
+    expect_errno(ibfs_fs_rmdir(fs, "/d1"), ENOTEMPTY, "rmdir of a non-empty directory");
+    expect_errno(ibfs_fs_rmdir(fs, "/d1/f"), ENOTDIR, "rmdir of a file");
+    expect_errno(ibfs_fs_unlink(fs, "/d1"), EISDIR, "unlink of a directory");
+    expect_errno(ibfs_fs_open(fs, "/d1", IBFS_O_WRONLY), EISDIR, "open a directory for writing");
+    expect_errno(ibfs_fs_open(fs, "/d1/f/x", IBFS_O_RDONLY), ENOTDIR, "path through a file");
+
+    expect(ibfs_fs_rename(fs, "/d1/f", "/d2/g") == 0, "rename /d1/f to /d2/g");
+    expect_errno(ibfs_fs_stat(fs, "/d1/f", &st), ENOENT, "old name is gone");
+    char back[16] = { 0 };
+    fd = ibfs_fs_open(fs, "/d2/g", IBFS_O_RDONLY);
+    expect(ibfs_fs_read(fs, fd, back, sizeof(back)) == 9 && memcmp(back, "rename me", 9) == 0, "renamed file keeps its data");
+    ibfs_fs_close(fs, fd);
+    expect_errno(ibfs_fs_rename(fs, "/d1/missing", "/d2/x"), ENOENT, "rename of a missing file");
+    expect_errno(ibfs_fs_rename(fs, "/d2", "/d2/sub"), EINVAL, "rename a directory into itself");
+    expect_errno(ibfs_fs_rename(fs, "/d2/g", "/d1"), EISDIR, "rename a file onto a directory");
+    expect_errno(ibfs_fs_rename(fs, "/d1", "/d2/g"), ENOTDIR, "rename a directory onto a file");
+    expect_errno(ibfs_fs_rename(fs, "/d1", "/d2"), ENOTEMPTY, "rename onto a non-empty directory");
+    expect(ibfs_fs_rename(fs, "/d2", "/d1") == 0, "rename onto an empty directory");
+    expect(ibfs_fs_stat(fs, "/d1/g", &st) == 0 && ibfs_fs_stat(fs, "/d2", &st) != 0, "directory moved with its entries");
+
+    const char* names[] = { "/d1/c", "/d1/a2", "/d1/b", "/d1/a1" };
+    for (int i = 0; i < 4; i++) ibfs_fs_close(fs, ibfs_fs_open(fs, names[i], IBFS_O_WRONLY | IBFS_O_CREAT));
+    IBFS_Dir* dir = ibfs_fs_opendir_sorted(fs, "/d1", NULL, NULL, 0);
+    const IBFS_DirEntry* e1 = ibfs_fs_readdir(dir);
+    const IBFS_DirEntry* e2 = ibfs_fs_readdir(dir);
+    expect(dir && e1 && e2 && strcmp(e1->name, "a1") == 0 && strcmp(e2->name, "a2") == 0, "opendir_sorted lists in name order");
+    ibfs_fs_closedir(dir);
+    dir = ibfs_fs_opendir_sorted(fs, "/d1", "a", "a1", 5);
+    e1 = ibfs_fs_readdir(dir);
+    expect(dir && e1 && strcmp(e1->name, "a2") == 0 && ibfs_fs_readdir(dir) == NULL, "opendir_sorted with prefix and cursor");
+    ibfs_fs_closedir(dir);
+    for (int i = 0; i < 4; i++) ibfs_fs_unlink(fs, names[i]);
+
+    dir = ibfs_fs_opendir_sorted(fs, "/d1/g", NULL, NULL, 0);
+    expect(dir == NULL && errno == ENOTDIR, "opendir_sorted of a file fails with ENOTDIR");
+    dir = ibfs_fs_opendir_sorted(fs, "/nope", NULL, NULL, 0);
+    expect(dir == NULL && errno == ENOENT, "opendir_sorted of a missing directory fails with ENOENT");
+    expect(ibfs_fs_unlink(fs, "/d1/g") == 0 && ibfs_fs_rmdir(fs, "/d1") == 0, "remove /d1");
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/* The sorted listing must be exactly the directory's entries in name order. */
+static void expect_sorted_listing(IBFS_FS* fs, const char* path, uint32_t expected) {
+    char names[expected + 1][MAX_FILENAME_LENGTH];
+    const char* order[expected + 1];
+    uint32_t count = 0;
+    const IBFS_DirEntry* entry;
+    IBFS_Dir* dir = ibfs_fs_opendir(fs, path);
+    while (dir && (entry = ibfs_fs_readdir(dir)) != NULL && count <= expected) {
+        memcpy(names[count], entry->name, MAX_FILENAME_LENGTH);
+        order[count] = names[count];
+        count++;
+    }
+    ibfs_fs_closedir(dir);
+    expect(dir && count == expected, "the directory holds the expected number of entries");
+    qsort(order, count, sizeof(order[0]), compare_names);
+
+    uint32_t listed = 0;
+    int same = 1;
+    dir = ibfs_fs_opendir_sorted(fs, path, NULL, NULL, 0);
+    while (dir && (entry = ibfs_fs_readdir(dir)) != NULL) {
+        if (listed >= count || strcmp(entry->name, order[listed]) != 0) same = 0;
+        listed++;
+    }
+    ibfs_fs_closedir(dir);
+    expect(dir && same && listed == count, "opendir_sorted matches the sorted directory listing");
+}
+
+/* The name index follows mkdir, create, rename and unlink, and fsck compares it with the tree entry by entry. */
+static void test_name_index(IBFS_FS* fs) {
+    printf("--- Running name index test ---\n");
+    IBFS_Context* ctx = ibfs_fs_context(fs);
+    char path[64], target[64];
+    expect(name_index_enable(ctx) == 0, "enable the name index");
+    expect(ibfs_fs_mkdir(fs, "/n") == 0 && ibfs_fs_mkdir(fs, "/n/sub") == 0 && ibfs_fs_mkdir(fs, "/n/empty") == 0,
+           "mkdir /n, /n/sub and /n/empty");
+    for (int i = 0; i < 60; i++) {
+        snprintf(path, sizeof(path), "/n/f%02d", (i * 37) % 60);
+        expect(ibfs_fs_close(fs, ibfs_fs_open(fs, path, IBFS_O_WRONLY | IBFS_O_CREAT)) == 0, "create a file in /n");
+    }
+    for (int i = 0; i < 60; i += 7) {
+        snprintf(path, sizeof(path), "/n/f%02d", i);
+        snprintf(target, sizeof(target), i % 2 ? "/n/sub/m%02d" : "/n/r%02d", i);
+        expect(ibfs_fs_rename(fs, path, target) == 0, "rename a file in /n");
+    }
+    for (int i = 3; i < 60; i += 10) {
+        snprintf(path, sizeof(path), "/n/f%02d", i);
+        expect(ibfs_fs_unlink(fs, path) == 0, "unlink a file in /n");
+    }
+    expect(ibfs_fs_rmdir(fs, "/n/empty") == 0 && ibfs_fs_rename(fs, "/n/sub", "/n/moved") == 0,
+           "rmdir /n/empty and rename /n/sub");
+    /* 60 files, 9 renamed (4 of them into sub), 6 unlinked, plus the subdirectory. */
+    expect_sorted_listing(fs, "/n", 60 - 4 - 6 + 1);
+    expect_sorted_listing(fs, "/n/moved", 4);
+    expect(ibfs_fsck(ctx, 1, false) == 0, "fsck finds the name index in step with the tree");
+
+    /* Same entry count, different entries: only an entry-by-entry comparison notices. */
+    IBFS_Stat st;
+    BPlusTreeKey key;
+    expect(ibfs_fs_stat(fs, "/n", &st) == 0 && path_make_key(&key, st.ino, "f01") == 0 &&
+           name_index_delete(ctx, &key) == 0 && path_make_key(&key, st.ino, "ghost") == 0 &&
+           name_index_insert(ctx, &key, st.ino) == 0, "swap an index entry for a stale one");
+    expect(ibfs_fsck(ctx, 1, false) == 1, "fsck reports the swapped index entries");
+    expect(ibfs_fsck(ctx, 1, true) == 0 && ibfs_fsck(ctx, 1, false) == 0, "fsck -y rebuilds the name index");
+    expect_sorted_listing(fs, "/n", 60 - 4 - 6 + 1);
+
+    IBFS_Dir* dir = ibfs_fs_opendir(fs, "/n/moved");
+    const IBFS_DirEntry* entry;
+    while (dir && (entry = ibfs_fs_readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "/n/moved/%.*s", MAX_FILENAME_LENGTH, entry->name);
+        ibfs_fs_unlink(fs, path);
+    }
+    ibfs_fs_closedir(dir);
+    dir = ibfs_fs_opendir(fs, "/n");
+    while (dir && (entry = ibfs_fs_readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "/n/%.*s", MAX_FILENAME_LENGTH, entry->name);
+        if (ibfs_fs_unlink(fs, path) != 0) ibfs_fs_rmdir(fs, path);
+    }
+    ibfs_fs_closedir(dir);
+    expect(ibfs_fs_rmdir(fs, "/n") == 0 && name_index_disable(ctx) == 0, "remove /n and disable the name index");
+}
+
+/* A snapshot keeps the data it saw; overwriting the live file copies the shared blocks first. */
+static void test_snapshot(IBFS_FS* fs) {
+    printf("--- Running snapshot test ---\n");
+    IBFS_Context* ctx = ibfs_fs_context(fs);
+    size_t length = 2 * (size_t)ctx->sb.block_size;
+    char old_data[length], new_data[length];
+    memset(old_data, 'o', length);
+    memset(new_data, 'n', length);
+
+    expect(put_file(fs, "/s", old_data, length) == 0, "write /s");
+    uint32_t shared = file_block(fs, "/s", 0);
+    expect(snapshot_create(ctx, "before") == 0, "create snapshot 'before'");
+    expect(shared != 0 && extra_refs(fs, shared) == 1, "the snapshot holds a reference to /s's first block");
+    int fd = ibfs_fs_open(fs, "/s", IBFS_O_WRONLY);
+    expect(fd >= 0 && ibfs_fs_write(fs, fd, new_data, length) == (long long)length && ibfs_fs_close(fs, fd) == 0,
+           "overwrite /s");
+    expect(file_block(fs, "/s", 0) != shared && extra_refs(fs, shared) == 0, "the overwrite copied the shared block");
+    expect(file_equals(fs, "/s", new_data, length), "/s reads the new data");
+    expect(ibfs_fsck(ctx, 1, false) == 0, "fsck finds the reference counts clean");
+    expect(ibfs_fs_sync(fs) == 0, "sync before opening the snapshot");
+
+    IBFS_FS* view = ibfs_fs_mount(TEST_DISK, IBFS_BACKEND_FILE);
+    expect(view != NULL && snapshot_open(ibfs_fs_context(view), "before") == 0, "open snapshot 'before'");
+    if (view) {
+        expect(file_equals(view, "/s", old_data, length), "the snapshot still reads the old data");
+        expect_errno(put_file(view, "/t", old_data, 1), EROFS, "the snapshot is read-only");
+        ibfs_fs_unmount(view);
+    }
+
+    expect(snapshot_delete(ctx, "before") == 0, "delete snapshot 'before'");
+    expect(ibfs_fs_unlink(fs, "/s") == 0, "unlink /s");
+    expect(ibfs_fsck(ctx, 1, false) == 0, "fsck is clean after the snapshot is gone");
+}
+
+/* Identical blocks share one physical block; freeing one copy drops a reference and keeps the data. */
+static void test_dedup(IBFS_FS* fs) {
+    printf("--- Running dedup test ---\n");
+    IBFS_Context* ctx = ibfs_fs_context(fs);
+    size_t block_size = ctx->sb.block_size;
+    char first[2 * block_size], second[2 * block_size];
+    memset(first, 'X', block_size);
+    memset(first + block_size, 'Y', block_size);
+    memset(second, 'X', block_size);
+    memset(second + block_size, 'Z', block_size);
+
+    expect(dedup_enable(ctx) == 0, "enable dedup");
+    expect(put_file(fs, "/x1", first, sizeof(first)) == 0 && put_file(fs, "/x2", second, sizeof(second)) == 0,
+           "write /x1 and /x2");
+    uint32_t shared = file_block(fs, "/x1", 0);
+    expect(shared != 0 && file_block(fs, "/x2", 0) == shared, "the duplicate blocks share one block number");
+    expect(file_block(fs, "/x2", 1) != file_block(fs, "/x1", 1), "different blocks stay apart");
+    expect(extra_refs(fs, shared) == 1, "the shared block has one extra reference");
+
+    expect(ibfs_fs_unlink(fs, "/x1") == 0, "unlink /x1");
+    expect(extra_refs(fs, shared) == 0 && file_block(fs, "/x2", 0) == shared, "/x2 keeps the block alone");
+    expect(file_equals(fs, "/x2", second, sizeof(second)), "/x2 is intact");
+    expect(ibfs_fsck(ctx, 1, false) == 0, "fsck is clean after freeing one copy");
+
+    expect(ibfs_fs_unlink(fs, "/x2") == 0, "unlink /x2");
+    expect(put_file(fs, "/x3", first, sizeof(first)) == 0 && file_equals(fs, "/x3", first, sizeof(first)),
+           "a new copy after both are gone reads back");
+    expect(ibfs_fs_unlink(fs, "/x3") == 0 && dedup_disable(ctx) == 0, "unlink /x3 and disable dedup");
+    expect(ibfs_fsck(ctx, 1, false) == 0, "fsck is clean after dedup is disabled");
+}
+
+/* A batch that runs into a saturated count must leave every count as it was, in this leaf and earlier ones. */
+static void test_refcount_limit(void) {
+    printf("--- Running refcount limit test ---\n");
+    IBFS_FS* fs = make_image("16M");
+    if (!fs) return;
+    IBFS_Context* ctx = ibfs_fs_context(fs);
+    uint32_t per_leaf = refcount_blocks_per_leaf(ctx);
+    uint32_t first = ctx->sb.first_data_block + 1, second = per_leaf + 1, full = per_leaf + 2;
+    uint32_t warmup[1] = { first };
+    expect(refcount_share(ctx, warmup, 1) == 0 && extra_refs(fs, first) == 1, "share one block");
+
+    uint32_t leaf;
+    uint16_t counts[per_leaf];
+    memset(counts, 0, ctx->sb.block_size);
+    counts[full % per_leaf] = ibfs_le16(0xFFFF);
+    expect(refcount_leaf_block(ctx, full / per_leaf, true, &leaf) == 0 && write_block(ctx, leaf, counts) == 0,
+           "saturate the count of a block in the second leaf");
+
+    uint32_t batch[3] = { full, second, first };
+    expect(refcount_share(ctx, batch, 3) == -1, "sharing a saturated block fails");
+    expect(extra_refs(fs, first) == 1, "the first leaf's increment was taken back");
+    expect(extra_refs(fs, second) == 0, "the failing leaf was not written");
+    expect(extra_refs(fs, full) == 0xFFFF, "the saturated count is unchanged");
+
+    uint32_t release[1] = { first }, kept = 1;
+    counts[full % per_leaf] = 0;
+    expect(write_block(ctx, leaf, counts) == 0 && refcount_release(ctx, release, &kept) == 0 && kept == 0,
+           "drop the test references");
+    expect(ibfs_fsck(ctx, 1, false) == 0, "fsck is clean after the failed share");
+    expect(ibfs_fs_unmount(fs) == 0, "unmount the refcount image");
+    remove(TEST_DISK);
+}
+
+/* Flips one byte of a B+ tree node behind the mount's back; every read that reaches the disk must notice. */
+static void test_corrupt_node(void) {
+    printf("--- Running corrupt node test ---\n");
+    IBFS_FS* fs = make_image("8M");
+    if (!fs) return;
+    IBFS_Context* ctx = ibfs_fs_context(fs);
+    int fd = ibfs_fs_open(fs, "/c", IBFS_O_WRONLY | IBFS_O_CREAT);
+    expect(fd >= 0 && ibfs_fs_close(fs, fd) == 0 && ibfs_fs_sync(fs) == 0, "create /c");
+    uint32_t node = ctx->sb.root_bpt_block;
+    char buffer[ctx->sb.block_size];
+    expect(read_meta_block(ctx, node, buffer) == 0, "read the intact root node");
+
+    FILE* disk = fopen(TEST_DISK, "r+b");
+    long offset = (long)node * ctx->sb.block_size + ctx->sb.block_size / 2;
+    int byte = disk && fseek(disk, offset, SEEK_SET) == 0 ? fgetc(disk) : EOF;
+    expect(byte != EOF && fseek(disk, offset, SEEK_SET) == 0 && fputc(byte ^ 0x01, disk) != EOF && fclose(disk) == 0,
+           "corrupt one byte of the root node");
+
+    meta_cache_reset(ctx);
+    expect(read_meta_block(ctx, node, buffer) == -1, "a corrupt node read from the disk fails its checksum");
+    IBFS_Stat st;
+    expect(ibfs_fs_stat(fs, "/c", &st) == -1, "a lookup through the corrupt node fails");
+    expect(ibfs_fs_unmount(fs) == 0, "unmount the corrupt image");
+
+    fs = ibfs_fs_mount(TEST_DISK, IBFS_BACKEND_FILE);
+    expect(fs != NULL, "remount the corrupt image");
+    if (fs) {
+        expect(ibfs_fs_stat(fs, "/c", &st) == -1, "a lookup after remount fails");
+        ibfs_fs_unmount(fs);
+    }
+    remove(TEST_DISK);
+}
+
+int main(void) {
+    IBFS_FS* fs = make_image("8M");
+    if (!fs) return 1;
+    test_file_io(fs);
+    test_triple_indirect(fs);
+    test_sparse(fs);
+    test_unlink_open(fs);
+    test_unnamed(fs);
+    test_directories(fs);
+    test_name_index(fs);
+    test_snapshot(fs);
+    test_dedup(fs);
+    expect(ibfs_fsck(ibfs_fs_context(fs), 1, false) == 0, "fsck finds the image clean");
+    expect(ibfs_fs_unmount(fs) == 0, "unmount");
+    remove(TEST_DISK);
+    test_refcount_limit();
+    test_corrupt_node();
+
+    if (failures == 0) printf("SUCCESS! All file system tests passed.\n");
+    return failures ? 1 : 0;
+}
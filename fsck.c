@@ -0,0 +1,687 @@
+#include "fsck.h"
+#include "io.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "block.h"
+#include "bplustree.h"
+#include "file.h"
+#include "nameindex.h"
+#include "refcount.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define FSCK_READ_CHUNK_BLOCKS 64
+#define FSCK_MAX_REPORTS 20
+
+enum {
+    FSCK_BAD_POINTER,
+    FSCK_DOUBLE_ALLOC,
+    FSCK_BAD_INODE,
+    FSCK_BAD_NODE,
+    FSCK_DANGLING_ENTRY,
+    FSCK_BAD_PARENT,
+    FSCK_ORPHAN_INODE,
+    FSCK_LINK_COUNT,
+    FSCK_LEAKED_BLOCK,
+    FSCK_UNMARKED_BLOCK,
+    FSCK_FREE_COUNT,
+    FSCK_REFCOUNT,
+    FSCK_BAD_BITMAP,
+    FSCK_NAME_INDEX,
+    FSCK_PROBLEM_KINDS
+};
+
+static const char* fsck_problem_names[FSCK_PROBLEM_KINDS] = {
+    "out-of-range block pointers",
+    "doubly allocated blocks",
+    "corrupt inodes",
+    "corrupt tree nodes",
+    "entries pointing at free inodes",
+    "entries under a non-directory",
+    "orphaned inodes",
+    "wrong link counts",
+    "leaked blocks",
+    "used blocks marked free",
+    "wrong superblock free counts",
+    "wrong reference counts",
+    "corrupt bitmaps",
+    "name index mismatches",
+};
+
+typedef struct FsckState {
+    IBFS_Context* ctx;
+    int thread_count;
+
+    unsigned char* inode_bitmap;
+    atomic_uchar* reachable;
+    atomic_uchar* duplicate;
+    atomic_ushort* claims;
+    atomic_uint* inode_refs;
+    unsigned char* is_dir;
+    uint16_t* links;
+
+    atomic_uint problems[FSCK_PROBLEM_KINDS];
+    pthread_mutex_t lock;
+
+    BPlusTreeKey* dangling;
+    uint32_t dangling_count;
+    uint32_t dangling_capacity;
+} FsckState;
+
+typedef struct FsckWorker {
+    FsckState* state;
+    IBFS_Context ctx;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t* nodes;
+    uint32_t* next_nodes;
+    uint32_t next_count;
+    uint32_t next_capacity;
+    int leaf_level;
+    bool check_leaves;
+    int failed;
+} FsckWorker;
+
+static int bit_test(const unsigned char* bits, uint32_t i) {
+    return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+static void fsck_report(FsckState* st, int kind, const char* fmt, ...) {
+    unsigned int seen = atomic_fetch_add_explicit(&st->problems[kind], 1, memory_order_relaxed);
+    if (seen >= FSCK_MAX_REPORTS) return;
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&st->lock);
+    vprintf(fmt, args);
+    if (seen + 1 == FSCK_MAX_REPORTS) printf("  (further %s not listed)\n", fsck_problem_names[kind]);
+    pthread_mutex_unlock(&st->lock);
+    va_end(args);
+}
+
+static void fsck_name_index_report(const BPlusTreeKey* key, const uint32_t* primary, const uint32_t* index, void* user_data) {
+    FsckState* st = (FsckState*)user_data;
+    if (!index) {
+        fsck_report(st, FSCK_NAME_INDEX, "  '%.*s' in directory %u (inode %u) is missing from the name index\n",
+                    MAX_FILENAME_LENGTH, key->name, key->parent_inode_id, *primary);
+    } else if (!primary) {
+        fsck_report(st, FSCK_NAME_INDEX, "  name index lists '%.*s' in directory %u (inode %u), which does not exist\n",
+                    MAX_FILENAME_LENGTH, key->name, key->parent_inode_id, *index);
+    } else {
+        fsck_report(st, FSCK_NAME_INDEX, "  name index maps '%.*s' in directory %u to inode %u instead of %u\n",
+                    MAX_FILENAME_LENGTH, key->name, key->parent_inode_id, *index, *primary);
+    }
+}
+
+static int fsck_is_data_block(IBFS_Context* ctx, uint32_t block) {
+    if (block < ctx->sb.first_data_block || block >= ctx->sb.block_count) return 0;
+    return (block - ctx->sb.first_data_block) % ctx->sb.blocks_per_group != 0;
+}
+
+static int fsck_mark_block(FsckState* st, uint32_t block, const char* owner, uint32_t owner_id) {
+    if (!fsck_is_data_block(st->ctx, block)) {
+        fsck_report(st, FSCK_BAD_POINTER, "  %s %u points at invalid block %u\n", owner, owner_id, block);
+        return -1;
+    }
+    unsigned char mask = (unsigned char)(1 << (block % 8));
+    unsigned char old = atomic_fetch_or_explicit(&st->reachable[block / 8], mask, memory_order_relaxed);
+    if (old & mask) {
+        atomic_fetch_or_explicit(&st->duplicate[block / 8], mask, memory_order_relaxed);
+        fsck_report(st, FSCK_DOUBLE_ALLOC, "  block %u claimed again by %s %u\n", block, owner, owner_id);
+        return -1;
+    }
+    return 0;
+}
+
+/* File blocks may be shared once refcounts exist; every further claim is counted instead of reported. */
+static int fsck_claim_block(FsckState* st, uint32_t block, const char* owner, uint32_t owner_id) {
+    if (!st->claims) return fsck_mark_block(st, block, owner, owner_id);
+    if (!fsck_is_data_block(st->ctx, block)) {
+        fsck_report(st, FSCK_BAD_POINTER, "  %s %u points at invalid block %u\n", owner, owner_id, block);
+        return -1;
+    }
+    unsigned char mask = (unsigned char)(1 << (block % 8));
+    unsigned char old = atomic_fetch_or_explicit(&st->reachable[block / 8], mask, memory_order_relaxed);
+    if (old & mask) atomic_fetch_add_explicit(&st->claims[block], 1, memory_order_relaxed);
+    return 0;
+}
+
+static int fsck_open_worker(FsckState* st, FsckWorker* w) {
+    memset(w, 0, sizeof(FsckWorker));
+    w->state = st;
+    w->ctx = *st->ctx;
+    w->ctx.device = st->ctx->device->ops->dup(st->ctx->device);
+    if (!w->ctx.device) {
+        fprintf(stderr, "fsck: Failed to open the image for a worker\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void fsck_close_worker(FsckWorker* w) {
+    if (w->ctx.device) w->ctx.device->ops->close(w->ctx.device);
+    free(w->next_nodes);
+}
+
+/* Claims an indirect block and everything under it; height 1 points at data blocks. */
+static void fsck_claim_tree(FsckWorker* w, uint32_t inode_num, uint32_t node, int height, bool compressed) {
+    FsckState* st = w->state;
+    IBFS_Context* ctx = &w->ctx;
+    if (fsck_claim_block(st, node, "inode", inode_num) != 0) return;
+
+    uint32_t ptrs_per_block = ctx->sb.block_size / sizeof(uint32_t);
+    uint32_t* indirect = alloc_block_buffer(ctx, 1);
+    if (!indirect || read_block(ctx, node, indirect) != 0) {
+        fsck_report(st, FSCK_BAD_INODE, "  inode %u: unreadable indirect block %u\n", inode_num, node);
+        free(indirect);
+        return;
+    }
+    for (uint32_t i = 0; i < ptrs_per_block; i++) {
+        uint32_t entry = ibfs_le32(indirect[i]);
+        if (entry == 0) continue;
+        if (height > 1) fsck_claim_tree(w, inode_num, entry, height - 1, compressed);
+        else if (!(compressed && IBFS_IS_CLUSTER_MARK(entry))) fsck_claim_block(st, entry, "inode", inode_num);
+    }
+    free(indirect);
+}
+
+static void fsck_check_inode(FsckWorker* w, uint32_t inode_num, Inode* inode) {
+    FsckState* st = w->state;
+    IBFS_Context* ctx = &w->ctx;
+
+    st->is_dir[inode_num] = (inode->mode & S_IFDIR) == S_IFDIR;
+    st->links[inode_num] = inode->links_count;
+
+    if (inode->flags & IBFS_INODE_INLINE) {
+        if (inode->size > file_inline_capacity(ctx)) {
+            fsck_report(st, FSCK_BAD_INODE, "  inode %u: inline size %llu exceeds capacity %u\n",
+                        inode_num, (unsigned long long)inode->size, file_inline_capacity(ctx));
+        }
+        return;
+    }
+
+    /* Compressed files keep the length of a compressed cluster in the cluster's last slot. */
+    bool compressed = (inode->flags & IBFS_INODE_COMPRESSED) != 0;
+    for (int i = 0; i < 12; i++) {
+        uint32_t entry = inode->direct_blocks[i];
+        if (entry != 0 && !(compressed && IBFS_IS_CLUSTER_MARK(entry))) fsck_claim_block(st, entry, "inode", inode_num);
+    }
+    uint32_t roots[3] = { inode->single_indirect, inode->double_indirect, inode->triple_indirect };
+    for (int levels = 1; levels <= 3; levels++) {
+        if (roots[levels - 1] != 0) fsck_claim_tree(w, inode_num, roots[levels - 1], levels, compressed);
+    }
+}
+
+static void* fsck_inode_worker(void* arg) {
+    FsckWorker* w = (FsckWorker*)arg;
+    FsckState* st = w->state;
+    IBFS_Context* ctx = &w->ctx;
+    uint32_t per_block = inodes_per_block(ctx);
+
+    char* chunk = alloc_block_buffer(ctx, FSCK_READ_CHUNK_BLOCKS);
+    if (!chunk) {
+        w->failed = 1;
+        return NULL;
+    }
+
+    for (uint32_t block = w->begin; block < w->end; block += FSCK_READ_CHUNK_BLOCKS) {
+        uint32_t count = w->end - block;
+        if (count > FSCK_READ_CHUNK_BLOCKS) count = FSCK_READ_CHUNK_BLOCKS;
+        bool chunk_ok = read_meta_blocks(ctx, ctx->sb.inode_table_start + block, count, chunk) == 0;
+        for (uint32_t b = 0; b < count; b++) {
+            /* Retry block by block so one bad block only loses its own inodes. */
+            if (!chunk_ok && read_meta_block(ctx, ctx->sb.inode_table_start + block + b, chunk + (size_t)b * ctx->sb.block_size) != 0) {
+                fsck_report(st, FSCK_BAD_INODE, "  inode table block %u is unreadable or corrupt\n", ctx->sb.inode_table_start + block + b);
+                continue;
+            }
+            for (uint32_t i = 0; i < per_block; i++) {
+                uint32_t inode_num = (block + b) * per_block + i;
+                if (inode_num >= ctx->sb.inode_count) break;
+                if (!bit_test(st->inode_bitmap, inode_num)) continue;
+
+                Inode inode;
+                inode_unpack(ctx, chunk + (size_t)b * ctx->sb.block_size, i, &inode);
+                fsck_check_inode(w, inode_num, &inode);
+            }
+        }
+    }
+    free(chunk);
+    return NULL;
+}
+
+static void fsck_push_node(FsckWorker* w, uint32_t block) {
+    if (w->next_count == w->next_capacity) {
+        uint32_t capacity = w->next_capacity ? w->next_capacity * 2 : 256;
+        uint32_t* grown = realloc(w->next_nodes, capacity * sizeof(uint32_t));
+        if (!grown) {
+            w->failed = 1;
+            return;
+        }
+        w->next_nodes = grown;
+        w->next_capacity = capacity;
+    }
+    w->next_nodes[w->next_count++] = block;
+}
+
+static void fsck_add_dangling(FsckState* st, BPlusTreeKey* key) {
+    pthread_mutex_lock(&st->lock);
+    if (st->dangling_count == st->dangling_capacity) {
+        uint32_t capacity = st->dangling_capacity ? st->dangling_capacity * 2 : 64;
+        BPlusTreeKey* grown = realloc(st->dangling, capacity * sizeof(BPlusTreeKey));
+        if (grown) {
+            st->dangling = grown;
+            st->dangling_capacity = capacity;
+        }
+    }
+    if (st->dangling_count < st->dangling_capacity) st->dangling[st->dangling_count++] = *key;
+    pthread_mutex_unlock(&st->lock);
+}
+
+static void fsck_check_leaf(FsckWorker* w, uint32_t block, BPlusTreeNode* node) {
+    FsckState* st = w->state;
+    IBFS_Context* ctx = &w->ctx;
+    uint32_t* children = bpt_children(ctx, node);
+
+    for (uint32_t i = 0; i < node->num_keys; i++) {
+        BPlusTreeKey* key = &node->keys[i];
+        uint32_t child = children[i];
+        if (child >= ctx->sb.inode_count || !bit_test(st->inode_bitmap, child)) {
+            fsck_report(st, FSCK_DANGLING_ENTRY, "  entry '%s' (parent %u) points at free inode %u\n",
+                        key->name, key->parent_inode_id, child);
+            fsck_add_dangling(st, key);
+            continue;
+        }
+        atomic_fetch_add_explicit(&st->inode_refs[child], 1, memory_order_relaxed);
+        if (key->parent_inode_id >= ctx->sb.inode_count || !bit_test(st->inode_bitmap, key->parent_inode_id) ||
+            !st->is_dir[key->parent_inode_id]) {
+            fsck_report(st, FSCK_BAD_PARENT, "  entry '%s' in leaf %u has invalid parent %u\n",
+                        key->name, block, key->parent_inode_id);
+        }
+    }
+}
+
+static void* fsck_tree_worker(void* arg) {
+    FsckWorker* w = (FsckWorker*)arg;
+    FsckState* st = w->state;
+    IBFS_Context* ctx = &w->ctx;
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    BPlusTreeNode* node = (BPlusTreeNode*)block_buffer;
+
+    for (uint32_t n = w->begin; n < w->end && !w->failed; n++) {
+        uint32_t block = w->nodes[n];
+        if (bpt_read_node(ctx, block, block_buffer) != 0 || node->num_keys > bpt_order(ctx)) {
+            fsck_report(st, FSCK_BAD_NODE, "  tree node %u is unreadable or corrupt\n", block);
+            continue;
+        }
+        if (n == w->begin) w->leaf_level = node->is_leaf ? 1 : 0;
+        if ((node->is_leaf ? 1 : 0) != w->leaf_level) {
+            fsck_report(st, FSCK_BAD_NODE, "  tree node %u: leaves and internal nodes mixed on one level\n", block);
+            continue;
+        }
+        for (uint32_t i = 1; i < node->num_keys; i++) {
+            BPlusTreeKey* a = &node->keys[i - 1];
+            BPlusTreeKey* b = &node->keys[i];
+            if (a->parent_inode_id > b->parent_inode_id ||
+                (a->parent_inode_id == b->parent_inode_id && a->name_hash > b->name_hash)) {
+                fsck_report(st, FSCK_BAD_NODE, "  tree node %u: keys out of order at %u\n", block, i);
+                break;
+            }
+        }
+
+        if (node->is_leaf) {
+            if (w->check_leaves) fsck_check_leaf(w, block, node);
+            continue;
+        }
+        uint32_t* children = bpt_children(ctx, node);
+        for (uint32_t i = 0; i <= node->num_keys; i++) {
+            if (fsck_mark_block(st, children[i], "tree node", block) == 0) fsck_push_node(w, children[i]);
+        }
+    }
+    return NULL;
+}
+
+static int fsck_run_workers(FsckWorker* workers, int count, void* (*fn)(void*)) {
+    pthread_t threads[count];
+    bool started[count];
+    int result = 0;
+    for (int t = 0; t < count; t++) {
+        started[t] = (pthread_create(&threads[t], NULL, fn, &workers[t]) == 0);
+        if (!started[t]) fn(&workers[t]);
+    }
+    for (int t = 0; t < count; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+        if (workers[t].failed) result = -1;
+    }
+    return result;
+}
+
+static int fsck_scan_inodes(FsckState* st, FsckWorker* workers) {
+    uint32_t table_blocks = (st->ctx->sb.inode_count + inodes_per_block(st->ctx) - 1) / inodes_per_block(st->ctx);
+    uint32_t per_thread = (table_blocks + st->thread_count - 1) / st->thread_count;
+    for (int t = 0; t < st->thread_count; t++) {
+        workers[t].begin = t * per_thread < table_blocks ? t * per_thread : table_blocks;
+        workers[t].end = workers[t].begin + per_thread < table_blocks ? workers[t].begin + per_thread : table_blocks;
+    }
+    return fsck_run_workers(workers, st->thread_count, fsck_inode_worker);
+}
+
+/* Snapshot trees are only checked for structure; their entries refer to the snapshot's inodes. */
+static int fsck_scan_tree(FsckState* st, FsckWorker* workers, uint32_t root, bool check_leaves) {
+    if (root == 0) return 0;
+    if (fsck_mark_block(st, root, "superblock root", 0) != 0) return -1;
+
+    uint32_t* level = malloc(sizeof(uint32_t));
+    if (!level) return -1;
+    level[0] = root;
+    uint32_t level_count = 1;
+    int result = 0;
+
+    while (level_count > 0 && result == 0) {
+        uint32_t per_thread = (level_count + st->thread_count - 1) / st->thread_count;
+        for (int t = 0; t < st->thread_count; t++) {
+            workers[t].nodes = level;
+            workers[t].begin = t * per_thread < level_count ? t * per_thread : level_count;
+            workers[t].end = workers[t].begin + per_thread < level_count ? workers[t].begin + per_thread : level_count;
+            workers[t].next_count = 0;
+            workers[t].check_leaves = check_leaves;
+        }
+        result = fsck_run_workers(workers, st->thread_count, fsck_tree_worker);
+
+        uint32_t next_count = 0;
+        for (int t = 0; t < st->thread_count; t++) next_count += workers[t].next_count;
+        uint32_t* next = malloc((next_count ? next_count : 1) * sizeof(uint32_t));
+        if (!next) {
+            result = -1;
+            break;
+        }
+        next_count = 0;
+        for (int t = 0; t < st->thread_count; t++) {
+            memcpy(next + next_count, workers[t].next_nodes, workers[t].next_count * sizeof(uint32_t));
+            next_count += workers[t].next_count;
+        }
+        free(level);
+        level = next;
+        level_count = next_count;
+    }
+    free(level);
+    return result;
+}
+
+static int fsck_scan_snapshot_inodes(FsckState* st, SnapshotEntry* entries) {
+    IBFS_Context* ctx = st->ctx;
+    for (uint32_t s = 0; s < snapshot_capacity(ctx); s++) {
+        if (entries[s].name[0] == '\0') continue;
+        if (!fsck_is_data_block(ctx, entries[s].map_block)) {
+            fsck_report(st, FSCK_BAD_POINTER, "  snapshot '%.*s' has invalid map block %u\n",
+                        IBFS_SNAPSHOT_NAME_LENGTH, entries[s].name, entries[s].map_block);
+            continue;
+        }
+        IBFS_Context view = *ctx;
+        view.read_only = true;
+        uint32_t* blocks;
+        uint32_t count;
+        if (snapshot_load_map(ctx, &entries[s], &view.meta_map) != 0) return -1;
+        int rc = snapshot_collect_blocks(&view, &blocks, &count);
+        free(view.meta_map);
+        if (rc != 0) return -1;
+        for (uint32_t i = 0; i < count; i++) fsck_claim_block(st, blocks[i], "snapshot", s);
+        free(blocks);
+    }
+    return 0;
+}
+
+static int fsck_scan_snapshot_meta(FsckState* st, FsckWorker* workers, SnapshotEntry* entries) {
+    IBFS_Context* ctx = st->ctx;
+    if (ctx->sb.snapshot_table_block != 0) fsck_mark_block(st, ctx->sb.snapshot_table_block, "superblock snapshot table", 0);
+    for (uint32_t s = 0; s < snapshot_capacity(ctx); s++) {
+        if (entries[s].name[0] == '\0' || !fsck_is_data_block(ctx, entries[s].map_block)) continue;
+        uint32_t* map;
+        fsck_mark_block(st, entries[s].map_block, "snapshot", s);
+        if (snapshot_load_map(ctx, &entries[s], &map) != 0) return -1;
+        for (uint32_t i = 0; i < ctx->sb.first_data_block - ctx->sb.inode_bitmap_start; i++) {
+            fsck_mark_block(st, map[i], "snapshot", s);
+        }
+        free(map);
+        if (fsck_scan_tree(st, workers, entries[s].root_bpt_block, false) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Marks the refcount table and leaves and compares every stored count with the claims seen. */
+static int fsck_check_refcounts(FsckState* st, bool fix) {
+    IBFS_Context* ctx = st->ctx;
+    uint32_t per_leaf = refcount_blocks_per_leaf(ctx);
+    uint32_t leaves = (uint32_t)(((uint64_t)ctx->sb.block_count + per_leaf - 1) / per_leaf);
+    IBFS_BLOCK_ALIGNED uint16_t counts[per_leaf];
+
+    for (uint32_t i = 0; i < ctx->sb.refcount_table_blocks; i++) {
+        fsck_mark_block(st, ctx->sb.refcount_table_start + i, "superblock refcount table", 0);
+    }
+    for (uint32_t leaf_index = 0; leaf_index < leaves; leaf_index++) {
+        uint32_t leaf;
+        if (refcount_leaf_block(ctx, leaf_index, false, &leaf) != 0) return -1;
+        if (leaf != 0 && fsck_mark_block(st, leaf, "refcount leaf", leaf_index) != 0) continue;
+        if (leaf == 0) memset(counts, 0, ctx->sb.block_size);
+        else if (read_block(ctx, leaf, counts) != 0) return -1;
+
+        bool dirty = false;
+        for (uint32_t i = 0; i < per_leaf; i++) {
+            uint32_t block = leaf_index * per_leaf + i;
+            uint16_t expected = 0;
+            if (block < ctx->sb.block_count && fsck_is_data_block(ctx, block)) {
+                expected = atomic_load_explicit(&st->claims[block], memory_order_relaxed);
+            }
+            uint16_t stored = ibfs_le16(counts[i]);
+            if (stored == expected) continue;
+            fsck_report(st, FSCK_REFCOUNT, "  block %u has %u extra references but refcount %u\n", block, expected, stored);
+            counts[i] = ibfs_le16(expected);
+            dirty = true;
+        }
+        if (!dirty || !fix) continue;
+        if (leaf == 0) {
+            if (refcount_leaf_block(ctx, leaf_index, true, &leaf) != 0) return -1;
+            fsck_mark_block(st, leaf, "refcount leaf", leaf_index);
+        }
+        if (write_block(ctx, leaf, counts) != 0) return -1;
+    }
+    return 0;
+}
+
+static int fsck_check_bitmaps(FsckState* st, bool fix) {
+    IBFS_Context* ctx = st->ctx;
+    IBFS_BLOCK_ALIGNED unsigned char block_buffer[ctx->sb.block_size];
+    uint32_t groups = bitmap_group_count(ctx);
+
+    for (uint32_t g = 0; g < groups; g++) {
+        uint32_t start = bitmap_group_start(ctx, g);
+        uint32_t length = bitmap_group_length(ctx, g);
+        bool dirty = false;
+        if (read_meta_block(ctx, start, block_buffer) != 0) {
+            /* Rebuilt from what the scan reached; every block in use shows up as unmarked. */
+            fsck_report(st, FSCK_BAD_BITMAP, "  bitmap of group %u is unreadable or corrupt\n", g);
+            memset(block_buffer, 0, ctx->sb.block_size);
+            dirty = fix;
+        }
+        for (uint32_t bit = 1; bit < length; bit++) {
+            uint32_t block = start + bit;
+            int used = bit_test(block_buffer, bit);
+            int reached = (atomic_load_explicit(&st->reachable[block / 8], memory_order_relaxed) >> (block % 8)) & 1;
+            if (used && !reached) {
+                fsck_report(st, FSCK_LEAKED_BLOCK, "  block %u is allocated but unreachable\n", block);
+                if (fix) { block_buffer[bit / 8] &= ~(1 << (bit % 8)); dirty = true; }
+            } else if (!used && reached) {
+                fsck_report(st, FSCK_UNMARKED_BLOCK, "  block %u is in use but marked free\n", block);
+                if (fix) { block_buffer[bit / 8] |= (1 << (bit % 8)); dirty = true; }
+            }
+        }
+        if (dirty && write_meta_block(ctx, start, block_buffer) != 0) return -1;
+    }
+    return 0;
+}
+
+static void fsck_check_inodes(FsckState* st, bool fix) {
+    IBFS_Context* ctx = st->ctx;
+    for (uint32_t i = 0; i < ctx->sb.inode_count; i++) {
+        if (!bit_test(st->inode_bitmap, i)) continue;
+        uint32_t refs = atomic_load_explicit(&st->inode_refs[i], memory_order_relaxed);
+        if (i == ctx->sb.root_inode) continue;
+
+        if (refs == 0) {
+            fsck_report(st, FSCK_ORPHAN_INODE, "  inode %u is allocated but not linked anywhere\n", i);
+            if (fix) {
+                Inode inode;
+                bool shares_blocks = atomic_load(&st->problems[FSCK_DOUBLE_ALLOC]) != 0;
+                if (!shares_blocks && !st->is_dir[i] && inode_read(ctx, i, &inode) == 0) {
+                    file_free_blocks(ctx, &inode);
+                }
+                free_inode_num(ctx, i);
+            }
+        } else if (st->links[i] != refs) {
+            fsck_report(st, FSCK_LINK_COUNT, "  inode %u has links_count %u but %u entries\n", i, st->links[i], refs);
+            if (fix) {
+                Inode inode;
+                if (inode_read(ctx, i, &inode) == 0) {
+                    inode.links_count = (uint16_t)refs;
+                    inode_write(ctx, i, &inode);
+                }
+            }
+        }
+    }
+}
+
+int ibfs_fsck(IBFS_Context* ctx, int thread_count, bool fix) {
+    if (thread_count < 1) thread_count = 1;
+
+    FsckState st;
+    memset(&st, 0, sizeof(FsckState));
+    st.ctx = ctx;
+    st.thread_count = thread_count;
+    pthread_mutex_init(&st.lock, NULL);
+
+    size_t block_bytes = ((size_t)ctx->sb.block_count + 7) / 8;
+    st.inode_bitmap = calloc((size_t)ctx->sb.inode_bitmap_blocks, ctx->sb.block_size);
+    st.reachable = calloc(block_bytes, sizeof(atomic_uchar));
+    st.duplicate = calloc(block_bytes, sizeof(atomic_uchar));
+    if (ctx->sb.refcount_table_start != 0) st.claims = calloc(ctx->sb.block_count, sizeof(atomic_ushort));
+    st.inode_refs = calloc(ctx->sb.inode_count, sizeof(atomic_uint));
+    st.is_dir = calloc(ctx->sb.inode_count, 1);
+    st.links = calloc(ctx->sb.inode_count, sizeof(uint16_t));
+    FsckWorker* workers = calloc(thread_count, sizeof(FsckWorker));
+    int result = -1;
+
+    SnapshotEntry snapshots[snapshot_capacity(ctx)];
+    if (!st.inode_bitmap || !st.reachable || !st.duplicate || !st.inode_refs || !st.is_dir || !st.links || !workers ||
+        (ctx->sb.refcount_table_start != 0 && !st.claims)) {
+        fprintf(stderr, "fsck: Out of memory\n");
+        goto out;
+    }
+    if (bitmap_read_inodes(ctx, st.inode_bitmap) != 0) {
+        fprintf(stderr, "fsck: Failed to read inode bitmap\n");
+        goto out;
+    }
+    if (!bit_test(st.inode_bitmap, ctx->sb.root_inode)) {
+        fsck_report(&st, FSCK_BAD_INODE, "  root inode %u is not allocated\n", ctx->sb.root_inode);
+    }
+
+    for (int t = 0; t < thread_count; t++) {
+        if (fsck_open_worker(&st, &workers[t]) != 0) goto out;
+    }
+
+    printf("Pass 1: scanning inode table with %d threads...\n", thread_count);
+    if (fsck_scan_inodes(&st, workers) != 0) {
+        fprintf(stderr, "fsck: Inode table scan failed\n");
+        goto out;
+    }
+    if (ctx->sb.snapshot_table_block != 0 && !fsck_is_data_block(ctx, ctx->sb.snapshot_table_block)) {
+        fsck_report(&st, FSCK_BAD_POINTER, "  superblock points at invalid snapshot table %u\n", ctx->sb.snapshot_table_block);
+        ctx->sb.snapshot_table_block = 0;
+    }
+    if (snapshot_read_entries(ctx, snapshots) != 0 || fsck_scan_snapshot_inodes(&st, snapshots) != 0) {
+        fprintf(stderr, "fsck: Snapshot inode table scan failed\n");
+        goto out;
+    }
+    printf("Pass 2: scanning B+ Tree level by level...\n");
+    if (fsck_scan_tree(&st, workers, ctx->sb.root_bpt_block, true) != 0 ||
+        fsck_scan_tree(&st, workers, ctx->sb.name_index_root, false) != 0 ||
+        fsck_scan_snapshot_meta(&st, workers, snapshots) != 0) {
+        fprintf(stderr, "fsck: Tree scan failed\n");
+        goto out;
+    }
+    for (uint32_t i = 0; i < ctx->sb.dedup_index_blocks; i++) {
+        fsck_mark_block(&st, ctx->sb.dedup_index_start + i, "superblock dedup index", 0);
+    }
+    if (st.claims) {
+        printf("Pass 2b: checking reference counts...\n");
+        if (fsck_check_refcounts(&st, fix) != 0) {
+            fprintf(stderr, "fsck: Reference count check failed\n");
+            goto out;
+        }
+    }
+    printf("Pass 3: checking block bitmaps...\n");
+    if (fsck_check_bitmaps(&st, fix) != 0) {
+        fprintf(stderr, "fsck: Bitmap check failed\n");
+        goto out;
+    }
+    printf("Pass 4: checking inode links...\n");
+    fsck_check_inodes(&st, fix);
+
+    if (fix) {
+        for (uint32_t i = 0; i < st.dangling_count; i++) {
+            bpt_delete(ctx, &ctx->sb.root_bpt_block, &st.dangling[i]);
+        }
+    }
+
+    if (ctx->sb.feature_flags & IBFS_FEATURE_NAME_INDEX) {
+        printf("Pass 4b: checking the name index...\n");
+        unsigned int before = atomic_load(&st.problems[FSCK_NAME_INDEX]);
+        if (name_index_verify(ctx, fsck_name_index_report, &st) != 0) {
+            fsck_report(&st, FSCK_NAME_INDEX, "  name index could not be compared with the directory tree\n");
+        }
+        if (fix && atomic_load(&st.problems[FSCK_NAME_INDEX]) != before && name_index_rebuild(ctx) != 0) goto out;
+    }
+
+    printf("Pass 5: checking free counts...\n");
+    uint32_t free_blocks, free_inodes;
+    if (bitmap_count_free(ctx, &free_blocks, &free_inodes) != 0) {
+        fprintf(stderr, "fsck: Failed to count free blocks and inodes\n");
+        goto out;
+    }
+    if (free_blocks != ctx->sb.free_blocks_count || free_inodes != ctx->sb.free_inodes_count) {
+        fsck_report(&st, FSCK_FREE_COUNT, "  superblock says %u free blocks and %u free inodes, bitmaps have %u and %u\n",
+                    ctx->sb.free_blocks_count, ctx->sb.free_inodes_count, free_blocks, free_inodes);
+        if (fix) {
+            ctx->sb.free_blocks_count = free_blocks;
+            ctx->sb.free_inodes_count = free_inodes;
+        }
+    }
+    if (fix && (write_superblock(ctx) != 0 || sync_disk(ctx) != 0)) goto out;
+
+    result = 0;
+    for (int k = 0; k < FSCK_PROBLEM_KINDS; k++) {
+        unsigned int count = atomic_load(&st.problems[k]);
+        if (count == 0) continue;
+        printf("%8u %s%s\n", count, fsck_problem_names[k],
+               (fix && k != FSCK_DOUBLE_ALLOC && k != FSCK_BAD_NODE && k != FSCK_BAD_INODE) ? " (fixed)" : "");
+        if (!fix || k == FSCK_DOUBLE_ALLOC || k == FSCK_BAD_NODE || k == FSCK_BAD_INODE) result = 1;
+    }
+
+out:
+    for (int t = 0; workers && t < thread_count; t++) fsck_close_worker(&workers[t]);
+    free(workers);
+    free(st.inode_bitmap);
+    free(st.reachable);
+    free(st.duplicate);
+    free(st.claims);
+    free(st.inode_refs);
+    free(st.is_dir);
+    free(st.links);
+    free(st.dangling);
+    pthread_mutex_destroy(&st.lock);
+    return result;
+}
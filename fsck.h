@@ -0,0 +1,5 @@
+#pragma once
+#include "ibfs.h"
+#include <stdbool.h>
+
+int ibfs_fsck(IBFS_Context* ctx, int thread_count, bool fix);
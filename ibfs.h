@@ -1,11 +1,21 @@
 #pragma once
 #include "ibfs_disk.h"
+#include "device.h"
 #include <stdio.h>
+#include <stdbool.h>
+
+typedef struct IBFS_MetaCache IBFS_MetaCache;
 
 typedef struct IBFS_Context {
-    FILE* disk_file;
+    IBFS_Device* device;
     Superblock sb;
+    bool sb_dirty;
+    bool read_only;
+    uint32_t* meta_map;   /* snapshot view: where each inode bitmap/table block lives */
+    bool skip_checksums;  /* benchmarks only: read metadata without verifying it */
+    struct IBFS_MetaCache* meta_cache;  /* verified metadata buffers, shared by copies of the context */
+    FILE* trace;  /* block access trace, see trace.h */
 } IBFS_Context;
 
-int ibfs_mount(const char* disk_path, IBFS_Context* ctx);
+int ibfs_mount(const char* disk_path, IBFS_Backend backend, IBFS_Context* ctx);
 void ibfs_unmount(IBFS_Context* ctx);
\ No newline at end of file
@@ -2,9 +2,86 @@
 #include <stdint.h>
 #include <time.h> 
 
-#define BLOCK_SIZE 4096
+#define IBFS_DEFAULT_BLOCK_SIZE 4096
+#define IBFS_MIN_BLOCK_SIZE 4096
+#define IBFS_MAX_BLOCK_SIZE 65536
+#define IBFS_VALID_BLOCK_SIZE(bs) ((bs) >= IBFS_MIN_BLOCK_SIZE && (bs) <= IBFS_MAX_BLOCK_SIZE && ((bs) & ((bs) - 1)) == 0)
 #define IBFS_MAGIC_NUMBER 0xDEADBEEF
+#define IBFS_VERSION 10
+#define IBFS_INODE_VERSION 1
+#define IBFS_MAX_INODE_SIZE 256
 
+#define IBFS_INODE_INLINE 0x0001
+#define IBFS_INODE_COMPRESSED 0x0002
+#define IBFS_INODE_INLINE_OFFSET 40
+
+#define IBFS_FEATURE_NAME_INDEX 0x0001
+#define IBFS_INLINE_CAPACITY(inode_size) ((inode_size) - IBFS_INODE_INLINE_OFFSET)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ibfs_le16(x) __builtin_bswap16((uint16_t)(x))
+#define ibfs_le32(x) __builtin_bswap32((uint32_t)(x))
+#define ibfs_le64(x) __builtin_bswap64((uint64_t)(x))
+#else
+#define ibfs_le16(x) ((uint16_t)(x))
+#define ibfs_le32(x) ((uint32_t)(x))
+#define ibfs_le64(x) ((uint64_t)(x))
+#endif
+
+/*
+ * Layout: superblock in block 0, inode bitmap, inode table, then data
+ * groups of blocks_per_group blocks starting at first_data_block. The
+ * first block of every group is that group's bitmap; bit i maps to block
+ * group_start + i, and bit 0 (the bitmap itself) is never allocated.
+ * The free counters are maintained by the allocators so usage can be
+ * reported without scanning the bitmaps; fsck recomputes them.
+ *
+ * Data blocks shared by clones and snapshots are reference counted. The
+ * refcount table (refcount_table_blocks blocks) holds pointers to leaf
+ * blocks of 16-bit counts, one leaf per block_size / 2 blocks, allocated
+ * on first use. A count is the number of references beyond the first, so
+ * an absent leaf means every block it covers has a single owner.
+ *
+ * With dedup enabled, dedup_index_blocks blocks from dedup_index_start
+ * form a hash table of DedupEntry records mapping a content hash to a
+ * data block; the hash picks the index block. The index is a cache:
+ * entries may be evicted, and every hit is verified against the block.
+ *
+ * A file's block map is its 12 direct blocks followed by the trees under
+ * single_indirect, double_indirect and triple_indirect, one to three
+ * levels of blocks of block_size / 4 little-endian pointers. A zero
+ * pointer at any level is a hole that reads as zeros.
+ *
+ * Files flagged IBFS_INODE_COMPRESSED store their data in clusters of
+ * IBFS_CLUSTER_BLOCKS logical blocks (fewer for the last cluster the block
+ * map can address). A compressed cluster keeps its LZ stream in the first
+ * slots of the cluster and IBFS_CLUSTER_MARK | stream length in its last
+ * slot; any other cluster is stored raw. New regular files get the inode
+ * flags in new_file_flags.
+ *
+ * Directory entries live in the B+ tree under root_bpt_block, keyed by
+ * (parent, name hash, name). Images with IBFS_FEATURE_NAME_INDEX in
+ * feature_flags keep the same entries in a second tree under
+ * name_index_root with name_hash zero, so it is ordered by (parent, name)
+ * and serves sorted listings and prefix scans. Every change to the first
+ * tree is applied to both; an empty index has a zero root.
+ *
+ * Bitmap, inode table and B+ tree blocks end in a little-endian CRC32C
+ * of the rest of the block. An all-zero block has never been written
+ * and is valid as it is; everything else must match its checksum.
+ */
+#define IBFS_CLUSTER_BLOCKS 8
+#define IBFS_CLUSTER_MARK 0xFFF00000u
+#define IBFS_CLUSTER_LENGTH(slot) ((slot) & ~IBFS_CLUSTER_MARK)
+#define IBFS_IS_CLUSTER_MARK(slot) (((slot) & IBFS_CLUSTER_MARK) == IBFS_CLUSTER_MARK)
+/* Block numbers from IBFS_CLUSTER_MARK up are reserved for cluster marks. */
+#define IBFS_MAX_BLOCK_COUNT IBFS_CLUSTER_MARK
+
+#define IBFS_CHECKSUM_SIZE 4
+#define IBFS_META_PAYLOAD(block_size) ((block_size) - IBFS_CHECKSUM_SIZE)
+#define IBFS_BITMAP_BITS(block_size) (IBFS_META_PAYLOAD(block_size) * 8)
+
+/* Every superblock field is a little-endian uint32_t; io.c converts on read and write. */
 typedef struct Superblock {
     uint32_t magic;
     uint32_t version;
@@ -13,15 +90,105 @@ typedef struct Superblock {
     uint32_t block_count;
     uint32_t root_inode;
     uint32_t root_bpt_block;
+    uint32_t inode_size;
+    uint32_t inode_table_start;
+    uint32_t first_data_block;
+    uint32_t inode_bitmap_start;
+    uint32_t inode_bitmap_blocks;
+    uint32_t blocks_per_group;
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t last_alloc_group;
+    uint32_t refcount_table_start;
+    uint32_t refcount_table_blocks;
+    uint32_t snapshot_table_block;
+    uint32_t dedup_index_start;
+    uint32_t dedup_index_blocks;
+    uint32_t new_file_flags;
+    uint32_t feature_flags;
+    uint32_t name_index_root;
 } Superblock;
 
+_Static_assert(sizeof(Superblock) == 96, "Superblock layout must stay 96 bytes");
+
+typedef struct DedupEntry {
+    uint64_t hash;
+    uint32_t block;
+    uint32_t reserved;
+} DedupEntry;
+
+/*
+ * A snapshot owns a copy of the inode bitmap and table (the blocks from
+ * inode_bitmap_start up to first_data_block), listed as extents in its
+ * map block, and a copy of the B+ tree. File data is shared with the live
+ * image through the reference counts and copied on the first write.
+ */
+#define IBFS_SNAPSHOT_NAME_LENGTH 28
+
+typedef struct SnapshotEntry {
+    char name[IBFS_SNAPSHOT_NAME_LENGTH];
+    uint32_t root_bpt_block;
+    uint32_t root_inode;
+    uint32_t map_block;
+    uint32_t created;
+    uint32_t reserved[2];
+} SnapshotEntry;
+
+typedef struct SnapshotExtent {
+    uint32_t start;
+    uint32_t count;
+} SnapshotExtent;
+
+typedef struct IBFS_Timespec {
+    uint32_t sec;
+    uint32_t nsec;
+} IBFS_Timespec;
+
 typedef struct Inode {
     uint16_t mode;       
     uint16_t links_count;
+    uint16_t version;
+    uint16_t flags;
     uint64_t size;       
-    time_t   atime;      
-    time_t   mtime;      
-    time_t   ctime;      
-    uint32_t direct_blocks[12];
-    uint32_t single_indirect;
-} Inode;
\ No newline at end of file
+    IBFS_Timespec atime;
+    IBFS_Timespec mtime;
+    IBFS_Timespec ctime;
+    union {
+        struct {
+            uint32_t direct_blocks[12];
+            uint32_t single_indirect;
+            uint32_t double_indirect;
+            uint32_t triple_indirect;
+        };
+        uint8_t inline_data[IBFS_MAX_INODE_SIZE - IBFS_INODE_INLINE_OFFSET];
+    };
+} Inode;
+
+/* On-disk inode record: every field little-endian, no implicit padding. */
+#pragma pack(push, 1)
+typedef struct DiskInode {
+    uint16_t mode;              /*  0 */
+    uint16_t links_count;       /*  2 */
+    uint16_t version;           /*  4 */
+    uint16_t flags;             /*  6 */
+    uint64_t size;              /*  8 */
+    uint32_t atime_sec;         /* 16 */
+    uint32_t atime_nsec;        /* 20 */
+    uint32_t mtime_sec;         /* 24 */
+    uint32_t mtime_nsec;        /* 28 */
+    uint32_t ctime_sec;         /* 32 */
+    uint32_t ctime_nsec;        /* 36 */
+    union {
+        struct {
+            uint32_t direct_blocks[12]; /* 40 */
+            uint32_t single_indirect;   /* 88 */
+            uint32_t double_indirect;   /* 92 */
+            uint32_t triple_indirect;   /* 96 */
+        };
+        uint8_t inline_data[60];        /* 40, continues into the record tail */
+    };
+} DiskInode;
+#pragma pack(pop)
+
+_Static_assert(sizeof(DiskInode) == 100, "DiskInode layout must stay 100 bytes");
+
@@ -0,0 +1,262 @@
+"""Load test for the ibfs_server.py web API.
+
+Builds a throwaway image with directories of the requested sizes, serves it with
+IBFSHandler on a local port and drives list, mkdir, upload, cp_out and delete
+requests from a pool of clients. For every endpoint it reports throughput and
+p50/p99/p999 latency as the client saw it, split into the time ibfs_tool spent
+being started (spawn), mounting the image, running the command and unmounting it;
+"wait" is the rest: queueing behind other requests, HTTP and the handler itself.
+
+The server handles one request at a time, as ibfs_server.py does, because
+concurrent ibfs_tool processes must not share an image. Higher concurrency
+therefore measures queueing; only the listen backlog is raised so that clients
+are not dropped while they wait.
+
+    python ibfs_loadtest.py --sizes 100,1000,10000 --concurrency 1,8 --requests 200
+
+Needs ./ibfs_tool and ./mkfs built next to this script.
+"""
+import argparse
+import contextlib
+import http.client
+import json
+import math
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+from concurrent.futures import ThreadPoolExecutor
+from http.server import HTTPServer
+
+OPERATIONS = ['list', 'mkdir', 'upload', 'cp_out', 'delete']
+PHASES = ['spawn', 'mount', 'op', 'unmount', 'wait']
+
+def parse_list(value):
+    return [int(item) for item in value.split(',') if item]
+
+def parse_server_timing(header):
+    """'spawn;dur=1.2, mount;dur=0.3' -> {'spawn': 1.2, 'mount': 0.3}"""
+    timings = {}
+    for metric in (header or '').split(','):
+        name, _, params = metric.strip().partition(';')
+        if params.startswith('dur='):
+            timings[name] = float(params[4:])
+    return timings
+
+def percentile(ordered, fraction):
+    """Nearest-rank percentile of an already sorted list"""
+    if not ordered:
+        return 0.0
+    return ordered[min(len(ordered) - 1, max(0, math.ceil(fraction * len(ordered)) - 1))]
+
+def run_tool(disk, *args):
+    result = subprocess.run(['./ibfs_tool', disk] + list(args), capture_output=True, text=True)
+    if result.returncode != 0:
+        raise RuntimeError(f"ibfs_tool {' '.join(args)} failed: {result.stderr.strip()}")
+
+def build_image(work_dir, sizes, image_size, name_index):
+    """Create the image with one directory per size, /bench/d<size>, filled with small files"""
+    disk = os.path.join(work_dir, 'bench.ibfs')
+    inodes = sum(sizes) * 2 + 4096
+    result = subprocess.run(['./mkfs', '-n', '-s', image_size, '-N', str(inodes), disk], capture_output=True, text=True)
+    if result.returncode != 0:
+        raise RuntimeError(f"mkfs failed: {result.stderr.strip()}")
+    run_tool(disk, 'mkdir', '/bench')
+    for size in sizes:
+        host_dir = os.path.join(work_dir, f'seed{size}')
+        os.mkdir(host_dir)
+        for i in range(size):
+            with open(os.path.join(host_dir, f'f{i:07d}'), 'wb') as f:
+                f.write(b'x' * (i % 64))
+        run_tool(disk, 'mkdir', f'/bench/d{size}')
+        run_tool(disk, 'import', host_dir, f'/bench/d{size}')
+        shutil.rmtree(host_dir)
+    if name_index:
+        run_tool(disk, 'name_index', 'on')
+    return disk
+
+class Client:
+    """Sends one request per connection, as the handler closes it after each response"""
+    def __init__(self, port):
+        self.port = port
+
+    def request(self, method, path, body=None, headers=None):
+        start = time.perf_counter()
+        conn = http.client.HTTPConnection('127.0.0.1', self.port, timeout=300)
+        try:
+            conn.request(method, path, body=body, headers=headers or {})
+            response = conn.getresponse()
+            data = response.read()
+            timing = response.getheader('Server-Timing')
+            status = response.status
+        finally:
+            conn.close()
+        latency = (time.perf_counter() - start) * 1000
+        ok = status == 200
+        if ok and data:
+            reply = json.loads(data)
+            ok = reply.get('success', 'files' in reply)
+        return ok, latency, parse_server_timing(timing)
+
+def make_requests(operation, directory, count, pass_id, payload, out_dir, list_limit):
+    """The (method, path, body, headers) of every request of one operation"""
+    quote = urllib.parse.quote
+    if operation == 'list':
+        query = f'path={quote(directory)}' + (f'&limit={list_limit}' if list_limit else '')
+        return [('GET', f'/api/list?{query}', None, None)] * count
+    if operation == 'mkdir':
+        return [('GET', f'/api/mkdir?path={quote(f"{directory}/mk{pass_id}_{i}")}', None, None) for i in range(count)]
+    if operation == 'upload':
+        return [('POST', f'/api/upload?path={quote(directory)}&name=up{pass_id}_{i}', payload,
+                 {'Content-Length': str(len(payload)), 'Content-Type': 'application/octet-stream'}) for i in range(count)]
+    if operation == 'cp_out':
+        return [('GET', f'/api/cp_out?ibfs_path={quote(f"{directory}/up{pass_id}_{i}")}'
+                 f'&host_path={quote(os.path.join(out_dir, f"out{i}"))}', None, None) for i in range(count)]
+    # Removes what mkdir and upload added, so every pass starts from the same directory size.
+    requests = []
+    for i in range(count):
+        for name in (f'up{pass_id}_{i}', f'mk{pass_id}_{i}/'):
+            body = json.dumps({'path': f'{directory}/{name}'}).encode()
+            requests.append(('POST', '/api/delete', body, {'Content-Length': str(len(body)),
+                                                           'Content-Type': 'application/json'}))
+    return requests
+
+def run_operation(client, requests, concurrency):
+    samples = []
+    lock = threading.Lock()
+
+    def send(request):
+        try:
+            sample = client.request(*request)
+        except (OSError, http.client.HTTPException, ValueError):
+            sample = (False, 0.0, {})
+        with lock:
+            samples.append(sample)
+
+    start = time.perf_counter()
+    with ThreadPoolExecutor(max_workers=concurrency) as pool:
+        list(pool.map(send, requests))
+    return samples, time.perf_counter() - start
+
+def summarize(samples, elapsed):
+    latencies = sorted(latency for ok, latency, _ in samples if ok)
+    timed = [(latency, timing) for ok, latency, timing in samples if ok and 'tool' in timing]
+    breakdown = {}
+    for phase in PHASES:
+        if phase == 'wait':
+            values = [latency - timing['tool'] for latency, timing in timed]
+        else:
+            values = [timing.get(phase, 0.0) for _, timing in timed]
+        breakdown[phase] = sum(values) / len(values) if values else 0.0
+    return {
+        'requests': len(samples),
+        'errors': sum(1 for ok, _, _ in samples if not ok),
+        'throughput': len(samples) / elapsed if elapsed > 0 else 0.0,
+        'p50': percentile(latencies, 0.50),
+        'p99': percentile(latencies, 0.99),
+        'p999': percentile(latencies, 0.999),
+        'breakdown': breakdown,
+    }
+
+def print_report(results):
+    header = f"{'dir size':>9} {'conc':>4} {'operation':<9} {'reqs':>5} {'errs':>4} {'req/s':>8} " \
+             f"{'p50 ms':>8} {'p99 ms':>8} {'p999 ms':>8} | " + ' '.join(f'{phase:>7}' for phase in PHASES)
+    print(header)
+    print('-' * len(header))
+    for row in results:
+        print(f"{row['dir_size']:>9} {row['concurrency']:>4} {row['operation']:<9} {row['requests']:>5} "
+              f"{row['errors']:>4} {row['throughput']:>8.1f} {row['p50']:>8.2f} {row['p99']:>8.2f} "
+              f"{row['p999']:>8.2f} | " + ' '.join(f"{row['breakdown'][phase]:>7.2f}" for phase in PHASES))
+    print("Breakdown columns are mean milliseconds per successful request.")
+
+def main():
+    parser = argparse.ArgumentParser(description='Load test for the ibfs_server.py web API')
+    parser.add_argument('--sizes', type=parse_list, default=[100, 1000, 10000],
+                        help='comma-separated entry counts of the test directories (default 100,1000,10000)')
+    parser.add_argument('--concurrency', type=parse_list, default=[1, 8],
+                        help='comma-separated numbers of concurrent clients (default 1,8)')
+    parser.add_argument('--requests', type=int, default=200,
+                        help='requests per operation and pass; delete sends twice as many (default 200)')
+    parser.add_argument('--operations', default=','.join(OPERATIONS),
+                        help='comma-separated subset of ' + ','.join(OPERATIONS))
+    parser.add_argument('--file-size', type=int, default=64 * 1024, help='bytes per uploaded file (default 65536)')
+    parser.add_argument('--list-limit', type=int, default=0, help='page size for list requests, 0 for whole directories')
+    parser.add_argument('--image-size', default='512M', help='size of the generated image (default 512M)')
+    parser.add_argument('--name-index', action='store_true', help='enable the name index on the generated image')
+    parser.add_argument('--json', metavar='FILE', help='also write the results as JSON')
+    parser.add_argument('--keep', action='store_true', help='keep the work directory with the image')
+    args = parser.parse_args()
+
+    operations = [op for op in args.operations.split(',') if op]
+    unknown = [op for op in operations if op not in OPERATIONS]
+    if unknown or args.requests <= 0 or not args.sizes or not args.concurrency or min(args.concurrency) <= 0:
+        parser.error(f"unknown operations {unknown}" if unknown else "sizes, concurrency and requests must be positive")
+    # cp_out and delete work on the files that upload creates.
+    if ('cp_out' in operations or 'delete' in operations) and 'upload' not in operations:
+        parser.error("cp_out and delete need upload in --operations")
+
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+    missing = [tool for tool in ('ibfs_tool', 'mkfs') if not os.path.exists(tool)]
+    if missing:
+        print(f"❌ Missing programs: {missing}")
+        print("Please build ibfs_tool and mkfs first")
+        return 1
+
+    work_dir = tempfile.mkdtemp(prefix='ibfs_loadtest_')
+    out_dir = os.path.join(work_dir, 'out')
+    os.mkdir(out_dir)
+    try:
+        print(f"🔨 Building image in {work_dir} ...", file=sys.stderr)
+        disk = build_image(work_dir, args.sizes, args.image_size, args.name_index)
+
+        # ibfs_server reads these when it is imported.
+        os.environ['IBFS_DISK'] = disk
+        os.environ['IBFS_TIMING'] = '1'
+        import ibfs_server
+
+        class QuietHandler(ibfs_server.IBFSHandler):
+            def log_message(self, format, *args):
+                pass
+
+        class BenchServer(HTTPServer):
+            request_queue_size = max(args.concurrency) * 2 + 16
+
+        server = BenchServer(('127.0.0.1', 0), QuietHandler)
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        client = Client(server.server_address[1])
+        payload = bytes(range(256)) * (args.file_size // 256) + bytes(args.file_size % 256)
+
+        results = []
+        pass_id = 0
+        for size in args.sizes:
+            for concurrency in args.concurrency:
+                pass_id += 1
+                for operation in operations:
+                    print(f"🚀 {operation} on /bench/d{size} with {concurrency} clients", file=sys.stderr)
+                    requests = make_requests(operation, f'/bench/d{size}', args.requests, pass_id, payload,
+                                             out_dir, args.list_limit)
+                    # The handler prints a line per request; keep it out of the report.
+                    with open(os.devnull, 'w') as devnull, contextlib.redirect_stdout(devnull):
+                        samples, elapsed = run_operation(client, requests, concurrency)
+                    results.append({'dir_size': size, 'concurrency': concurrency, 'operation': operation,
+                                    **summarize(samples, elapsed)})
+        server.shutdown()
+        server.server_close()
+
+        print_report(results)
+        if args.json:
+            with open(args.json, 'w') as f:
+                json.dump(results, f, indent=2)
+        return 1 if any(row['errors'] for row in results) else 0
+    finally:
+        if args.keep:
+            print(f"📂 Work directory kept: {work_dir}", file=sys.stderr)
+        else:
+            shutil.rmtree(work_dir, ignore_errors=True)
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -4,11 +4,45 @@ import subprocess
 import os
 import cgi
 import urllib.parse
+import socket
 import webbrowser
 import threading
 import time
 
+IBFS_DISK = os.environ.get('IBFS_DISK', 'mydisk.ibfs')
+# With IBFS_TIMING set, ibfs_tool reports its own timings and responses carry a Server-Timing header
+IBFS_TIMING = bool(os.environ.get('IBFS_TIMING'))
+
 class IBFSHandler(SimpleHTTPRequestHandler):
+    timings = None
+    
+    def run_tool(self, args, **kwargs):
+        """Run ibfs_tool and time it; its timing line is taken off stderr"""
+        start = time.perf_counter()
+        result = subprocess.run(args, **kwargs)
+        result.stderr = self.record_timing(time.perf_counter() - start, result.stderr)
+        return result
+    
+    def record_timing(self, elapsed, stderr):
+        """Split the process time into spawn, mount, op and unmount; spawn is whatever ibfs_tool did not measure"""
+        if not IBFS_TIMING:
+            return stderr
+        self.timings = {'tool': elapsed * 1000}
+        if not isinstance(stderr, str):
+            return stderr
+        lines = stderr.splitlines(keepends=True)
+        if lines and lines[-1].startswith('ibfs_timing '):
+            for field in lines.pop().split()[1:]:
+                name, _, value = field.partition('=')
+                self.timings[name] = float(value)
+            self.timings['spawn'] = self.timings['tool'] - sum(self.timings.get(name, 0) for name in ('mount', 'op', 'unmount'))
+        return ''.join(lines)
+    
+    def end_headers(self):
+        if self.timings:
+            self.send_header('Server-Timing', ', '.join(f'{name};dur={value:.3f}' for name, value in self.timings.items()))
+            self.timings = None
+        super().end_headers()
     
     def do_GET(self):
         print(f"GET request: {self.path}")
@@ -21,11 +55,17 @@ class IBFSHandler(SimpleHTTPRequestHandler):
             query = urllib.parse.urlparse(self.path).query
             params = urllib.parse.parse_qs(query)
             path = params.get('path', ['/'])[0]
+            prefix = params.get('prefix', [''])[0]
+            limit = params.get('limit', ['0'])[0]
+            after = params.get('after', [''])[0]
             
             print(f"Listing directory: {path}")
             
-            result = subprocess.run(['./ibfs_tool', 'mydisk.ibfs', 'ls', path], 
-                                  capture_output=True, text=True)
+            # Entries come back in name order; prefix, limit and after page through large directories.
+            args = ['./ibfs_tool', IBFS_DISK, 'ls', path.rstrip('/') + '/' + prefix + '*' if prefix else path]
+            if limit != '0' or after:
+                args += [limit, after] if after else [limit]
+            result = self.run_tool(args, capture_output=True, text=True)
             
             files = self.parse_ls_output(result.stdout)
             
@@ -42,7 +82,7 @@ class IBFSHandler(SimpleHTTPRequestHandler):
             
             print(f"Creating directory: {path}")
             
-            result = subprocess.run(['./ibfs_tool', 'mydisk.ibfs', 'mkdir', path], 
+            result = self.run_tool(['./ibfs_tool', IBFS_DISK, 'mkdir', path], 
                                   capture_output=True, text=True)
             
             self.send_response(200)
@@ -62,7 +102,7 @@ class IBFSHandler(SimpleHTTPRequestHandler):
             
             print(f"Copying from {host_path} to {ibfs_path}")
             
-            result = subprocess.run(['./ibfs_tool', 'mydisk.ibfs', 'cp_in', host_path, ibfs_path], 
+            result = self.run_tool(['./ibfs_tool', IBFS_DISK, 'cp_in', host_path, ibfs_path], 
                                   capture_output=True, text=True)
             
             self.send_response(200)
@@ -82,21 +122,11 @@ class IBFSHandler(SimpleHTTPRequestHandler):
             
             print(f"Copying from {ibfs_path} to {host_path}")
             
-            result = subprocess.run(['./ibfs_tool', 'mydisk.ibfs', 'cat', ibfs_path], 
+            result = self.run_tool(['./ibfs_tool', IBFS_DISK, 'cp_out', ibfs_path, host_path], 
                                   capture_output=True, text=True)
             
-            if result.returncode == 0:
-                try:
-                    with open(host_path, 'w', encoding='utf-8') as f:
-                        f.write(result.stdout)
-                    success = True
-                    message = "File copied successfully"
-                except Exception as e:
-                    success = False
-                    message = f"Error writing to host file: {str(e)}"
-            else:
-                success = False
-                message = result.stderr
+            success = result.returncode == 0
+            message = "File copied successfully" if success else result.stderr
             
             self.send_response(200)
             self.send_header('Content-type', 'application/json')
@@ -107,9 +137,66 @@ class IBFSHandler(SimpleHTTPRequestHandler):
                 'message': message
             }).encode())
         
+        elif self.path.startswith('/api/download'):
+            query = urllib.parse.urlparse(self.path).query
+            params = urllib.parse.parse_qs(query)
+            ibfs_path = params.get('path', [''])[0]
+            
+            print(f"Downloading: {ibfs_path}")
+            
+            # Errors are only reportable before the headers go out, so look the file up first
+            info = self.run_tool(['./ibfs_tool', IBFS_DISK, 'stat', ibfs_path], capture_output=True, text=True)
+            fields = dict(line.split(': ', 1) for line in info.stdout.splitlines() if ': ' in line)
+            if info.returncode != 0 or fields.get('Type') != 'file' or not fields.get('Size', '').isdigit():
+                missing = 'No such file or directory' in info.stderr or 'Not a directory' in info.stderr
+                status = 404 if missing else 400 if fields.get('Type') == 'directory' else 500
+                message = info.stderr.strip() or f"'{ibfs_path}' is not a file"
+                print(f"Download of {ibfs_path} failed: {message}")
+                self.send_response(status)
+                self.send_header('Content-type', 'application/json')
+                self.end_headers()
+                self.wfile.write(json.dumps({'success': False, 'message': message}).encode())
+                return
+            
+            # ibfs_tool writes straight into the socket, so the file never passes through Python
+            self.send_response(200)
+            self.send_header('Content-type', 'application/octet-stream')
+            self.send_header('Content-Length', fields['Size'])
+            self.send_header('Content-Disposition', self.content_disposition(os.path.basename(ibfs_path)))
+            self.end_headers()
+            self.wfile.flush()
+            result = self.run_tool(['./ibfs_tool', IBFS_DISK, 'cat', ibfs_path], 
+                                   stdout=self.connection.fileno(), stderr=subprocess.PIPE, text=True)
+            if result.returncode != 0:
+                # The status line is gone; cutting the connection short of Content-Length tells the client
+                print(f"Download of {ibfs_path} failed after the headers were sent: {result.stderr.strip()}")
+                self.close_connection = True
+                try:
+                    self.connection.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+        
+        elif self.path.startswith('/api/df'):
+            result = self.run_tool(['./ibfs_tool', IBFS_DISK, 'df'], 
+                                  capture_output=True, text=True)
+            
+            self.send_response(200)
+            self.send_header('Content-type', 'application/json')
+            self.send_header('Access-Control-Allow-Origin', '*')
+            self.end_headers()
+            if result.returncode == 0:
+                self.wfile.write(json.dumps({'success': True, **self.parse_df_output(result.stdout)}).encode())
+            else:
+                self.wfile.write(json.dumps({'success': False, 'message': result.stderr}).encode())
+        
         else:
             return SimpleHTTPRequestHandler.do_GET(self)
     
+    def content_disposition(self, name):
+        """Attachment header with an ASCII fallback name and the exact name in RFC 5987 form"""
+        fallback = ''.join(c if 32 <= ord(c) < 127 and c not in '"\\' else '_' for c in name) or 'download'
+        return f'attachment; filename="{fallback}"; filename*=UTF-8\'\'{urllib.parse.quote(name, safe="")}'
+    
     def parse_ls_output(self, output):
         """Parse ibfs_tool ls output into structured data"""
         files = []
@@ -135,41 +222,140 @@ class IBFSHandler(SimpleHTTPRequestHandler):
         
         return files
     
+    def parse_df_output(self, output):
+        """Parse ibfs_tool df output into structured data"""
+        usage = {}
+        
+        for line in output.split('\n'):
+            line = line.strip()
+            if line.startswith('Block size:'):
+                usage['block_size'] = int(line.split(':')[1])
+            elif line.startswith('Blocks:') or line.startswith('Inodes:'):
+                key = line.split(':')[0].lower()
+                parts = line.split(':')[1].replace(',', '').split()
+                usage[key] = {
+                    'total': int(parts[0]),
+                    'used': int(parts[2]),
+                    'free': int(parts[4])
+                }
+        
+        return usage
+    
+    def read_body_chunks(self, length, chunk_size=65536):
+        """Yield the request body in chunks without holding it in memory"""
+        while length > 0:
+            chunk = self.rfile.read(min(chunk_size, length))
+            if not chunk:
+                break
+            length -= len(chunk)
+            yield chunk
+    
+    def upload_stream(self, ibfs_path, chunks, expected_size=None):
+        """Pipe upload data into ibfs_tool cp_in, which only links the file once complete"""
+        cmd = ['./ibfs_tool', IBFS_DISK, 'cp_in', '-', ibfs_path]
+        if expected_size is not None:
+            cmd.append(str(expected_size))
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                stderr=subprocess.PIPE, text=False)
+        complete = False
+        try:
+            for chunk in chunks:
+                if chunk is None:
+                    break
+                proc.stdin.write(chunk)
+            else:
+                complete = True
+        except BrokenPipeError:
+            pass
+        if not complete:
+            proc.terminate()
+        stdout, stderr = proc.communicate()
+        stderr = self.record_timing(time.perf_counter() - start, stderr.decode(errors='replace'))
+        if proc.returncode == 0:
+            return True, stdout.decode(errors='replace')
+        return False, stderr or 'Upload incomplete'
+    
+    def upload_multipart(self, body, boundary, path_value):
+        """Stream the first file part of a multipart body into the image.
+        Form fields that precede the file (e.g. 'path') set its destination."""
+        if not boundary:
+            return False, 'Missing multipart boundary'
+        delimiter = b'\r\n--' + boundary
+        buffer = b'\r\n'
+        
+        for chunk in body:
+            buffer += chunk
+            while True:
+                start = buffer.find(delimiter)
+                header_end = buffer.find(b'\r\n\r\n', start)
+                if start < 0 or header_end < 0:
+                    break
+                headers = buffer[start + len(delimiter):header_end].decode(errors='replace')
+                buffer = buffer[header_end + 4:]
+                disposition = cgi.parse_header(next((line.split(':', 1)[1] for line in headers.split('\r\n')
+                                                     if line.lower().startswith('content-disposition')), ''))[1]
+                
+                if disposition.get('filename'):
+                    ibfs_path = path_value.rstrip('/') + '/' + os.path.basename(disposition['filename'])
+                    return self.upload_stream(ibfs_path, self.multipart_part(buffer, body, delimiter))
+                
+                end = buffer.find(delimiter)
+                while end < 0:
+                    chunk = next(body, None)
+                    if chunk is None:
+                        return False, 'Truncated form field'
+                    buffer += chunk
+                    end = buffer.find(delimiter)
+                if disposition.get('name') == 'path':
+                    path_value = buffer[:end].decode(errors='replace') or '/'
+                buffer = buffer[end:]
+        
+        return False, 'No file in upload'
+    
+    def multipart_part(self, buffer, body, delimiter):
+        """Yield a part's data up to the next delimiter; yields None if the body ends early"""
+        keep = len(delimiter) - 1
+        while True:
+            end = buffer.find(delimiter)
+            if end >= 0:
+                if end:
+                    yield buffer[:end]
+                return
+            if len(buffer) > keep:
+                yield buffer[:-keep]
+                buffer = buffer[-keep:]
+            chunk = next(body, None)
+            if chunk is None:
+                yield None
+                return
+            buffer += chunk
+    
     def do_POST(self):
-        if self.path == '/api/upload':
+        if self.path.startswith('/api/upload'):
             content_type = self.headers.get('Content-Type', '')
+            content_length = int(self.headers.get('Content-Length', 0))
+            query = urllib.parse.urlparse(self.path).query
+            params = urllib.parse.parse_qs(query)
+            path_value = params.get('path', ['/'])[0]
+            body = self.read_body_chunks(content_length)
             
             if 'multipart/form-data' in content_type:
-                form = cgi.FieldStorage(
-                    fp=self.rfile,
-                    headers=self.headers,
-                    environ={'REQUEST_METHOD': 'POST', 'CONTENT_TYPE': content_type}
-                )
-                
-                file_item = form['file']
-                path_value = form.getvalue('path', '/')
-                
-                if file_item.filename:
-                    temp_path = f"temp_{file_item.filename}"
-                    with open(temp_path, 'wb') as f:
-                        f.write(file_item.file.read())
-                    
-                    result = subprocess.run(['./ibfs_tool', 'mydisk.ibfs', 'cp_in', temp_path, path_value], 
-                                          capture_output=True, text=True)
-                    
-                    os.remove(temp_path)
-                    
-                    self.send_response(200)
-                    self.send_header('Content-type', 'application/json')
-                    self.end_headers()
-                    self.wfile.write(json.dumps({
-                        'success': result.returncode == 0,
-                        'message': result.stdout if result.returncode == 0 else result.stderr
-                    }).encode())
-                    return
+                boundary = cgi.parse_header(content_type)[1].get('boundary', '').encode()
+                success, message = self.upload_multipart(body, boundary, path_value)
+            else:
+                # Raw body: the destination comes from ?path= and optionally ?name=
+                name = params.get('name', [''])[0]
+                ibfs_path = path_value.rstrip('/') + '/' + name if name else path_value
+                success, message = self.upload_stream(ibfs_path, body, content_length)
             
-            self.send_response(400)
+            self.send_response(200 if success else 400)
+            self.send_header('Content-type', 'application/json')
             self.end_headers()
+            self.wfile.write(json.dumps({
+                'success': success,
+                'message': message
+            }).encode())
         
         elif self.path == '/api/delete':
             content_length = int(self.headers['Content-Length'])
@@ -185,7 +371,7 @@ class IBFSHandler(SimpleHTTPRequestHandler):
             else:
                 cmd = 'rm'
             
-            result = subprocess.run(['./ibfs_tool', 'mydisk.ibfs', cmd, path], 
+            result = self.run_tool(['./ibfs_tool', IBFS_DISK, cmd, path], 
                                   capture_output=True, text=True)
             
             self.send_response(200)
@@ -199,17 +385,17 @@ class IBFSHandler(SimpleHTTPRequestHandler):
 def run_server():
     os.chdir(os.path.dirname(os.path.abspath(__file__)))
     
-    # Check if mydisk.ibfs exists
-    if not os.path.exists('mydisk.ibfs'):
-        print("❌ Error: mydisk.ibfs not found!")
-        print("Please run: ./mkfs mydisk.ibfs first")
+    # Check if the disk image exists
+    if not os.path.exists(IBFS_DISK):
+        print(f"❌ Error: {IBFS_DISK} not found!")
+        print(f"Please run: ./mkfs {IBFS_DISK} first")
         return
     
     server = HTTPServer(('localhost', 8000), IBFSHandler)
     
     print("🚀 Starting IBFS File Manager...")
     print("📍 Local:   http://localhost:8000")
-    print("📂 Disk:    mydisk.ibfs")
+    print(f"📂 Disk:    {IBFS_DISK}")
     print("⏹️  Press Ctrl+C to stop")
     print("=" * 50)
     
@@ -234,7 +420,7 @@ def compile_c_programs():
     print("🔨 Compiling C programs...")
     
     # Check if source files exist
-    required_files = ['ibfs_tool.c', 'io.c', 'bitmap.c', 'inode.c', 'bplustree.c']
+    required_files = ['ibfs_tool.c', 'io.c', 'bitmap.c', 'inode.c', 'bplustree.c', 'file.c', 'fsck.c', 'path.c', 'walk.c', 'import.c', 'refcount.c', 'snapshot.c', 'dedup.c', 'lz.c', 'crc32c.c', 'device.c', 'libibfs.c', 'trace.c', 'nameindex.c']
     missing_files = [f for f in required_files if not os.path.exists(f)]
     
     if missing_files:
@@ -244,7 +430,7 @@ def compile_c_programs():
     # Compile ibfs_tool
     compile_cmd = [
         'gcc', '-o', 'ibfs_tool', 
-        'ibfs_tool.c', 'io.c', 'bitmap.c', 'inode.c', 'bplustree.c'
+        'ibfs_tool.c', 'io.c', 'bitmap.c', 'inode.c', 'bplustree.c', 'file.c', 'fsck.c', 'path.c', 'walk.c', 'import.c', 'refcount.c', 'snapshot.c', 'dedup.c', 'lz.c', 'crc32c.c', 'device.c', 'libibfs.c', 'trace.c', 'nameindex.c', '-pthread'
     ]
     
     result = subprocess.run(compile_cmd, capture_output=True, text=True)
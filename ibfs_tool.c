@@ -8,48 +8,42 @@
 #include "bplustree.h"
 #include "block.h"   
 #include "bitmap.h"  
+#include "file.h"
+#include "io.h"
+#include "fsck.h"
+#include "path.h"
+#include "walk.h"
+#include "import.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "nameindex.h"
+#include "crc32c.h"
+#include "trace.h"
+#include "libibfs.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
 
 static void print_entry_callback(BPlusTreeKey* key, uint32_t value, void* user_data);
-static int ibfs_mkdir(IBFS_Context* ctx, uint32_t parent_inode_num, const char* name);
-static int ibfs_rmdir(IBFS_Context* ctx, uint32_t parent_inode_num, const char* name);
-static int ibfs_rm(IBFS_Context* ctx, uint32_t parent_inode_num, const char* name);
-static bool is_directory_empty(IBFS_Context* ctx, uint32_t dir_inode_num);
-int ibfs_mount(const char* disk_path, IBFS_Context* ctx);
-void ibfs_unmount(IBFS_Context* ctx);
-
-
-int ibfs_mount(const char* disk_path, IBFS_Context* ctx) {
-    if (!disk_path || !ctx) return -1;
-    ctx->disk_file = fopen(disk_path, "rb+");
-    if (!ctx->disk_file) {
-        perror("Error opening disk file");
-        return -1;
-    }
-    if (fread(&ctx->sb, sizeof(Superblock), 1, ctx->disk_file) != 1) {
-        fprintf(stderr, "Error: could not read superblock.\n");
-        fclose(ctx->disk_file);
-        return -1;
-    }
-    if (ctx->sb.magic != IBFS_MAGIC_NUMBER) {
-        fprintf(stderr, "Error: Magic number mismatch. Not an IBFS disk?\n");
-        fclose(ctx->disk_file);
-        return -1;
-    }
-    if (ctx->sb.block_size != BLOCK_SIZE || ctx->sb.block_count == 0 || ctx->sb.inode_count == 0 || ctx->sb.root_inode >= ctx->sb.inode_count) {
-         fprintf(stderr, "Error: Superblock contains invalid parameters.\n");
-         fclose(ctx->disk_file);
-         return -1;
-    }
-    fseek(ctx->disk_file, 0, SEEK_SET);
-    return 0;
-}
-
-void ibfs_unmount(IBFS_Context* ctx) {
-    if (ctx && ctx->disk_file) {
-        fclose(ctx->disk_file);
-        ctx->disk_file = NULL;
-    }
-}
+static int ibfs_grow(IBFS_Context* ctx, long long new_size);
+static int ibfs_defrag(IBFS_Context* ctx, uint32_t fill_percent);
+static int ibfs_du(IBFS_Context* ctx, const char* path, int threads);
+static int ibfs_find(IBFS_Context* ctx, const char* path, char** args, int arg_count, int threads);
+static int ibfs_tree(IBFS_Context* ctx, const char* path, int threads);
+static int ibfs_rm_recursive(IBFS_FS* fs, const char* path, int threads);
+static int ibfs_clone(IBFS_Context* ctx, const char* src_path, const char* dst_path);
+static int ibfs_compress(IBFS_Context* ctx, const char* path, bool compress);
+static int ibfs_truncate(IBFS_Context* ctx, const char* path, uint64_t size);
+static int ibfs_preallocate(IBFS_Context* ctx, const char* path, uint64_t offset, uint64_t length);
+static int ibfs_map(IBFS_Context* ctx, const char* path);
+static int ibfs_bench(IBFS_Context* ctx, uint32_t rounds);
+static int ibfs_ls(IBFS_Context* ctx, const char* path, uint32_t limit, const char* after);
 
 static void print_entry_callback(BPlusTreeKey* key, uint32_t value, void* user_data) {
     IBFS_Context* ctx = (IBFS_Context*)user_data;
@@ -57,7 +51,8 @@ static void print_entry_callback(BPlusTreeKey* key, uint32_t value, void* user_d
     char time_buf[30];
 
     if (inode_read(ctx, value, &entry_inode) == 0) {
-        struct tm *tm_info = localtime(&entry_inode.mtime);
+        time_t mtime = (time_t)entry_inode.mtime.sec;
+        struct tm *tm_info = localtime(&mtime);
         if (tm_info) {
             strftime(time_buf, sizeof(time_buf), "%b %d %H:%M", tm_info);
         } else {
@@ -77,277 +72,1293 @@ static void print_entry_callback(BPlusTreeKey* key, uint32_t value, void* user_d
     }
 }
 
-static int ibfs_mkdir(IBFS_Context* ctx, uint32_t parent_inode_num, const char* name) {
-    if (!name || strlen(name) == 0 || strlen(name) >= MAX_FILENAME_LENGTH || strcmp(name,".") == 0 || strcmp(name,"..") == 0) {
-        fprintf(stderr, "mkdir Error: Invalid directory name '%s'.\n", name ? name : "");
-        return -1;
-    }
+#define CP_IN_CHUNK_BLOCKS 64
 
-    BPlusTreeKey search_key;
-    search_key.parent_inode_id = parent_inode_num;
-    search_key.name_hash = hash_name(name);
-    strncpy(search_key.name, name, MAX_FILENAME_LENGTH -1);
-    search_key.name[MAX_FILENAME_LENGTH - 1] = '\0';
-    uint32_t found_inode;
-    if (bpt_search(ctx, ctx->sb.root_bpt_block, &search_key, &found_inode) == 0) {
-        fprintf(stderr, "mkdir Error: '%s' already exists.\n", name);
-        return -1;
-    }
+static volatile sig_atomic_t cp_in_cancelled = 0;
 
-    printf("Allocating inode for '%s'...\n", name);
-    int new_inode_num = inode_alloc(ctx, S_IFDIR);
-    if (new_inode_num < 0) return -1;
-    printf("Allocated inode %d.\n", new_inode_num);
+static void cp_in_cancel(int sig) {
+    cp_in_cancelled = 1;
+}
 
-    BPlusTreeKey new_key = search_key;
+static int tool_fail(const char* command, const char* path) {
+    fprintf(stderr, "%s Error: '%s': %s.\n", command, path, strerror(errno));
+    return -1;
+}
 
-    printf("Inserting key into B+ Tree (parent=%u, name='%s', inode=%d)...\n",
-           parent_inode_num, name, new_inode_num);
-    uint32_t old_bpt_root = ctx->sb.root_bpt_block;
-    if (bpt_insert(ctx, &ctx->sb.root_bpt_block, &new_key, new_inode_num) != 0) {
-        fprintf(stderr, "mkdir Error: Failed to insert entry into B+ Tree.\n");
-        free_inode_num(ctx, new_inode_num);
+/* The copy has no name until its last byte arrived, so a failed or cancelled copy never becomes visible. */
+static int ibfs_cp_in(IBFS_FS* fs, const char* host_path, const char* dir_path, const char* path, long long expected_size) {
+    IBFS_Stat st;
+    if (ibfs_fs_stat(fs, path, &st) == 0) {
+        fprintf(stderr, "cp_in Error: '%s' already exists.\n", path);
         return -1;
     }
-    printf("B+ Tree insertion successful.\n");
 
-    if (ctx->sb.root_bpt_block != old_bpt_root) {
-        printf("B+ Tree root changed, updating superblock...\n");
-        if (fseek(ctx->disk_file, 0, SEEK_SET) != 0) { perror("mkdir Error: Seek superblock"); return -1;}
-        if (fwrite(&ctx->sb, sizeof(Superblock), 1, ctx->disk_file) != 1) { perror("mkdir Error: Write superblock"); return -1;}
-        printf("Superblock updated on disk.\n");
+    bool from_stdin = strcmp(host_path, "-") == 0;
+    FILE* host_file = from_stdin ? stdin : fopen(host_path, "rb");
+    if (!host_file) {
+        perror("cp_in Error: Opening host file");
+        return -1;
+    }
+    if (from_stdin) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#else
+        /* No SA_RESTART: SIGTERM interrupts the pending read so a cancelled upload is rolled back. */
+        struct sigaction cancel_action;
+        memset(&cancel_action, 0, sizeof(cancel_action));
+        cancel_action.sa_handler = cp_in_cancel;
+        sigaction(SIGTERM, &cancel_action, NULL);
+#endif
     }
-    return 0; 
-}
 
-typedef struct {
-    bool is_empty;
-} IsEmptyCheckData;
+    int fd = ibfs_fs_open(fs, dir_path, IBFS_O_WRONLY | IBFS_O_TMPFILE);
+    if (fd < 0) tool_fail("cp_in", dir_path);
+    size_t chunk_size = (size_t)ibfs_fs_context(fs)->sb.block_size * CP_IN_CHUNK_BLOCKS;
+    char* buffer = fd >= 0 ? malloc(chunk_size) : NULL;
+    if (!buffer) {
+        if (!from_stdin) fclose(host_file);
+        if (fd >= 0) ibfs_fs_close(fs, fd);
+        return -1;
+    }
 
-static void check_empty_callback(BPlusTreeKey* key, uint32_t value, void* user_data) {
-    IsEmptyCheckData* data = (IsEmptyCheckData*)user_data;
-    data->is_empty = false;
+    uint64_t offset = 0;
+    size_t n;
+    bool failed = false;
+    while (!cp_in_cancelled && (n = fread(buffer, 1, chunk_size, host_file)) > 0) {
+        if (ibfs_fs_write(fs, fd, buffer, n) != (long long)n) {
+            fprintf(stderr, "cp_in Error: Failed to write data at offset %llu.\n", (unsigned long long)offset);
+            failed = true;
+            break;
+        }
+        offset += n;
+    }
+    if (!failed && (cp_in_cancelled || ferror(host_file))) {
+        fprintf(stderr, "cp_in Error: Input %s after %llu bytes.\n",
+                cp_in_cancelled ? "cancelled" : "failed", (unsigned long long)offset);
+        failed = true;
+    }
+    if (!failed && expected_size >= 0 && offset != (uint64_t)expected_size) {
+        fprintf(stderr, "cp_in Error: Received %llu bytes, expected %lld.\n", (unsigned long long)offset, expected_size);
+        failed = true;
+    }
+    if (!from_stdin) fclose(host_file);
+    free(buffer);
+    if (!failed && ibfs_fs_link(fs, fd, path) != 0) failed = tool_fail("cp_in", path) != 0;
+    if (!failed && ibfs_fs_fstat(fs, fd, &st) == 0) {
+        printf("Copied %llu bytes into inode %u%s.\n", (unsigned long long)st.size, st.ino,
+               (st.flags & IBFS_INODE_INLINE) ? " (inline)" : "");
+    }
+    /* Closing a file that never got its name frees it. */
+    ibfs_fs_close(fs, fd);
+    return failed ? -1 : 0;
 }
 
-static bool is_directory_empty(IBFS_Context* ctx, uint32_t dir_inode_num) {
-    IsEmptyCheckData check_data = { .is_empty = true };
-    bpt_iterate(ctx, ctx->sb.root_bpt_block, dir_inode_num, check_empty_callback, &check_data);
-    return check_data.is_empty;
+static int ibfs_cat(IBFS_FS* fs, const char* command, const char* path, FILE* out) {
+    int fd = ibfs_fs_open(fs, path, IBFS_O_RDONLY);
+    if (fd < 0) return tool_fail(command, path);
+    fflush(out);
+    int result = ibfs_fs_export(fs, fd, fileno(out));
+    if (result != 0) tool_fail(command, path);
+    ibfs_fs_close(fs, fd);
+    return result;
 }
 
-static int ibfs_rmdir(IBFS_Context* ctx, uint32_t parent_inode_num, const char* name) {
-    if (!name || strlen(name) == 0 || strlen(name) >= MAX_FILENAME_LENGTH || strcmp(name,".") == 0 || strcmp(name,"..") == 0) {
-        fprintf(stderr, "rmdir Error: Invalid directory name '%s'.\n", name ? name : "");
+static int ibfs_grow(IBFS_Context* ctx, long long new_size) {
+    long long new_blocks_ll = new_size / ctx->sb.block_size;
+    if (new_blocks_ll > IBFS_MAX_BLOCK_COUNT) {
+        fprintf(stderr, "grow Error: %lld blocks exceeds the limit of %u blocks.\n", new_blocks_ll, IBFS_MAX_BLOCK_COUNT);
+        return -1;
+    }
+    uint32_t old_blocks = ctx->sb.block_count;
+    uint32_t new_blocks = (uint32_t)new_blocks_ll;
+    if (new_blocks <= old_blocks) {
+        fprintf(stderr, "grow Error: New size (%u blocks) must be larger than the current %u blocks.\n",
+                new_blocks, old_blocks);
         return -1;
     }
 
-    BPlusTreeKey search_key;
-    search_key.parent_inode_id = parent_inode_num;
-    search_key.name_hash = hash_name(name);
-    strncpy(search_key.name, name, MAX_FILENAME_LENGTH - 1);
-    search_key.name[MAX_FILENAME_LENGTH - 1] = '\0';
-    uint32_t target_inode_num;
+    uint32_t old_groups = bitmap_group_count(ctx);
+    uint32_t last_group = old_groups - 1;
+    uint32_t last_group_length = bitmap_group_length(ctx, last_group);
 
-    if (bpt_search(ctx, ctx->sb.root_bpt_block, &search_key, &target_inode_num) != 0) {
-        fprintf(stderr, "rmdir Error: Directory '%s' not found.\n", name);
+    printf("Extending image from %u to %u blocks...\n", old_blocks, new_blocks);
+    if (resize_disk(ctx, (uint64_t)new_blocks * ctx->sb.block_size) != 0) {
+        fprintf(stderr, "grow Error: Failed to extend backing file.\n");
         return -1;
     }
 
-    Inode target_inode;
-    if (inode_read(ctx, target_inode_num, &target_inode) != 0) {
-        fprintf(stderr, "rmdir Error: Failed to read inode %u for '%s'.\n", target_inode_num, name);
+    ctx->sb.block_count = new_blocks;
+    uint32_t new_groups = bitmap_group_count(ctx);
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    int result = 0;
+
+    if (last_group_length < ctx->sb.blocks_per_group) {
+        printf("Opening tail of group %u (%u -> %u blocks)...\n",
+               last_group, last_group_length, bitmap_group_length(ctx, last_group));
+        if (read_meta_block(ctx, bitmap_group_start(ctx, last_group), block_buffer) != 0) {
+            result = -1;
+        } else {
+            for (uint32_t bit = last_group_length; bit < ctx->sb.blocks_per_group; bit++) {
+                block_buffer[bit / 8] &= ~(1 << (bit % 8));
+            }
+            if (write_meta_block(ctx, bitmap_group_start(ctx, last_group), block_buffer) != 0) result = -1;
+        }
+    }
+
+    memset(block_buffer, 0, ctx->sb.block_size);
+    for (uint32_t g = old_groups; g < new_groups && result == 0; g++) {
+        if (write_meta_block(ctx, bitmap_group_start(ctx, g), block_buffer) != 0) result = -1;
+    }
+    printf("Initialized %u new groups.\n", new_groups - old_groups);
+
+    if (result != 0 || sync_disk(ctx) != 0) {
+        fprintf(stderr, "grow Error: Failed to initialize new groups, superblock left unchanged.\n");
+        ctx->sb.block_count = old_blocks;
         return -1;
     }
-    if ((target_inode.mode & S_IFDIR) != S_IFDIR) {
-        fprintf(stderr, "rmdir Error: '%s' is not a directory.\n", name);
+
+    ctx->sb.free_blocks_count += (new_blocks - old_blocks) - (new_groups - old_groups);
+    printf("Committing superblock...\n");
+    if (write_superblock(ctx) != 0 || sync_disk(ctx) != 0) {
+        fprintf(stderr, "grow Error: Failed to update superblock.\n");
         return -1;
     }
+    return 0;
+}
 
-    printf("Checking if directory '%s' (inode %u) is empty...\n", name, target_inode_num);
-    if (!is_directory_empty(ctx, target_inode_num)) {
-        fprintf(stderr, "rmdir Error: Directory '%s' is not empty.\n", name);
+static void print_tree_stats(const char* label, BPlusTreeStats* stats) {
+    printf("%s: height %u, %u internal + %u leaf nodes, %llu entries, %u leaf-chain jumps\n",
+           label, stats->height, stats->internal_nodes, stats->leaf_nodes,
+           (unsigned long long)stats->entries, stats->leaf_jumps);
+}
+
+static int ibfs_defrag(IBFS_Context* ctx, uint32_t fill_percent) {
+    BPlusTreeStats before, after;
+    if (bpt_stats(ctx, ctx->sb.root_bpt_block, &before) != 0) {
+        fprintf(stderr, "defrag Error: Failed to scan B+ Tree.\n");
         return -1;
     }
-    printf("Directory is empty.\n");
+    print_tree_stats("Before", &before);
+    if (before.leaf_nodes == 0) {
+        printf("Tree is empty, nothing to do.\n");
+        return 0;
+    }
 
-    printf("Deleting entry '%s' from parent inode %u...\n", name, parent_inode_num);
-    uint32_t old_bpt_root = ctx->sb.root_bpt_block;
-    if (bpt_delete(ctx, &ctx->sb.root_bpt_block, &search_key) != 0) {
-        fprintf(stderr, "rmdir Error: Failed to delete entry from B+ Tree.\n");
+    printf("Rebuilding tree with %u%% leaf fill...\n", fill_percent);
+    uint32_t old_root = ctx->sb.root_bpt_block;
+    uint32_t new_root;
+    if (bpt_rebuild(ctx, old_root, fill_percent, &new_root) != 0) {
+        fprintf(stderr, "defrag Error: Rebuild failed, original tree left in place.\n");
+        return -1;
+    }
+    if (sync_disk(ctx) != 0) {
+        fprintf(stderr, "defrag Error: Failed to flush new tree, original tree left in place.\n");
+        bpt_free_tree(ctx, new_root);
         return -1;
     }
-     printf("B+ Tree entry deleted.\n");
 
-    if (ctx->sb.root_bpt_block != old_bpt_root) {
-        printf("B+ Tree root changed, updating superblock...\n");
-        if (fseek(ctx->disk_file, 0, SEEK_SET) != 0) { perror("rmdir Error: Seek superblock"); return -1;}
-        if (fwrite(&ctx->sb, sizeof(Superblock), 1, ctx->disk_file) != 1) { perror("rmdir Error: Write superblock"); return -1;}
-        printf("Superblock updated.\n");
+    printf("Switching root %u -> %u...\n", old_root, new_root);
+    ctx->sb.root_bpt_block = new_root;
+    if (write_superblock(ctx) != 0 || sync_disk(ctx) != 0) {
+        fprintf(stderr, "defrag Error: Failed to update superblock.\n");
+        return -1;
     }
 
-    printf("Freeing inode %u...\n", target_inode_num);
-    free_inode_num(ctx, target_inode_num);
+    printf("Freeing old tree nodes...\n");
+    if (bpt_free_tree(ctx, old_root) != 0) {
+        fprintf(stderr, "Warning: Some old tree nodes could not be freed.\n");
+    }
 
+    if (bpt_stats(ctx, ctx->sb.root_bpt_block, &after) == 0) {
+        print_tree_stats("After", &after);
+    }
+    if (ctx->sb.feature_flags & IBFS_FEATURE_NAME_INDEX) {
+        printf("Rebuilding the name index...\n");
+        if (name_index_rebuild(ctx) != 0) return -1;
+    }
     return 0;
 }
 
-static int ibfs_rm(IBFS_Context* ctx, uint32_t parent_inode_num, const char* name) {
-    if (!name || strlen(name) == 0 || strlen(name) >= MAX_FILENAME_LENGTH || strcmp(name,".") == 0 || strcmp(name,"..") == 0) {
-        fprintf(stderr, "rm Error: Invalid file name '%s'.\n", name ? name : "");
+/* A last component ending in '*' lists only the names starting with what precedes it. */
+static int ibfs_ls(IBFS_Context* ctx, const char* path, uint32_t limit, const char* after) {
+    char dir_path[4096];
+    char prefix[MAX_FILENAME_LENGTH] = "";
+    size_t length = strlen(path);
+    if (length >= sizeof(dir_path)) {
+        fprintf(stderr, "ls Error: Path too long.\n");
         return -1;
     }
+    strcpy(dir_path, path);
+    bool has_prefix = length > 0 && dir_path[length - 1] == '*';
+    if (has_prefix) {
+        dir_path[length - 1] = '\0';
+        char* slash = strrchr(dir_path, '/');
+        char* name = slash ? slash + 1 : dir_path;
+        if (strlen(name) >= MAX_FILENAME_LENGTH) {
+            fprintf(stderr, "ls Error: Prefix '%s' is longer than a name.\n", name);
+            return -1;
+        }
+        strcpy(prefix, name);
+        *name = '\0';
+        if (dir_path[0] == '\0') strcpy(dir_path, "/");
+    }
+
+    uint32_t dir_inode_num;
+    if (path_lookup(ctx, dir_path, &dir_inode_num) != 0) return -1;
+    printf("Type Lnk      Size Mod Time        Name\n");
+    printf("---- --- ---------- --------------- --------\n");
+    return name_index_list(ctx, dir_inode_num, has_prefix ? prefix : NULL, after, limit, print_entry_callback, ctx);
+}
+
+static int default_thread_count(void) {
+#ifdef _WIN32
+    return 4;
+#else
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (int)online : 1;
+#endif
+}
 
-    BPlusTreeKey search_key;
-    search_key.parent_inode_id = parent_inode_num;
-    search_key.name_hash = hash_name(name);
-    strncpy(search_key.name, name, MAX_FILENAME_LENGTH - 1);
-    search_key.name[MAX_FILENAME_LENGTH - 1] = '\0';
-    uint32_t target_inode_num;
+static int grow_array(void** items, uint32_t* capacity, uint32_t needed, size_t item_size) {
+    if (needed <= *capacity) return 0;
+    uint32_t new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed) new_capacity *= 2;
+    void* grown = realloc(*items, (size_t)new_capacity * item_size);
+    if (!grown) return -1;
+    *items = grown;
+    *capacity = new_capacity;
+    return 0;
+}
 
-    if (bpt_search(ctx, ctx->sb.root_bpt_block, &search_key, &target_inode_num) != 0) {
-        fprintf(stderr, "rm Error: File '%s' not found.\n", name);
+static int lookup_directory(IBFS_Context* ctx, const char* path, uint32_t* inode_num_out) {
+    Inode dir;
+    if (path_lookup(ctx, path, inode_num_out) != 0 || inode_read(ctx, *inode_num_out, &dir) != 0) return -1;
+    if ((dir.mode & S_IFDIR) != S_IFDIR) {
+        fprintf(stderr, "Error: '%s' is not a directory.\n", path);
         return -1;
     }
+    return 0;
+}
+
+typedef struct DuTotals {
+    pthread_mutex_t lock;
+    uint64_t bytes;
+    uint64_t blocks;
+    uint32_t files;
+    uint32_t dirs;
+} DuTotals;
+
+static void du_count_block(uint32_t block_num, void* user_data) {
+    (*(uint64_t*)user_data)++;
+}
+
+static void du_callback(const WalkEntry* entry, void* user_data) {
+    DuTotals* totals = (DuTotals*)user_data;
+    Inode inode = entry->inode;
+    uint64_t blocks = 0;
+    file_for_each_block(entry->ctx, &inode, du_count_block, &blocks);
+
+    pthread_mutex_lock(&totals->lock);
+    totals->bytes += inode.size;
+    totals->blocks += blocks;
+    if ((inode.mode & S_IFDIR) == S_IFDIR) totals->dirs++;
+    else totals->files++;
+    pthread_mutex_unlock(&totals->lock);
+}
+
+static int ibfs_du(IBFS_Context* ctx, const char* path, int threads) {
+    uint32_t dir_inode_num;
+    if (lookup_directory(ctx, path, &dir_inode_num) != 0) return -1;
+
+    DuTotals totals;
+    memset(&totals, 0, sizeof(DuTotals));
+    pthread_mutex_init(&totals.lock, NULL);
+    int result = ibfs_walk(ctx, dir_inode_num, path, threads, du_callback, &totals);
+    pthread_mutex_destroy(&totals.lock);
+    if (result != 0) return -1;
+
+    printf("Files: %u, directories: %u\n", totals.files, totals.dirs);
+    printf("Apparent size: %llu bytes\n", (unsigned long long)totals.bytes);
+    printf("Allocated: %llu blocks (%llu bytes)\n", (unsigned long long)totals.blocks,
+           (unsigned long long)(totals.blocks * ctx->sb.block_size));
+    return 0;
+}
+
+typedef struct FindQuery {
+    const char* pattern;
+    char type;
+    int size_cmp;
+    uint64_t size;
+    int mtime_cmp;
+    int64_t mtime_days;
+    int64_t now;
+
+    pthread_mutex_t lock;
+    char** matches;
+    uint32_t match_count;
+    uint32_t match_capacity;
+    int failed;
+} FindQuery;
+
+static bool name_matches(const char* pattern, const char* name) {
+    if (*pattern == '\0') return *name == '\0';
+    if (*pattern == '*') return name_matches(pattern + 1, name) || (*name && name_matches(pattern, name + 1));
+    if (*name == '\0') return false;
+    if (*pattern == '?' || *pattern == *name) return name_matches(pattern + 1, name + 1);
+    return false;
+}
+
+static int compare_numbers(int cmp, int64_t value, int64_t limit) {
+    if (cmp > 0) return value > limit;
+    if (cmp < 0) return value < limit;
+    return value == limit;
+}
+
+static void find_callback(const WalkEntry* entry, void* user_data) {
+    FindQuery* query = (FindQuery*)user_data;
+    bool is_dir = (entry->inode.mode & S_IFDIR) == S_IFDIR;
+
+    if (query->pattern && !name_matches(query->pattern, entry->key.name)) return;
+    if (query->type == 'f' && is_dir) return;
+    if (query->type == 'd' && !is_dir) return;
+    if (query->size_cmp != 2 && !compare_numbers(query->size_cmp, (int64_t)entry->inode.size, (int64_t)query->size)) return;
+    if (query->mtime_cmp != 2 &&
+        !compare_numbers(query->mtime_cmp, (query->now - (int64_t)entry->inode.mtime.sec) / 86400, query->mtime_days)) return;
+
+    char* copy = malloc(strlen(entry->path) + 1);
+    pthread_mutex_lock(&query->lock);
+    if (!copy || grow_array((void**)&query->matches, &query->match_capacity, query->match_count + 1, sizeof(char*)) != 0) {
+        query->failed = 1;
+        free(copy);
+    } else {
+        strcpy(copy, entry->path);
+        query->matches[query->match_count++] = copy;
+    }
+    pthread_mutex_unlock(&query->lock);
+}
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int parse_comparison(const char* text, int* cmp_out) {
+    *cmp_out = (*text == '+') ? 1 : (*text == '-') ? -1 : 0;
+    return *cmp_out != 0;
+}
+
+static int ibfs_find(IBFS_Context* ctx, const char* path, char** args, int arg_count, int threads) {
+    FindQuery query;
+    memset(&query, 0, sizeof(FindQuery));
+    query.size_cmp = 2;
+    query.mtime_cmp = 2;
+    query.now = (int64_t)time(NULL);
+
+    for (int i = 0; i < arg_count; i++) {
+        if (i + 1 >= arg_count) {
+            fprintf(stderr, "find Error: Option '%s' needs a value.\n", args[i]);
+            return -1;
+        }
+        const char* value = args[i + 1];
+        if (strcmp(args[i], "-name") == 0) {
+            query.pattern = value;
+        } else if (strcmp(args[i], "-type") == 0 && (strcmp(value, "f") == 0 || strcmp(value, "d") == 0)) {
+            query.type = value[0];
+        } else if (strcmp(args[i], "-size") == 0) {
+            int skip = parse_comparison(value, &query.size_cmp);
+            long long size = parse_size(value + skip);
+            if (size < 0 && strcmp(value + skip, "0") != 0) {
+                fprintf(stderr, "find Error: Invalid size '%s'.\n", value);
+                return -1;
+            }
+            query.size = size < 0 ? 0 : (uint64_t)size;
+        } else if (strcmp(args[i], "-mtime") == 0) {
+            int skip = parse_comparison(value, &query.mtime_cmp);
+            query.mtime_days = strtoll(value + skip, NULL, 10);
+        } else {
+            fprintf(stderr, "find Error: Unknown option '%s'.\n", args[i]);
+            return -1;
+        }
+        i++;
+    }
+
+    uint32_t dir_inode_num;
+    if (lookup_directory(ctx, path, &dir_inode_num) != 0) return -1;
+
+    pthread_mutex_init(&query.lock, NULL);
+    int result = ibfs_walk(ctx, dir_inode_num, path, threads, find_callback, &query);
+    pthread_mutex_destroy(&query.lock);
+    if (query.failed) {
+        fprintf(stderr, "find Error: Out of memory collecting matches.\n");
+        result = -1;
+    }
+
+    qsort(query.matches, query.match_count, sizeof(char*), compare_strings);
+    for (uint32_t i = 0; i < query.match_count; i++) {
+        if (result == 0) printf("%s\n", query.matches[i]);
+        free(query.matches[i]);
+    }
+    free(query.matches);
+    return result;
+}
+
+typedef struct TreeItem {
+    char* path;
+    uint32_t depth;
+    bool is_dir;
+} TreeItem;
+
+typedef struct TreeList {
+    pthread_mutex_t lock;
+    TreeItem* items;
+    uint32_t count;
+    uint32_t capacity;
+    int failed;
+} TreeList;
+
+static void tree_callback(const WalkEntry* entry, void* user_data) {
+    TreeList* list = (TreeList*)user_data;
+    char* copy = malloc(strlen(entry->path) + 1);
+    pthread_mutex_lock(&list->lock);
+    if (!copy || grow_array((void**)&list->items, &list->capacity, list->count + 1, sizeof(TreeItem)) != 0) {
+        list->failed = 1;
+        free(copy);
+    } else {
+        strcpy(copy, entry->path);
+        list->items[list->count].path = copy;
+        list->items[list->count].depth = entry->depth;
+        list->items[list->count].is_dir = (entry->inode.mode & S_IFDIR) == S_IFDIR;
+        list->count++;
+    }
+    pthread_mutex_unlock(&list->lock);
+}
+
+static int tree_compare(const void* a, const void* b) {
+    const unsigned char* x = (const unsigned char*)((const TreeItem*)a)->path;
+    const unsigned char* y = (const unsigned char*)((const TreeItem*)b)->path;
+    while (*x && *x == *y) { x++; y++; }
+    /* Order '/' before any other character so children follow their parent. */
+    int cx = *x == '/' ? 1 : (*x ? *x + 1 : 0);
+    int cy = *y == '/' ? 1 : (*y ? *y + 1 : 0);
+    return cx - cy;
+}
+
+static int ibfs_tree(IBFS_Context* ctx, const char* path, int threads) {
+    uint32_t dir_inode_num;
+    if (lookup_directory(ctx, path, &dir_inode_num) != 0) return -1;
+
+    TreeList list;
+    memset(&list, 0, sizeof(TreeList));
+    pthread_mutex_init(&list.lock, NULL);
+    int result = ibfs_walk(ctx, dir_inode_num, path, threads, tree_callback, &list);
+    pthread_mutex_destroy(&list.lock);
+    if (list.failed) {
+        fprintf(stderr, "tree Error: Out of memory collecting entries.\n");
+        result = -1;
+    }
+
+    qsort(list.items, list.count, sizeof(TreeItem), tree_compare);
+    uint32_t dirs = 0;
+    if (result == 0) printf("%s\n", path);
+    for (uint32_t i = 0; i < list.count; i++) {
+        if (result == 0) {
+            const char* base = strrchr(list.items[i].path, '/') + 1;
+            printf("%*s%s%s\n", (int)(list.items[i].depth * 2), "", base, list.items[i].is_dir ? "/" : "");
+        }
+        if (list.items[i].is_dir) dirs++;
+        free(list.items[i].path);
+    }
+    if (result == 0) printf("%u directories, %u files\n", dirs, list.count - dirs);
+    free(list.items);
+    return result;
+}
+
+typedef struct BlockList {
+    uint32_t* items;
+    uint32_t count;
+    uint32_t capacity;
+    int failed;
+} BlockList;
+
+typedef struct RmCollect {
+    pthread_mutex_t lock;
+    BPlusTreeKey* keys;
+    uint32_t key_count;
+    uint32_t key_capacity;
+    uint32_t* inodes;
+    uint32_t inode_capacity;
+    BlockList blocks;
+    int failed;
+} RmCollect;
+
+static void rm_collect_block(uint32_t block_num, void* user_data) {
+    BlockList* list = (BlockList*)user_data;
+    if (grow_array((void**)&list->items, &list->capacity, list->count + 1, sizeof(uint32_t)) != 0) {
+        list->failed = 1;
+        return;
+    }
+    list->items[list->count++] = block_num;
+}
+
+static void rm_callback(const WalkEntry* entry, void* user_data) {
+    RmCollect* rm = (RmCollect*)user_data;
+    Inode inode = entry->inode;
+    BlockList blocks;
+    memset(&blocks, 0, sizeof(BlockList));
+    if (file_for_each_block(entry->ctx, &inode, rm_collect_block, &blocks) != 0) blocks.failed = 1;
+
+    pthread_mutex_lock(&rm->lock);
+    if (blocks.failed ||
+        grow_array((void**)&rm->keys, &rm->key_capacity, rm->key_count + 1, sizeof(BPlusTreeKey)) != 0 ||
+        grow_array((void**)&rm->inodes, &rm->inode_capacity, rm->key_count + 1, sizeof(uint32_t)) != 0 ||
+        grow_array((void**)&rm->blocks.items, &rm->blocks.capacity, rm->blocks.count + blocks.count, sizeof(uint32_t)) != 0) {
+        rm->failed = 1;
+    } else {
+        rm->keys[rm->key_count] = entry->key;
+        rm->inodes[rm->key_count] = entry->inode_num;
+        rm->key_count++;
+        memcpy(rm->blocks.items + rm->blocks.count, blocks.items, blocks.count * sizeof(uint32_t));
+        rm->blocks.count += blocks.count;
+    }
+    pthread_mutex_unlock(&rm->lock);
+    free(blocks.items);
+}
 
+static int ibfs_rm_recursive(IBFS_FS* fs, const char* path, int threads) {
+    IBFS_Context* ctx = ibfs_fs_context(fs);
+    uint32_t parent_inode_num, target_inode_num;
+    char name[MAX_FILENAME_LENGTH];
+    BPlusTreeKey target_key;
     Inode target_inode;
-    if (inode_read(ctx, target_inode_num, &target_inode) != 0) {
-        fprintf(stderr, "rm Error: Failed to read inode %u for '%s'.\n", target_inode_num, name);
+    if (path_lookup_parent(ctx, path, &parent_inode_num, name) != 0) return -1;
+    path_make_key(&target_key, parent_inode_num, name);
+    if (bpt_search(ctx, ctx->sb.root_bpt_block, &target_key, &target_inode_num) != 0) {
+        fprintf(stderr, "rm Error: '%s' not found.\n", path);
         return -1;
     }
-    if ((target_inode.mode & S_IFDIR) == S_IFDIR) {
-        fprintf(stderr, "rm Error: '%s' is a directory. Use rmdir.\n", name);
+    if (inode_read(ctx, target_inode_num, &target_inode) != 0) return -1;
+    if ((target_inode.mode & S_IFDIR) != S_IFDIR) return ibfs_fs_unlink(fs, path) == 0 ? 0 : tool_fail("rm", path);
+
+    RmCollect rm;
+    memset(&rm, 0, sizeof(RmCollect));
+    pthread_mutex_init(&rm.lock, NULL);
+    printf("Scanning '%s' with %d threads...\n", path, threads);
+    int result = ibfs_walk(ctx, target_inode_num, path, threads, rm_callback, &rm);
+    pthread_mutex_destroy(&rm.lock);
+    if (result == 0 && (rm.failed ||
+        grow_array((void**)&rm.keys, &rm.key_capacity, rm.key_count + 1, sizeof(BPlusTreeKey)) != 0 ||
+        grow_array((void**)&rm.inodes, &rm.inode_capacity, rm.key_count + 1, sizeof(uint32_t)) != 0)) {
+        fprintf(stderr, "rm Error: Out of memory collecting entries.\n");
+        result = -1;
+    }
+    if (result != 0) {
+        fprintf(stderr, "rm Error: Scan failed, nothing was removed.\n");
+        goto out;
+    }
+    rm.keys[rm.key_count] = target_key;
+    rm.inodes[rm.key_count] = target_inode_num;
+    rm.key_count++;
+
+    printf("Removing %u entries...\n", rm.key_count);
+    uint32_t old_bpt_root = ctx->sb.root_bpt_block;
+    uint32_t deleted;
+    if (bpt_delete_batch(ctx, &ctx->sb.root_bpt_block, rm.keys, rm.key_count, &deleted) != 0) {
+        fprintf(stderr, "rm Error: Failed to delete entries from B+ Tree.\n");
+        result = -1;
+        goto out;
+    }
+    if (deleted != rm.key_count) {
+        fprintf(stderr, "Warning: Only %u of %u entries were found in the B+ Tree.\n", deleted, rm.key_count);
+    }
+    if (ctx->sb.root_bpt_block != old_bpt_root && write_superblock(ctx) != 0) {
+        fprintf(stderr, "rm Error: Failed to update superblock.\n");
+        result = -1;
+        goto out;
+    }
+    if (name_index_delete_batch(ctx, rm.keys, rm.key_count) != 0) result = -1;
+
+    printf("Freeing %u blocks and %u inodes...\n", rm.blocks.count, rm.key_count);
+    if (file_unref_blocks(ctx, rm.blocks.items, rm.blocks.count) != 0 ||
+        free_inode_nums(ctx, rm.inodes, rm.key_count) != 0) {
+        fprintf(stderr, "Warning: Some blocks or inodes could not be freed, run fsck.\n");
+    }
+
+    BPlusTreeStats stats;
+    if (bpt_stats(ctx, ctx->sb.root_bpt_block, &stats) == 0 && stats.leaf_nodes > 1 &&
+        stats.entries * 2 < (uint64_t)stats.leaf_nodes * bpt_order(ctx)) {
+        printf("Directory tree is less than half full, rebuilding...\n");
+        if (ibfs_defrag(ctx, 100) != 0) fprintf(stderr, "Warning: Rebuild failed, tree left as is.\n");
+    }
+
+out:
+    free(rm.keys);
+    free(rm.inodes);
+    free(rm.blocks.items);
+    return result;
+}
+
+/* The clone gets its own inode with the source's block pointers; blocks are copied on the first write to either file. */
+static int ibfs_clone(IBFS_Context* ctx, const char* src_path, const char* dst_path) {
+    uint32_t src_inode_num, parent_inode_num, found_inode;
+    char name[MAX_FILENAME_LENGTH];
+    Inode clone_inode;
+    if (path_lookup(ctx, src_path, &src_inode_num) != 0 || inode_read(ctx, src_inode_num, &clone_inode) != 0) return -1;
+    if ((clone_inode.mode & S_IFDIR) == S_IFDIR) {
+        fprintf(stderr, "clone Error: '%s' is a directory.\n", src_path);
+        return -1;
+    }
+    if (path_lookup_parent(ctx, dst_path, &parent_inode_num, name) != 0) return -1;
+    if (strlen(name) == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "clone Error: Invalid file name '%s'.\n", name);
+        return -1;
+    }
+    BPlusTreeKey key;
+    path_make_key(&key, parent_inode_num, name);
+    if (bpt_search(ctx, ctx->sb.root_bpt_block, &key, &found_inode) == 0) {
+        fprintf(stderr, "clone Error: '%s' already exists.\n", dst_path);
         return -1;
     }
 
-    printf("Deleting entry '%s' from parent inode %u...\n", name, parent_inode_num);
+    int new_inode_num = alloc_inode_num(ctx);
+    if (new_inode_num < 0) return -1;
+    clone_inode.links_count = 1;
+    inode_now(&clone_inode.ctime);
+    if (file_share_blocks(ctx, &clone_inode) != 0) {
+        fprintf(stderr, "clone Error: Failed to share the blocks of '%s'.\n", src_path);
+        free_inode_num(ctx, new_inode_num);
+        return -1;
+    }
     uint32_t old_bpt_root = ctx->sb.root_bpt_block;
-    if (bpt_delete(ctx, &ctx->sb.root_bpt_block, &search_key) != 0) {
-        fprintf(stderr, "rm Error: Failed to delete entry from B+ Tree.\n");
+    if (inode_write(ctx, new_inode_num, &clone_inode) != 0 ||
+        bpt_insert(ctx, &ctx->sb.root_bpt_block, &key, new_inode_num) != 0) {
+        fprintf(stderr, "clone Error: Failed to create '%s'.\n", dst_path);
+        file_free_blocks(ctx, &clone_inode);
+        free_inode_num(ctx, new_inode_num);
+        return -1;
+    }
+    if (ctx->sb.root_bpt_block != old_bpt_root && write_superblock(ctx) != 0) {
+        fprintf(stderr, "clone Error: Failed to update superblock.\n");
         return -1;
     }
-     printf("B+ Tree entry deleted.\n");
+    if (name_index_insert(ctx, &key, new_inode_num) != 0) return -1;
+    printf("Cloned inode %u to inode %d (%llu bytes shared).\n", src_inode_num, new_inode_num,
+           (unsigned long long)clone_inode.size);
+    return 0;
+}
+
+static int ibfs_compress(IBFS_Context* ctx, const char* path, bool compress) {
+    uint32_t inode_num;
+    Inode inode;
+    if (path_lookup(ctx, path, &inode_num) != 0 || inode_read(ctx, inode_num, &inode) != 0) return -1;
+    uint64_t before = 0, after = 0;
+    if (file_for_each_block(ctx, &inode, du_count_block, &before) != 0) return -1;
+    if (file_set_compressed(ctx, inode_num, &inode, compress) != 0) {
+        fprintf(stderr, "%s Error: Failed to convert '%s'.\n", compress ? "compress" : "decompress", path);
+        return -1;
+    }
+    if (file_for_each_block(ctx, &inode, du_count_block, &after) != 0) return -1;
+    printf("%s: %llu bytes, %llu -> %llu blocks.\n", path, (unsigned long long)inode.size,
+           (unsigned long long)before, (unsigned long long)after);
+    return 0;
+}
+
+static int ibfs_truncate(IBFS_Context* ctx, const char* path, uint64_t size) {
+    uint32_t inode_num;
+    Inode inode;
+    if (path_lookup(ctx, path, &inode_num) != 0 || inode_read(ctx, inode_num, &inode) != 0) return -1;
+    uint64_t before = 0, after = 0;
+    if (file_for_each_block(ctx, &inode, du_count_block, &before) != 0) return -1;
+    if (file_truncate(ctx, inode_num, &inode, size) != 0) {
+        fprintf(stderr, "truncate Error: Failed to truncate '%s'.\n", path);
+        return -1;
+    }
+    if (file_for_each_block(ctx, &inode, du_count_block, &after) != 0) return -1;
+    printf("%s: %llu bytes, %llu -> %llu blocks.\n", path, (unsigned long long)inode.size,
+           (unsigned long long)before, (unsigned long long)after);
+    return 0;
+}
+
+static int ibfs_preallocate(IBFS_Context* ctx, const char* path, uint64_t offset, uint64_t length) {
+    uint32_t inode_num;
+    Inode inode;
+    if (path_lookup(ctx, path, &inode_num) != 0 || inode_read(ctx, inode_num, &inode) != 0) return -1;
+    uint64_t before = 0, after = 0;
+    if (file_for_each_block(ctx, &inode, du_count_block, &before) != 0) return -1;
+    if (file_preallocate(ctx, inode_num, &inode, offset, length, false) != 0) {
+        fprintf(stderr, "preallocate Error: Failed to preallocate '%s'.\n", path);
+        return -1;
+    }
+    if (file_for_each_block(ctx, &inode, du_count_block, &after) != 0) return -1;
+    printf("%s: %llu bytes, %llu -> %llu blocks.\n", path, (unsigned long long)inode.size,
+           (unsigned long long)before, (unsigned long long)after);
+    return 0;
+}
+
+typedef struct MapState {
+    uint32_t block_size;
+    uint64_t next;
+    uint64_t extents;
+    uint64_t blocks;
+} MapState;
+
+static void map_print_extent(uint64_t logical, uint32_t block_num, uint32_t count, void* user_data) {
+    MapState* map = (MapState*)user_data;
+    if (logical > map->next) {
+        printf("  %10llu..%-10llu hole\n", (unsigned long long)map->next, (unsigned long long)logical - 1);
+    }
+    printf("  %10llu..%-10llu blocks %u..%u\n", (unsigned long long)logical, (unsigned long long)(logical + count - 1),
+           block_num, block_num + count - 1);
+    map->next = logical + count;
+    map->extents++;
+    map->blocks += count;
+}
 
-    if (ctx->sb.root_bpt_block != old_bpt_root) {
-        printf("B+ Tree root changed, updating superblock...\n");
-        if (fseek(ctx->disk_file, 0, SEEK_SET) != 0) { perror("rm Error: Seek superblock"); return -1;}
-        if (fwrite(&ctx->sb, sizeof(Superblock), 1, ctx->disk_file) != 1) { perror("rm Error: Write superblock"); return -1;}
-        printf("Superblock updated.\n");
+/* Lists the file's logical blocks as extents and holes, like filefrag -v. */
+static int ibfs_map(IBFS_Context* ctx, const char* path) {
+    uint32_t inode_num;
+    Inode inode;
+    if (path_lookup(ctx, path, &inode_num) != 0 || inode_read(ctx, inode_num, &inode) != 0) return -1;
+    if (inode.flags & IBFS_INODE_INLINE) {
+        printf("%s: %llu bytes stored in the inode.\n", path, (unsigned long long)inode.size);
+        return 0;
     }
+    MapState map = { ctx->sb.block_size, 0, 0, 0 };
+    uint64_t total = (inode.size + ctx->sb.block_size - 1) / ctx->sb.block_size;
+    printf("%s: %llu bytes, %llu logical blocks%s\n", path, (unsigned long long)inode.size, (unsigned long long)total,
+           (inode.flags & IBFS_INODE_COMPRESSED) ? ", compressed" : "");
+    if (file_for_each_extent(ctx, &inode, map_print_extent, &map) != 0) return -1;
+    if (map.next < total) {
+        printf("  %10llu..%-10llu hole\n", (unsigned long long)map.next, (unsigned long long)total - 1);
+    }
+    printf("%llu extents, %llu blocks allocated.\n", (unsigned long long)map.extents, (unsigned long long)map.blocks);
+    return 0;
+}
+
+typedef struct BenchKeys {
+    pthread_mutex_t lock;
+    BPlusTreeKey* items;
+    uint32_t count;
+    uint32_t capacity;
+    int failed;
+} BenchKeys;
+
+static void bench_callback(const WalkEntry* entry, void* user_data) {
+    BenchKeys* keys = (BenchKeys*)user_data;
+    pthread_mutex_lock(&keys->lock);
+    if (grow_array((void**)&keys->items, &keys->capacity, keys->count + 1, sizeof(BPlusTreeKey)) != 0) keys->failed = 1;
+    else keys->items[keys->count++] = entry->key;
+    pthread_mutex_unlock(&keys->lock);
+}
 
-    printf("Freeing data blocks for inode %u...\n", target_inode_num);
-    for (int i = 0; i < 12; i++) {
-        if (target_inode.direct_blocks[i] != 0) {
-            printf("  - Freeing block %u\n", target_inode.direct_blocks[i]);
-            free_data_block(ctx, target_inode.direct_blocks[i]);
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* One round looks up every key and reads its inode, like a stat of every path. */
+static double bench_round(IBFS_Context* ctx, BenchKeys* keys, bool verify) {
+    ctx->skip_checksums = !verify;
+    double start = bench_now();
+    for (uint32_t i = 0; i < keys->count; i++) {
+        uint32_t inode_num;
+        Inode inode;
+        if (bpt_search(ctx, ctx->sb.root_bpt_block, &keys->items[i], &inode_num) != 0 ||
+            inode_read(ctx, inode_num, &inode) != 0) {
+            keys->failed = 1;
         }
     }
+    ctx->skip_checksums = false;
+    return bench_now() - start;
+}
 
-    printf("Freeing inode %u...\n", target_inode_num);
-    free_inode_num(ctx, target_inode_num);
+static int bench_compare_times(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
 
+/*
+ * Runs verified and unverified rounds in turn, so that drift in the speed of the machine hits
+ * both modes alike, and compares the median round of each. A cold round starts from an empty
+ * cache, as a freshly started command would, so every block it needs comes from the device.
+ */
+static int bench_compare(IBFS_Context* ctx, BenchKeys* keys, uint32_t rounds, bool cold, const char* label) {
+    double* times = malloc(2 * (size_t)rounds * sizeof(double));
+    if (!times) return -1;
+    meta_cache_reset(ctx);
+    for (uint32_t i = 0; i < rounds; i++) {
+        for (int run = 0; run < 2; run++) {
+            /* The first round of a pair measures a little slower whatever its mode, so the modes take turns. */
+            bool verify = (run == 0) == (i % 2 == 0);
+            if (cold) meta_cache_reset(ctx);
+            times[(verify ? 0 : rounds) + i] = bench_round(ctx, keys, verify);
+        }
+    }
+    meta_cache_reset(ctx);
+    qsort(times, rounds, sizeof(double), bench_compare_times);
+    qsort(times + rounds, rounds, sizeof(double), bench_compare_times);
+    double verified = times[rounds / 2], unverified = times[rounds + rounds / 2];
+    printf("  %s: %10.0f lookups/s verified, %10.0f skipped, overhead %6.2f%%\n", label,
+           keys->count / verified, keys->count / unverified, (verified - unverified) / unverified * 100.0);
+    free(times);
     return 0;
 }
 
+static int ibfs_bench(IBFS_Context* ctx, uint32_t rounds) {
+    BenchKeys keys;
+    memset(&keys, 0, sizeof(BenchKeys));
+    pthread_mutex_init(&keys.lock, NULL);
+    int result = ibfs_walk(ctx, ctx->sb.root_inode, "/", 1, bench_callback, &keys);
+    pthread_mutex_destroy(&keys.lock);
+    if (result != 0 || keys.failed || keys.count == 0) {
+        fprintf(stderr, "bench Error: %s.\n", keys.count == 0 && result == 0 ? "The image has no entries to look up" : "Failed to collect entries");
+        free(keys.items);
+        return -1;
+    }
+
+    char block_buffer[ctx->sb.block_size];
+    memset(block_buffer, 0x5A, ctx->sb.block_size);
+    uint32_t crc_blocks = 20000;
+    double start = bench_now();
+    uint32_t sink = 0;
+    for (uint32_t i = 0; i < crc_blocks; i++) sink += crc32c(i, block_buffer, ctx->sb.block_size);
+    double crc_time = bench_now() - start;
+    printf("crc32c (%s): %.0f MB/s on %u-byte blocks [%08x]\n", crc32c_implementation(),
+           (double)crc_blocks * ctx->sb.block_size / crc_time / 1e6, ctx->sb.block_size, sink);
+
+    printf("Lookups: %u entries, median of %u rounds per mode\n", keys.count, rounds);
+    if (bench_compare(ctx, &keys, rounds, false, "warm cache") != 0 ||
+        bench_compare(ctx, &keys, rounds, true, "cold cache") != 0) {
+        result = -1;
+    }
+    if (keys.failed) {
+        fprintf(stderr, "bench Error: Some lookups failed.\n");
+        result = -1;
+    }
+    free(keys.items);
+    return result;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr, "Usage: %s <disk_filename> <command> [path]\n", argv[0]);
-        fprintf(stderr, "Commands: ls, mkdir, rmdir, rm, test\n");
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <disk_filename> <command> [path] [path]\n", argv[0]);
+        fprintf(stderr, "Commands: ls [path[/prefix*]] [limit] [after], mkdir, rmdir, rm [-r], cp_in <host_path|-> <path> [size], import <host_dir> <dir>, cp_out <path> <host_path>, cat <path>, grow <new_size>, defrag [fill%%], fsck [-y] [-jN], df, test\n");
+        fprintf(stderr, "          du [path], tree [path], find <path> [-name pattern] [-type f|d] [-size [+-]N] [-mtime [+-]days]\n");
+        fprintf(stderr, "          clone <path> <new_path>, snapshot create|delete|restore <name>, snapshot list, dedup [on|off], name_index on|off|rebuild\n");
+        fprintf(stderr, "          compress on|off, compress <path>, decompress <path>, bench [rounds], replay <trace_file>\n");
+        fprintf(stderr, "          truncate <path> <size>, preallocate <path> <length> [offset], map <path>, stat <path>\n");
+        fprintf(stderr, "<disk_filename>@<snapshot> opens a snapshot read-only.\n");
+        fprintf(stderr, "IBFS_BACKEND=file|direct|memory|ram picks the block device backend; memory discards all changes.\n");
+        fprintf(stderr, "ram keeps the image in memory and writes dirty blocks back on exit, and at sync points at most every IBFS_SYNC_CHECKPOINT seconds.\n");
+        fprintf(stderr, "IBFS_TRACE=<file> appends a trace of every block read and write to the file.\n");
+        fprintf(stderr, "IBFS_META_CACHE=<blocks> sizes the metadata cache (default %u, 0 for none), e.g. to replay a trace against it.\n",
+                IBFS_META_CACHE_BLOCKS);
+        fprintf(stderr, "IBFS_TIMING=1 ends stderr with the mount, command and unmount times in milliseconds.\n");
         return 1;
     }
     const char* disk_path = argv[1];
+    char disk_path_buf[4096];
+    const char* snapshot_name = NULL;
+    const char* at = strrchr(disk_path, '@');
+    FILE* probe = fopen(disk_path, "rb");
+    if (probe) {
+        fclose(probe);
+    } else if (at && at[1] != '\0' && (size_t)(at - disk_path) < sizeof(disk_path_buf)) {
+        memcpy(disk_path_buf, disk_path, (size_t)(at - disk_path));
+        disk_path_buf[at - disk_path] = '\0';
+        disk_path = disk_path_buf;
+        snapshot_name = at + 1;
+    }
     const char* command = argv[2];
-    const char* path_arg = (argc == 4) ? argv[3] : NULL;
+    const char* path_arg = (argc >= 4) ? argv[3] : NULL;
+    const char* path_arg2 = (argc >= 5) ? argv[4] : NULL;
+    bool quiet = (strcmp(command, "cat") == 0 || strcmp(command, "find") == 0 || strcmp(command, "tree") == 0);
+
+    IBFS_Backend backend = IBFS_BACKEND_FILE;
+    const char* backend_name = getenv("IBFS_BACKEND");
+    if (backend_name && backend_name[0] && device_parse_backend(backend_name, &backend) != 0) {
+        fprintf(stderr, "Error: Unknown backend '%s' in IBFS_BACKEND (file, direct, memory or ram).\n", backend_name);
+        return 1;
+    }
 
-    IBFS_Context ctx;
-    memset(&ctx, 0, sizeof(IBFS_Context));
+    const char* timing = getenv("IBFS_TIMING");
+    double mount_start = bench_now();
 
-    if (ibfs_mount(disk_path, &ctx) != 0) {
+    IBFS_FS* fs = ibfs_fs_mount(disk_path, backend);
+    if (!fs) {
         fprintf(stderr, "Failed to mount filesystem '%s'.\n", disk_path);
         return 1;
     }
-    printf("File system '%s' mounted successfully.\n", disk_path);
+    IBFS_Context* ctx = ibfs_fs_context(fs);
+    if (snapshot_name && snapshot_open(ctx, snapshot_name) != 0) {
+        ibfs_fs_unmount(fs);
+        return 1;
+    }
+    const char* checkpoint_seconds = getenv("IBFS_SYNC_CHECKPOINT");
+    if (checkpoint_seconds && checkpoint_seconds[0] &&
+        device_set_sync_checkpoint_interval(ctx->device, (unsigned)strtoul(checkpoint_seconds, NULL, 10)) != 0) {
+        ibfs_fs_unmount(fs);
+        return 1;
+    }
+    const char* cache_blocks = getenv("IBFS_META_CACHE");
+    if (cache_blocks && cache_blocks[0]) {
+        meta_cache_free(ctx);
+        meta_cache_init(ctx, (uint32_t)strtoul(cache_blocks, NULL, 10));
+    }
+    const char* trace_path = getenv("IBFS_TRACE");
+    if (trace_path && trace_path[0] && strcmp(command, "replay") != 0 && trace_open(ctx, trace_path) != 0) {
+        ibfs_fs_unmount(fs);
+        return 1;
+    }
+    if (!quiet) printf("File system '%s' mounted successfully%s.\n", disk_path, snapshot_name ? " (read-only snapshot)" : "");
     int result = 0;
+    double command_start = bench_now();
 
     if (strcmp(command, "ls") == 0) {
         const char* ls_path = path_arg ? path_arg : "/";
+        uint32_t limit = path_arg2 ? (uint32_t)strtoul(path_arg2, NULL, 10) : 0;
         printf("--- Listing directory: %s ---\n", ls_path);
-        uint32_t target_inode_num;
-        if (strcmp(ls_path, "/") == 0) {
-            target_inode_num = ctx.sb.root_inode;
-        } else {
-            fprintf(stderr, "Error: Path resolution not implemented. Only '/' supported for ls.\n");
-            result = 1;
-        }
-        if (result == 0) {
-            printf("Type Lnk      Size Mod Time        Name\n");
-            printf("---- --- ---------- --------------- --------\n");
-            if (bpt_iterate(&ctx, ctx.sb.root_bpt_block, target_inode_num, print_entry_callback, &ctx) != 0) {
-                 result = 1;
-            }
-        }
+        if (ibfs_ls(ctx, ls_path, limit, argc >= 6 ? argv[5] : NULL) != 0) result = 1;
         printf("--- ls Complete ---\n");
 
     } else if (strcmp(command, "mkdir") == 0) {
         if (!path_arg) { fprintf(stderr, "mkdir Error: Path argument required.\n"); result = 1; }
         else {
             printf("--- Attempting to create directory: %s ---\n", path_arg);
-            if (path_arg[0] != '/' || strcmp(path_arg, "/") == 0 || strchr(path_arg + 1, '/') != NULL) {
-                 fprintf(stderr, "Error: Invalid path. Only /dirname supported.\n");
-                 result = 1;
-             } else {
-                const char* new_dir_name = path_arg + 1;
-                if (ibfs_mkdir(&ctx, ctx.sb.root_inode, new_dir_name) != 0) {
-                    result = 1;
-                } else {
-                    printf("Directory '%s' created successfully.\n", path_arg);
-                }
+            if (ibfs_fs_mkdir(fs, path_arg) != 0) {
+                tool_fail("mkdir", path_arg);
+                result = 1;
+            } else {
+                printf("Directory '%s' created successfully.\n", path_arg);
             }
-             printf("--- mkdir Complete ---\n");
+            printf("--- mkdir Complete ---\n");
         }
 
     } else if (strcmp(command, "rmdir") == 0) {
          if (!path_arg) { fprintf(stderr, "rmdir Error: Path argument required.\n"); result = 1; }
          else {
             printf("--- Attempting to remove directory: %s ---\n", path_arg);
-            if (path_arg[0] != '/' || strcmp(path_arg, "/") == 0 || strchr(path_arg + 1, '/') != NULL) {
-                 fprintf(stderr, "Error: Invalid path. Only /dirname supported.\n");
-                 result = 1;
-             } else {
-                const char* dir_name = path_arg + 1;
-                if (ibfs_rmdir(&ctx, ctx.sb.root_inode, dir_name) != 0) {
-                    result = 1;
-                }
+            if (ibfs_fs_rmdir(fs, path_arg) != 0) {
+                tool_fail("rmdir", path_arg);
+                result = 1;
+            } else {
+                printf("Directory '%s' removed successfully.\n", path_arg);
+            }
+            printf("--- rmdir Complete ---\n");
+         }
+
+    } else if (strcmp(command, "rm") == 0 && path_arg && strcmp(path_arg, "-r") == 0) {
+         if (!path_arg2) { fprintf(stderr, "rm Error: Path argument required.\n"); result = 1; }
+         else {
+            printf("--- Removing recursively: %s ---\n", path_arg2);
+            if (ibfs_rm_recursive(fs, path_arg2, default_thread_count()) != 0) {
+                result = 1;
             }
-             printf("--- rmdir Complete ---\n");
+            printf("--- rm Complete ---\n");
          }
 
     } else if (strcmp(command, "rm") == 0) {
          if (!path_arg) { fprintf(stderr, "rm Error: Path argument required.\n"); result = 1; }
          else {
             printf("--- Attempting to remove file: %s ---\n", path_arg);
-            if (path_arg[0] != '/' || strcmp(path_arg, "/") == 0 || strchr(path_arg + 1, '/') != NULL) {
-                 fprintf(stderr, "Error: Invalid path. Only /filename supported.\n");
+            if (ibfs_fs_unlink(fs, path_arg) != 0) {
+                tool_fail("rm", path_arg);
+                result = 1;
+            } else {
+                printf("File '%s' removed successfully.\n", path_arg);
+            }
+            printf("--- rm Complete ---\n");
+         }
+
+    } else if (strcmp(command, "cp_in") == 0) {
+         if (!path_arg || !path_arg2) { fprintf(stderr, "cp_in Error: Host path and IBFS path required.\n"); result = 1; }
+         else {
+            printf("--- Copying host file %s to %s ---\n", path_arg, path_arg2);
+            /* A destination that is an existing directory, or ends in '/', receives the host file under its own name. */
+            char dir_path[4096], dest_path[4096];
+            size_t length = strlen(path_arg2);
+            IBFS_Stat st;
+            bool into_dir = path_arg2[length - 1] == '/' || (ibfs_fs_stat(fs, path_arg2, &st) == 0 && (st.mode & S_IFDIR) == S_IFDIR);
+            const char* base = strrchr(path_arg, '/');
+            const char* base_win = strrchr(path_arg, '\\');
+            if (base_win && (!base || base_win > base)) base = base_win;
+            base = base ? base + 1 : path_arg;
+            const char* slash = strrchr(path_arg2, '/');
+            if (length >= sizeof(dir_path) || (into_dir && length + 1 + strlen(base) >= sizeof(dest_path))) {
+                fprintf(stderr, "cp_in Error: Path '%s' is too long.\n", path_arg2);
+                result = 1;
+            } else if (into_dir && strcmp(path_arg, "-") == 0) {
+                fprintf(stderr, "Error: A file name is required when copying from standard input.\n");
+                result = 1;
+            } else if (into_dir && strlen(base) >= MAX_FILENAME_LENGTH) {
+                fprintf(stderr, "Error: Host file name '%s' is too long.\n", base);
+                result = 1;
+            } else if (into_dir) {
+                snprintf(dir_path, sizeof(dir_path), "%s", path_arg2);
+                snprintf(dest_path, sizeof(dest_path), "%.*s/%s", (int)(path_arg2[length - 1] == '/' ? length - 1 : length), path_arg2, base);
+            } else {
+                snprintf(dest_path, sizeof(dest_path), "%s", path_arg2);
+                snprintf(dir_path, sizeof(dir_path), "%.*s", slash && slash != path_arg2 ? (int)(slash - path_arg2) : 1, path_arg2);
+            }
+            long long expected_size = (argc >= 6) ? strtoll(argv[5], NULL, 10) : -1;
+            if (result == 0 && ibfs_cp_in(fs, path_arg, dir_path, dest_path, expected_size) != 0) {
+                result = 1;
+            } else if (result == 0) {
+                printf("File '%s' created successfully.\n", dest_path);
+            }
+            printf("--- cp_in Complete ---\n");
+         }
+
+    } else if (strcmp(command, "import") == 0) {
+         uint32_t dest_inode_num;
+         if (!path_arg || !path_arg2) { fprintf(stderr, "import Error: Host directory and IBFS directory required.\n"); result = 1; }
+         else if (lookup_directory(ctx, path_arg2, &dest_inode_num) != 0) result = 1;
+         else {
+            printf("--- Importing host directory %s to %s ---\n", path_arg, path_arg2);
+            if (ibfs_import(ctx, path_arg, dest_inode_num, default_thread_count()) != 0) result = 1;
+            printf("--- import Complete ---\n");
+         }
+
+    } else if (strcmp(command, "cat") == 0) {
+         if (!path_arg) { fprintf(stderr, "cat Error: Path argument required.\n"); result = 1; }
+         else if (ibfs_cat(fs, "cat", path_arg, stdout) != 0) result = 1;
+
+    } else if (strcmp(command, "cp_out") == 0) {
+         IBFS_Stat st;
+         if (!path_arg || !path_arg2) { fprintf(stderr, "cp_out Error: IBFS path and host path required.\n"); result = 1; }
+         else if (ibfs_fs_stat(fs, path_arg, &st) != 0) result = tool_fail("cp_out", path_arg) != 0;
+         else {
+            printf("--- Copying %s to host file %s ---\n", path_arg, path_arg2);
+            FILE* host_file = fopen(path_arg2, "wb");
+            if (!host_file) {
+                perror("cp_out Error: Opening host file");
+                result = 1;
+            } else {
+                if (ibfs_cat(fs, "cp_out", path_arg, host_file) != 0) result = 1;
+                if (fclose(host_file) != 0) result = 1;
+            }
+            printf("--- cp_out Complete ---\n");
+         }
+
+    } else if (strcmp(command, "grow") == 0) {
+         long long new_size = path_arg ? parse_size(path_arg) : -1;
+         if (new_size <= 0) { fprintf(stderr, "grow Error: New size argument required (e.g. 2G).\n"); result = 1; }
+         else {
+            printf("--- Growing image to %lld bytes ---\n", new_size);
+            if (ibfs_grow(ctx, new_size) != 0) {
+                result = 1;
+            } else {
+                printf("Image now has %u blocks in %u groups.\n", ctx->sb.block_count, bitmap_group_count(ctx));
+            }
+            printf("--- grow Complete ---\n");
+         }
+
+    } else if (strcmp(command, "defrag") == 0) {
+         uint32_t fill_percent = path_arg ? (uint32_t)strtoul(path_arg, NULL, 10) : 100;
+         printf("--- Defragmenting directory tree ---\n");
+         if (ibfs_defrag(ctx, fill_percent) != 0) {
+             result = 1;
+         }
+         printf("--- defrag Complete ---\n");
+
+    } else if (strcmp(command, "clone") == 0) {
+         if (!path_arg || !path_arg2) { fprintf(stderr, "clone Error: Source and destination paths required.\n"); result = 1; }
+         else {
+            printf("--- Cloning %s to %s ---\n", path_arg, path_arg2);
+            if (ibfs_clone(ctx, path_arg, path_arg2) != 0) result = 1;
+            printf("--- clone Complete ---\n");
+         }
+
+    } else if (strcmp(command, "snapshot") == 0) {
+         if (path_arg && strcmp(path_arg, "list") == 0) {
+             if (snapshot_list(ctx) != 0) result = 1;
+         } else if (!path_arg || !path_arg2) {
+             fprintf(stderr, "snapshot Error: Use snapshot create|delete|restore <name> or snapshot list.\n");
+             result = 1;
+         } else {
+            printf("--- snapshot %s %s ---\n", path_arg, path_arg2);
+            if (strcmp(path_arg, "create") == 0) result = snapshot_create(ctx, path_arg2) != 0;
+            else if (strcmp(path_arg, "delete") == 0) result = snapshot_delete(ctx, path_arg2) != 0;
+            else if (strcmp(path_arg, "restore") == 0) result = snapshot_restore(ctx, path_arg2) != 0;
+            else { fprintf(stderr, "snapshot Error: Unknown action '%s'.\n", path_arg); result = 1; }
+            printf("--- snapshot Complete ---\n");
+         }
+
+    } else if (strcmp(command, "dedup") == 0) {
+         if (path_arg && strcmp(path_arg, "on") == 0) {
+             if (dedup_enable(ctx) != 0) result = 1;
+         } else if (path_arg && strcmp(path_arg, "off") == 0) {
+             if (dedup_disable(ctx) != 0) result = 1;
+         } else if (path_arg) {
+             fprintf(stderr, "dedup Error: Unknown option '%s'.\n", path_arg);
+             result = 1;
+         } else {
+            uint32_t freed;
+            printf("--- Deduplicating data blocks ---\n");
+            if (dedup_run(ctx, &freed) != 0) result = 1;
+            printf("%u blocks freed.\n", freed);
+            printf("--- dedup Complete ---\n");
+         }
+
+    } else if (strcmp(command, "name_index") == 0) {
+         if (path_arg && strcmp(path_arg, "on") == 0) {
+             if (name_index_enable(ctx) != 0) result = 1;
+         } else if (path_arg && strcmp(path_arg, "off") == 0) {
+             if (name_index_disable(ctx) != 0) result = 1;
+         } else if (path_arg && strcmp(path_arg, "rebuild") == 0) {
+             if (!(ctx->sb.feature_flags & IBFS_FEATURE_NAME_INDEX)) {
+                 fprintf(stderr, "name_index Error: The name index is not enabled.\n");
                  result = 1;
-             } else {
-                const char* file_name = path_arg + 1;
-                if (ibfs_rm(&ctx, ctx.sb.root_inode, file_name) != 0) {
-                    result = 1;
-                } else {
-                    printf("File '%s' removed successfully.\n", path_arg);
-                }
+             } else if (name_index_rebuild(ctx) != 0) {
+                 result = 1;
+             }
+         } else {
+             fprintf(stderr, "name_index Error: Expected on, off or rebuild.\n");
+             result = 1;
+         }
+
+    } else if (strcmp(command, "compress") == 0 || strcmp(command, "decompress") == 0) {
+         bool compress = strcmp(command, "compress") == 0;
+         if (!path_arg) {
+             fprintf(stderr, "%s Error: Missing path.\n", command);
+             result = 1;
+         } else if (compress && (strcmp(path_arg, "on") == 0 || strcmp(path_arg, "off") == 0)) {
+             if (strcmp(path_arg, "on") == 0) ctx->sb.new_file_flags |= IBFS_INODE_COMPRESSED;
+             else ctx->sb.new_file_flags &= ~IBFS_INODE_COMPRESSED;
+             if (write_superblock(ctx) != 0) result = 1;
+             else printf("New files are %s.\n", strcmp(path_arg, "on") == 0 ? "compressed" : "stored raw");
+         } else {
+             printf("--- %s %s ---\n", compress ? "Compressing" : "Decompressing", path_arg);
+             if (ibfs_compress(ctx, path_arg, compress) != 0) result = 1;
+             printf("--- %s Complete ---\n", command);
+         }
+
+    } else if (strcmp(command, "truncate") == 0) {
+         long long size = path_arg2 ? parse_size(path_arg2) : -1;
+         if (path_arg2 && size < 0 && strcmp(path_arg2, "0") == 0) size = 0;
+         if (!path_arg || size < 0) { fprintf(stderr, "truncate Error: Path and new size required (e.g. 10M).\n"); result = 1; }
+         else {
+            printf("--- Truncating %s to %lld bytes ---\n", path_arg, size);
+            if (ibfs_truncate(ctx, path_arg, (uint64_t)size) != 0) result = 1;
+            printf("--- truncate Complete ---\n");
+         }
+
+    } else if (strcmp(command, "preallocate") == 0) {
+         long long length = path_arg2 ? parse_size(path_arg2) : -1;
+         long long offset = argc >= 6 ? parse_size(argv[5]) : 0;
+         if (argc >= 6 && offset < 0 && strcmp(argv[5], "0") == 0) offset = 0;
+         if (!path_arg || length < 0 || offset < 0) {
+             fprintf(stderr, "preallocate Error: Path, length and optional offset required (e.g. 1G 0).\n");
+             result = 1;
+         } else {
+            printf("--- Preallocating %lld bytes at %lld in %s ---\n", length, offset, path_arg);
+            if (ibfs_preallocate(ctx, path_arg, (uint64_t)offset, (uint64_t)length) != 0) result = 1;
+            printf("--- preallocate Complete ---\n");
+         }
+
+    } else if (strcmp(command, "map") == 0) {
+         if (!path_arg) { fprintf(stderr, "map Error: Path argument required.\n"); result = 1; }
+         else if (ibfs_map(ctx, path_arg) != 0) result = 1;
+
+    } else if (strcmp(command, "stat") == 0) {
+         IBFS_Stat st;
+         if (!path_arg) { fprintf(stderr, "stat Error: Path argument required.\n"); result = 1; }
+         else if (ibfs_fs_stat(fs, path_arg, &st) != 0) result = tool_fail("stat", path_arg) != 0;
+         else {
+            printf("Path: %s\n", path_arg);
+            printf("Type: %s\n", (st.mode & S_IFDIR) == S_IFDIR ? "directory" : "file");
+            printf("Size: %llu\n", (unsigned long long)st.size);
+            printf("Inode: %u\n", st.ino);
+            printf("Links: %u\n", st.links);
+         }
+
+    } else if (strcmp(command, "fsck") == 0 && ctx->read_only) {
+         fprintf(stderr, "fsck Error: Check the image itself, not a snapshot of it.\n");
+         result = 1;
+
+    } else if (strcmp(command, "fsck") == 0) {
+         bool fix = false;
+         int threads = default_thread_count();
+         const char* fsck_args[2] = { path_arg, path_arg2 };
+         for (int i = 0; i < 2; i++) {
+             if (!fsck_args[i]) continue;
+             if (strcmp(fsck_args[i], "-y") == 0) fix = true;
+             else if (strncmp(fsck_args[i], "-j", 2) == 0) threads = atoi(fsck_args[i] + 2);
+             else { fprintf(stderr, "fsck Error: Unknown option '%s'.\n", fsck_args[i]); result = 1; }
+         }
+         if (result == 0) {
+            printf("--- Checking filesystem%s ---\n", fix ? " (repairing)" : "");
+            int problems = ibfs_fsck(ctx, threads, fix);
+            if (problems < 0) {
+                result = 1;
+            } else if (problems > 0) {
+                printf("Filesystem has uncorrected errors.\n");
+                result = 1;
+            } else {
+                printf("Filesystem is clean%s.\n", fix ? " (after repairs)" : "");
             }
-             printf("--- rm Complete ---\n");
+            printf("--- fsck Complete ---\n");
          }
 
+    } else if (strcmp(command, "df") == 0) {
+         uint32_t used_blocks = ctx->sb.block_count - ctx->sb.free_blocks_count;
+         uint32_t used_inodes = ctx->sb.inode_count - ctx->sb.free_inodes_count;
+         printf("--- Disk usage ---\n");
+         printf("Block size: %u\n", ctx->sb.block_size);
+         printf("Blocks: %u total, %u used, %u free (%u%% used)\n", ctx->sb.block_count, used_blocks,
+                ctx->sb.free_blocks_count, (uint32_t)((uint64_t)used_blocks * 100 / ctx->sb.block_count));
+         printf("Inodes: %u total, %u used, %u free (%u%% used)\n", ctx->sb.inode_count, used_inodes,
+                ctx->sb.free_inodes_count, (uint32_t)((uint64_t)used_inodes * 100 / ctx->sb.inode_count));
+         printf("--- df Complete ---\n");
+
+    } else if (strcmp(command, "du") == 0) {
+         const char* du_path = path_arg ? path_arg : "/";
+         printf("--- Disk usage of %s ---\n", du_path);
+         if (ibfs_du(ctx, du_path, default_thread_count()) != 0) {
+             result = 1;
+         }
+         printf("--- du Complete ---\n");
+
+    } else if (strcmp(command, "tree") == 0) {
+         if (ibfs_tree(ctx, path_arg ? path_arg : "/", default_thread_count()) != 0) {
+             result = 1;
+         }
+
+    } else if (strcmp(command, "find") == 0) {
+         if (!path_arg) { fprintf(stderr, "find Error: Path argument required.\n"); result = 1; }
+         else if (ibfs_find(ctx, path_arg, argv + 4, argc - 4, default_thread_count()) != 0) {
+             result = 1;
+         }
+
+    } else if (strcmp(command, "bench") == 0) {
+         int rounds = path_arg ? atoi(path_arg) : 200;
+         if (rounds < 1) {
+             fprintf(stderr, "bench Error: Invalid round count '%s'.\n", path_arg);
+             result = 1;
+         } else {
+            printf("--- Benchmarking metadata lookups ---\n");
+            if (ibfs_bench(ctx, (uint32_t)rounds) != 0) result = 1;
+            printf("--- bench Complete ---\n");
+         }
+
+    } else if (strcmp(command, "replay") == 0) {
+        if (!path_arg) {
+            fprintf(stderr, "replay Error: Missing trace file.\n");
+            result = 1;
+        } else {
+            printf("--- Replaying block trace %s ---\n", path_arg);
+            if (trace_replay(ctx, path_arg) != 0) result = 1;
+            printf("--- replay Complete ---\n");
+        }
+
     } else if (strcmp(command, "test") == 0) {
         printf("--- Running B+ Tree Search Test ---\n");
         BPlusTreeKey search_key;
-        search_key.parent_inode_id = ctx.sb.root_inode;
+        search_key.parent_inode_id = ctx->sb.root_inode;
         search_key.name_hash = hash_name("readme.txt");
         strncpy(search_key.name, "readme.txt", MAX_FILENAME_LENGTH - 1);
         search_key.name[MAX_FILENAME_LENGTH - 1] = '\0';
         uint32_t found_inode;
-        if (bpt_search(&ctx, ctx.sb.root_bpt_block, &search_key, &found_inode) == 0) {
+        if (bpt_search(ctx, ctx->sb.root_bpt_block, &search_key, &found_inode) == 0) {
              printf("TEST SUCCESS: Found 'readme.txt'! Mapped to inode %u\n", found_inode);
              if (found_inode != 1) printf("  - !!! ERROR: Expected inode 1 !!!\n");
         } else {
@@ -359,7 +1370,12 @@ int main(int argc, char *argv[]) {
         result = 1;
     }
 
-    ibfs_unmount(&ctx);
-    printf("Filesystem unmounted.\n");
+    double unmount_start = bench_now();
+    ibfs_fs_unmount(fs);
+    if (!quiet) printf("Filesystem unmounted.\n");
+    if (timing && timing[0]) {
+        fprintf(stderr, "ibfs_timing mount=%.3f op=%.3f unmount=%.3f\n", (command_start - mount_start) * 1e3,
+                (unmount_start - command_start) * 1e3, (bench_now() - unmount_start) * 1e3);
+    }
     return result;
 }
\ No newline at end of file
@@ -0,0 +1,543 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "import.h"
+#include "bplustree.h"
+#include "bitmap.h"
+#include "block.h"
+#include "file.h"
+#include "inode.h"
+#include "io.h"
+#include "nameindex.h"
+#include "path.h"
+
+#define IMPORT_CHUNK_BLOCKS 256
+#define IMPORT_SLOTS_PER_THREAD 4
+#define IMPORT_ROOT UINT32_MAX
+
+typedef struct ImportItem {
+    char* host_path;
+    uint32_t parent;
+    char name[MAX_FILENAME_LENGTH];
+    bool is_dir;
+    uint64_t size;
+    uint32_t mtime;
+} ImportItem;
+
+typedef struct ImportChunk {
+    uint32_t item;
+    uint32_t first_block;
+    uint64_t offset;
+    uint32_t length;
+} ImportChunk;
+
+typedef struct Import {
+    IBFS_Context* ctx;
+    ImportItem* items;
+    uint32_t item_count;
+    uint32_t item_capacity;
+    uint32_t* inode_nums;
+    Inode* inodes;
+    bool inodes_allocated;
+    ImportChunk* chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+    uint32_t goal;
+
+    char* ring;
+    bool* ready;
+    uint32_t slot_count;
+    size_t slot_size;
+    uint32_t next_chunk;
+    uint32_t written;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Import;
+
+static int import_reserve(void** items, uint32_t* capacity, uint32_t needed, size_t item_size) {
+    if (needed <= *capacity) return 0;
+    uint32_t new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed) new_capacity *= 2;
+    void* grown = realloc(*items, (size_t)new_capacity * item_size);
+    if (!grown) return -1;
+    *items = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static int compare_item_names(const void* a, const void* b) {
+    return strcmp(((const ImportItem*)a)->name, ((const ImportItem*)b)->name);
+}
+
+static int import_stat(const char* host_path, struct stat* st) {
+#ifdef _WIN32
+    return stat(host_path, st);
+#else
+    return lstat(host_path, st);
+#endif
+}
+
+static int import_scan_dir(Import* imp, const char* host_dir, uint32_t parent) {
+    DIR* dir = opendir(host_dir);
+    if (!dir) {
+        fprintf(stderr, "import Error: Cannot open host directory '%s': %s\n", host_dir, strerror(errno));
+        return -1;
+    }
+    uint64_t max_size = file_max_size(imp->ctx);
+    uint32_t first = imp->item_count;
+    int result = 0;
+    struct dirent* de;
+
+    while (result == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        size_t length = strlen(host_dir) + strlen(de->d_name) + 2;
+        char* host_path = malloc(length);
+        struct stat st;
+        if (!host_path) {
+            result = -1;
+            break;
+        }
+        snprintf(host_path, length, "%s/%s", host_dir, de->d_name);
+        if (import_stat(host_path, &st) != 0) {
+            fprintf(stderr, "import Error: Cannot stat '%s': %s\n", host_path, strerror(errno));
+            result = -1;
+        } else if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            printf("Skipping '%s' (not a regular file or directory).\n", host_path);
+            free(host_path);
+            continue;
+        } else if (strlen(de->d_name) >= MAX_FILENAME_LENGTH) {
+            fprintf(stderr, "import Error: Name of '%s' is longer than %d characters.\n", host_path, MAX_FILENAME_LENGTH - 1);
+            result = -1;
+        } else if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > max_size) {
+            fprintf(stderr, "import Error: '%s' exceeds the maximum file size of %llu bytes.\n",
+                    host_path, (unsigned long long)max_size);
+            result = -1;
+        } else if (import_reserve((void**)&imp->items, &imp->item_capacity, imp->item_count + 1, sizeof(ImportItem)) != 0) {
+            result = -1;
+        }
+        if (result != 0) {
+            free(host_path);
+            break;
+        }
+
+        ImportItem* item = &imp->items[imp->item_count++];
+        memset(item, 0, sizeof(ImportItem));
+        item->host_path = host_path;
+        item->parent = parent;
+        strcpy(item->name, de->d_name);
+        item->is_dir = S_ISDIR(st.st_mode);
+        item->size = item->is_dir ? 0 : (uint64_t)st.st_size;
+        item->mtime = (uint32_t)st.st_mtime;
+    }
+    closedir(dir);
+    /* Sorted siblings make the layout of an import independent of readdir order. */
+    qsort(imp->items + first, imp->item_count - first, sizeof(ImportItem), compare_item_names);
+    return result;
+}
+
+static int import_add_chunk(Import* imp, uint32_t item, uint32_t first_block, uint64_t offset, uint32_t length) {
+    if (import_reserve((void**)&imp->chunks, &imp->chunk_capacity, imp->chunk_count + 1, sizeof(ImportChunk)) != 0) {
+        fprintf(stderr, "import Error: Out of memory planning chunks.\n");
+        return -1;
+    }
+    ImportChunk* chunk = &imp->chunks[imp->chunk_count++];
+    chunk->item = item;
+    chunk->first_block = first_block;
+    chunk->offset = offset;
+    chunk->length = length;
+    return 0;
+}
+
+static int import_plan_file(Import* imp, uint32_t index) {
+    IBFS_Context* ctx = imp->ctx;
+    ImportItem* item = &imp->items[index];
+    Inode* inode = &imp->inodes[index];
+    uint32_t block_size = ctx->sb.block_size;
+
+    if (item->size == 0) return 0;
+    if (item->size <= file_inline_capacity(ctx)) {
+        inode->flags |= IBFS_INODE_INLINE;
+        return import_add_chunk(imp, index, 0, 0, (uint32_t)item->size);
+    }
+
+    uint32_t blocks = (uint32_t)((item->size + block_size - 1) / block_size);
+    uint32_t logical = 0;
+    uint32_t data_end = blocks;
+    int result = 0;
+    int fd = -1;
+#ifdef SEEK_DATA
+    fd = open(item->host_path, O_RDONLY);
+    if (fd >= 0) data_end = 0;
+#endif
+
+    while (logical < blocks) {
+#ifdef SEEK_DATA
+        /* Holes in the host file stay holes; only the ranges holding data are planned. */
+        if (fd >= 0 && logical == data_end) {
+            off_t data = lseek(fd, (off_t)logical * block_size, SEEK_DATA);
+            off_t hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+            if (data < 0 && errno == ENXIO) break;
+            if (data < 0 || hole < 0) {
+                close(fd);
+                fd = -1;
+                data_end = blocks;
+            } else {
+                uint64_t start = (uint64_t)data / block_size;
+                if (start >= blocks) break;
+                if (start > logical) logical = (uint32_t)start;
+                data_end = (uint32_t)(((uint64_t)hole + block_size - 1) / block_size);
+                if (data_end > blocks) data_end = blocks;
+            }
+        }
+#endif
+        uint32_t want = data_end - logical;
+        if (want > IMPORT_CHUNK_BLOCKS) want = IMPORT_CHUNK_BLOCKS;
+
+        uint32_t got;
+        uint32_t first = alloc_data_extent(ctx, imp->goal, want, &got);
+        if (first == 0) {
+            result = -1;
+            break;
+        }
+        uint64_t offset = (uint64_t)logical * block_size;
+        uint64_t length = (uint64_t)got * block_size;
+        if (length > item->size - offset) length = item->size - offset;
+        if (import_add_chunk(imp, index, first, offset, (uint32_t)length) != 0) {
+            for (uint32_t n = 0; n < got; n++) free_data_block(ctx, first + n);
+            result = -1;
+            break;
+        }
+
+        /* Indirect blocks the extent needs are allocated right after it. */
+        if (file_map_extent(ctx, inode, logical, first, got, first + got) != 0) {
+            result = -1;
+            break;
+        }
+        logical += got;
+        imp->goal = first + got;
+    }
+#ifdef SEEK_DATA
+    if (fd >= 0) close(fd);
+#endif
+    return result;
+}
+
+static int import_plan(Import* imp, uint32_t dest_inode_num) {
+    IBFS_Context* ctx = imp->ctx;
+    uint32_t block_size = ctx->sb.block_size;
+    uint64_t needed_blocks = 0;
+
+    for (uint32_t i = 0; i < imp->item_count; i++) {
+        ImportItem* item = &imp->items[i];
+        if (item->parent == IMPORT_ROOT) {
+            BPlusTreeKey key;
+            uint32_t existing;
+            path_make_key(&key, dest_inode_num, item->name);
+            if (bpt_search(ctx, ctx->sb.root_bpt_block, &key, &existing) == 0) {
+                fprintf(stderr, "import Error: '%s' already exists in the destination.\n", item->name);
+                return -1;
+            }
+        }
+        if (!item->is_dir && item->size > file_inline_capacity(ctx)) {
+            uint64_t blocks = (item->size + block_size - 1) / block_size;
+            needed_blocks += blocks + file_indirect_blocks(ctx, blocks);
+        }
+    }
+    if (needed_blocks > ctx->sb.free_blocks_count) {
+        fprintf(stderr, "import Error: Needs %llu blocks, only %u free.\n",
+                (unsigned long long)needed_blocks, ctx->sb.free_blocks_count);
+        return -1;
+    }
+
+    imp->inode_nums = malloc((size_t)imp->item_count * sizeof(uint32_t));
+    imp->inodes = calloc(imp->item_count, sizeof(Inode));
+    if (!imp->inode_nums || !imp->inodes) {
+        fprintf(stderr, "import Error: Out of memory.\n");
+        return -1;
+    }
+    if (alloc_inode_nums(ctx, imp->item_count, imp->inode_nums) != 0) return -1;
+    imp->inodes_allocated = true;
+
+    IBFS_Timespec now;
+    inode_now(&now);
+    imp->goal = inode_goal_block(ctx, imp->inode_nums[0]);
+    for (uint32_t i = 0; i < imp->item_count; i++) {
+        Inode* inode = &imp->inodes[i];
+        inode->mode = imp->items[i].is_dir ? S_IFDIR : S_IFREG;
+        inode->links_count = 1;
+        inode->version = IBFS_INODE_VERSION;
+        inode->size = imp->items[i].size;
+        inode->atime = now;
+        inode->ctime = now;
+        inode->mtime.sec = imp->items[i].mtime;
+        if (!imp->items[i].is_dir && import_plan_file(imp, i) != 0) {
+            fprintf(stderr, "import Error: Failed to allocate blocks for '%s'.\n", imp->items[i].host_path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+typedef struct ImportBlocks {
+    uint32_t* items;
+    uint32_t count;
+    uint32_t capacity;
+    bool failed;
+} ImportBlocks;
+
+static void import_collect_block(uint32_t block_num, void* user_data) {
+    ImportBlocks* blocks = (ImportBlocks*)user_data;
+    if (blocks->failed || import_reserve((void**)&blocks->items, &blocks->capacity, blocks->count + 1, sizeof(uint32_t)) != 0) {
+        blocks->failed = true;
+        return;
+    }
+    blocks->items[blocks->count++] = block_num;
+}
+
+static int import_compare_blocks(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void import_rollback(Import* imp) {
+    IBFS_Context* ctx = imp->ctx;
+    uint32_t block_size = ctx->sb.block_size;
+    ImportBlocks blocks = { NULL, 0, 0, false };
+
+    for (uint32_t c = 0; c < imp->chunk_count; c++) {
+        ImportChunk* chunk = &imp->chunks[c];
+        if (chunk->first_block == 0) continue;
+        uint32_t n = (chunk->length + block_size - 1) / block_size;
+        for (uint32_t b = 0; b < n; b++) import_collect_block(chunk->first_block + b, &blocks);
+    }
+    /* The block maps hold the chunks' blocks again plus their indirect blocks; duplicates are dropped below. */
+    for (uint32_t i = 0; imp->inodes && i < imp->item_count; i++) {
+        if (imp->inodes[i].flags & IBFS_INODE_INLINE) continue;
+        if (file_for_each_block(ctx, &imp->inodes[i], import_collect_block, &blocks) != 0) blocks.failed = true;
+    }
+    bool complete = !blocks.failed;
+    uint32_t count = 0;
+    if (blocks.count > 0) {
+        qsort(blocks.items, blocks.count, sizeof(uint32_t), import_compare_blocks);
+        for (uint32_t i = 0; i < blocks.count; i++) {
+            if (count == 0 || blocks.items[count - 1] != blocks.items[i]) blocks.items[count++] = blocks.items[i];
+        }
+    }
+    if (file_unref_blocks(ctx, blocks.items, count) != 0) complete = false;
+    if (imp->inodes_allocated && free_inode_nums(ctx, imp->inode_nums, imp->item_count) != 0) complete = false;
+    if (!complete) fprintf(stderr, "Warning: Some blocks or inodes could not be released, run fsck.\n");
+    free(blocks.items);
+}
+
+static int import_read_chunk(Import* imp, const ImportChunk* chunk, char* slot, FILE** host, uint32_t* host_item) {
+    ImportItem* item = &imp->items[chunk->item];
+    if (*host_item != chunk->item) {
+        if (*host) fclose(*host);
+        *host = fopen(item->host_path, "rb");
+        *host_item = *host ? chunk->item : IMPORT_ROOT;
+        if (!*host) {
+            fprintf(stderr, "import Error: Cannot open '%s': %s\n", item->host_path, strerror(errno));
+            return -1;
+        }
+    }
+    if (fseek(*host, (long)chunk->offset, SEEK_SET) != 0 ||
+        fread(slot, 1, chunk->length, *host) != chunk->length) {
+        fprintf(stderr, "import Error: Short read from '%s', was it modified during the import?\n", item->host_path);
+        return -1;
+    }
+    uint32_t block_size = imp->ctx->sb.block_size;
+    uint32_t padded = (chunk->length + block_size - 1) / block_size * block_size;
+    memset(slot + chunk->length, 0, padded - chunk->length);
+    return 0;
+}
+
+static void* import_reader(void* arg) {
+    Import* imp = arg;
+    FILE* host = NULL;
+    uint32_t host_item = IMPORT_ROOT;
+
+    pthread_mutex_lock(&imp->lock);
+    while (!imp->failed && imp->next_chunk < imp->chunk_count) {
+        uint32_t c = imp->next_chunk++;
+        while (!imp->failed && c >= imp->written + imp->slot_count) {
+            pthread_cond_wait(&imp->changed, &imp->lock);
+        }
+        if (imp->failed) break;
+        pthread_mutex_unlock(&imp->lock);
+
+        uint32_t slot = c % imp->slot_count;
+        int rc = import_read_chunk(imp, &imp->chunks[c], imp->ring + slot * imp->slot_size, &host, &host_item);
+
+        pthread_mutex_lock(&imp->lock);
+        if (rc == 0) imp->ready[slot] = true;
+        else imp->failed = 1;
+        pthread_cond_broadcast(&imp->changed);
+    }
+    pthread_mutex_unlock(&imp->lock);
+    if (host) fclose(host);
+    return NULL;
+}
+
+static int import_stream(Import* imp, int thread_count) {
+    IBFS_Context* ctx = imp->ctx;
+    uint32_t block_size = ctx->sb.block_size;
+    imp->slot_size = (size_t)IMPORT_CHUNK_BLOCKS * block_size;
+    imp->slot_count = (uint32_t)thread_count * IMPORT_SLOTS_PER_THREAD;
+    if (imp->slot_count > imp->chunk_count) imp->slot_count = imp->chunk_count;
+    if (imp->slot_count == 0) return 0;
+
+    imp->ring = alloc_block_buffer(ctx, (size_t)imp->slot_count * IMPORT_CHUNK_BLOCKS);
+    imp->ready = calloc(imp->slot_count, sizeof(bool));
+    pthread_t* threads = malloc((size_t)thread_count * sizeof(pthread_t));
+    if (!imp->ring || !imp->ready || !threads) {
+        fprintf(stderr, "import Error: Out of memory for %u chunk buffers.\n", imp->slot_count);
+        free(threads);
+        return -1;
+    }
+    pthread_mutex_init(&imp->lock, NULL);
+    pthread_cond_init(&imp->changed, NULL);
+
+    int started = 0;
+    for (; started < thread_count; started++) {
+        if (pthread_create(&threads[started], NULL, import_reader, imp) != 0) break;
+    }
+    if (started == 0) {
+        fprintf(stderr, "import Error: Failed to start reader threads.\n");
+        imp->failed = 1;
+    }
+
+    /* The single writer takes chunks in allocation order, so the image is written sequentially. */
+    for (uint32_t c = 0; c < imp->chunk_count; c++) {
+        uint32_t slot = c % imp->slot_count;
+        pthread_mutex_lock(&imp->lock);
+        while (!imp->failed && !imp->ready[slot]) pthread_cond_wait(&imp->changed, &imp->lock);
+        int failed = imp->failed;
+        pthread_mutex_unlock(&imp->lock);
+        if (failed) break;
+
+        ImportChunk* chunk = &imp->chunks[c];
+        char* data = imp->ring + slot * imp->slot_size;
+        int rc = 0;
+        if (chunk->first_block == 0) {
+            memcpy(imp->inodes[chunk->item].inline_data, data, chunk->length);
+        } else {
+            rc = write_blocks(ctx, chunk->first_block, (chunk->length + block_size - 1) / block_size, data);
+        }
+
+        pthread_mutex_lock(&imp->lock);
+        imp->ready[slot] = false;
+        imp->written++;
+        if (rc != 0) imp->failed = 1;
+        pthread_cond_broadcast(&imp->changed);
+        pthread_mutex_unlock(&imp->lock);
+    }
+
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&imp->lock);
+    pthread_cond_destroy(&imp->changed);
+    free(threads);
+    return imp->failed ? -1 : 0;
+}
+
+static int import_commit(Import* imp, uint32_t dest_inode_num) {
+    IBFS_Context* ctx = imp->ctx;
+    BPlusTreeEntry* entries = malloc((size_t)imp->item_count * sizeof(BPlusTreeEntry));
+    if (!entries) {
+        fprintf(stderr, "import Error: Out of memory.\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < imp->item_count; i++) {
+        uint32_t parent = imp->items[i].parent;
+        path_make_key(&entries[i].key, parent == IMPORT_ROOT ? dest_inode_num : imp->inode_nums[parent], imp->items[i].name);
+        entries[i].value = imp->inode_nums[i];
+    }
+
+    /* Data first, then the inodes, then the entries that make them reachable. */
+    int result = 0;
+    if (sync_disk(ctx) != 0 || inode_write_batch(ctx, imp->inode_nums, imp->inodes, imp->item_count) != 0) {
+        fprintf(stderr, "import Error: Failed to write inodes.\n");
+        result = -1;
+    } else if (bpt_insert_batch(ctx, &ctx->sb.root_bpt_block, entries, imp->item_count) != 0) {
+        /* Some entries may already be linked, so the allocations are kept for fsck to sort out. */
+        fprintf(stderr, "import Error: Failed to insert entries into B+ Tree, run fsck.\n");
+        result = 1;
+    } else if (name_index_insert_batch(ctx, entries, imp->item_count) != 0) {
+        result = 1;
+    }
+    if (result >= 0 && write_superblock(ctx) != 0) {
+        fprintf(stderr, "import Error: Failed to update superblock.\n");
+        result = 1;
+    }
+    free(entries);
+    return result;
+}
+
+int ibfs_import(IBFS_Context* ctx, const char* host_dir, uint32_t dest_inode_num, int thread_count) {
+    Import imp;
+    memset(&imp, 0, sizeof(Import));
+    imp.ctx = ctx;
+    if (thread_count < 1) thread_count = 1;
+
+    struct timespec start, end;
+    timespec_get(&start, TIME_UTC);
+
+    printf("Scanning '%s'...\n", host_dir);
+    int result = import_scan_dir(&imp, host_dir, IMPORT_ROOT);
+    for (uint32_t i = 0; result == 0 && i < imp.item_count; i++) {
+        if (imp.items[i].is_dir) result = import_scan_dir(&imp, imp.items[i].host_path, i);
+    }
+
+    uint32_t files = 0;
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < imp.item_count; i++) {
+        if (!imp.items[i].is_dir) files++;
+        bytes += imp.items[i].size;
+    }
+    if (result == 0 && imp.item_count == 0) {
+        printf("Nothing to import.\n");
+    } else if (result == 0) {
+        printf("Allocating %u inodes for %u files and %u directories (%llu bytes)...\n",
+               imp.item_count, files, imp.item_count - files, (unsigned long long)bytes);
+        result = import_plan(&imp, dest_inode_num);
+        if (result == 0) {
+            printf("Copying %u chunks with %d reader threads...\n", imp.chunk_count, thread_count);
+            result = import_stream(&imp, thread_count);
+        }
+        if (result == 0) result = import_commit(&imp, dest_inode_num);
+        if (result < 0) {
+            fprintf(stderr, "import Error: Import failed, nothing was added.\n");
+            import_rollback(&imp);
+            write_superblock(ctx);
+        }
+    }
+
+    if (result == 0 && imp.item_count > 0) {
+        timespec_get(&end, TIME_UTC);
+        double seconds = (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Imported %u files and %u directories, %llu bytes in %.2f s (%.1f MB/s).\n",
+               files, imp.item_count - files, (unsigned long long)bytes, seconds,
+               seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0);
+    }
+
+    for (uint32_t i = 0; i < imp.item_count; i++) free(imp.items[i].host_path);
+    free(imp.items);
+    free(imp.inode_nums);
+    free(imp.inodes);
+    free(imp.chunks);
+    free(imp.ring);
+    free(imp.ready);
+    return result == 0 ? 0 : -1;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "ibfs.h"
+
+/*
+ * Copies the contents of host_dir into the directory dest_inode_num. The host tree
+ * is scanned and all inodes and extents are allocated up front; thread_count reader
+ * threads then fill a ring of chunk buffers which a single writer streams to the
+ * image in allocation order. Entries are inserted into the B+ tree as one batch
+ * after the data is written, so a failed import leaves nothing behind.
+ */
+int ibfs_import(IBFS_Context* ctx, const char* host_dir, uint32_t dest_inode_num, int thread_count);
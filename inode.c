@@ -1,11 +1,87 @@
 #include "inode.h"
 #include "bitmap.h"
+#include "block.h"
 #include "io.h"
 #include <string.h>
 #include <stdio.h> 
 #include <time.h>  
 
-#define INODE_TABLE_START_BLOCK 3
+uint32_t inodes_per_block(IBFS_Context* ctx)
+{
+    if (ctx->sb.inode_size < sizeof(DiskInode) || ctx->sb.inode_size > IBFS_MAX_INODE_SIZE) return 0;
+    return IBFS_META_PAYLOAD(ctx->sb.block_size) / ctx->sb.inode_size;
+}
+
+static void inode_encode(const Inode* in, char* record, uint32_t record_size)
+{
+    DiskInode out;
+    memset(&out, 0, sizeof(DiskInode));
+    out.mode = ibfs_le16(in->mode);
+    out.links_count = ibfs_le16(in->links_count);
+    out.version = ibfs_le16(in->version);
+    out.flags = ibfs_le16(in->flags);
+    out.size = ibfs_le64(in->size);
+    out.atime_sec = ibfs_le32(in->atime.sec);
+    out.atime_nsec = ibfs_le32(in->atime.nsec);
+    out.mtime_sec = ibfs_le32(in->mtime.sec);
+    out.mtime_nsec = ibfs_le32(in->mtime.nsec);
+    out.ctime_sec = ibfs_le32(in->ctime.sec);
+    out.ctime_nsec = ibfs_le32(in->ctime.nsec);
+    if (!(in->flags & IBFS_INODE_INLINE)) {
+        for (int i = 0; i < 12; i++) {
+            out.direct_blocks[i] = ibfs_le32(in->direct_blocks[i]);
+        }
+        out.single_indirect = ibfs_le32(in->single_indirect);
+        out.double_indirect = ibfs_le32(in->double_indirect);
+        out.triple_indirect = ibfs_le32(in->triple_indirect);
+    }
+
+    memset(record, 0, record_size);
+    memcpy(record, &out, sizeof(DiskInode));
+    if (in->flags & IBFS_INODE_INLINE) {
+        memcpy(record + IBFS_INODE_INLINE_OFFSET, in->inline_data, IBFS_INLINE_CAPACITY(record_size));
+    }
+}
+
+static void inode_decode(const char* record, uint32_t record_size, Inode* out)
+{
+    DiskInode in;
+    memcpy(&in, record, sizeof(DiskInode));
+
+    memset(out, 0, sizeof(Inode));
+    out->mode = ibfs_le16(in.mode);
+    out->links_count = ibfs_le16(in.links_count);
+    out->version = ibfs_le16(in.version);
+    out->flags = ibfs_le16(in.flags);
+    out->size = ibfs_le64(in.size);
+    out->atime.sec = ibfs_le32(in.atime_sec);
+    out->atime.nsec = ibfs_le32(in.atime_nsec);
+    out->mtime.sec = ibfs_le32(in.mtime_sec);
+    out->mtime.nsec = ibfs_le32(in.mtime_nsec);
+    out->ctime.sec = ibfs_le32(in.ctime_sec);
+    out->ctime.nsec = ibfs_le32(in.ctime_nsec);
+    if (out->flags & IBFS_INODE_INLINE) {
+        memcpy(out->inline_data, record + IBFS_INODE_INLINE_OFFSET, IBFS_INLINE_CAPACITY(record_size));
+    } else {
+        for (int i = 0; i < 12; i++) {
+            out->direct_blocks[i] = ibfs_le32(in.direct_blocks[i]);
+        }
+        out->single_indirect = ibfs_le32(in.single_indirect);
+        out->double_indirect = ibfs_le32(in.double_indirect);
+        out->triple_indirect = ibfs_le32(in.triple_indirect);
+    }
+}
+
+void inode_now(IBFS_Timespec* ts)
+{
+    struct timespec now;
+    if (timespec_get(&now, TIME_UTC) == 0) {
+        now.tv_sec = time(NULL);
+        now.tv_nsec = 0;
+    }
+    ts->sec = (uint32_t)now.tv_sec;
+    ts->nsec = (uint32_t)now.tv_nsec;
+}
 
 int inode_write(IBFS_Context* ctx, uint32_t inode_num, const Inode* inode_data)
 {
@@ -14,24 +90,54 @@ int inode_write(IBFS_Context* ctx, uint32_t inode_num, const Inode* inode_data)
         return -1;
     }
 
-    uint32_t inodes_per_block = BLOCK_SIZE / sizeof(Inode);
-    if (inodes_per_block == 0) {
-         fprintf(stderr, "inode_write: Error - Inode size too large for block size.\n");
+    uint32_t per_block = inodes_per_block(ctx);
+    if (per_block == 0) {
+         fprintf(stderr, "inode_write: Error - Invalid inode size %u.\n", ctx->sb.inode_size);
          return -1;
     }
-    uint32_t block_num = INODE_TABLE_START_BLOCK + (inode_num / inodes_per_block);
-    char block_buffer[BLOCK_SIZE];
+    uint32_t block_num = ctx->sb.inode_table_start + (inode_num / per_block);
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
 
-    if (read_block(ctx, block_num, block_buffer) != 0)
+    if (read_meta_block(ctx, block_num, block_buffer) != 0)
     {
         fprintf(stderr, "inode_write: Failed to read block %u for inode %u.\n", block_num, inode_num);
         return -1;
     }
 
-    uint32_t offset_in_block = (inode_num % inodes_per_block) * sizeof(Inode);
-    memcpy(block_buffer + offset_in_block, inode_data, sizeof(Inode));
+    uint32_t offset_in_block = (inode_num % per_block) * ctx->sb.inode_size;
+    inode_encode(inode_data, block_buffer + offset_in_block, ctx->sb.inode_size);
+
+    return write_meta_block(ctx, block_num, block_buffer);
+}
+
+int inode_write_batch(IBFS_Context* ctx, const uint32_t* inode_nums, const Inode* inodes, uint32_t count)
+{
+    uint32_t per_block = inodes_per_block(ctx);
+    if (per_block == 0) {
+         fprintf(stderr, "inode_write_batch: Error - Invalid inode size %u.\n", ctx->sb.inode_size);
+         return -1;
+    }
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
 
-    return write_block(ctx, block_num, block_buffer);
+    /* Neighbouring inodes that share a table block are written with one read-modify-write. */
+    uint32_t i = 0;
+    while (i < count) {
+        if (inode_nums[i] >= ctx->sb.inode_count) {
+            fprintf(stderr, "inode_write_batch: Error - inode number %u out of range.\n", inode_nums[i]);
+            return -1;
+        }
+        uint32_t table_index = inode_nums[i] / per_block;
+        uint32_t block_num = ctx->sb.inode_table_start + table_index;
+        if (read_meta_block(ctx, block_num, block_buffer) != 0) {
+            fprintf(stderr, "inode_write_batch: Failed to read inode table block %u.\n", block_num);
+            return -1;
+        }
+        for (; i < count && inode_nums[i] < ctx->sb.inode_count && inode_nums[i] / per_block == table_index; i++) {
+            inode_encode(&inodes[i], block_buffer + (inode_nums[i] % per_block) * ctx->sb.inode_size, ctx->sb.inode_size);
+        }
+        if (write_meta_block(ctx, block_num, block_buffer) != 0) return -1;
+    }
+    return 0;
 }
 
 int inode_read(IBFS_Context* ctx, uint32_t inode_num, Inode* inode_data)
@@ -41,20 +147,20 @@ int inode_read(IBFS_Context* ctx, uint32_t inode_num, Inode* inode_data)
         return -1;
     }
 
-    uint32_t inodes_per_block = BLOCK_SIZE / sizeof(Inode);
-     if (inodes_per_block == 0) {
-         fprintf(stderr, "inode_read: Error - Inode size too large for block size.\n");
+    uint32_t per_block = inodes_per_block(ctx);
+     if (per_block == 0) {
+         fprintf(stderr, "inode_read: Error - Invalid inode size %u.\n", ctx->sb.inode_size);
          return -1;
     }
-    uint32_t block_num = INODE_TABLE_START_BLOCK + (inode_num / inodes_per_block);
-    char block_buffer[BLOCK_SIZE];
+    uint32_t block_num = ctx->sb.inode_table_start + (inode_num / per_block);
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
 
-    if (read_block(ctx, block_num, block_buffer) != 0) {
+    if (read_meta_block(ctx, block_num, block_buffer) != 0) {
         return -1;
     }
 
-    uint32_t offset_in_block = (inode_num % inodes_per_block) * sizeof(Inode);
-    memcpy(inode_data, block_buffer + offset_in_block, sizeof(Inode));
+    uint32_t offset_in_block = (inode_num % per_block) * ctx->sb.inode_size;
+    inode_decode(block_buffer + offset_in_block, ctx->sb.inode_size, inode_data);
     return 0;
 }
 
@@ -68,10 +174,13 @@ int inode_alloc(IBFS_Context *ctx, uint16_t mode)
     Inode new_inode;
     memset(&new_inode, 0, sizeof(Inode));
 
-    time_t current_time = time(NULL);
+    IBFS_Timespec current_time;
+    inode_now(&current_time);
 
     new_inode.mode = mode;
+    if ((mode & S_IFREG) == S_IFREG) new_inode.flags = (uint16_t)ctx->sb.new_file_flags;
     new_inode.links_count = 1;
+    new_inode.version = IBFS_INODE_VERSION;
     new_inode.size = 0;
     new_inode.atime = current_time;
     new_inode.mtime = current_time;
@@ -84,4 +193,17 @@ int inode_alloc(IBFS_Context *ctx, uint16_t mode)
         return -1;
     }
     return inode_num;
-}
\ No newline at end of file
+}
+
+uint32_t inode_goal_block(IBFS_Context* ctx, uint32_t inode_num)
+{
+    uint32_t groups = bitmap_group_count(ctx);
+    if (groups == 0 || ctx->sb.inode_count == 0) return 0;
+    uint32_t group = (uint32_t)((uint64_t)inode_num * groups / ctx->sb.inode_count);
+    return bitmap_group_start(ctx, group) + 1;
+}
+
+void inode_unpack(IBFS_Context* ctx, const char* table_block, uint32_t index, Inode* inode_data)
+{
+    inode_decode(table_block + index * ctx->sb.inode_size, ctx->sb.inode_size, inode_data);
+}
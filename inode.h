@@ -1,8 +1,19 @@
 #pragma once
 #include "ibfs.h"
 
-#define S_IFDIR 0040000 
+/* Same values as the host's <sys/stat.h>, which may be included first. */
+#ifndef S_IFDIR
+#define S_IFDIR 0040000
+#endif
+#ifndef S_IFREG
+#define S_IFREG 0100000
+#endif
 
 int inode_alloc(IBFS_Context* ctx, uint16_t mode);
 int inode_write(IBFS_Context* ctx, uint32_t inode_num, const Inode* inode_data);
-int inode_read(IBFS_Context* ctx, uint32_t inode_num, Inode* inode_data);
\ No newline at end of file
+int inode_write_batch(IBFS_Context* ctx, const uint32_t* inode_nums, const Inode* inodes, uint32_t count);
+int inode_read(IBFS_Context* ctx, uint32_t inode_num, Inode* inode_data);
+void inode_now(IBFS_Timespec* ts);
+uint32_t inodes_per_block(IBFS_Context* ctx);
+uint32_t inode_goal_block(IBFS_Context* ctx, uint32_t inode_num);
+void inode_unpack(IBFS_Context* ctx, const char* table_block, uint32_t index, Inode* inode_data);
@@ -1,53 +1,473 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include "io.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "ibfs.h" 
+#include "crc32c.h"
+#include "trace.h"
 
-int read_block(IBFS_Context* ctx, uint32_t block_num, void* buffer) {
-    if (!ctx || !ctx->disk_file || !buffer) return -1; 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
+
+/* A snapshot view reads its own copy of the inode bitmap and table. */
+static uint32_t io_map_block(IBFS_Context* ctx, uint32_t block_num) {
+    if (!ctx->meta_map || block_num < ctx->sb.inode_bitmap_start || block_num >= ctx->sb.first_data_block) return block_num;
+    return ctx->meta_map[block_num - ctx->sb.inode_bitmap_start];
+}
+
+/*
+ * Recently read or written metadata blocks, keyed by physical block so snapshot views
+ * share them. A block enters only after its checksum held, and every write to the
+ * device updates or drops it, so a hit needs no verification. Anything read from the
+ * device is verified again.
+ */
+#define IO_META_CACHE_EMPTY UINT32_MAX
+
+struct IBFS_MetaCache {
+    pthread_mutex_t lock;
+    uint32_t block_size;
+    uint32_t slots;
+    uint64_t generation;  /* bumped by every write, so a read that raced one is not cached */
+    uint32_t* blocks;
+    unsigned char* data;
+};
+
+void meta_cache_init(IBFS_Context* ctx, uint32_t slots) {
+    ctx->meta_cache = NULL;
+    if (slots == 0) return;
+    IBFS_MetaCache* cache = calloc(1, sizeof(IBFS_MetaCache));
+    if (cache) {
+        cache->blocks = malloc((size_t)slots * sizeof(uint32_t));
+        cache->data = malloc((size_t)slots * ctx->sb.block_size);
+    }
+    if (!cache || !cache->blocks || !cache->data) {
+        if (cache) {
+            free(cache->blocks);
+            free(cache->data);
+        }
+        free(cache);
+        fprintf(stderr, "Warning: Not enough memory for a %u-block metadata cache; running without one.\n", slots);
+        return;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->block_size = ctx->sb.block_size;
+    cache->slots = slots;
+    ctx->meta_cache = cache;
+    meta_cache_reset(ctx);
+}
+
+void meta_cache_reset(IBFS_Context* ctx) {
+    IBFS_MetaCache* cache = ctx->meta_cache;
+    if (!cache) return;
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < cache->slots; i++) cache->blocks[i] = IO_META_CACHE_EMPTY;
+    cache->generation++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void meta_cache_free(IBFS_Context* ctx) {
+    IBFS_MetaCache* cache = ctx->meta_cache;
+    if (!cache) return;
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->blocks);
+    free(cache->data);
+    free(cache);
+    ctx->meta_cache = NULL;
+}
+
+static bool meta_cache_get(IBFS_Context* ctx, uint32_t physical, void* buffer, uint64_t* generation) {
+    IBFS_MetaCache* cache = ctx->meta_cache;
+    if (!cache) return false;
+    uint32_t slot = physical % cache->slots;
+    pthread_mutex_lock(&cache->lock);
+    bool hit = cache->blocks[slot] == physical;
+    if (hit) memcpy(buffer, cache->data + (size_t)slot * cache->block_size, cache->block_size);
+    *generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+/* A read passes the generation seen before it went to the device; a block written since then is left out. */
+static void meta_cache_put(IBFS_Context* ctx, uint32_t physical, const void* buffer, const uint64_t* generation) {
+    IBFS_MetaCache* cache = ctx->meta_cache;
+    if (!cache) return;
+    uint32_t slot = physical % cache->slots;
+    pthread_mutex_lock(&cache->lock);
+    if (!generation || cache->generation == *generation) {
+        memcpy(cache->data + (size_t)slot * cache->block_size, buffer, cache->block_size);
+        cache->blocks[slot] = physical;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void meta_cache_drop(IBFS_Context* ctx, uint32_t first_block, uint32_t count) {
+    IBFS_MetaCache* cache = ctx->meta_cache;
+    if (!cache) return;
+    pthread_mutex_lock(&cache->lock);
+    if (count >= cache->slots) {
+        for (uint32_t i = 0; i < cache->slots; i++) {
+            if (cache->blocks[i] - first_block < count) cache->blocks[i] = IO_META_CACHE_EMPTY;
+        }
+    } else {
+        for (uint32_t block = first_block; block - first_block < count; block++) {
+            if (cache->blocks[block % cache->slots] == block) cache->blocks[block % cache->slots] = IO_META_CACHE_EMPTY;
+        }
+    }
+    cache->generation++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Cached metadata requests are traced above the cache, so the device-level request is not traced again. */
+typedef enum IoPath {
+    IO_DATA,
+    IO_META,
+    IO_META_CACHED
+} IoPath;
+
+static int io_check_writable(IBFS_Context* ctx) {
+    if (!ctx->read_only) return 0;
+    fprintf(stderr, "Error: Image is opened read-only.\n");
+    return -1;
+}
+
+static int io_read(IBFS_Context* ctx, uint64_t offset, void* buffer, size_t length, uint32_t first_block, uint32_t count, IoPath path) {
+    if (ctx->trace && path != IO_META_CACHED) {
+        trace_record(ctx, IBFS_TRACE_READ, first_block, count, trace_subsystem(ctx, first_block, path == IO_META));
+    }
+    long long got = ctx->device->ops->read(ctx->device, offset, buffer, length);
+    if (got == (long long)length) return 0;
+    if (got < 0) {
+        fprintf(stderr, "Error: Failed to read %u blocks at %u (%s)\n", count, first_block, strerror(errno));
+    } else {
+        fprintf(stderr, "Error: Failed to read %u blocks at %u (Unexpected end of file - is the disk large enough?)\n",
+                count, first_block);
+    }
+    return -1;
+}
+
+static int io_write(IBFS_Context* ctx, uint64_t offset, const void* buffer, size_t length, uint32_t first_block, uint32_t count, IoPath path) {
+    if (ctx->trace && path != IO_META_CACHED) {
+        trace_record(ctx, IBFS_TRACE_WRITE, first_block, count, trace_subsystem(ctx, first_block, path == IO_META));
+    }
+    meta_cache_drop(ctx, first_block, count);
+    if (ctx->device->ops->write(ctx->device, offset, buffer, length) == 0) return 0;
+    fprintf(stderr, "Error: Failed to write %u blocks at %u (%s)\n", count, first_block, strerror(errno));
+    return -1;
+}
+
+static int io_read_block(IBFS_Context* ctx, uint32_t block_num, void* buffer, IoPath path) {
+    if (!ctx || !ctx->device || !buffer || ctx->sb.block_size == 0) return -1; 
+    block_num = io_map_block(ctx, block_num);
 
     if (ctx->sb.block_count > 0 && block_num >= ctx->sb.block_count) {
         fprintf(stderr, "Error: Attempt to read block %u beyond disk boundary (%u)\n",
                 block_num, ctx->sb.block_count);
         return -1;
     }
+    return io_read(ctx, (uint64_t)block_num * ctx->sb.block_size, buffer, ctx->sb.block_size, block_num, 1, path);
+}
+
+int read_block(IBFS_Context* ctx, uint32_t block_num, void* buffer) {
+    return io_read_block(ctx, block_num, buffer, IO_DATA);
+}
 
-    if (fseek(ctx->disk_file, (long)block_num * BLOCK_SIZE, SEEK_SET) != 0) {
-        perror("Error seeking for read");
+static int io_write_block(IBFS_Context* ctx, uint32_t block_num, const void* buffer, IoPath path) {
+    if (!ctx || !ctx->device || !buffer || ctx->sb.block_size == 0) return -1; 
+    if (io_check_writable(ctx) != 0) return -1;
+
+     if (ctx->sb.block_count > 0 && block_num >= ctx->sb.block_count) {
+        fprintf(stderr, "Error: Attempt to write block %u beyond disk boundary (%u)\n",
+                block_num, ctx->sb.block_count);
         return -1;
     }
-    size_t blocks_read = fread(buffer, BLOCK_SIZE, 1, ctx->disk_file);
-    if (blocks_read != 1) {
-        fprintf(stderr, "Error: Failed to read block %u", block_num);
-        if (feof(ctx->disk_file)) {
-             fprintf(stderr, " (Unexpected end of file - is the disk large enough?)\n");
-        } else if (ferror(ctx->disk_file)) {
-             perror(" (fread error)");
-        } else {
-             fprintf(stderr, " (Read %zu blocks instead of 1)\n", blocks_read);
+    return io_write(ctx, (uint64_t)block_num * ctx->sb.block_size, buffer, ctx->sb.block_size, block_num, 1, path);
+}
+
+int write_block(IBFS_Context* ctx, uint32_t block_num, const void* buffer) {
+    return io_write_block(ctx, block_num, buffer, IO_DATA);
+}
+
+static int io_read_blocks(IBFS_Context* ctx, uint32_t first_block, uint32_t count, void* buffer, IoPath path) {
+    if (!ctx || !ctx->device || !buffer || ctx->sb.block_size == 0) return -1;
+    if (ctx->meta_map && first_block < ctx->sb.first_data_block) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (io_read_block(ctx, first_block + i, (char*)buffer + (size_t)i * ctx->sb.block_size, path) != 0) return -1;
         }
+        return 0;
+    }
+    if ((uint64_t)first_block + count > ctx->sb.block_count) {
+        fprintf(stderr, "Error: Attempt to read blocks %u-%u beyond disk boundary (%u)\n",
+                first_block, first_block + count - 1, ctx->sb.block_count);
         return -1;
     }
-    return 0; 
+    return io_read(ctx, (uint64_t)first_block * ctx->sb.block_size, buffer, (size_t)count * ctx->sb.block_size, first_block, count, path);
 }
 
-int write_block(IBFS_Context* ctx, uint32_t block_num, const void* buffer) {
-    if (!ctx || !ctx->disk_file || !buffer) return -1; 
+int read_blocks(IBFS_Context* ctx, uint32_t first_block, uint32_t count, void* buffer) {
+    return io_read_blocks(ctx, first_block, count, buffer, IO_DATA);
+}
 
-     if (ctx->sb.block_count > 0 && block_num >= ctx->sb.block_count) {
-        fprintf(stderr, "Error: Attempt to write block %u beyond disk boundary (%u)\n",
-                block_num, ctx->sb.block_count);
+int write_blocks(IBFS_Context* ctx, uint32_t first_block, uint32_t count, const void* buffer) {
+    if (!ctx || !ctx->device || !buffer || ctx->sb.block_size == 0) return -1;
+    if (io_check_writable(ctx) != 0) return -1;
+    if ((uint64_t)first_block + count > ctx->sb.block_count) {
+        fprintf(stderr, "Error: Attempt to write blocks %u-%u beyond disk boundary (%u)\n",
+                first_block, first_block + count - 1, ctx->sb.block_count);
         return -1;
     }
+    return io_write(ctx, (uint64_t)first_block * ctx->sb.block_size, buffer, (size_t)count * ctx->sb.block_size, first_block, count, IO_DATA);
+}
+
+static int io_verify_meta(IBFS_Context* ctx, uint32_t block_num, const unsigned char* buffer) {
+    if (ctx->skip_checksums) return 0;
+    uint32_t payload = IBFS_META_PAYLOAD(ctx->sb.block_size);
+    uint32_t stored;
+    memcpy(&stored, buffer + payload, sizeof(stored));
+    if (ibfs_le32(stored) == crc32c(0, buffer, payload) ||
+        (stored == 0 && buffer[0] == 0 && memcmp(buffer, buffer + 1, payload - 1) == 0)) {
+        return 0;
+    }
+    fprintf(stderr, "Error: Checksum mismatch in metadata block %u.\n", block_num);
+    return -1;
+}
+
+int read_meta_block(IBFS_Context* ctx, uint32_t block_num, void* buffer) {
+    if (!ctx || !buffer) return -1;
+    uint32_t physical = io_map_block(ctx, block_num);
+    if (ctx->trace) trace_record(ctx, IBFS_TRACE_READ, physical, 1, trace_subsystem(ctx, physical, true) | IBFS_TRACE_META);
+    uint64_t generation = 0;
+    if (meta_cache_get(ctx, physical, buffer, &generation)) return 0;
+    if (io_read_block(ctx, block_num, buffer, IO_META_CACHED) != 0 || io_verify_meta(ctx, block_num, buffer) != 0) return -1;
+    meta_cache_put(ctx, physical, buffer, &generation);
+    return 0;
+}
+
+/* Bulk scans read past the cache so they do not evict the working set. */
+int read_meta_blocks(IBFS_Context* ctx, uint32_t first_block, uint32_t count, void* buffer) {
+    if (io_read_blocks(ctx, first_block, count, buffer, IO_META) != 0) return -1;
+    for (uint32_t i = 0; i < count; i++) {
+        if (io_verify_meta(ctx, first_block + i, (const unsigned char*)buffer + (size_t)i * ctx->sb.block_size) != 0) return -1;
+    }
+    return 0;
+}
+
+int write_meta_block(IBFS_Context* ctx, uint32_t block_num, void* buffer) {
+    if (!ctx || !buffer || ctx->sb.block_size == 0) return -1;
+    uint32_t payload = IBFS_META_PAYLOAD(ctx->sb.block_size);
+    uint32_t checksum = ibfs_le32(crc32c(0, buffer, payload));
+    memcpy((unsigned char*)buffer + payload, &checksum, sizeof(checksum));
+    if (ctx->trace) trace_record(ctx, IBFS_TRACE_WRITE, block_num, 1, trace_subsystem(ctx, block_num, true) | IBFS_TRACE_META);
+    if (io_write_block(ctx, block_num, buffer, IO_META_CACHED) != 0) return -1;
+    meta_cache_put(ctx, block_num, buffer, NULL);
+    return 0;
+}
+
+/* Like malloc, freed with free(). */
+void* alloc_block_buffer(IBFS_Context* ctx, size_t count) {
+    size_t length = count * ctx->sb.block_size;
+#ifdef _WIN32
+    return malloc(length ? length : 1);
+#else
+    void* buffer = NULL;
+    return posix_memalign(&buffer, IBFS_DIRECT_ALIGNMENT, length ? length : 1) == 0 ? buffer : NULL;
+#endif
+}
+
+/* Superblock fields are stored little-endian; ibfs_le32 converts in either direction. */
+static void superblock_convert(const Superblock* in, Superblock* out) {
+    out->magic = ibfs_le32(in->magic);
+    out->version = ibfs_le32(in->version);
+    out->block_size = ibfs_le32(in->block_size);
+    out->inode_count = ibfs_le32(in->inode_count);
+    out->block_count = ibfs_le32(in->block_count);
+    out->root_inode = ibfs_le32(in->root_inode);
+    out->root_bpt_block = ibfs_le32(in->root_bpt_block);
+    out->inode_size = ibfs_le32(in->inode_size);
+    out->inode_table_start = ibfs_le32(in->inode_table_start);
+    out->first_data_block = ibfs_le32(in->first_data_block);
+    out->inode_bitmap_start = ibfs_le32(in->inode_bitmap_start);
+    out->inode_bitmap_blocks = ibfs_le32(in->inode_bitmap_blocks);
+    out->blocks_per_group = ibfs_le32(in->blocks_per_group);
+    out->free_blocks_count = ibfs_le32(in->free_blocks_count);
+    out->free_inodes_count = ibfs_le32(in->free_inodes_count);
+    out->last_alloc_group = ibfs_le32(in->last_alloc_group);
+    out->refcount_table_start = ibfs_le32(in->refcount_table_start);
+    out->refcount_table_blocks = ibfs_le32(in->refcount_table_blocks);
+    out->snapshot_table_block = ibfs_le32(in->snapshot_table_block);
+    out->dedup_index_start = ibfs_le32(in->dedup_index_start);
+    out->dedup_index_blocks = ibfs_le32(in->dedup_index_blocks);
+    out->new_file_flags = ibfs_le32(in->new_file_flags);
+    out->feature_flags = ibfs_le32(in->feature_flags);
+    out->name_index_root = ibfs_le32(in->name_index_root);
+}
+
+int read_superblock(IBFS_Context* ctx) {
+    if (!ctx || !ctx->device) return -1;
+    if (ctx->trace) trace_record(ctx, IBFS_TRACE_READ, 0, 1, IBFS_TRACE_SUPERBLOCK);
+    Superblock disk_sb;
+    if (ctx->device->ops->read(ctx->device, 0, &disk_sb, sizeof(Superblock)) != (long long)sizeof(Superblock)) {
+        fprintf(stderr, "Error: could not read superblock.\n");
+        return -1;
+    }
+    superblock_convert(&disk_sb, &ctx->sb);
+    return 0;
+}
+
+int write_superblock(IBFS_Context* ctx) {
+    if (!ctx || !ctx->device) return -1;
+    if (io_check_writable(ctx) != 0) return -1;
+    if (ctx->trace) trace_record(ctx, IBFS_TRACE_WRITE, 0, 1, IBFS_TRACE_SUPERBLOCK);
+    Superblock disk_sb;
+    superblock_convert(&ctx->sb, &disk_sb);
+    if (ctx->device->ops->write(ctx->device, 0, &disk_sb, sizeof(Superblock)) != 0) {
+        perror("Error writing superblock");
+        return -1;
+    }
+    if (ctx->device->ops->flush(ctx->device) != 0) {
+        perror("Error flushing superblock");
+        return -1;
+    }
+    ctx->sb_dirty = false;
+    return 0;
+}
+
+int sync_disk(IBFS_Context* ctx) {
+    if (!ctx || !ctx->device) return -1;
+    if (ctx->device->ops->sync(ctx->device) != 0) {
+        perror("Error syncing disk file");
+        return -1;
+    }
+    return 0;
+}
 
-    if (fseek(ctx->disk_file, (long)block_num * BLOCK_SIZE, SEEK_SET) != 0) {
-        perror("Error seeking for write");
+int checkpoint_disk(IBFS_Context* ctx) {
+    if (!ctx || !ctx->device) return -1;
+    if (ctx->device->ops->checkpoint(ctx->device) != 0) {
+        perror("Error checkpointing disk file");
         return -1;
     }
-    size_t blocks_written = fwrite(buffer, BLOCK_SIZE, 1, ctx->disk_file);
-    if (blocks_written != 1) {
-        perror("Error writing block");
-        fprintf(stderr, " (Attempted to write block %u, wrote %zu)\n", block_num, blocks_written);
+    return 0;
+}
+
+int resize_disk(IBFS_Context* ctx, uint64_t new_size) {
+    if (!ctx || !ctx->device) return -1;
+    if (io_check_writable(ctx) != 0) return -1;
+    if (ctx->device->ops->resize(ctx->device, new_size) != 0) {
+        perror("Error resizing disk file");
         return -1;
     }
-    return 0; 
-}
\ No newline at end of file
+    return 0;
+}
+
+int write_fd(int fd, const void* data, size_t length) {
+    const char* buffer = (const char*)data;
+    while (length > 0) {
+        int n = (int)write(fd, buffer, (unsigned int)length);
+        if (n <= 0) return -1;
+        buffer += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+int zero_fill_fd(int fd, uint64_t length) {
+    if (length == 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        /* Leave a hole in regular files; the final byte makes sure the size is right. */
+        if (lseek(fd, (off_t)(length - 1), SEEK_CUR) != (off_t)-1) return write_fd(fd, "", 1);
+    }
+    static const char zeros[4096];
+    while (length > 0) {
+        size_t chunk = length < sizeof(zeros) ? (size_t)length : sizeof(zeros);
+        if (write_fd(fd, zeros, chunk) != 0) return -1;
+        length -= chunk;
+    }
+    return 0;
+}
+
+int copy_blocks_to_fd(IBFS_Context* ctx, uint32_t first_block, uint64_t length, int out_fd) {
+    if (!ctx || !ctx->device || ctx->sb.block_size == 0) return -1;
+    if ((uint64_t)first_block * ctx->sb.block_size + length > (uint64_t)ctx->sb.block_count * ctx->sb.block_size) {
+        fprintf(stderr, "Error: Copy of %llu bytes from block %u runs past the end of the disk\n",
+                (unsigned long long)length, first_block);
+        return -1;
+    }
+    int64_t offset = (int64_t)first_block * ctx->sb.block_size;
+#ifdef __linux__
+    /* Let the kernel move the data: copy_file_range between files, sendfile to sockets and pipes. */
+    int in_fd = ctx->device->ops->fd(ctx->device);
+    bool try_range = true;
+    if (ctx->trace && in_fd >= 0 && length > 0) {
+        trace_record(ctx, IBFS_TRACE_READ, first_block, (uint32_t)((length + ctx->sb.block_size - 1) / ctx->sb.block_size),
+                     IBFS_TRACE_DATA);
+    }
+    while (in_fd >= 0 && length > 0) {
+        ssize_t n = -1;
+        if (try_range) {
+            loff_t in_offset = offset;
+            n = copy_file_range(in_fd, &in_offset, out_fd, NULL, length, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+                try_range = false;
+                continue;
+            }
+        } else {
+            off_t in_offset = offset;
+            n = sendfile(out_fd, in_fd, &in_offset, length);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("Error copying blocks");
+            return -1;
+        }
+        offset += n;
+        length -= (uint64_t)n;
+    }
+    if (length == 0) return 0;
+#endif
+
+    IBFS_BLOCK_ALIGNED char buffer[ctx->sb.block_size];
+    while (length > 0) {
+        uint32_t block_num = (uint32_t)(offset / ctx->sb.block_size);
+        uint32_t in_block = (uint32_t)(offset % ctx->sb.block_size);
+        size_t chunk = ctx->sb.block_size - in_block;
+        if (chunk > length) chunk = (size_t)length;
+        if (read_block(ctx, block_num, buffer) != 0) return -1;
+        if (write_fd(out_fd, buffer + in_block, chunk) != 0) {
+            perror("Error writing output");
+            return -1;
+        }
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+long long parse_size(const char* text) {
+    char* end = NULL;
+    long long value = strtoll(text, &end, 0);
+    if (end == text || value <= 0) return -1;
+    switch (toupper((unsigned char)*end)) {
+        case '\0': return value;
+        case 'K': value *= 1024LL; break;
+        case 'M': value *= 1024LL * 1024; break;
+        case 'G': value *= 1024LL * 1024 * 1024; break;
+        case 'T': value *= 1024LL * 1024 * 1024 * 1024; break;
+        default: return -1;
+    }
+    return (end[1] == '\0' || (toupper((unsigned char)end[1]) == 'B' && end[2] == '\0')) ? value : -1;
+}
@@ -1,5 +1,33 @@
 #pragma once
 #include "ibfs.h"
+#include <stddef.h>
 
 int read_block(IBFS_Context* ctx, uint32_t block_num, void* buffer);
-int write_block(IBFS_Context* ctx, uint32_t block_num, const void* buffer);
\ No newline at end of file
+int write_block(IBFS_Context* ctx, uint32_t block_num, const void* buffer);
+int read_blocks(IBFS_Context* ctx, uint32_t first_block, uint32_t count, void* buffer);
+int write_blocks(IBFS_Context* ctx, uint32_t first_block, uint32_t count, const void* buffer);
+/* Bitmap, inode table and B+ tree blocks: verify the checksum on read, set it on write. */
+int read_meta_block(IBFS_Context* ctx, uint32_t block_num, void* buffer);
+int read_meta_blocks(IBFS_Context* ctx, uint32_t first_block, uint32_t count, void* buffer);
+int write_meta_block(IBFS_Context* ctx, uint32_t block_num, void* buffer);
+/* Block buffers aligned so the direct backend can hand them to the device as they are. */
+#define IBFS_BLOCK_ALIGNED __attribute__((aligned(IBFS_DIRECT_ALIGNMENT)))
+void* alloc_block_buffer(IBFS_Context* ctx, size_t count);
+/*
+ * Verified metadata buffers, one block per slot; 0 slots leaves the cache off.
+ * Reset empties the cache, so the next reads go to the device.
+ */
+#define IBFS_META_CACHE_BLOCKS 1024
+void meta_cache_init(IBFS_Context* ctx, uint32_t slots);
+void meta_cache_reset(IBFS_Context* ctx);
+void meta_cache_free(IBFS_Context* ctx);
+int read_superblock(IBFS_Context* ctx);
+int write_superblock(IBFS_Context* ctx);
+int sync_disk(IBFS_Context* ctx);
+int checkpoint_disk(IBFS_Context* ctx);
+int resize_disk(IBFS_Context* ctx, uint64_t new_size);
+int copy_blocks_to_fd(IBFS_Context* ctx, uint32_t first_block, uint64_t length, int out_fd);
+int write_fd(int fd, const void* data, size_t length);
+int zero_fill_fd(int fd, uint64_t length);
+/* A positive byte count with an optional K/M/G/T suffix, optionally followed by B; -1 if malformed. */
+long long parse_size(const char* text);
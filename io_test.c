@@ -3,47 +3,200 @@
 #include <string.h>
 #include "ibfs.h"
 #include "io.h"  
+#include "crc32c.h"
 
-int main() {
-    const char* test_filename = "io_test.disk";
+static int run_test(IBFS_Device* device) {
     IBFS_Context ctx;
-    
-    ctx.disk_file = fopen(test_filename, "wb+");
-    if (!ctx.disk_file) {
-        perror("Failed to create test file");
-        return 1;
-    }
+    memset(&ctx, 0, sizeof(IBFS_Context));
+    ctx.sb.block_size = IBFS_DEFAULT_BLOCK_SIZE;
+    ctx.device = device;
 
-    printf("--- Running I/O Write/Read Test ---\n");
+    printf("--- Running I/O Write/Read Test (%s backend) ---\n", device->ops->name);
 
-    char write_buffer[BLOCK_SIZE];
-    memset(write_buffer, 'A', BLOCK_SIZE);
+    char write_buffer[IBFS_DEFAULT_BLOCK_SIZE];
+    memset(write_buffer, 'A', IBFS_DEFAULT_BLOCK_SIZE);
 
     printf("Writing pattern to Block 0...\n");
     if (write_block(&ctx, 0, write_buffer) != 0) {
         fprintf(stderr, "TEST FAILED: write_block returned an error.\n");
-        fclose(ctx.disk_file);
         return 1;
     }
     printf("Write completed.\n");
     
-    char read_buffer[BLOCK_SIZE];
-    memset(read_buffer, 'B', BLOCK_SIZE);
+    char read_buffer[IBFS_DEFAULT_BLOCK_SIZE];
+    memset(read_buffer, 'B', IBFS_DEFAULT_BLOCK_SIZE);
 
     printf("Reading pattern from Block 0...\n");
     if (read_block(&ctx, 0, read_buffer) != 0) {
         fprintf(stderr, "TEST FAILED: read_block returned an error.\n");
-        fclose(ctx.disk_file);
         return 1;
     }
     printf("Read completed.\n");
 
-    if (memcmp(write_buffer, read_buffer, BLOCK_SIZE) == 0) {
+    if (memcmp(write_buffer, read_buffer, IBFS_DEFAULT_BLOCK_SIZE) == 0) {
         printf("SUCCESS! Data written and read back correctly.\n");
-    } else {
-        printf("TEST FAILED: Data read back does not match what was written.\n");
+        return 0;
+    }
+    printf("TEST FAILED: Data read back does not match what was written.\n");
+    return 1;
+}
+
+/* Bit-at-a-time CRC-32C to check whichever implementation crc32c picked for this CPU. */
+static uint32_t crc32c_bitwise(uint32_t crc, const unsigned char* p, size_t length) {
+    crc = ~crc;
+    while (length--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static int run_crc32c_test(void) {
+    printf("--- Running CRC-32C Test (%s) ---\n", crc32c_implementation());
+    static unsigned char data[3 * IBFS_MAX_BLOCK_SIZE / 2];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (unsigned char)(i * 131 + (i >> 7));
+
+    if (crc32c(0, "123456789", 9) != 0xE3069283u) {
+        fprintf(stderr, "TEST FAILED: crc32c of the check string is %08x.\n", crc32c(0, "123456789", 9));
+        return 1;
+    }
+    /* Every short length, then samples up to the largest block, at several alignments. */
+    for (size_t length = 0; length + 8 <= sizeof(data); length += length < 1024 ? 1 : length < 3 * IBFS_DEFAULT_BLOCK_SIZE ? 13 : 1021) {
+        for (size_t offset = 0; offset < 8; offset += 3) {
+            uint32_t seed = (uint32_t)length;
+            if (crc32c(seed, data + offset, length) != crc32c_bitwise(seed, data + offset, length)) {
+                fprintf(stderr, "TEST FAILED: crc32c differs from the reference for %zu bytes at offset %zu.\n",
+                        length, offset);
+                return 1;
+            }
+        }
+    }
+    if (crc32c(crc32c(0, data, 1000), data + 1000, 5000) != crc32c(0, data, 6000)) {
+        fprintf(stderr, "TEST FAILED: a continued crc32c differs from a single pass.\n");
+        return 1;
+    }
+    printf("SUCCESS! crc32c matches the reference.\n");
+    return 0;
+}
+
+static int file_byte(const char* filename, long offset) {
+    FILE* f = fopen(filename, "rb");
+    int byte = f && fseek(f, offset, SEEK_SET) == 0 ? fgetc(f) : EOF;
+    if (f) fclose(f);
+    return byte;
+}
+
+/* Changes stay in RAM until a checkpoint; a reopened image sees everything checkpointed or closed. */
+static int run_ram_test(const char* filename) {
+    printf("--- Running RAM Checkpoint Test ---\n");
+    FILE* f = fopen(filename, "wb");
+    if (!f || fseek(f, 4L * IBFS_DEFAULT_BLOCK_SIZE - 1, SEEK_SET) != 0 || fputc(0, f) == EOF || fclose(f) != 0) {
+        perror("Failed to create test file");
+        return 1;
+    }
+
+    IBFS_Device* device = device_open(filename, IBFS_BACKEND_RAM, true);
+    if (!device) return 1;
+    if (run_test(device) != 0) {
+        device->ops->close(device);
+        return 1;
+    }
+    if (file_byte(filename, 0) != 0) {
+        fprintf(stderr, "TEST FAILED: The write reached the file before a checkpoint.\n");
+        device->ops->close(device);
+        return 1;
+    }
+    if (device->ops->checkpoint(device) != 0 || file_byte(filename, 0) != 'A') {
+        fprintf(stderr, "TEST FAILED: The checkpoint did not write block 0 back.\n");
+        device->ops->close(device);
+        return 1;
     }
 
-    fclose(ctx.disk_file);
+    char buffer[IBFS_DEFAULT_BLOCK_SIZE];
+    memset(buffer, 'C', IBFS_DEFAULT_BLOCK_SIZE);
+    int failed = device->ops->write(device, 3L * IBFS_DEFAULT_BLOCK_SIZE, buffer, IBFS_DEFAULT_BLOCK_SIZE) != 0 ||
+                 device->ops->sync(device) != 0;
+    if (!failed && file_byte(filename, 3L * IBFS_DEFAULT_BLOCK_SIZE) != 0) {
+        fprintf(stderr, "TEST FAILED: A sync point without an interval checkpointed.\n");
+        failed = 1;
+    }
+    device->ops->close(device);
+    if (failed) return 1;
+
+    device = device_open(filename, IBFS_BACKEND_RAM, false);
+    if (!device) return 1;
+    memset(buffer, 0, IBFS_DEFAULT_BLOCK_SIZE);
+    failed = device->ops->read(device, 0, buffer, 1) != 1 || buffer[0] != 'A' ||
+             device->ops->read(device, 3L * IBFS_DEFAULT_BLOCK_SIZE, buffer, IBFS_DEFAULT_BLOCK_SIZE) != IBFS_DEFAULT_BLOCK_SIZE ||
+             buffer[0] != 'C' || buffer[IBFS_DEFAULT_BLOCK_SIZE - 1] != 'C';
+    device->ops->close(device);
+    if (failed) {
+        fprintf(stderr, "TEST FAILED: The reopened image lacks checkpointed or closed writes.\n");
+        return 1;
+    }
+    printf("SUCCESS! Checkpoints and close wrote the image back.\n");
     return 0;
-}
\ No newline at end of file
+}
+
+/* Aligned buffers go straight to the device; misaligned pointers and partial sectors are bounced. */
+static int run_direct_test(const char* filename) {
+    printf("--- Running Direct I/O Test ---\n");
+    IBFS_Device* device = device_open(filename, IBFS_BACKEND_DIRECT, true);
+    if (!device) {
+        printf("Skipped: O_DIRECT is not available for '%s'.\n", filename);
+        return 0;
+    }
+    if (run_test(device) != 0) {
+        device->ops->close(device);
+        return 1;
+    }
+
+    static IBFS_BLOCK_ALIGNED char buffer[4 * IBFS_DIRECT_ALIGNMENT];
+    memset(buffer, 'D', IBFS_DIRECT_ALIGNMENT);
+    int failed = device->ops->write(device, IBFS_DIRECT_ALIGNMENT, buffer, IBFS_DIRECT_ALIGNMENT) != 0;
+    memset(buffer + 1, 'E', IBFS_DIRECT_ALIGNMENT);
+    failed = failed || device->ops->write(device, 2 * IBFS_DIRECT_ALIGNMENT, buffer + 1, IBFS_DIRECT_ALIGNMENT) != 0;
+    failed = failed || device->ops->write(device, 10, "xyz", 3) != 0;
+    memset(buffer, 0, sizeof(buffer));
+    failed = failed || device->ops->read(device, 0, buffer + 1, 3 * IBFS_DIRECT_ALIGNMENT) != 3 * IBFS_DIRECT_ALIGNMENT;
+    device->ops->close(device);
+
+    const char* data = buffer + 1;
+    failed = failed || data[9] != 'A' || memcmp(data + 10, "xyz", 3) != 0 || data[13] != 'A' ||
+             data[IBFS_DIRECT_ALIGNMENT - 1] != 'A' || data[IBFS_DIRECT_ALIGNMENT] != 'D' ||
+             data[2 * IBFS_DIRECT_ALIGNMENT - 1] != 'D' || data[2 * IBFS_DIRECT_ALIGNMENT] != 'E' ||
+             data[3 * IBFS_DIRECT_ALIGNMENT - 1] != 'E';
+    if (failed) {
+        fprintf(stderr, "TEST FAILED: Direct I/O through aligned, misaligned or partial buffers lost data.\n");
+        return 1;
+    }
+    printf("SUCCESS! Aligned, misaligned and partial requests read back correctly.\n");
+    return 0;
+}
+
+int main() {
+    const char* test_filename = "io_test.disk";
+    FILE* f = fopen(test_filename, "wb");
+    if (!f) {
+        perror("Failed to create test file");
+        return 1;
+    }
+    fclose(f);
+
+    int failures = 0;
+    IBFS_Device* device = device_open(test_filename, IBFS_BACKEND_FILE, true);
+    if (!device) return 1;
+    failures += run_test(device);
+    device->ops->close(device);
+
+    device = device_create_memory(IBFS_DEFAULT_BLOCK_SIZE);
+    if (!device) return 1;
+    failures += run_test(device);
+    device->ops->close(device);
+
+    failures += run_direct_test(test_filename);
+    failures += run_ram_test(test_filename);
+    failures += run_crc32c_test();
+    remove(test_filename);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,659 @@
+#include "libibfs.h"
+#include "inode.h"
+#include "bplustree.h"
+#include "bitmap.h"
+#include "file.h"
+#include "io.h"
+#include "nameindex.h"
+#include "path.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+/* Largest request handed to file_read/file_write, which report byte counts as int. */
+#define LIB_IO_CHUNK (1u << 30)
+
+typedef struct IBFS_Handle {
+    bool used;
+    bool unlinked;
+    int flags;
+    uint32_t inode_num;
+    Inode inode;
+    uint64_t position;
+    bool map_loaded;
+    FileBlockMap map;
+} IBFS_Handle;
+
+struct IBFS_FS {
+    IBFS_Context ctx;
+    IBFS_Handle* handles;
+    uint32_t handle_capacity;
+};
+
+struct IBFS_Dir {
+    IBFS_DirEntry* entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t next;
+    bool failed;
+};
+
+int ibfs_mount(const char* disk_path, IBFS_Backend backend, IBFS_Context* ctx) {
+    if (!disk_path || !ctx) return -1;
+    ctx->device = device_open(disk_path, backend, true);
+    if (!ctx->device) return -1;
+    if (read_superblock(ctx) != 0) {
+        ctx->device->ops->close(ctx->device);
+        return -1;
+    }
+    if (ctx->sb.magic != IBFS_MAGIC_NUMBER) {
+        fprintf(stderr, "Error: Magic number mismatch. Not an IBFS disk?\n");
+        ctx->device->ops->close(ctx->device);
+        return -1;
+    }
+    if (ctx->sb.version != IBFS_VERSION) {
+         fprintf(stderr, "Error: Unsupported IBFS version %u (expected %u).\n", ctx->sb.version, IBFS_VERSION);
+         ctx->device->ops->close(ctx->device);
+         return -1;
+    }
+    if (!IBFS_VALID_BLOCK_SIZE(ctx->sb.block_size) || ctx->sb.block_count == 0 || ctx->sb.inode_count == 0 || ctx->sb.root_inode >= ctx->sb.inode_count ||
+        ctx->sb.inode_size < sizeof(DiskInode) || ctx->sb.inode_size > IBFS_MAX_INODE_SIZE ||
+        ctx->sb.inode_bitmap_start == 0 || ctx->sb.inode_bitmap_blocks == 0 ||
+        (uint64_t)ctx->sb.inode_bitmap_blocks * IBFS_BITMAP_BITS(ctx->sb.block_size) < ctx->sb.inode_count ||
+        ctx->sb.inode_table_start < ctx->sb.inode_bitmap_start + ctx->sb.inode_bitmap_blocks ||
+        ctx->sb.first_data_block <= ctx->sb.inode_table_start || ctx->sb.first_data_block >= ctx->sb.block_count ||
+        ctx->sb.blocks_per_group < 8 || ctx->sb.blocks_per_group > IBFS_BITMAP_BITS(ctx->sb.block_size) ||
+        ctx->sb.free_blocks_count >= ctx->sb.block_count || ctx->sb.free_inodes_count > ctx->sb.inode_count ||
+        ctx->sb.refcount_table_start >= ctx->sb.block_count ||
+        ctx->sb.refcount_table_blocks > ctx->sb.block_count - ctx->sb.refcount_table_start ||
+        ctx->sb.snapshot_table_block >= ctx->sb.block_count ||
+        ctx->sb.dedup_index_start >= ctx->sb.block_count ||
+        ctx->sb.dedup_index_blocks > ctx->sb.block_count - ctx->sb.dedup_index_start ||
+        (ctx->sb.dedup_index_start != 0) != (ctx->sb.dedup_index_blocks != 0) ||
+        (ctx->sb.feature_flags & ~IBFS_FEATURE_NAME_INDEX) != 0 || ctx->sb.name_index_root >= ctx->sb.block_count ||
+        (ctx->sb.name_index_root != 0 && !(ctx->sb.feature_flags & IBFS_FEATURE_NAME_INDEX)) ||
+        ctx->sb.block_count > IBFS_MAX_BLOCK_COUNT || (ctx->sb.new_file_flags & ~IBFS_INODE_COMPRESSED) != 0) {
+         fprintf(stderr, "Error: Superblock contains invalid parameters.\n");
+         ctx->device->ops->close(ctx->device);
+         return -1;
+    }
+    meta_cache_init(ctx, IBFS_META_CACHE_BLOCKS);
+    return 0;
+}
+
+void ibfs_unmount(IBFS_Context* ctx) {
+    if (ctx && ctx->device) {
+        if (ctx->sb_dirty && !ctx->read_only && write_superblock(ctx) != 0) {
+            fprintf(stderr, "Warning: Failed to write free counts to superblock.\n");
+        }
+        if (!ctx->read_only && checkpoint_disk(ctx) != 0) {
+            fprintf(stderr, "Warning: Changes may not have reached the disk file.\n");
+        }
+        trace_close(ctx);
+        ctx->device->ops->close(ctx->device);
+        ctx->device = NULL;
+        free(ctx->meta_map);
+        ctx->meta_map = NULL;
+        meta_cache_free(ctx);
+    }
+}
+
+static int lib_fail(int error) {
+    errno = error;
+    return -1;
+}
+
+static IBFS_Handle* lib_handle(IBFS_FS* fs, int fd) {
+    if (!fs || fd < 0 || (uint32_t)fd >= fs->handle_capacity || !fs->handles[fd].used) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &fs->handles[fd];
+}
+
+static bool lib_is_open(IBFS_FS* fs, uint32_t inode_num) {
+    for (uint32_t i = 0; i < fs->handle_capacity; i++) {
+        if (fs->handles[i].used && fs->handles[i].inode_num == inode_num) return true;
+    }
+    return false;
+}
+
+/* Every handle on the inode sees the new copy; their block maps are reloaded on the next read. */
+static void lib_refresh_handles(IBFS_FS* fs, uint32_t inode_num, const Inode* inode) {
+    for (uint32_t i = 0; i < fs->handle_capacity; i++) {
+        IBFS_Handle* h = &fs->handles[i];
+        if (!h->used || h->inode_num != inode_num) continue;
+        if (&h->inode != inode) h->inode = *inode;
+        if (h->map_loaded) file_map_free(&h->map);
+        h->map_loaded = false;
+    }
+}
+
+static void lib_release_inode(IBFS_FS* fs, uint32_t inode_num, Inode* inode) {
+    file_free_blocks(&fs->ctx, inode);
+    free_inode_num(&fs->ctx, inode_num);
+}
+
+static int lib_update_root(IBFS_FS* fs, uint32_t old_root) {
+    if (fs->ctx.sb.root_bpt_block != old_root && write_superblock(&fs->ctx) != 0) return lib_fail(EIO);
+    return 0;
+}
+
+static void lib_empty_callback(BPlusTreeKey* key, uint32_t value, void* user_data) {
+    (*(uint32_t*)user_data)++;
+}
+
+static bool lib_dir_empty(IBFS_FS* fs, uint32_t dir_inode_num) {
+    uint32_t entries = 0;
+    bpt_iterate(&fs->ctx, fs->ctx.sb.root_bpt_block, dir_inode_num, lib_empty_callback, &entries);
+    return entries == 0;
+}
+
+/* Resolves the entry `path` names: its parent, its key and the inode it points to. */
+static int lib_lookup_entry(IBFS_FS* fs, const char* path, BPlusTreeKey* key, uint32_t* inode_num_out, Inode* inode_out) {
+    uint32_t parent;
+    char name[MAX_FILENAME_LENGTH];
+    int error;
+    if (path_resolve(&fs->ctx, path, true, &parent, name, &error) != 0) return lib_fail(error);
+    if (path_make_key(key, parent, name) != 0) return lib_fail(ENAMETOOLONG);
+    if (bpt_search(&fs->ctx, fs->ctx.sb.root_bpt_block, key, inode_num_out) != 0) return lib_fail(ENOENT);
+    if (inode_read(&fs->ctx, *inode_num_out, inode_out) != 0) return lib_fail(EIO);
+    return 0;
+}
+
+/* Resolves the key of a new entry at path; fails with EEXIST if path already names something. */
+static int lib_new_entry(IBFS_FS* fs, const char* path, BPlusTreeKey* key) {
+    uint32_t parent, existing;
+    char name[MAX_FILENAME_LENGTH];
+    int error;
+    if (path_resolve(&fs->ctx, path, false, &existing, NULL, &error) == 0) return lib_fail(EEXIST);
+    if (error != ENOENT) return lib_fail(error);
+    if (path_resolve(&fs->ctx, path, true, &parent, name, &error) != 0) return lib_fail(error);
+    if (path_make_key(key, parent, name) != 0) return lib_fail(ENAMETOOLONG);
+    return 0;
+}
+
+static int lib_insert_entry(IBFS_FS* fs, const BPlusTreeKey* key, uint32_t inode_num) {
+    BPlusTreeKey entry = *key;
+    uint32_t old_root = fs->ctx.sb.root_bpt_block;
+    if (bpt_insert(&fs->ctx, &fs->ctx.sb.root_bpt_block, &entry, inode_num) != 0) return lib_fail(ENOSPC);
+    if (lib_update_root(fs, old_root) != 0) return -1;
+    if (name_index_insert(&fs->ctx, &entry, inode_num) != 0) return lib_fail(EIO);
+    return 0;
+}
+
+/* Inserts a new entry for a fresh inode of the given mode and returns the inode number. */
+static int lib_create(IBFS_FS* fs, const char* path, uint16_t mode) {
+    if (fs->ctx.read_only) return lib_fail(EROFS);
+    BPlusTreeKey key;
+    if (lib_new_entry(fs, path, &key) != 0) return -1;
+    int inode_num = inode_alloc(&fs->ctx, mode);
+    if (inode_num < 0) return lib_fail(ENOSPC);
+    if (lib_insert_entry(fs, &key, (uint32_t)inode_num) != 0) {
+        if (errno == ENOSPC) free_inode_num(&fs->ctx, (uint32_t)inode_num);
+        return -1;
+    }
+    return inode_num;
+}
+
+/* A file with no entry, for IBFS_O_TMPFILE; dir_path must name a directory. */
+static int lib_create_unnamed(IBFS_FS* fs, const char* dir_path) {
+    if (fs->ctx.read_only) return lib_fail(EROFS);
+    uint32_t dir_inode_num;
+    int error;
+    Inode dir;
+    if (path_resolve(&fs->ctx, dir_path, false, &dir_inode_num, NULL, &error) != 0) return lib_fail(error);
+    if (inode_read(&fs->ctx, dir_inode_num, &dir) != 0) return lib_fail(EIO);
+    if ((dir.mode & S_IFDIR) != S_IFDIR) return lib_fail(ENOTDIR);
+    int inode_num = inode_alloc(&fs->ctx, S_IFREG);
+    return inode_num < 0 ? lib_fail(ENOSPC) : inode_num;
+}
+
+IBFS_FS* ibfs_fs_mount(const char* disk_path, IBFS_Backend backend) {
+    IBFS_FS* fs = calloc(1, sizeof(IBFS_FS));
+    if (!fs) return NULL;
+    if (ibfs_mount(disk_path, backend, &fs->ctx) != 0) {
+        free(fs);
+        errno = EIO;
+        return NULL;
+    }
+    return fs;
+}
+
+int ibfs_fs_unmount(IBFS_FS* fs) {
+    if (!fs) return lib_fail(EINVAL);
+    for (uint32_t i = 0; i < fs->handle_capacity; i++) {
+        if (fs->handles[i].used) ibfs_fs_close(fs, (int)i);
+    }
+    int result = ibfs_fs_sync(fs);
+    ibfs_unmount(&fs->ctx);
+    free(fs->handles);
+    free(fs);
+    return result;
+}
+
+int ibfs_fs_sync(IBFS_FS* fs) {
+    if (!fs) return lib_fail(EINVAL);
+    if (fs->ctx.read_only) return 0;
+    if (fs->ctx.sb_dirty && write_superblock(&fs->ctx) != 0) return lib_fail(EIO);
+    if (sync_disk(&fs->ctx) != 0 || checkpoint_disk(&fs->ctx) != 0) return lib_fail(EIO);
+    return 0;
+}
+
+IBFS_Context* ibfs_fs_context(IBFS_FS* fs) {
+    return fs ? &fs->ctx : NULL;
+}
+
+int ibfs_fs_open(IBFS_FS* fs, const char* path, int flags) {
+    if (!fs || !path || (flags & IBFS_O_ACCMODE) == IBFS_O_ACCMODE) return lib_fail(EINVAL);
+    bool writable = (flags & IBFS_O_ACCMODE) != IBFS_O_RDONLY;
+    bool unnamed = (flags & IBFS_O_TMPFILE) != 0;
+    if (unnamed && !writable) return lib_fail(EINVAL);
+    if (writable && fs->ctx.read_only) return lib_fail(EROFS);
+    uint32_t inode_num;
+    int error;
+    if (unnamed) {
+        int created = lib_create_unnamed(fs, path);
+        if (created < 0) return -1;
+        inode_num = (uint32_t)created;
+    } else if (path_resolve(&fs->ctx, path, false, &inode_num, NULL, &error) == 0) {
+        if ((flags & IBFS_O_CREAT) && (flags & IBFS_O_EXCL)) return lib_fail(EEXIST);
+    } else {
+        if (error != ENOENT || !(flags & IBFS_O_CREAT)) return lib_fail(error);
+        int created = lib_create(fs, path, S_IFREG);
+        if (created < 0) return -1;
+        inode_num = (uint32_t)created;
+    }
+
+    Inode inode;
+    if (inode_read(&fs->ctx, inode_num, &inode) != 0) return lib_fail(EIO);
+    if ((inode.mode & S_IFDIR) == S_IFDIR && writable) return lib_fail(EISDIR);
+    if ((flags & IBFS_O_TRUNC) && writable && (inode.size > 0 || (inode.flags & IBFS_INODE_INLINE))) {
+        file_free_blocks(&fs->ctx, &inode);
+        inode_now(&inode.mtime);
+        inode.ctime = inode.mtime;
+        if (inode_write(&fs->ctx, inode_num, &inode) != 0) return lib_fail(EIO);
+        lib_refresh_handles(fs, inode_num, &inode);
+    }
+
+    uint32_t fd = 0;
+    while (fd < fs->handle_capacity && fs->handles[fd].used) fd++;
+    if (fd == fs->handle_capacity) {
+        uint32_t capacity = fs->handle_capacity ? fs->handle_capacity * 2 : 16;
+        IBFS_Handle* grown = realloc(fs->handles, (size_t)capacity * sizeof(IBFS_Handle));
+        if (!grown) {
+            if (unnamed) free_inode_num(&fs->ctx, inode_num);
+            return lib_fail(ENOMEM);
+        }
+        memset(grown + fs->handle_capacity, 0, (size_t)(capacity - fs->handle_capacity) * sizeof(IBFS_Handle));
+        fs->handles = grown;
+        fs->handle_capacity = capacity;
+    }
+    IBFS_Handle* h = &fs->handles[fd];
+    memset(h, 0, sizeof(IBFS_Handle));
+    h->used = true;
+    h->flags = flags;
+    h->inode_num = inode_num;
+    h->inode = inode;
+    h->unlinked = unnamed;
+    return (int)fd;
+}
+
+long long ibfs_fs_read(IBFS_FS* fs, int fd, void* buffer, size_t length) {
+    IBFS_Handle* h = lib_handle(fs, fd);
+    if (!h) return -1;
+    if ((h->flags & IBFS_O_ACCMODE) == IBFS_O_WRONLY) return lib_fail(EBADF);
+    if ((h->inode.mode & S_IFDIR) == S_IFDIR) return lib_fail(EISDIR);
+    if (!h->map_loaded) {
+        if (file_map_load(&fs->ctx, &h->inode, &h->map) != 0) return lib_fail(EIO);
+        h->map_loaded = true;
+    }
+
+    size_t done = 0;
+    while (done < length) {
+        size_t chunk = length - done < LIB_IO_CHUNK ? length - done : LIB_IO_CHUNK;
+        int n = file_read_mapped(&fs->ctx, &h->inode, &h->map, h->position, (char*)buffer + done, chunk);
+        if (n < 0) return done > 0 ? (long long)done : lib_fail(EIO);
+        h->position += (uint64_t)n;
+        done += (size_t)n;
+        if ((size_t)n < chunk) break;
+    }
+    return (long long)done;
+}
+
+long long ibfs_fs_write(IBFS_FS* fs, int fd, const void* buffer, size_t length) {
+    IBFS_Handle* h = lib_handle(fs, fd);
+    if (!h) return -1;
+    if ((h->flags & IBFS_O_ACCMODE) == IBFS_O_RDONLY) return lib_fail(EBADF);
+    if (h->flags & IBFS_O_APPEND) h->position = h->inode.size;
+
+    size_t done = 0;
+    int result = 0;
+    while (done < length && result == 0) {
+        size_t chunk = length - done < LIB_IO_CHUNK ? length - done : LIB_IO_CHUNK;
+        if (file_write(&fs->ctx, h->inode_num, &h->inode, h->position, (const char*)buffer + done, chunk) < 0) {
+            result = -1;
+            break;
+        }
+        h->position += chunk;
+        done += chunk;
+    }
+    lib_refresh_handles(fs, h->inode_num, &h->inode);
+    if (result != 0 && done == 0) return lib_fail(EIO);
+    return (long long)done;
+}
+
+long long ibfs_fs_lseek(IBFS_FS* fs, int fd, long long offset, int whence) {
+    IBFS_Handle* h = lib_handle(fs, fd);
+    if (!h) return -1;
+    long long base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = (long long)h->position; break;
+        case SEEK_END: base = (long long)h->inode.size; break;
+        case IBFS_SEEK_DATA:
+        case IBFS_SEEK_HOLE: {
+            uint64_t found;
+            if (offset < 0 || (uint64_t)offset >= h->inode.size) return lib_fail(ENXIO);
+            int rc = file_seek_data(&fs->ctx, &h->inode, (uint64_t)offset, whence == IBFS_SEEK_HOLE, &found);
+            if (rc != 0) return lib_fail(rc > 0 ? ENXIO : EIO);
+            h->position = found;
+            return (long long)found;
+        }
+        default: return lib_fail(EINVAL);
+    }
+    if ((offset > 0 && base > LLONG_MAX - offset) || base + offset < 0) return lib_fail(EINVAL);
+    h->position = (uint64_t)(base + offset);
+    return base + offset;
+}
+
+int ibfs_fs_ftruncate(IBFS_FS* fs, int fd, long long length) {
+    IBFS_Handle* h = lib_handle(fs, fd);
+    if (!h) return -1;
+    if (length < 0 || (h->flags & IBFS_O_ACCMODE) == IBFS_O_RDONLY) return lib_fail(EINVAL);
+    if ((uint64_t)length > file_max_size(&fs->ctx)) return lib_fail(EFBIG);
+    int result = file_truncate(&fs->ctx, h->inode_num, &h->inode, (uint64_t)length);
+    lib_refresh_handles(fs, h->inode_num, &h->inode);
+    return result == 0 ? 0 : lib_fail(EIO);
+}
+
+int ibfs_fs_fallocate(IBFS_FS* fs, int fd, int mode, long long offset, long long length) {
+    IBFS_Handle* h = lib_handle(fs, fd);
+    if (!h) return -1;
+    if (offset < 0 || length <= 0 || (mode & ~IBFS_FALLOC_KEEP_SIZE) != 0) return lib_fail(EINVAL);
+    if ((h->flags & IBFS_O_ACCMODE) == IBFS_O_RDONLY) return lib_fail(EBADF);
+    if (offset > LLONG_MAX - length || (uint64_t)(offset + length) > file_max_size(&fs->ctx)) return lib_fail(EFBIG);
+    if (h->inode.flags & IBFS_INODE_COMPRESSED) return lib_fail(EOPNOTSUPP);
+    /* A failed request frees what it reserved, so running out is judged against the space it started with. */
+    uint32_t block_size = fs->ctx.sb.block_size;
+    uint64_t blocks = ((uint64_t)offset % block_size + (uint64_t)length + block_size - 1) / block_size;
+    uint64_t free_before = fs->ctx.sb.free_blocks_count;
+    int result = file_preallocate(&fs->ctx, h->inode_num, &h->inode, (uint64_t)offset, (uint64_t)length,
+                                  (mode & IBFS_FALLOC_KEEP_SIZE) != 0);
+    lib_refresh_handles(fs, h->inode_num, &h->inode);
+    if (result != 0) return lib_fail(blocks + file_indirect_blocks(&fs->ctx, blocks) > free_before ? ENOSPC : EIO);
+    return 0;
+}
+
+int ibfs_fs_close(IBFS_FS* fs, int fd) {
+    IBFS_Handle* h = lib_handle(fs, fd);
+    if (!h) return -1;
+    if (h->map_loaded) file_map_free(&h->map);
+    h->used = false;
+    if (h->unlinked && !lib_is_open(fs, h->inode_num)) lib_release_inode(fs, h->inode_num, &h->inode);
+    return 0;
+}
+
+int ibfs_fs_link(IBFS_FS* fs, int fd, const char* path) {
+    IBFS_Handle* h = lib_handle(fs, fd);
+    if (!h) return -1;
+    if (!h->unlinked) return lib_fail(EMLINK);
+    BPlusTreeKey key;
+    if (lib_new_entry(fs, path, &key) != 0 || lib_insert_entry(fs, &key, h->inode_num) != 0) return -1;
+    for (uint32_t i = 0; i < fs->handle_capacity; i++) {
+        if (fs->handles[i].used && fs->handles[i].inode_num == h->inode_num) fs->handles[i].unlinked = false;
+    }
+    return 0;
+}
+
+int ibfs_fs_export(IBFS_FS* fs, int fd, int out_fd) {
+    IBFS_Handle* h = lib_handle(fs, fd);
+    if (!h) return -1;
+    if ((h->flags & IBFS_O_ACCMODE) == IBFS_O_WRONLY) return lib_fail(EBADF);
+    if ((h->inode.mode & S_IFDIR) == S_IFDIR) return lib_fail(EISDIR);
+    return file_export(&fs->ctx, &h->inode, out_fd) == 0 ? 0 : lib_fail(EIO);
+}
+
+static void lib_fill_stat(uint32_t inode_num, const Inode* inode, IBFS_Stat* st) {
+    st->ino = inode_num;
+    st->mode = inode->mode;
+    st->links = inode->links_count;
+    st->flags = inode->flags;
+    st->size = inode->size;
+    st->atime = inode->atime;
+    st->mtime = inode->mtime;
+    st->ctime = inode->ctime;
+}
+
+int ibfs_fs_stat(IBFS_FS* fs, const char* path, IBFS_Stat* st) {
+    if (!fs || !st) return lib_fail(EINVAL);
+    uint32_t inode_num;
+    int error;
+    Inode inode;
+    if (path_resolve(&fs->ctx, path, false, &inode_num, NULL, &error) != 0) return lib_fail(error);
+    if (inode_read(&fs->ctx, inode_num, &inode) != 0) return lib_fail(EIO);
+    lib_fill_stat(inode_num, &inode, st);
+    return 0;
+}
+
+int ibfs_fs_fstat(IBFS_FS* fs, int fd, IBFS_Stat* st) {
+    IBFS_Handle* h = lib_handle(fs, fd);
+    if (!h) return -1;
+    if (!st) return lib_fail(EINVAL);
+    lib_fill_stat(h->inode_num, &h->inode, st);
+    return 0;
+}
+
+static void lib_dir_callback(BPlusTreeKey* key, uint32_t value, void* user_data) {
+    IBFS_Dir* dir = (IBFS_Dir*)user_data;
+    if (dir->failed) return;
+    if (dir->count == dir->capacity) {
+        uint32_t capacity = dir->capacity ? dir->capacity * 2 : 64;
+        IBFS_DirEntry* grown = realloc(dir->entries, (size_t)capacity * sizeof(IBFS_DirEntry));
+        if (!grown) {
+            dir->failed = true;
+            return;
+        }
+        dir->entries = grown;
+        dir->capacity = capacity;
+    }
+    IBFS_DirEntry* entry = &dir->entries[dir->count++];
+    entry->ino = value;
+    memcpy(entry->name, key->name, sizeof(entry->name));
+    entry->name[sizeof(entry->name) - 1] = '\0';
+}
+
+static IBFS_Dir* lib_open_dir(IBFS_FS* fs, const char* path, uint32_t* inode_num_out) {
+    if (!fs) {
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t inode_num;
+    int error;
+    Inode inode;
+    if (path_resolve(&fs->ctx, path, false, &inode_num, NULL, &error) != 0) {
+        errno = error;
+        return NULL;
+    }
+    if (inode_read(&fs->ctx, inode_num, &inode) != 0) {
+        errno = EIO;
+        return NULL;
+    }
+    if ((inode.mode & S_IFDIR) != S_IFDIR) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    IBFS_Dir* dir = calloc(1, sizeof(IBFS_Dir));
+    if (!dir) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    *inode_num_out = inode_num;
+    return dir;
+}
+
+IBFS_Dir* ibfs_fs_opendir(IBFS_FS* fs, const char* path) {
+    uint32_t inode_num;
+    IBFS_Dir* dir = lib_open_dir(fs, path, &inode_num);
+    if (!dir) return NULL;
+    if (bpt_iterate(&fs->ctx, fs->ctx.sb.root_bpt_block, inode_num, lib_dir_callback, dir) != 0 || dir->failed) {
+        errno = dir->failed ? ENOMEM : EIO;
+        ibfs_fs_closedir(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+IBFS_Dir* ibfs_fs_opendir_sorted(IBFS_FS* fs, const char* path, const char* prefix, const char* after, uint32_t limit) {
+    uint32_t inode_num;
+    IBFS_Dir* dir = lib_open_dir(fs, path, &inode_num);
+    if (!dir) return NULL;
+    if (name_index_list(&fs->ctx, inode_num, prefix, after, limit, lib_dir_callback, dir) != 0 || dir->failed) {
+        errno = dir->failed ? ENOMEM : EIO;
+        ibfs_fs_closedir(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+const IBFS_DirEntry* ibfs_fs_readdir(IBFS_Dir* dir) {
+    if (!dir || dir->next >= dir->count) return NULL;
+    return &dir->entries[dir->next++];
+}
+
+void ibfs_fs_closedir(IBFS_Dir* dir) {
+    if (!dir) return;
+    free(dir->entries);
+    free(dir);
+}
+
+int ibfs_fs_mkdir(IBFS_FS* fs, const char* path) {
+    if (!fs) return lib_fail(EINVAL);
+    return lib_create(fs, path, S_IFDIR) < 0 ? -1 : 0;
+}
+
+int ibfs_fs_rmdir(IBFS_FS* fs, const char* path) {
+    if (!fs) return lib_fail(EINVAL);
+    if (fs->ctx.read_only) return lib_fail(EROFS);
+    BPlusTreeKey key;
+    uint32_t inode_num;
+    Inode inode;
+    if (lib_lookup_entry(fs, path, &key, &inode_num, &inode) != 0) return -1;
+    if ((inode.mode & S_IFDIR) != S_IFDIR) return lib_fail(ENOTDIR);
+    if (!lib_dir_empty(fs, inode_num)) return lib_fail(ENOTEMPTY);
+
+    uint32_t old_root = fs->ctx.sb.root_bpt_block;
+    if (bpt_delete(&fs->ctx, &fs->ctx.sb.root_bpt_block, &key) != 0) return lib_fail(EIO);
+    if (lib_update_root(fs, old_root) != 0) return -1;
+    if (name_index_delete(&fs->ctx, &key) != 0) return lib_fail(EIO);
+    free_inode_num(&fs->ctx, inode_num);
+    return 0;
+}
+
+/* Drops a file whose entry is already gone, now or when its last handle closes. */
+static void lib_drop_file(IBFS_FS* fs, uint32_t inode_num, Inode* inode) {
+    if (!lib_is_open(fs, inode_num)) {
+        lib_release_inode(fs, inode_num, inode);
+        return;
+    }
+    for (uint32_t i = 0; i < fs->handle_capacity; i++) {
+        if (fs->handles[i].used && fs->handles[i].inode_num == inode_num) fs->handles[i].unlinked = true;
+    }
+}
+
+int ibfs_fs_unlink(IBFS_FS* fs, const char* path) {
+    if (!fs) return lib_fail(EINVAL);
+    if (fs->ctx.read_only) return lib_fail(EROFS);
+    BPlusTreeKey key;
+    uint32_t inode_num;
+    Inode inode;
+    if (lib_lookup_entry(fs, path, &key, &inode_num, &inode) != 0) return -1;
+    if ((inode.mode & S_IFDIR) == S_IFDIR) return lib_fail(EISDIR);
+
+    uint32_t old_root = fs->ctx.sb.root_bpt_block;
+    if (bpt_delete(&fs->ctx, &fs->ctx.sb.root_bpt_block, &key) != 0) return lib_fail(EIO);
+    if (lib_update_root(fs, old_root) != 0) return -1;
+    if (name_index_delete(&fs->ctx, &key) != 0) return lib_fail(EIO);
+    lib_drop_file(fs, inode_num, &inode);
+    return 0;
+}
+
+/* True when moving directory dir_inode_num to path would place it inside itself. */
+static bool lib_inside(IBFS_FS* fs, uint32_t dir_inode_num, const char* path) {
+    char prefix[4096];
+    size_t length = strlen(path);
+    if (length >= sizeof(prefix)) return false;
+    memcpy(prefix, path, length + 1);
+    for (size_t i = 1; i < length; i++) {
+        if (prefix[i] != '/') continue;
+        uint32_t inode_num;
+        int error;
+        prefix[i] = '\0';
+        bool match = path_resolve(&fs->ctx, prefix, false, &inode_num, NULL, &error) == 0 && inode_num == dir_inode_num;
+        prefix[i] = '/';
+        if (match) return true;
+    }
+    return false;
+}
+
+int ibfs_fs_rename(IBFS_FS* fs, const char* old_path, const char* new_path) {
+    if (!fs || !new_path) return lib_fail(EINVAL);
+    if (fs->ctx.read_only) return lib_fail(EROFS);
+    BPlusTreeKey old_key, new_key;
+    uint32_t inode_num, parent, target_num;
+    char name[MAX_FILENAME_LENGTH];
+    int error;
+    Inode inode, target;
+    if (lib_lookup_entry(fs, old_path, &old_key, &inode_num, &inode) != 0) return -1;
+    if (path_resolve(&fs->ctx, new_path, true, &parent, name, &error) != 0) return lib_fail(error);
+    if (path_make_key(&new_key, parent, name) != 0) return lib_fail(ENAMETOOLONG);
+    if (memcmp(&old_key, &new_key, sizeof(BPlusTreeKey)) == 0) return 0;
+    bool is_dir = (inode.mode & S_IFDIR) == S_IFDIR;
+    if (is_dir && (parent == inode_num || lib_inside(fs, inode_num, new_path))) return lib_fail(EINVAL);
+
+    bool replace = bpt_search(&fs->ctx, fs->ctx.sb.root_bpt_block, &new_key, &target_num) == 0;
+    if (replace) {
+        if (inode_read(&fs->ctx, target_num, &target) != 0) return lib_fail(EIO);
+        bool target_dir = (target.mode & S_IFDIR) == S_IFDIR;
+        if (target_dir && !is_dir) return lib_fail(EISDIR);
+        if (!target_dir && is_dir) return lib_fail(ENOTDIR);
+        if (target_dir && !lib_dir_empty(fs, target_num)) return lib_fail(ENOTEMPTY);
+    }
+
+    uint32_t old_root = fs->ctx.sb.root_bpt_block;
+    if (bpt_delete(&fs->ctx, &fs->ctx.sb.root_bpt_block, &old_key) != 0) return lib_fail(EIO);
+    if (replace && bpt_delete(&fs->ctx, &fs->ctx.sb.root_bpt_block, &new_key) != 0) {
+        bpt_insert(&fs->ctx, &fs->ctx.sb.root_bpt_block, &old_key, inode_num);
+        lib_update_root(fs, old_root);
+        return lib_fail(EIO);
+    }
+    if (bpt_insert(&fs->ctx, &fs->ctx.sb.root_bpt_block, &new_key, inode_num) != 0) {
+        if (replace) bpt_insert(&fs->ctx, &fs->ctx.sb.root_bpt_block, &new_key, target_num);
+        bpt_insert(&fs->ctx, &fs->ctx.sb.root_bpt_block, &old_key, inode_num);
+        lib_update_root(fs, old_root);
+        return lib_fail(ENOSPC);
+    }
+    if (lib_update_root(fs, old_root) != 0) return -1;
+    if (name_index_delete(&fs->ctx, &old_key) != 0 || (replace && name_index_delete(&fs->ctx, &new_key) != 0) ||
+        name_index_insert(&fs->ctx, &new_key, inode_num) != 0) {
+        return lib_fail(EIO);
+    }
+    if (replace) {
+        if ((target.mode & S_IFDIR) == S_IFDIR) free_inode_num(&fs->ctx, target_num);
+        else lib_drop_file(fs, target_num, &target);
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "ibfs.h"
+#include "bplustree.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * In-process file API over a mounted image, for programs that embed IBFS
+ * instead of running ibfs_tool. Link libibfs.c with the other sources
+ * except ibfs_tool.c and mkfs.c.
+ *
+ * Calls follow POSIX: paths are absolute, failures return -1 (NULL for
+ * pointers) and set errno. Each open file keeps its inode and block map,
+ * so reads through a handle neither walk the path nor re-read the inode
+ * and indirect blocks. An IBFS_FS is not thread-safe; callers serialise
+ * access to it. Calls that would change a read-only image, such as a
+ * snapshot view, fail with EROFS.
+ */
+
+#define IBFS_O_RDONLY 0x0000
+#define IBFS_O_WRONLY 0x0001
+#define IBFS_O_RDWR   0x0002
+#define IBFS_O_ACCMODE 0x0003
+#define IBFS_O_CREAT  0x0100
+#define IBFS_O_EXCL   0x0200
+#define IBFS_O_TRUNC  0x0400
+#define IBFS_O_APPEND 0x0800
+/* path names a directory; the new file has no name until ibfs_fs_link gives it one. */
+#define IBFS_O_TMPFILE 0x1000
+
+/* lseek whence values past SEEK_END, numbered as on Linux. */
+#define IBFS_SEEK_DATA 3
+#define IBFS_SEEK_HOLE 4
+
+#define IBFS_FALLOC_KEEP_SIZE 0x01
+
+typedef struct IBFS_FS IBFS_FS;
+typedef struct IBFS_Dir IBFS_Dir;
+
+typedef struct IBFS_Stat {
+    uint32_t ino;
+    uint16_t mode;
+    uint16_t links;
+    uint16_t flags;
+    uint64_t size;
+    IBFS_Timespec atime;
+    IBFS_Timespec mtime;
+    IBFS_Timespec ctime;
+} IBFS_Stat;
+
+typedef struct IBFS_DirEntry {
+    uint32_t ino;
+    char name[MAX_FILENAME_LENGTH];
+} IBFS_DirEntry;
+
+IBFS_FS* ibfs_fs_mount(const char* disk_path, IBFS_Backend backend);
+/* Closes every handle still open, then writes back and closes the image. */
+int ibfs_fs_unmount(IBFS_FS* fs);
+int ibfs_fs_sync(IBFS_FS* fs);
+IBFS_Context* ibfs_fs_context(IBFS_FS* fs);
+
+int ibfs_fs_open(IBFS_FS* fs, const char* path, int flags);
+long long ibfs_fs_read(IBFS_FS* fs, int fd, void* buffer, size_t length);
+long long ibfs_fs_write(IBFS_FS* fs, int fd, const void* buffer, size_t length);
+/*
+ * whence is SEEK_SET, SEEK_CUR, SEEK_END, or IBFS_SEEK_DATA / IBFS_SEEK_HOLE to find
+ * the next data or hole at or after offset; the end of the file counts as a hole.
+ */
+long long ibfs_fs_lseek(IBFS_FS* fs, int fd, long long offset, int whence);
+/* Shrinking frees the blocks past the new end; growing leaves a hole that reads as zeros. */
+int ibfs_fs_ftruncate(IBFS_FS* fs, int fd, long long length);
+/* Reserves zeroed blocks for the range; the file grows to cover it unless mode has IBFS_FALLOC_KEEP_SIZE. */
+int ibfs_fs_fallocate(IBFS_FS* fs, int fd, int mode, long long offset, long long length);
+int ibfs_fs_close(IBFS_FS* fs, int fd);
+/* Names a file opened with IBFS_O_TMPFILE; fails with EEXIST if path exists. Files have one name only. */
+int ibfs_fs_link(IBFS_FS* fs, int fd, const char* path);
+/* Copies the whole file to a host descriptor without going through the handle's position; holes stay holes where out_fd can seek. */
+int ibfs_fs_export(IBFS_FS* fs, int fd, int out_fd);
+
+int ibfs_fs_stat(IBFS_FS* fs, const char* path, IBFS_Stat* st);
+int ibfs_fs_fstat(IBFS_FS* fs, int fd, IBFS_Stat* st);
+
+/* The listing is taken when the directory is opened, in B+ tree order. */
+IBFS_Dir* ibfs_fs_opendir(IBFS_FS* fs, const char* path);
+/*
+ * A page of the listing in name order: names after `after` that start with prefix
+ * (either may be NULL), at most limit of them (0 for all). Uses the image's name
+ * index when it has one.
+ */
+IBFS_Dir* ibfs_fs_opendir_sorted(IBFS_FS* fs, const char* path, const char* prefix, const char* after, uint32_t limit);
+const IBFS_DirEntry* ibfs_fs_readdir(IBFS_Dir* dir);
+void ibfs_fs_closedir(IBFS_Dir* dir);
+
+int ibfs_fs_mkdir(IBFS_FS* fs, const char* path);
+int ibfs_fs_rmdir(IBFS_FS* fs, const char* path);
+/* An open file loses its name at once; its data is freed when the last handle closes. */
+int ibfs_fs_unlink(IBFS_FS* fs, const char* path);
+/* Replaces an existing file, or an empty directory when a directory is moved onto it. */
+int ibfs_fs_rename(IBFS_FS* fs, const char* old_path, const char* new_path);
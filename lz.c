@@ -0,0 +1,129 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_LOG 13
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+/* The last match must end this far before the input does; the tail is always literals. */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static uint32_t lz_read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static unsigned char* lz_put_length(unsigned char* op, unsigned char* end, size_t length) {
+    while (length >= 255) {
+        if (op >= end) return NULL;
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= end) return NULL;
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+static unsigned char* lz_put_sequence(unsigned char* op, unsigned char* end, const unsigned char* literals,
+                                      size_t literal_length, size_t offset, size_t match_length) {
+    if (op >= end) return NULL;
+    unsigned char* token = op++;
+    *token = (unsigned char)((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15 && !(op = lz_put_length(op, end, literal_length - 15))) return NULL;
+    if ((size_t)(end - op) < literal_length) return NULL;
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0) return op;
+
+    if (end - op < 2) return NULL;
+    *op++ = (unsigned char)(offset & 0xFF);
+    *op++ = (unsigned char)(offset >> 8);
+    size_t code = match_length - LZ_MIN_MATCH;
+    *token |= (unsigned char)(code >= 15 ? 15 : code);
+    if (code >= 15 && !(op = lz_put_length(op, end, code - 15))) return NULL;
+    return op;
+}
+
+/* Greedy single-probe matcher: one hash slot per 4-byte prefix, skipping faster through incompressible runs. */
+size_t lz_compress(const void* src, size_t src_length, void* dst, size_t dst_capacity) {
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* op = (unsigned char*)dst;
+    unsigned char* end = op + dst_capacity;
+    uint32_t table[1 << LZ_HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0, anchor = 0;
+    if (src_length > LZ_MATCH_LIMIT) {
+        size_t limit = src_length - LZ_MATCH_LIMIT;
+        while (ip < limit) {
+            uint32_t sequence = lz_read32(in + ip);
+            uint32_t h = lz_hash(sequence);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(in + ref) != sequence) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            size_t match_length = LZ_MIN_MATCH;
+            while (ip + match_length < src_length - LZ_LAST_LITERALS && in[ref + match_length] == in[ip + match_length]) {
+                match_length++;
+            }
+            op = lz_put_sequence(op, end, in + anchor, ip - anchor, ip - ref, match_length);
+            if (!op) return 0;
+            ip += match_length;
+            anchor = ip;
+        }
+    }
+    op = lz_put_sequence(op, end, in + anchor, src_length - anchor, 0, 0);
+    if (!op) return 0;
+    return (size_t)(op - (unsigned char*)dst);
+}
+
+static int lz_get_length(const unsigned char** ip, const unsigned char* end, size_t* length) {
+    unsigned char byte;
+    do {
+        if (*ip >= end) return -1;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int lz_decompress(const void* src, size_t src_length, void* dst, size_t dst_length) {
+    const unsigned char* ip = (const unsigned char*)src;
+    const unsigned char* in_end = ip + src_length;
+    unsigned char* out = (unsigned char*)dst;
+    size_t op = 0;
+
+    /* Every stream ends in a sequence of literals only, so running out of input anywhere else is corruption. */
+    for (;;) {
+        if (ip >= in_end) return -1;
+        unsigned char token = *ip++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && lz_get_length(&ip, in_end, &literal_length) != 0) return -1;
+        if ((size_t)(in_end - ip) < literal_length || dst_length - op < literal_length) return -1;
+        memcpy(out + op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == in_end) break;
+
+        if (in_end - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && lz_get_length(&ip, in_end, &match_length) != 0) return -1;
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || dst_length - op < match_length) return -1;
+        /* Byte by byte: the source may overlap the bytes being produced. */
+        const unsigned char* from = out + op - offset;
+        for (size_t i = 0; i < match_length; i++) out[op + i] = from[i];
+        op += match_length;
+    }
+    return op == dst_length ? 0 : -1;
+}
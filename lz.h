@@ -0,0 +1,14 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * Byte-oriented LZ77 codec in the LZ4 block layout: each sequence is a token
+ * (literal length in the high nibble, match length - 4 in the low nibble), the
+ * literals, a little-endian 16-bit back offset and length extension bytes.
+ * The last sequence carries literals only.
+ */
+
+/* Returns the compressed size, or 0 when the result would not fit in dst_capacity. */
+size_t lz_compress(const void* src, size_t src_length, void* dst, size_t dst_capacity);
+/* Fills dst with exactly dst_length bytes; fails when the input is corrupt, truncated or decodes to another length. */
+int lz_decompress(const void* src, size_t src_length, void* dst, size_t dst_length);
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ibfs_disk.h"
+#include "lz.h"
+
+#define TEST_BLOCK_SIZE IBFS_DEFAULT_BLOCK_SIZE
+#define TEST_CLUSTER_BYTES (IBFS_CLUSTER_BLOCKS * TEST_BLOCK_SIZE)
+/* Bytes past dst_capacity that the decompressor must leave alone. */
+#define TEST_GUARD 64
+
+static int failures = 0;
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ull;
+
+static unsigned char next_byte(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned char)(rng_state >> 24);
+}
+
+static void expect(int condition, const char* what) {
+    if (!condition) {
+        fprintf(stderr, "TEST FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+/* Decompresses into `length` bytes followed by a guard; returns the result and checks the guard. */
+static int decompress_guarded(const unsigned char* stream, size_t stream_length, unsigned char* out, size_t length,
+                              const char* what) {
+    /* A heap copy of exactly stream_length bytes lets a sanitizer catch reads past the input. */
+    unsigned char* input = malloc(stream_length ? stream_length : 1);
+    if (!input) return -1;
+    memcpy(input, stream, stream_length);
+    memset(out + length, 0xA5, TEST_GUARD);
+    int result = lz_decompress(input, stream_length, out, length);
+    free(input);
+    for (size_t i = 0; i < TEST_GUARD; i++) {
+        if (out[length + i] != 0xA5) {
+            fprintf(stderr, "TEST FAILED: %s wrote past the output buffer\n", what);
+            failures++;
+            break;
+        }
+    }
+    return result;
+}
+
+/* Compresses with room for the worst case, checks the size against `limit` and decompresses it back. */
+static size_t round_trip(const unsigned char* data, size_t length, size_t limit, unsigned char* stream, const char* what) {
+    printf("--- Running round trip: %s (%zu bytes) ---\n", what, length);
+    size_t capacity = length + length / 255 + 16;
+    size_t stream_length = lz_compress(data, length, stream, capacity);
+    if (stream_length == 0 || stream_length > limit) {
+        fprintf(stderr, "TEST FAILED: %s compressed to %zu bytes, expected 1 to %zu\n", what, stream_length, limit);
+        failures++;
+        return 0;
+    }
+    unsigned char* out = malloc(length + 1 + TEST_GUARD);
+    if (!out) return 0;
+    if (decompress_guarded(stream, stream_length, out, length, what) != 0 || memcmp(out, data, length) != 0) {
+        fprintf(stderr, "TEST FAILED: %s did not decompress to the original %zu bytes\n", what, length);
+        failures++;
+    }
+    if (length > 0) {
+        expect(decompress_guarded(stream, stream_length, out, length - 1, what) == -1,
+               "decompressing into one byte less than the original fails");
+    }
+    expect(decompress_guarded(stream, stream_length, out, length + 1, what) == -1,
+           "decompressing into one byte more than the original fails");
+    free(out);
+    printf("%zu -> %zu bytes\n", length, stream_length);
+    return stream_length;
+}
+
+static void test_incompressible(unsigned char* data, unsigned char* stream) {
+    for (size_t i = 0; i < TEST_CLUSTER_BYTES; i++) data[i] = next_byte();
+    round_trip(data, TEST_CLUSTER_BYTES, TEST_CLUSTER_BYTES + TEST_CLUSTER_BYTES / 255 + 16, stream, "random data");
+    /* The file layer only keeps a stream that saves a block; random data must report that it does not fit. */
+    expect(lz_compress(data, TEST_CLUSTER_BYTES, stream, TEST_CLUSTER_BYTES - TEST_BLOCK_SIZE) == 0,
+           "random data does not fit in one block less");
+}
+
+static void test_zeros(unsigned char* data, unsigned char* stream) {
+    memset(data, 0, TEST_CLUSTER_BYTES);
+    round_trip(data, TEST_CLUSTER_BYTES, TEST_CLUSTER_BYTES / 128, stream, "all zeros");
+    round_trip(data, 0, 1, stream, "empty input");
+    round_trip(data, 7, 8, stream, "input shorter than a match");
+}
+
+/* The last block of a file is zero-filled past its end, and the last cluster may have fewer blocks. */
+static void test_partial_block(unsigned char* data, unsigned char* stream) {
+    size_t used = 7 * TEST_BLOCK_SIZE + 1000;
+    for (size_t i = 0; i < used; i++) data[i] = (unsigned char)("0123456789abcdef"[(i * i) % 16] + (i / 4096));
+    memset(data + used, 0, TEST_CLUSTER_BYTES - used);
+    round_trip(data, TEST_CLUSTER_BYTES, TEST_CLUSTER_BYTES - TEST_BLOCK_SIZE, stream, "cluster with a partial last block");
+    round_trip(data, 3 * TEST_BLOCK_SIZE, 2 * TEST_BLOCK_SIZE, stream, "short last cluster");
+    round_trip(data, used, used, stream, "input ending mid-block");
+}
+
+static void test_damaged_input(unsigned char* data, unsigned char* stream) {
+    printf("--- Running truncated and corrupted input test ---\n");
+    for (size_t i = 0; i < TEST_CLUSTER_BYTES; i++) data[i] = (i % 300 < 200) ? (unsigned char)(i / 7) : next_byte();
+    size_t stream_length = lz_compress(data, TEST_CLUSTER_BYTES, stream, 2 * TEST_CLUSTER_BYTES);
+    expect(stream_length > 0, "compress mixed data");
+    unsigned char* out = malloc(TEST_CLUSTER_BYTES + TEST_GUARD);
+    if (!out || stream_length == 0) {
+        free(out);
+        return;
+    }
+
+    int truncated_ok = 1;
+    for (size_t cut = 0; cut < stream_length; cut++) {
+        if (decompress_guarded(stream, cut, out, TEST_CLUSTER_BYTES, "truncated input") != -1) truncated_ok = 0;
+    }
+    expect(truncated_ok, "every truncated stream fails to decompress");
+
+    /* Damage to literal bytes still decodes, so only staying inside both buffers is required there. */
+    unsigned char* damaged = malloc(stream_length);
+    int errors = 0;
+    for (int trial = 0; damaged && trial < 2000; trial++) {
+        memcpy(damaged, stream, stream_length);
+        int flips = 1 + trial % 4;
+        for (int f = 0; f < flips; f++) damaged[(next_byte() << 16 | next_byte() << 8 | next_byte()) % stream_length] ^= (unsigned char)(1 + next_byte() % 255);
+        int result = decompress_guarded(damaged, stream_length, out, TEST_CLUSTER_BYTES, "corrupted input");
+        expect(result == 0 || result == -1, "corrupted input returns 0 or -1");
+        if (result == -1) errors++;
+    }
+    free(damaged);
+    printf("%d of 2000 corrupted streams rejected\n", errors);
+
+    static const unsigned char zero_offset[] = { 0x10, 'a', 0x00, 0x00, 0x00 };
+    static const unsigned char far_offset[] = { 0x10, 'a', 0x02, 0x00, 0x00 };
+    static const unsigned char long_literals[] = { 0xF0, 0xFF, 0xFF, 0x10, 'a' };
+    static const unsigned char long_match[] = { 0x1F, 'a', 0x01, 0x00, 0xFF, 0xFF, 0xFF, 0x00 };
+    expect(decompress_guarded(zero_offset, sizeof(zero_offset), out, TEST_CLUSTER_BYTES, "offset 0") == -1,
+           "a match at offset 0 fails");
+    expect(decompress_guarded(far_offset, sizeof(far_offset), out, TEST_CLUSTER_BYTES, "offset before start") == -1,
+           "a match reaching before the start fails");
+    expect(decompress_guarded(long_literals, sizeof(long_literals), out, TEST_CLUSTER_BYTES, "long literals") == -1,
+           "literals longer than the input fail");
+    expect(decompress_guarded(long_match, sizeof(long_match), out, 16, "long match") == -1,
+           "a match longer than the output fails");
+    free(out);
+}
+
+int main() {
+    unsigned char* data = malloc(TEST_CLUSTER_BYTES);
+    unsigned char* stream = malloc(2 * TEST_CLUSTER_BYTES);
+    if (!data || !stream) return 1;
+    test_incompressible(data, stream);
+    test_zeros(data, stream);
+    test_partial_block(data, stream);
+    test_damaged_input(data, stream);
+    free(data);
+    free(stream);
+
+    if (failures == 0) printf("SUCCESS! All LZ tests passed.\n");
+    return failures ? 1 : 0;
+}
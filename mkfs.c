@@ -1,36 +1,131 @@
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include "ibfs.h"
 #include "io.h"
 #include "inode.h"
-#include "bplustree.h" 
-#include "block.h"     
+#include "bplustree.h"
+#include "block.h"
 
 #ifdef _WIN32
 #include <io.h>
 #ifndef ftruncate
 #define ftruncate _chsize_s
 #endif
-#e
-#include <unistd.h> 
+#else
+#include <unistd.h>
+#include <fcntl.h>
 #endif
-#define DISK_BLOCKS 4096 
-#define INODE_COUNT 1024 
+#define DEFAULT_DISK_SIZE (16LL * 1024 * 1024)
+#define DEFAULT_BYTES_PER_INODE 16384
+#define MIN_INODE_COUNT 16
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [options] <disk_filename>\n", prog);
+    fprintf(stderr, "  -s <size>        image size, suffixes K/M/G/T (default 16M)\n");
+    fprintf(stderr, "  -b <bytes>       block size, power of two %u..%u (default %u)\n",
+            IBFS_MIN_BLOCK_SIZE, IBFS_MAX_BLOCK_SIZE, IBFS_DEFAULT_BLOCK_SIZE);
+    fprintf(stderr, "  -i <bytes>       bytes per inode (default %d)\n", DEFAULT_BYTES_PER_INODE);
+    fprintf(stderr, "  -N <count>       number of inodes (overrides -i)\n");
+    fprintf(stderr, "  -I <bytes>       inode record size, %u..%u (default %u)\n",
+            (unsigned)sizeof(DiskInode), IBFS_MAX_INODE_SIZE, (unsigned)sizeof(DiskInode));
+    fprintf(stderr, "  -g <blocks>      blocks per group (default 8 * (block size - 4))\n");
+    fprintf(stderr, "  -P               preallocate the image with fallocate instead of leaving it sparse\n");
+    fprintf(stderr, "  -n               do not create the sample readme.txt\n");
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <disk_filename>\n", argv[0]);
+    long long disk_size = DEFAULT_DISK_SIZE;
+    long long bytes_per_inode = DEFAULT_BYTES_PER_INODE;
+    long long inode_count_arg = 0;
+    uint32_t block_size = IBFS_DEFAULT_BLOCK_SIZE;
+    uint32_t inode_size = sizeof(DiskInode);
+    uint32_t blocks_per_group = 0;
+    bool preallocate = false;
+    bool create_sample = true;
+    const char* filename = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        if (strcmp(arg, "-s") == 0 && has_value) {
+            disk_size = parse_size(argv[++i]);
+        } else if (strcmp(arg, "-b") == 0 && has_value) {
+            block_size = (uint32_t)parse_size(argv[++i]);
+        } else if (strcmp(arg, "-i") == 0 && has_value) {
+            bytes_per_inode = parse_size(argv[++i]);
+        } else if (strcmp(arg, "-N") == 0 && has_value) {
+            inode_count_arg = strtoll(argv[++i], NULL, 0);
+        } else if (strcmp(arg, "-I") == 0 && has_value) {
+            inode_size = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(arg, "-g") == 0 && has_value) {
+            blocks_per_group = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(arg, "-P") == 0) {
+            preallocate = true;
+        } else if (strcmp(arg, "-n") == 0) {
+            create_sample = false;
+        } else if (!filename && arg[0] != '-') {
+            filename = arg;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!filename) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!IBFS_VALID_BLOCK_SIZE(block_size)) {
+        fprintf(stderr, "Error: Block size must be a power of two between %u and %u.\n",
+                IBFS_MIN_BLOCK_SIZE, IBFS_MAX_BLOCK_SIZE);
+        return 1;
+    }
+    if (disk_size <= 0 || bytes_per_inode <= 0 || inode_count_arg < 0) {
+        fprintf(stderr, "Error: Invalid size, inode ratio or inode count.\n");
+        return 1;
+    }
+    if (inode_size < sizeof(DiskInode) || inode_size > IBFS_MAX_INODE_SIZE || inode_size % 4 != 0) {
+        fprintf(stderr, "Error: Inode size must be a multiple of 4 between %u and %u.\n",
+                (unsigned)sizeof(DiskInode), IBFS_MAX_INODE_SIZE);
+        return 1;
+    }
+    if (blocks_per_group == 0) blocks_per_group = IBFS_BITMAP_BITS(block_size);
+    if (blocks_per_group < 8 || blocks_per_group > IBFS_BITMAP_BITS(block_size)) {
+        fprintf(stderr, "Error: Blocks per group must be between 8 and %u.\n", IBFS_BITMAP_BITS(block_size));
+        return 1;
+    }
+
+    long long block_count_ll = disk_size / block_size;
+    if (block_count_ll > IBFS_MAX_BLOCK_COUNT) {
+        fprintf(stderr, "Error: Image of %lld blocks exceeds the limit of %u blocks.\n", block_count_ll, IBFS_MAX_BLOCK_COUNT);
+        return 1;
+    }
+    uint32_t disk_blocks = (uint32_t)block_count_ll;
+
+    long long inode_count_ll = inode_count_arg ? inode_count_arg : disk_size / bytes_per_inode;
+    if (inode_count_ll < MIN_INODE_COUNT) inode_count_ll = MIN_INODE_COUNT;
+    if (inode_count_ll > INT32_MAX) inode_count_ll = INT32_MAX;
+    uint32_t inode_count = (uint32_t)inode_count_ll;
+
+    uint32_t inodes_per_block = IBFS_META_PAYLOAD(block_size) / inode_size;
+    uint32_t inode_bitmap_blocks = (inode_count + IBFS_BITMAP_BITS(block_size) - 1) / IBFS_BITMAP_BITS(block_size);
+    uint32_t inode_table_blocks = (inode_count + inodes_per_block - 1) / inodes_per_block;
+    uint32_t inode_table_start = 1 + inode_bitmap_blocks;
+    uint32_t first_data_block = inode_table_start + inode_table_blocks;
+    if ((long long)first_data_block + 2 > (long long)disk_blocks) {
+        fprintf(stderr, "Error: %u blocks are too few for %u inodes (metadata needs %u blocks).\n",
+                disk_blocks, inode_count, first_data_block + 2);
         return 1;
     }
-    const char* filename = argv[1];
 
     FILE *disk = fopen(filename, "wb+");
     if (!disk) {
         perror("Error creating disk file");
         return 1;
     }
-    long long target_size = (long long)DISK_BLOCKS * BLOCK_SIZE;
+    long long target_size = (long long)disk_blocks * block_size;
     if (ftruncate(fileno(disk), target_size) != 0) {
         perror("Error setting disk size");
         fseek(disk, 0, SEEK_END);
@@ -39,74 +134,86 @@ int main(int argc, char *argv[]) {
         fclose(disk);
         return 1;
     }
+    if (preallocate) {
+#ifdef _WIN32
+        printf("Preallocation is not supported on this platform, leaving the image sparse.\n");
+#else
+        int rc = posix_fallocate(fileno(disk), 0, target_size);
+        if (rc != 0) {
+            fprintf(stderr, "Warning: fallocate failed (%s), leaving the image sparse.\n", strerror(rc));
+        }
+#endif
+    }
+    if (fclose(disk) != 0) {
+        perror("Error closing disk file");
+        return 1;
+    }
 
     IBFS_Context temp_ctx;
-    temp_ctx.disk_file = disk;
-    temp_ctx.sb.inode_count = INODE_COUNT;
-    temp_ctx.sb.block_count = DISK_BLOCKS;
+    memset(&temp_ctx, 0, sizeof(IBFS_Context));
+    temp_ctx.device = device_open(filename, IBFS_BACKEND_FILE, true);
+    if (!temp_ctx.device) return 1;
+    temp_ctx.sb.inode_count = inode_count;
+    temp_ctx.sb.block_size = block_size;
+    temp_ctx.sb.block_count = disk_blocks;
+    temp_ctx.sb.inode_size = inode_size;
+    temp_ctx.sb.inode_bitmap_start = 1;
+    temp_ctx.sb.inode_bitmap_blocks = inode_bitmap_blocks;
+    temp_ctx.sb.inode_table_start = inode_table_start;
+    temp_ctx.sb.first_data_block = first_data_block;
+    temp_ctx.sb.blocks_per_group = blocks_per_group;
+    temp_ctx.sb.free_inodes_count = inode_count;
+    temp_ctx.sb.free_blocks_count = (disk_blocks - first_data_block) - bitmap_group_count(&temp_ctx);
 
-    printf("Initializing bitmaps...\n");
-    char zero_buffer[BLOCK_SIZE] = {0};
-    if (write_block(&temp_ctx, 1, zero_buffer) != 0) { fclose(disk); return 1; } 
-    if (write_block(&temp_ctx, 2, zero_buffer) != 0) { fclose(disk); return 1; } 
+    printf("Image: %u blocks of %u bytes (%lld bytes), %u groups of %u blocks.\n",
+           disk_blocks, block_size, target_size, bitmap_group_count(&temp_ctx), blocks_per_group);
+    printf("Inodes: %u of %u bytes; bitmap %u blocks at 1, table %u blocks at %u; data from block %u.\n",
+           inode_count, inode_size, inode_bitmap_blocks, inode_table_blocks, inode_table_start, first_data_block);
 
     printf("Creating root inode...\n");
     int root_inode_num = inode_alloc(&temp_ctx, S_IFDIR);
     if (root_inode_num != 0) {
         fprintf(stderr, "Error: Root inode allocation failed (expected 0, got %d).\n", root_inode_num);
-        fclose(disk);
-        return 1;
-    }
-
-    printf("Creating test file inode ('readme.txt')...\n");
-    int test_file_inode = inode_alloc(&temp_ctx, 0);
-    if (test_file_inode < 0) {
-        fprintf(stderr, "Error: Failed to allocate test file inode.\n");
-        fclose(disk);
+        temp_ctx.device->ops->close(temp_ctx.device);
         return 1;
     }
-    printf("Allocated inode %d for test file.\n", test_file_inode);
 
     uint32_t bpt_root_block = 0;
-    BPlusTreeKey test_key;
-    test_key.parent_inode_id = root_inode_num;
-    test_key.name_hash = hash_name("readme.txt");
-    strncpy(test_key.name, "readme.txt", MAX_FILENAME_LENGTH - 1);
-    test_key.name[MAX_FILENAME_LENGTH - 1] = '\0';
+    if (create_sample) {
+        printf("Creating test file inode ('readme.txt')...\n");
+        int test_file_inode = inode_alloc(&temp_ctx, S_IFREG);
+        if (test_file_inode < 0) {
+            fprintf(stderr, "Error: Failed to allocate test file inode.\n");
+            temp_ctx.device->ops->close(temp_ctx.device);
+            return 1;
+        }
+        printf("Allocated inode %d for test file.\n", test_file_inode);
 
-    printf("Inserting test file key (parent=%u, hash=%u, name='%s') into B+ Tree, mapping to inode %d...\n",
-           test_key.parent_inode_id, test_key.name_hash, test_key.name, test_file_inode);
+        BPlusTreeKey test_key;
+        test_key.parent_inode_id = root_inode_num;
+        test_key.name_hash = hash_name("readme.txt");
+        strncpy(test_key.name, "readme.txt", MAX_FILENAME_LENGTH - 1);
+        test_key.name[MAX_FILENAME_LENGTH - 1] = '\0';
 
-    if (bpt_insert(&temp_ctx, &bpt_root_block, &test_key, test_file_inode) != 0) {
-        fprintf(stderr, "Error: Failed to insert test key into B+ Tree.\n");
-        fclose(disk);
-        return 1;
-    }
-    printf("B+ Tree insertion successful. Root is now at block %u.\n", bpt_root_block);
+        printf("Inserting test file key (parent=%u, hash=%u, name='%s') into B+ Tree, mapping to inode %d...\n",
+               test_key.parent_inode_id, test_key.name_hash, test_key.name, test_file_inode);
 
-    printf("Writing Superblock...\n");
-    Superblock sb;
-    memset(&sb, 0, sizeof(Superblock));
-    sb.magic = IBFS_MAGIC_NUMBER;
-    sb.version = 1;
-    sb.block_size = BLOCK_SIZE;
-    sb.block_count = DISK_BLOCKS;
-    sb.inode_count = INODE_COUNT;
-    sb.root_inode = root_inode_num;
-    sb.root_bpt_block = bpt_root_block;
-    
-    if (fseek(disk, 0, SEEK_SET) != 0) {
-        perror("Error seeking to start to write superblock");
-        fclose(disk);
-        return 1;
-    }
-    if (fwrite(&sb, sizeof(Superblock), 1, disk) != 1) {
-       perror("Error writing superblock");
-       fclose(disk);
-       return 1;
+        if (bpt_insert(&temp_ctx, &bpt_root_block, &test_key, test_file_inode) != 0) {
+            fprintf(stderr, "Error: Failed to insert test key into B+ Tree.\n");
+            temp_ctx.device->ops->close(temp_ctx.device);
+            return 1;
+        }
+        printf("B+ Tree insertion successful. Root is now at block %u.\n", bpt_root_block);
     }
 
+    printf("Writing Superblock...\n");
+    temp_ctx.sb.magic = IBFS_MAGIC_NUMBER;
+    temp_ctx.sb.version = IBFS_VERSION;
+    temp_ctx.sb.root_inode = root_inode_num;
+    temp_ctx.sb.root_bpt_block = bpt_root_block;
+    int rc = write_superblock(&temp_ctx);
+    temp_ctx.device->ops->close(temp_ctx.device);
+    if (rc != 0) return 1;
     printf("Disk '%s' created and formatted successfully.\n", filename);
-    fclose(disk);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,276 @@
+#include "nameindex.h"
+#include "io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/* Leaves are left with some room so the inserts after a rebuild do not split every one of them. */
+#define NAME_INDEX_FILL_PERCENT 90
+
+typedef struct NameIndexEntries {
+    BPlusTreeEntry* items;
+    uint32_t count;
+    uint32_t capacity;
+    bool failed;
+} NameIndexEntries;
+
+static bool name_index_enabled(IBFS_Context* ctx) {
+    return (ctx->sb.feature_flags & IBFS_FEATURE_NAME_INDEX) != 0;
+}
+
+static void name_index_key(BPlusTreeKey* out, const BPlusTreeKey* key) {
+    *out = *key;
+    out->name_hash = 0;
+}
+
+static int name_index_store_root(IBFS_Context* ctx, uint32_t old_root) {
+    if (ctx->sb.name_index_root != old_root && write_superblock(ctx) != 0) return -1;
+    return 0;
+}
+
+static int name_index_push(NameIndexEntries* list, const BPlusTreeKey* key, uint32_t value) {
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        BPlusTreeEntry* grown = realloc(list->items, (size_t)capacity * sizeof(BPlusTreeEntry));
+        if (!grown) {
+            list->failed = true;
+            return -1;
+        }
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    name_index_key(&list->items[list->count].key, key);
+    list->items[list->count].value = value;
+    list->count++;
+    return 0;
+}
+
+int name_index_insert(IBFS_Context* ctx, const BPlusTreeKey* key, uint32_t inode_num) {
+    if (!name_index_enabled(ctx)) return 0;
+    BPlusTreeKey index_key;
+    name_index_key(&index_key, key);
+    uint32_t old_root = ctx->sb.name_index_root;
+    if (bpt_insert(ctx, &ctx->sb.name_index_root, &index_key, inode_num) != 0) {
+        fprintf(stderr, "name_index: Failed to add '%s', run fsck to rebuild the index.\n", key->name);
+        return -1;
+    }
+    return name_index_store_root(ctx, old_root);
+}
+
+int name_index_delete(IBFS_Context* ctx, const BPlusTreeKey* key) {
+    if (!name_index_enabled(ctx)) return 0;
+    BPlusTreeKey index_key;
+    name_index_key(&index_key, key);
+    uint32_t old_root = ctx->sb.name_index_root;
+    if (bpt_delete(ctx, &ctx->sb.name_index_root, &index_key) != 0) {
+        fprintf(stderr, "name_index: Failed to remove '%s', run fsck to rebuild the index.\n", key->name);
+        return -1;
+    }
+    return name_index_store_root(ctx, old_root);
+}
+
+int name_index_insert_batch(IBFS_Context* ctx, const BPlusTreeEntry* entries, uint32_t count) {
+    if (!name_index_enabled(ctx) || count == 0) return 0;
+    NameIndexEntries list = { 0 };
+    for (uint32_t i = 0; i < count; i++) {
+        if (name_index_push(&list, &entries[i].key, entries[i].value) != 0) break;
+    }
+    uint32_t old_root = ctx->sb.name_index_root;
+    int result = list.failed ? -1 : bpt_insert_batch(ctx, &ctx->sb.name_index_root, list.items, list.count);
+    free(list.items);
+    if (result != 0) {
+        fprintf(stderr, "name_index: Failed to add %u entries, run fsck to rebuild the index.\n", count);
+        return -1;
+    }
+    return name_index_store_root(ctx, old_root);
+}
+
+int name_index_delete_batch(IBFS_Context* ctx, const BPlusTreeKey* keys, uint32_t count) {
+    if (!name_index_enabled(ctx) || count == 0) return 0;
+    BPlusTreeKey* index_keys = malloc((size_t)count * sizeof(BPlusTreeKey));
+    if (!index_keys) return -1;
+    for (uint32_t i = 0; i < count; i++) name_index_key(&index_keys[i], &keys[i]);
+    uint32_t old_root = ctx->sb.name_index_root;
+    uint32_t deleted;
+    int result = bpt_delete_batch(ctx, &ctx->sb.name_index_root, index_keys, count, &deleted);
+    free(index_keys);
+    if (result != 0) {
+        fprintf(stderr, "name_index: Failed to remove %u entries, run fsck to rebuild the index.\n", count);
+        return -1;
+    }
+    return name_index_store_root(ctx, old_root);
+}
+
+static int name_index_collect(BPlusTreeKey* key, uint32_t value, void* user_data) {
+    return name_index_push((NameIndexEntries*)user_data, key, value);
+}
+
+int name_index_rebuild(IBFS_Context* ctx) {
+    NameIndexEntries list = { 0 };
+    BPlusTreeKey first;
+    memset(&first, 0, sizeof(first));
+    if (bpt_scan(ctx, ctx->sb.root_bpt_block, &first, name_index_collect, &list) != 0 || list.failed) {
+        fprintf(stderr, "name_index: Failed to read the directory tree.\n");
+        free(list.items);
+        return -1;
+    }
+    uint32_t new_root;
+    int result = bpt_build(ctx, list.items, list.count, NAME_INDEX_FILL_PERCENT, &new_root);
+    free(list.items);
+    if (result != 0) {
+        fprintf(stderr, "name_index: Failed to build the index.\n");
+        return -1;
+    }
+
+    uint32_t old_root = ctx->sb.name_index_root;
+    ctx->sb.name_index_root = new_root;
+    ctx->sb.feature_flags |= IBFS_FEATURE_NAME_INDEX;
+    if (write_superblock(ctx) != 0) return -1;
+    if (bpt_free_tree(ctx, old_root) != 0) {
+        fprintf(stderr, "Warning: Some blocks of the old name index could not be freed, run fsck.\n");
+    }
+    return write_superblock(ctx);
+}
+
+int name_index_enable(IBFS_Context* ctx) {
+    if (name_index_enabled(ctx)) {
+        printf("The name index is already enabled.\n");
+        return 0;
+    }
+    if (name_index_rebuild(ctx) != 0 || sync_disk(ctx) != 0) return -1;
+    BPlusTreeStats stats;
+    if (bpt_stats(ctx, ctx->sb.name_index_root, &stats) == 0) {
+        printf("Name index enabled: %llu entries in %u blocks.\n", (unsigned long long)stats.entries,
+               stats.internal_nodes + stats.leaf_nodes);
+    }
+    return 0;
+}
+
+int name_index_disable(IBFS_Context* ctx) {
+    if (!name_index_enabled(ctx)) {
+        printf("The name index is not enabled.\n");
+        return 0;
+    }
+    uint32_t old_root = ctx->sb.name_index_root;
+    ctx->sb.feature_flags &= ~IBFS_FEATURE_NAME_INDEX;
+    ctx->sb.name_index_root = 0;
+    if (write_superblock(ctx) != 0) return -1;
+    if (bpt_free_tree(ctx, old_root) != 0) {
+        fprintf(stderr, "Warning: Some blocks of the name index could not be freed, run fsck.\n");
+    }
+    if (write_superblock(ctx) != 0 || sync_disk(ctx) != 0) return -1;
+    printf("Name index disabled.\n");
+    return 0;
+}
+
+static int name_index_order(const void* a, const void* b) {
+    const BPlusTreeKey* left = &((const BPlusTreeEntry*)a)->key;
+    const BPlusTreeKey* right = &((const BPlusTreeEntry*)b)->key;
+    if (left->parent_inode_id != right->parent_inode_id) return left->parent_inode_id < right->parent_inode_id ? -1 : 1;
+    return strncmp(left->name, right->name, MAX_FILENAME_LENGTH);
+}
+
+static int name_index_read_tree(IBFS_Context* ctx, uint32_t root, NameIndexEntries* list) {
+    BPlusTreeKey first;
+    memset(&first, 0, sizeof(first));
+    if (root != 0 && (bpt_scan(ctx, root, &first, name_index_collect, list) != 0 || list->failed)) return -1;
+    if (list->count > 0) qsort(list->items, list->count, sizeof(BPlusTreeEntry), name_index_order);
+    return 0;
+}
+
+int name_index_verify(IBFS_Context* ctx,
+                      void (*report)(const BPlusTreeKey* key, const uint32_t* primary, const uint32_t* index, void* user_data),
+                      void* user_data) {
+    NameIndexEntries primary = { 0 }, index = { 0 };
+    int result = -1;
+    if (name_index_read_tree(ctx, ctx->sb.root_bpt_block, &primary) != 0 ||
+        name_index_read_tree(ctx, ctx->sb.name_index_root, &index) != 0) {
+        fprintf(stderr, "name_index: Failed to read the trees to compare.\n");
+        goto out;
+    }
+    uint32_t i = 0, j = 0;
+    while (i < primary.count || j < index.count) {
+        int order = i == primary.count ? 1 : j == index.count ? -1 : name_index_order(&primary.items[i], &index.items[j]);
+        if (order < 0) {
+            report(&primary.items[i].key, &primary.items[i].value, NULL, user_data);
+            i++;
+        } else if (order > 0) {
+            report(&index.items[j].key, NULL, &index.items[j].value, user_data);
+            j++;
+        } else {
+            if (primary.items[i].value != index.items[j].value) {
+                report(&primary.items[i].key, &primary.items[i].value, &index.items[j].value, user_data);
+            }
+            i++;
+            j++;
+        }
+    }
+    result = 0;
+out:
+    free(primary.items);
+    free(index.items);
+    return result;
+}
+
+typedef struct NameIndexScan {
+    uint32_t parent;
+    const char* prefix;
+    size_t prefix_length;
+    const char* after;
+    uint32_t limit;
+    uint32_t emitted;
+    void (*callback)(BPlusTreeKey* key, uint32_t value, void* user_data);
+    void* user_data;
+    NameIndexEntries entries;
+} NameIndexScan;
+
+static bool name_index_matches(NameIndexScan* scan, const BPlusTreeKey* key) {
+    if (scan->prefix_length && strncmp(key->name, scan->prefix, scan->prefix_length) != 0) return false;
+    return !scan->after || strncmp(key->name, scan->after, MAX_FILENAME_LENGTH) > 0;
+}
+
+static int name_index_visit(BPlusTreeKey* key, uint32_t value, void* user_data) {
+    NameIndexScan* scan = (NameIndexScan*)user_data;
+    if (key->parent_inode_id != scan->parent) return 1;
+    if (scan->prefix_length && strncmp(key->name, scan->prefix, scan->prefix_length) > 0) return 1;
+    if (!name_index_matches(scan, key)) return 0;
+    scan->callback(key, value, scan->user_data);
+    return ++scan->emitted == scan->limit;
+}
+
+static void name_index_gather(BPlusTreeKey* key, uint32_t value, void* user_data) {
+    NameIndexScan* scan = (NameIndexScan*)user_data;
+    if (name_index_matches(scan, key)) name_index_push(&scan->entries, key, value);
+}
+
+static int name_index_compare(const void* a, const void* b) {
+    return strncmp(((const BPlusTreeEntry*)a)->key.name, ((const BPlusTreeEntry*)b)->key.name, MAX_FILENAME_LENGTH);
+}
+
+int name_index_list(IBFS_Context* ctx, uint32_t parent, const char* prefix, const char* after, uint32_t limit,
+                    void (*callback)(BPlusTreeKey* key, uint32_t value, void* user_data), void* user_data) {
+    NameIndexScan scan = { parent, prefix, prefix ? strlen(prefix) : 0, after, limit, 0, callback, user_data, { 0 } };
+
+    if (name_index_enabled(ctx)) {
+        /* Start at whichever of the prefix and the page cursor sorts later. */
+        BPlusTreeKey start;
+        memset(&start, 0, sizeof(start));
+        start.parent_inode_id = parent;
+        const char* from = prefix ? prefix : "";
+        if (after && strncmp(after, from, MAX_FILENAME_LENGTH) > 0) from = after;
+        strncpy(start.name, from, MAX_FILENAME_LENGTH - 1);
+        return bpt_scan(ctx, ctx->sb.name_index_root, &start, name_index_visit, &scan);
+    }
+
+    if (bpt_iterate(ctx, ctx->sb.root_bpt_block, parent, name_index_gather, &scan) != 0 || scan.entries.failed) {
+        free(scan.entries.items);
+        return -1;
+    }
+    qsort(scan.entries.items, scan.entries.count, sizeof(BPlusTreeEntry), name_index_compare);
+    for (uint32_t i = 0; i < scan.entries.count && (limit == 0 || i < limit); i++) {
+        callback(&scan.entries.items[i].key, scan.entries.items[i].value, user_data);
+    }
+    free(scan.entries.items);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "ibfs.h"
+#include "bplustree.h"
+
+/*
+ * Optional second directory tree ordered by (parent, name); see ibfs_disk.h.
+ * The update calls take the key of the primary tree and do nothing on
+ * images without the index. They write the superblock when the index root moves.
+ */
+int name_index_insert(IBFS_Context* ctx, const BPlusTreeKey* key, uint32_t inode_num);
+int name_index_delete(IBFS_Context* ctx, const BPlusTreeKey* key);
+int name_index_insert_batch(IBFS_Context* ctx, const BPlusTreeEntry* entries, uint32_t count);
+int name_index_delete_batch(IBFS_Context* ctx, const BPlusTreeKey* keys, uint32_t count);
+
+int name_index_enable(IBFS_Context* ctx);
+int name_index_disable(IBFS_Context* ctx);
+/* Replaces the index with a fresh copy of the primary tree. */
+int name_index_rebuild(IBFS_Context* ctx);
+/*
+ * Compares the index with the primary tree entry by entry and calls report for every
+ * (parent, name) they disagree on; primary or index is NULL where that tree lacks the entry.
+ */
+int name_index_verify(IBFS_Context* ctx,
+                      void (*report)(const BPlusTreeKey* key, const uint32_t* primary, const uint32_t* index, void* user_data),
+                      void* user_data);
+
+/*
+ * Calls callback for the entries of parent in name order, starting after the
+ * name `after` and keeping to names that begin with prefix (either may be NULL),
+ * and stops after limit entries (0 for no limit). Without the index the
+ * directory is read and sorted first.
+ */
+int name_index_list(IBFS_Context* ctx, uint32_t parent, const char* prefix, const char* after, uint32_t limit,
+                    void (*callback)(BPlusTreeKey* key, uint32_t value, void* user_data), void* user_data);
@@ -0,0 +1,107 @@
+#include "path.h"
+#include "inode.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+int path_make_key(BPlusTreeKey* key, uint32_t parent_inode_num, const char* name)
+{
+    size_t length = strlen(name);
+    memset(key, 0, sizeof(BPlusTreeKey));
+    if (length >= MAX_FILENAME_LENGTH) return -1;
+    key->parent_inode_id = parent_inode_num;
+    key->name_hash = hash_name(name);
+    memcpy(key->name, name, length + 1);
+    return 0;
+}
+
+static const char* path_next_component(const char* path, char* name_out, int* status)
+{
+    while (*path == '/') path++;
+    size_t length = strcspn(path, "/");
+    *status = 0;
+    if (length == 0) {
+        name_out[0] = '\0';
+        return path;
+    }
+    if (length >= MAX_FILENAME_LENGTH || (length == 1 && path[0] == '.') ||
+        (length == 2 && path[0] == '.' && path[1] == '.')) {
+        *status = -1;
+        return path;
+    }
+    memcpy(name_out, path, length);
+    name_out[length] = '\0';
+    return path + length;
+}
+
+/* Failures are reported on stderr, or silently through *error_out as an errno value when it is given. */
+static int path_walk(IBFS_Context* ctx, const char* path, bool stop_at_parent, uint32_t* inode_out, char* name_out, int* error_out)
+{
+    if (!path || path[0] != '/') {
+        if (error_out) *error_out = EINVAL;
+        else fprintf(stderr, "Error: Path '%s' must be absolute.\n", path ? path : "");
+        return -1;
+    }
+
+    uint32_t current = ctx->sb.root_inode;
+    char name[MAX_FILENAME_LENGTH];
+    int status;
+    const char* rest = path_next_component(path, name, &status);
+    while (status == 0 && name[0] != '\0') {
+        char next_name[MAX_FILENAME_LENGTH];
+        const char* after = path_next_component(rest, next_name, &status);
+        if (status != 0) break;
+
+        Inode dir;
+        if (inode_read(ctx, current, &dir) != 0) {
+            if (error_out) *error_out = EIO;
+            return -1;
+        }
+        if ((dir.mode & S_IFDIR) != S_IFDIR) {
+            if (error_out) *error_out = ENOTDIR;
+            else fprintf(stderr, "Error: A component of '%s' is not a directory.\n", path);
+            return -1;
+        }
+        if (stop_at_parent && next_name[0] == '\0') {
+            strcpy(name_out, name);
+            *inode_out = current;
+            return 0;
+        }
+        BPlusTreeKey key;
+        path_make_key(&key, current, name);
+        if (bpt_search(ctx, ctx->sb.root_bpt_block, &key, &current) != 0) {
+            if (error_out) *error_out = ENOENT;
+            else fprintf(stderr, "Error: '%s' not found in '%s'.\n", name, path);
+            return -1;
+        }
+        strcpy(name, next_name);
+        rest = after;
+    }
+    if (status != 0) {
+        if (error_out) *error_out = EINVAL;
+        else fprintf(stderr, "Error: Invalid component in path '%s'.\n", path);
+        return -1;
+    }
+    if (stop_at_parent) {
+        if (error_out) *error_out = EINVAL;
+        else fprintf(stderr, "Error: Path '%s' does not name an entry.\n", path);
+        return -1;
+    }
+    *inode_out = current;
+    return 0;
+}
+
+int path_lookup(IBFS_Context* ctx, const char* path, uint32_t* inode_out)
+{
+    return path_walk(ctx, path, false, inode_out, NULL, NULL);
+}
+
+int path_lookup_parent(IBFS_Context* ctx, const char* path, uint32_t* parent_out, char* name_out)
+{
+    return path_walk(ctx, path, true, parent_out, name_out, NULL);
+}
+
+int path_resolve(IBFS_Context* ctx, const char* path, bool parent, uint32_t* inode_out, char* name_out, int* error_out)
+{
+    return path_walk(ctx, path, parent, inode_out, name_out, error_out);
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include "ibfs.h"
+#include "bplustree.h"
+
+/* Fails for names of MAX_FILENAME_LENGTH characters or more. */
+int path_make_key(BPlusTreeKey* key, uint32_t parent_inode_num, const char* name);
+int path_lookup(IBFS_Context* ctx, const char* path, uint32_t* inode_out);
+int path_lookup_parent(IBFS_Context* ctx, const char* path, uint32_t* parent_out, char* name_out);
+/* Quiet path_lookup, or path_lookup_parent with parent set; on failure *error_out holds an errno value. */
+int path_resolve(IBFS_Context* ctx, const char* path, bool parent, uint32_t* inode_out, char* name_out, int* error_out);
@@ -0,0 +1,180 @@
+#include "refcount.h"
+#include "block.h"
+#include "io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REFCOUNT_MAX 0xFFFF
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+uint32_t refcount_blocks_per_leaf(IBFS_Context* ctx)
+{
+    return ctx->sb.block_size / sizeof(uint16_t);
+}
+
+static uint32_t refcount_table_blocks_needed(IBFS_Context* ctx)
+{
+    uint32_t per_leaf = refcount_blocks_per_leaf(ctx);
+    uint32_t ptrs_per_block = ctx->sb.block_size / sizeof(uint32_t);
+    uint32_t leaves = (uint32_t)(((uint64_t)ctx->sb.block_count + per_leaf - 1) / per_leaf);
+    return (leaves + ptrs_per_block - 1) / ptrs_per_block;
+}
+
+/* Creates the table on first use and moves it to a larger run after the image grew. */
+static int refcount_reserve_table(IBFS_Context* ctx)
+{
+    uint32_t needed = refcount_table_blocks_needed(ctx);
+    if (ctx->sb.refcount_table_start != 0 && ctx->sb.refcount_table_blocks >= needed) return 0;
+
+    uint32_t table = alloc_data_run(ctx, needed);
+    if (table == 0) {
+        fprintf(stderr, "refcount: Failed to allocate a table of %u blocks.\n", needed);
+        return -1;
+    }
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    for (uint32_t i = 0; i < needed; i++) {
+        if (i < ctx->sb.refcount_table_blocks) {
+            if (read_block(ctx, ctx->sb.refcount_table_start + i, block_buffer) != 0) return -1;
+        } else {
+            memset(block_buffer, 0, ctx->sb.block_size);
+        }
+        if (write_block(ctx, table + i, block_buffer) != 0) return -1;
+    }
+
+    uint32_t old_start = ctx->sb.refcount_table_start;
+    uint32_t old_blocks = ctx->sb.refcount_table_blocks;
+    ctx->sb.refcount_table_start = table;
+    ctx->sb.refcount_table_blocks = needed;
+    if (write_superblock(ctx) != 0) return -1;
+    for (uint32_t i = 0; i < old_blocks; i++) free_data_block(ctx, old_start + i);
+    return 0;
+}
+
+int refcount_leaf_block(IBFS_Context* ctx, uint32_t leaf_index, bool create, uint32_t* block_out)
+{
+    uint32_t ptrs_per_block = ctx->sb.block_size / sizeof(uint32_t);
+    *block_out = 0;
+    if (ctx->sb.refcount_table_start == 0 || leaf_index / ptrs_per_block >= ctx->sb.refcount_table_blocks) {
+        return create ? -1 : 0;
+    }
+
+    IBFS_BLOCK_ALIGNED uint32_t table[ptrs_per_block];
+    uint32_t table_block = ctx->sb.refcount_table_start + leaf_index / ptrs_per_block;
+    if (read_block(ctx, table_block, table) != 0) return -1;
+    *block_out = ibfs_le32(table[leaf_index % ptrs_per_block]);
+    if (*block_out != 0 || !create) return 0;
+
+    IBFS_BLOCK_ALIGNED uint16_t counts[refcount_blocks_per_leaf(ctx)];
+    memset(counts, 0, ctx->sb.block_size);
+    uint32_t leaf = alloc_data_block(ctx, table_block + 1);
+    if (leaf == 0) return -1;
+    table[leaf_index % ptrs_per_block] = ibfs_le32(leaf);
+    if (write_block(ctx, leaf, counts) != 0 || write_block(ctx, table_block, table) != 0) {
+        free_data_block(ctx, leaf);
+        return -1;
+    }
+    *block_out = leaf;
+    return 0;
+}
+
+int refcount_get(IBFS_Context* ctx, uint32_t block_num, uint32_t* extra_out)
+{
+    *extra_out = 0;
+    if (ctx->sb.refcount_table_start == 0) return 0;
+
+    uint32_t per_leaf = refcount_blocks_per_leaf(ctx);
+    uint32_t leaf;
+    if (refcount_leaf_block(ctx, block_num / per_leaf, false, &leaf) != 0) return -1;
+    if (leaf == 0) return 0;
+
+    IBFS_BLOCK_ALIGNED uint16_t counts[per_leaf];
+    if (read_block(ctx, leaf, counts) != 0) return -1;
+    *extra_out = ibfs_le16(counts[block_num % per_leaf]);
+    return 0;
+}
+
+/* Takes back the references a failed refcount_share already stored for its first count blocks. */
+static int refcount_unshare(IBFS_Context* ctx, const uint32_t* blocks, uint32_t count)
+{
+    if (count == 0) return -1;
+    uint32_t* copy = malloc((size_t)count * sizeof(uint32_t));
+    uint32_t remaining = count;
+    if (copy) memcpy(copy, blocks, (size_t)count * sizeof(uint32_t));
+    if (!copy || refcount_release(ctx, copy, &remaining) != 0 || remaining != 0) {
+        fprintf(stderr, "refcount: Failed to take back %u references.\n", count);
+    }
+    free(copy);
+    return -1;
+}
+
+/* Adds one reference to each block; on failure no count is left changed. */
+int refcount_share(IBFS_Context* ctx, uint32_t* blocks, uint32_t count)
+{
+    if (count == 0) return 0;
+    if (refcount_reserve_table(ctx) != 0) return -1;
+    qsort(blocks, count, sizeof(uint32_t), compare_u32);
+
+    uint32_t per_leaf = refcount_blocks_per_leaf(ctx);
+    IBFS_BLOCK_ALIGNED uint16_t counts[per_leaf];
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t done = i;
+        uint32_t leaf_index = blocks[i] / per_leaf;
+        uint32_t leaf;
+        if (refcount_leaf_block(ctx, leaf_index, true, &leaf) != 0 || read_block(ctx, leaf, counts) != 0) {
+            return refcount_unshare(ctx, blocks, done);
+        }
+        for (; i < count && blocks[i] / per_leaf == leaf_index; i++) {
+            uint16_t value = ibfs_le16(counts[blocks[i] % per_leaf]);
+            if (value == REFCOUNT_MAX) {
+                fprintf(stderr, "refcount: Block %u already has the maximum number of references.\n", blocks[i]);
+                return refcount_unshare(ctx, blocks, done);
+            }
+            counts[blocks[i] % per_leaf] = ibfs_le16(value + 1);
+        }
+        if (write_block(ctx, leaf, counts) != 0) return refcount_unshare(ctx, blocks, done);
+    }
+    return 0;
+}
+
+/*
+ * Drops one reference from each block. Blocks that are still referenced
+ * elsewhere are removed from the list; what remains is free to release.
+ */
+int refcount_release(IBFS_Context* ctx, uint32_t* blocks, uint32_t* count_inout)
+{
+    uint32_t count = *count_inout;
+    if (ctx->sb.refcount_table_start == 0 || count == 0) return 0;
+    qsort(blocks, count, sizeof(uint32_t), compare_u32);
+
+    uint32_t per_leaf = refcount_blocks_per_leaf(ctx);
+    IBFS_BLOCK_ALIGNED uint16_t counts[per_leaf];
+    uint32_t kept = 0;
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t leaf_index = blocks[i] / per_leaf;
+        uint32_t leaf;
+        if (refcount_leaf_block(ctx, leaf_index, false, &leaf) != 0 || (leaf != 0 && read_block(ctx, leaf, counts) != 0)) {
+            return -1;
+        }
+        bool dirty = false;
+        for (; i < count && blocks[i] / per_leaf == leaf_index; i++) {
+            uint16_t value = leaf ? ibfs_le16(counts[blocks[i] % per_leaf]) : 0;
+            if (value == 0) {
+                blocks[kept++] = blocks[i];
+                continue;
+            }
+            counts[blocks[i] % per_leaf] = ibfs_le16(value - 1);
+            dirty = true;
+        }
+        if (dirty && write_block(ctx, leaf, counts) != 0) return -1;
+    }
+    *count_inout = kept;
+    return 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "ibfs.h"
+#include <stdbool.h>
+
+uint32_t refcount_blocks_per_leaf(IBFS_Context* ctx);
+int refcount_leaf_block(IBFS_Context* ctx, uint32_t leaf_index, bool create, uint32_t* block_out);
+int refcount_get(IBFS_Context* ctx, uint32_t block_num, uint32_t* extra_out);
+int refcount_share(IBFS_Context* ctx, uint32_t* blocks, uint32_t count);
+int refcount_release(IBFS_Context* ctx, uint32_t* blocks, uint32_t* count_inout);
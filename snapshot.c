@@ -0,0 +1,421 @@
+#include "snapshot.h"
+#include "bitmap.h"
+#include "block.h"
+#include "bplustree.h"
+#include "file.h"
+#include "inode.h"
+#include "io.h"
+#include "nameindex.h"
+#include "refcount.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SNAPSHOT_READ_CHUNK_BLOCKS 64
+
+typedef struct BlockCollector {
+    uint32_t* items;
+    uint32_t count;
+    uint32_t capacity;
+    int failed;
+} BlockCollector;
+
+static void collect_block(uint32_t block_num, void* user_data) {
+    BlockCollector* list = (BlockCollector*)user_data;
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        uint32_t* grown = realloc(list->items, (size_t)capacity * sizeof(uint32_t));
+        if (!grown) {
+            list->failed = 1;
+            return;
+        }
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = block_num;
+}
+
+static uint32_t snapshot_meta_blocks(IBFS_Context* ctx) {
+    return ctx->sb.first_data_block - ctx->sb.inode_bitmap_start;
+}
+
+uint32_t snapshot_capacity(IBFS_Context* ctx) {
+    return ctx->sb.block_size / sizeof(SnapshotEntry);
+}
+
+/* The table is little-endian on disk; converting twice restores the entries. */
+static void snapshot_convert_entries(IBFS_Context* ctx, SnapshotEntry* entries) {
+    for (uint32_t i = 0; i < snapshot_capacity(ctx); i++) {
+        entries[i].root_bpt_block = ibfs_le32(entries[i].root_bpt_block);
+        entries[i].root_inode = ibfs_le32(entries[i].root_inode);
+        entries[i].map_block = ibfs_le32(entries[i].map_block);
+        entries[i].created = ibfs_le32(entries[i].created);
+    }
+}
+
+int snapshot_read_entries(IBFS_Context* ctx, SnapshotEntry* entries) {
+    memset(entries, 0, snapshot_capacity(ctx) * sizeof(SnapshotEntry));
+    if (ctx->sb.snapshot_table_block == 0) return 0;
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    if (read_block(ctx, ctx->sb.snapshot_table_block, block_buffer) != 0) {
+        fprintf(stderr, "snapshot: Failed to read snapshot table.\n");
+        return -1;
+    }
+    memcpy(entries, block_buffer, snapshot_capacity(ctx) * sizeof(SnapshotEntry));
+    snapshot_convert_entries(ctx, entries);
+    return 0;
+}
+
+static int snapshot_write_entries(IBFS_Context* ctx, const SnapshotEntry* entries) {
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    memset(block_buffer, 0, ctx->sb.block_size);
+    memcpy(block_buffer, entries, snapshot_capacity(ctx) * sizeof(SnapshotEntry));
+    snapshot_convert_entries(ctx, (SnapshotEntry*)block_buffer);
+    if (ctx->sb.snapshot_table_block == 0) {
+        ctx->sb.snapshot_table_block = alloc_data_block(ctx, 0);
+        if (ctx->sb.snapshot_table_block == 0) return -1;
+    }
+    return write_block(ctx, ctx->sb.snapshot_table_block, block_buffer);
+}
+
+static int snapshot_find(IBFS_Context* ctx, SnapshotEntry* entries, const char* name) {
+    for (uint32_t i = 0; i < snapshot_capacity(ctx); i++) {
+        if (entries[i].name[0] != '\0' && strncmp(entries[i].name, name, IBFS_SNAPSHOT_NAME_LENGTH) == 0) return (int)i;
+    }
+    return -1;
+}
+
+int snapshot_load_map(IBFS_Context* ctx, const SnapshotEntry* entry, uint32_t** map_out) {
+    uint32_t meta_blocks = snapshot_meta_blocks(ctx);
+    uint32_t max_extents = ctx->sb.block_size / sizeof(SnapshotExtent);
+    IBFS_BLOCK_ALIGNED SnapshotExtent extents[max_extents];
+    uint32_t* map = malloc((size_t)meta_blocks * sizeof(uint32_t));
+    if (!map || read_block(ctx, entry->map_block, extents) != 0) {
+        fprintf(stderr, "snapshot: Failed to load map of '%.*s'.\n", IBFS_SNAPSHOT_NAME_LENGTH, entry->name);
+        free(map);
+        return -1;
+    }
+
+    uint32_t done = 0;
+    for (uint32_t e = 0; e < max_extents && done < meta_blocks; e++) {
+        uint32_t start = ibfs_le32(extents[e].start), count = ibfs_le32(extents[e].count);
+        if (count == 0 || count > meta_blocks - done) break;
+        for (uint32_t i = 0; i < count; i++) map[done++] = start + i;
+    }
+    if (done != meta_blocks) {
+        fprintf(stderr, "snapshot: Map of '%.*s' covers %u of %u blocks.\n",
+                IBFS_SNAPSHOT_NAME_LENGTH, entry->name, done, meta_blocks);
+        free(map);
+        return -1;
+    }
+    *map_out = map;
+    return 0;
+}
+
+/* Every block referenced by an in-use inode of the view: direct, indirect and the blocks it lists. */
+int snapshot_collect_blocks(IBFS_Context* view, uint32_t** blocks_out, uint32_t* count_out) {
+    BlockCollector list;
+    memset(&list, 0, sizeof(BlockCollector));
+    uint32_t per_block = inodes_per_block(view);
+    uint32_t table_blocks = (view->sb.inode_count + per_block - 1) / per_block;
+    unsigned char* inode_bitmap = alloc_block_buffer(view, view->sb.inode_bitmap_blocks);
+    char* chunk = alloc_block_buffer(view, SNAPSHOT_READ_CHUNK_BLOCKS);
+    int result = -1;
+
+    if (!inode_bitmap || !chunk ||
+        bitmap_read_inodes(view, inode_bitmap) != 0) {
+        goto out;
+    }
+    for (uint32_t block = 0; block < table_blocks; block += SNAPSHOT_READ_CHUNK_BLOCKS) {
+        uint32_t count = table_blocks - block;
+        if (count > SNAPSHOT_READ_CHUNK_BLOCKS) count = SNAPSHOT_READ_CHUNK_BLOCKS;
+        if (read_meta_blocks(view, view->sb.inode_table_start + block, count, chunk) != 0) goto out;
+        for (uint32_t b = 0; b < count; b++) {
+            for (uint32_t i = 0; i < per_block; i++) {
+                uint32_t inode_num = (block + b) * per_block + i;
+                if (inode_num >= view->sb.inode_count) break;
+                if (!((inode_bitmap[inode_num / 8] >> (inode_num % 8)) & 1)) continue;
+                Inode inode;
+                inode_unpack(view, chunk + (size_t)b * view->sb.block_size, i, &inode);
+                if (file_for_each_block(view, &inode, collect_block, &list) != 0) goto out;
+            }
+        }
+    }
+    if (!list.failed) result = 0;
+
+out:
+    if (result != 0) {
+        fprintf(stderr, "snapshot: Failed to collect the blocks of the inode table.\n");
+        free(list.items);
+        list.items = NULL;
+        list.count = 0;
+    }
+    free(inode_bitmap);
+    free(chunk);
+    *blocks_out = list.items;
+    *count_out = list.count;
+    return result;
+}
+
+/* Copies the inode bitmap and table into freshly allocated extents listed in a new map block. */
+static int snapshot_copy_meta(IBFS_Context* ctx, uint32_t* map_block_out) {
+    uint32_t meta_blocks = snapshot_meta_blocks(ctx);
+    uint32_t max_extents = ctx->sb.block_size / sizeof(SnapshotExtent);
+    IBFS_BLOCK_ALIGNED SnapshotExtent extents[max_extents];
+    memset(extents, 0, ctx->sb.block_size);
+    char* chunk = alloc_block_buffer(ctx, SNAPSHOT_READ_CHUNK_BLOCKS);
+    uint32_t map_block = alloc_data_block(ctx, 0);
+    uint32_t extent_count = 0, done = 0;
+    int result = -1;
+    if (!chunk || map_block == 0) goto out;
+
+    uint32_t goal = map_block + 1;
+    while (done < meta_blocks) {
+        uint32_t want = meta_blocks - done, got;
+        if (want > SNAPSHOT_READ_CHUNK_BLOCKS) want = SNAPSHOT_READ_CHUNK_BLOCKS;
+        uint32_t start = alloc_data_extent(ctx, goal, want, &got);
+        if (start == 0) goto out;
+        SnapshotExtent* last = extent_count > 0 ? &extents[extent_count - 1] : NULL;
+        if (last && ibfs_le32(last->start) + ibfs_le32(last->count) == start) {
+            last->count = ibfs_le32(ibfs_le32(last->count) + got);
+        } else if (extent_count < max_extents) {
+            extents[extent_count].start = ibfs_le32(start);
+            extents[extent_count].count = ibfs_le32(got);
+            extent_count++;
+        } else {
+            fprintf(stderr, "snapshot: Free space is too fragmented for the inode table copy.\n");
+            for (uint32_t i = 0; i < got; i++) free_data_block(ctx, start + i);
+            goto out;
+        }
+        if (read_blocks(ctx, ctx->sb.inode_bitmap_start + done, got, chunk) != 0 ||
+            write_blocks(ctx, start, got, chunk) != 0) {
+            goto out;
+        }
+        done += got;
+        goal = start + got;
+    }
+    if (write_block(ctx, map_block, extents) != 0) goto out;
+    *map_block_out = map_block;
+    result = 0;
+
+out:
+    if (result != 0) {
+        for (uint32_t e = 0; e < extent_count; e++) {
+            for (uint32_t i = 0; i < ibfs_le32(extents[e].count); i++) free_data_block(ctx, ibfs_le32(extents[e].start) + i);
+        }
+        if (map_block != 0) free_data_block(ctx, map_block);
+    }
+    free(chunk);
+    return result;
+}
+
+static int snapshot_free_meta(IBFS_Context* ctx, const SnapshotEntry* entry) {
+    uint32_t* map;
+    if (snapshot_load_map(ctx, entry, &map) != 0) return -1;
+    int result = free_data_blocks(ctx, map, snapshot_meta_blocks(ctx));
+    free_data_block(ctx, entry->map_block);
+    free(map);
+    return result;
+}
+
+static int snapshot_share_live(IBFS_Context* ctx) {
+    uint32_t* blocks;
+    uint32_t count;
+    if (snapshot_collect_blocks(ctx, &blocks, &count) != 0) return -1;
+    int result = refcount_share(ctx, blocks, count);
+    free(blocks);
+    return result;
+}
+
+static bool snapshot_valid_name(const char* name) {
+    size_t length = strlen(name);
+    if (length == 0 || length >= IBFS_SNAPSHOT_NAME_LENGTH) {
+        fprintf(stderr, "snapshot Error: Name must be 1 to %d characters.\n", IBFS_SNAPSHOT_NAME_LENGTH - 1);
+        return false;
+    }
+    if (strchr(name, '/') || strchr(name, '@')) {
+        fprintf(stderr, "snapshot Error: Name must not contain '/' or '@'.\n");
+        return false;
+    }
+    return true;
+}
+
+int snapshot_create(IBFS_Context* ctx, const char* name) {
+    if (!snapshot_valid_name(name)) return -1;
+    SnapshotEntry entries[snapshot_capacity(ctx)];
+    if (snapshot_read_entries(ctx, entries) != 0) return -1;
+    if (snapshot_find(ctx, entries, name) >= 0) {
+        fprintf(stderr, "snapshot Error: '%s' already exists.\n", name);
+        return -1;
+    }
+    int slot = -1;
+    for (uint32_t i = 0; slot < 0 && i < snapshot_capacity(ctx); i++) {
+        if (entries[i].name[0] == '\0') slot = (int)i;
+    }
+    if (slot < 0) {
+        fprintf(stderr, "snapshot Error: All %u snapshot slots are in use.\n", snapshot_capacity(ctx));
+        return -1;
+    }
+
+    SnapshotEntry* entry = &entries[slot];
+    memset(entry, 0, sizeof(SnapshotEntry));
+    strncpy(entry->name, name, IBFS_SNAPSHOT_NAME_LENGTH - 1);
+    entry->root_inode = ctx->sb.root_inode;
+    entry->created = (uint32_t)time(NULL);
+
+    printf("Copying inode bitmap and table (%u blocks)...\n", snapshot_meta_blocks(ctx));
+    if (snapshot_copy_meta(ctx, &entry->map_block) != 0) {
+        fprintf(stderr, "snapshot Error: Failed to copy the inode table.\n");
+        return -1;
+    }
+    printf("Copying B+ Tree...\n");
+    if (bpt_rebuild(ctx, ctx->sb.root_bpt_block, 100, &entry->root_bpt_block) != 0) {
+        fprintf(stderr, "snapshot Error: Failed to copy the B+ Tree.\n");
+        snapshot_free_meta(ctx, entry);
+        return -1;
+    }
+    printf("Sharing data blocks...\n");
+    if (snapshot_share_live(ctx) != 0) {
+        fprintf(stderr, "snapshot Error: Failed to share data blocks, run fsck.\n");
+        return -1;
+    }
+    if (snapshot_write_entries(ctx, entries) != 0 || write_superblock(ctx) != 0 || sync_disk(ctx) != 0) {
+        fprintf(stderr, "snapshot Error: Failed to record the snapshot, run fsck.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int snapshot_delete(IBFS_Context* ctx, const char* name) {
+    SnapshotEntry entries[snapshot_capacity(ctx)];
+    if (snapshot_read_entries(ctx, entries) != 0) return -1;
+    int slot = snapshot_find(ctx, entries, name);
+    if (slot < 0) {
+        fprintf(stderr, "snapshot Error: '%s' not found.\n", name);
+        return -1;
+    }
+    SnapshotEntry entry = entries[slot];
+
+    IBFS_Context view = *ctx;
+    view.read_only = true;
+    if (snapshot_load_map(ctx, &entry, &view.meta_map) != 0) return -1;
+    uint32_t* blocks;
+    uint32_t count;
+    int rc = snapshot_collect_blocks(&view, &blocks, &count);
+    free(view.meta_map);
+    if (rc != 0) return -1;
+
+    /* Unlink first: a failure below only leaks blocks, which fsck reclaims. */
+    memset(&entries[slot], 0, sizeof(SnapshotEntry));
+    if (snapshot_write_entries(ctx, entries) != 0) {
+        free(blocks);
+        return -1;
+    }
+    int result = 0;
+    printf("Releasing %u data block references...\n", count);
+    if (file_unref_blocks(ctx, blocks, count) != 0) result = -1;
+    free(blocks);
+    if (bpt_free_tree(ctx, entry.root_bpt_block) != 0 || snapshot_free_meta(ctx, &entry) != 0) result = -1;
+    if (result != 0) fprintf(stderr, "Warning: Some snapshot blocks could not be freed, run fsck.\n");
+    if (write_superblock(ctx) != 0 || sync_disk(ctx) != 0) return -1;
+    return 0;
+}
+
+int snapshot_restore(IBFS_Context* ctx, const char* name) {
+    SnapshotEntry entries[snapshot_capacity(ctx)];
+    if (snapshot_read_entries(ctx, entries) != 0) return -1;
+    int slot = snapshot_find(ctx, entries, name);
+    if (slot < 0) {
+        fprintf(stderr, "snapshot Error: '%s' not found.\n", name);
+        return -1;
+    }
+    SnapshotEntry* entry = &entries[slot];
+    uint32_t* map;
+    if (snapshot_load_map(ctx, entry, &map) != 0) return -1;
+
+    /* The tree copy is the only step that needs much space, so it runs before the live state is dropped. */
+    uint32_t new_root;
+    if (bpt_rebuild(ctx, entry->root_bpt_block, 100, &new_root) != 0) {
+        fprintf(stderr, "snapshot Error: Failed to copy the snapshot's B+ Tree, image unchanged.\n");
+        free(map);
+        return -1;
+    }
+
+    uint32_t* blocks;
+    uint32_t count;
+    IBFS_BLOCK_ALIGNED char block_buffer[ctx->sb.block_size];
+    int result = -1;
+    printf("Releasing the current file system...\n");
+    if (snapshot_collect_blocks(ctx, &blocks, &count) != 0) {
+        bpt_free_tree(ctx, new_root);
+        goto out;
+    }
+    if (file_unref_blocks(ctx, blocks, count) != 0 || bpt_free_tree(ctx, ctx->sb.root_bpt_block) != 0) {
+        fprintf(stderr, "Warning: Some blocks of the current file system could not be freed, run fsck.\n");
+    }
+    free(blocks);
+
+    printf("Restoring inode bitmap and table...\n");
+    for (uint32_t i = 0; i < snapshot_meta_blocks(ctx); i++) {
+        if (read_block(ctx, map[i], block_buffer) != 0 ||
+            write_block(ctx, ctx->sb.inode_bitmap_start + i, block_buffer) != 0) {
+            fprintf(stderr, "snapshot Error: Failed to restore the inode table, run fsck.\n");
+            goto out;
+        }
+    }
+    ctx->sb.root_bpt_block = new_root;
+    ctx->sb.root_inode = entry->root_inode;
+    if (snapshot_share_live(ctx) != 0) {
+        fprintf(stderr, "snapshot Error: Failed to share data blocks, run fsck.\n");
+        goto out;
+    }
+    if ((ctx->sb.feature_flags & IBFS_FEATURE_NAME_INDEX) && name_index_rebuild(ctx) != 0) {
+        fprintf(stderr, "snapshot Error: Failed to rebuild the name index, run fsck.\n");
+        goto out;
+    }
+    uint32_t free_blocks, free_inodes;
+    if (bitmap_count_free(ctx, &free_blocks, &free_inodes) == 0) {
+        ctx->sb.free_blocks_count = free_blocks;
+        ctx->sb.free_inodes_count = free_inodes;
+    }
+    result = 0;
+
+out:
+    free(map);
+    if (write_superblock(ctx) != 0 || sync_disk(ctx) != 0) result = -1;
+    return result;
+}
+
+int snapshot_list(IBFS_Context* ctx) {
+    SnapshotEntry entries[snapshot_capacity(ctx)];
+    if (snapshot_read_entries(ctx, entries) != 0) return -1;
+    printf("Created          Name\n");
+    printf("---------------- --------\n");
+    for (uint32_t i = 0; i < snapshot_capacity(ctx); i++) {
+        if (entries[i].name[0] == '\0') continue;
+        time_t created = (time_t)entries[i].created;
+        char time_buf[32];
+        strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M", localtime(&created));
+        printf("%-16s %.*s\n", time_buf, IBFS_SNAPSHOT_NAME_LENGTH, entries[i].name);
+    }
+    return 0;
+}
+
+int snapshot_open(IBFS_Context* ctx, const char* name) {
+    SnapshotEntry entries[snapshot_capacity(ctx)];
+    if (snapshot_read_entries(ctx, entries) != 0) return -1;
+    int slot = snapshot_find(ctx, entries, name);
+    if (slot < 0) {
+        fprintf(stderr, "Error: Snapshot '%s' not found.\n", name);
+        return -1;
+    }
+    if (snapshot_load_map(ctx, &entries[slot], &ctx->meta_map) != 0) return -1;
+    ctx->sb.root_bpt_block = entries[slot].root_bpt_block;
+    ctx->sb.root_inode = entries[slot].root_inode;
+    /* Snapshots keep no name index; listings of the view sort the directory instead. */
+    ctx->sb.feature_flags &= ~IBFS_FEATURE_NAME_INDEX;
+    ctx->sb.name_index_root = 0;
+    ctx->read_only = true;
+    return 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "ibfs.h"
+
+int snapshot_create(IBFS_Context* ctx, const char* name);
+int snapshot_delete(IBFS_Context* ctx, const char* name);
+int snapshot_restore(IBFS_Context* ctx, const char* name);
+int snapshot_list(IBFS_Context* ctx);
+/* Switches ctx to a read-only view of the snapshot; the map is freed by ibfs_unmount. */
+int snapshot_open(IBFS_Context* ctx, const char* name);
+
+uint32_t snapshot_capacity(IBFS_Context* ctx);
+int snapshot_read_entries(IBFS_Context* ctx, SnapshotEntry* entries);
+int snapshot_load_map(IBFS_Context* ctx, const SnapshotEntry* entry, uint32_t** map_out);
+int snapshot_collect_blocks(IBFS_Context* view, uint32_t** blocks_out, uint32_t* count_out);
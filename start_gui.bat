@@ -3,7 +3,7 @@ echo Starting IBFS File Manager...
 echo Compiling C programs...
 
 REM Compile C programs
-gcc -o ibfs_tool ibfs_tool.c io.c bitmap.c inode.c bplustree.c
+gcc -o ibfs_tool ibfs_tool.c io.c bitmap.c inode.c bplustree.c file.c fsck.c path.c walk.c import.c refcount.c snapshot.c dedup.c lz.c crc32c.c device.c libibfs.c trace.c nameindex.c -pthread
 
 echo Starting web server...
 echo Browser will open automatically...
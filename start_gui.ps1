@@ -2,7 +2,7 @@ Write-Host "Starting IBFS File Manager..." -ForegroundColor Green
 Write-Host "Compiling C programs..." -ForegroundColor Yellow
 
 # Compile C programs
-gcc -o ibfs_tool ibfs_tool.c io.c bitmap.c inode.c bplustree.c
+gcc -o ibfs_tool ibfs_tool.c io.c bitmap.c inode.c bplustree.c file.c fsck.c path.c walk.c import.c refcount.c snapshot.c dedup.c lz.c crc32c.c device.c libibfs.c trace.c nameindex.c -pthread
 
 Write-Host "Starting web server..." -ForegroundColor Yellow
 Write-Host "Browser will open automatically..." -ForegroundColor Green
@@ -0,0 +1,264 @@
+#include "trace.h"
+#include "io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Full records only: appends from several processes never split one. */
+#define TRACE_BUFFER_SIZE (4096 * sizeof(IBFS_TraceRecord))
+
+static const char* trace_subsystem_names[IBFS_TRACE_SUBSYSTEMS] = {
+    "superblock", "inode bitmap", "inode table", "block bitmap", "b+ tree", "refcount", "snapshot", "dedup", "data"
+};
+
+static uint64_t trace_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int trace_open(IBFS_Context* ctx, const char* path) {
+    FILE* file = fopen(path, "ab");
+    if (!file) {
+        perror("Error opening trace file");
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    if (fseek(file, 0, SEEK_END) == 0 && ftell(file) == 0) {
+        IBFS_TraceHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, IBFS_TRACE_MAGIC, sizeof(header.magic));
+        header.block_size = ibfs_le32(ctx->sb.block_size);
+        header.block_count = ibfs_le32(ctx->sb.block_count);
+        if (fwrite(&header, sizeof(header), 1, file) != 1) {
+            perror("Error writing trace header");
+            fclose(file);
+            return -1;
+        }
+    }
+    ctx->trace = file;
+    return 0;
+}
+
+void trace_close(IBFS_Context* ctx) {
+    if (!ctx->trace) return;
+    if (fclose(ctx->trace) != 0) perror("Error closing trace file");
+    ctx->trace = NULL;
+}
+
+uint8_t trace_subsystem(IBFS_Context* ctx, uint32_t block_num, bool meta) {
+    const Superblock* sb = &ctx->sb;
+    if (block_num == 0) return IBFS_TRACE_SUPERBLOCK;
+    if (block_num >= sb->inode_bitmap_start && block_num < sb->inode_bitmap_start + sb->inode_bitmap_blocks) return IBFS_TRACE_INODE_BITMAP;
+    if (block_num >= sb->inode_table_start && block_num < sb->first_data_block) return IBFS_TRACE_INODE_TABLE;
+    if (block_num >= sb->first_data_block && sb->blocks_per_group != 0 &&
+        (block_num - sb->first_data_block) % sb->blocks_per_group == 0) {
+        return IBFS_TRACE_BLOCK_BITMAP;
+    }
+    if (meta) return IBFS_TRACE_BTREE;
+    if (sb->refcount_table_start != 0 && block_num >= sb->refcount_table_start &&
+        block_num < sb->refcount_table_start + sb->refcount_table_blocks) {
+        return IBFS_TRACE_REFCOUNT;
+    }
+    if (sb->snapshot_table_block != 0 && block_num == sb->snapshot_table_block) return IBFS_TRACE_SNAPSHOT;
+    if (sb->dedup_index_start != 0 && block_num >= sb->dedup_index_start &&
+        block_num < sb->dedup_index_start + sb->dedup_index_blocks) {
+        return IBFS_TRACE_DEDUP;
+    }
+    return IBFS_TRACE_DATA;
+}
+
+void trace_record(IBFS_Context* ctx, uint8_t op, uint32_t first_block, uint32_t count, uint8_t subsystem) {
+    uint64_t now = trace_clock(CLOCK_REALTIME);
+    while (count > 0) {
+        uint32_t part = count > UINT16_MAX ? UINT16_MAX : count;
+        IBFS_TraceRecord record;
+        record.time_ns = ibfs_le64(now);
+        record.block = ibfs_le32(first_block);
+        record.count = ibfs_le16(part);
+        record.op = op;
+        record.subsystem = subsystem;
+        fwrite(&record, sizeof(record), 1, ctx->trace);
+        first_block += part;
+        count -= part;
+    }
+}
+
+static int trace_compare_latency(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void trace_print_latency(const char* label, double* latencies, uint64_t count) {
+    if (count == 0) return;
+    qsort(latencies, count, sizeof(double), trace_compare_latency);
+    printf("  %s latency p50 / p99 / p99.9: %9.1f / %9.1f / %9.1f us\n", label,
+           latencies[(count - 1) * 50 / 100] / 1e3, latencies[(count - 1) * 99 / 100] / 1e3,
+           latencies[(count - 1) * 999 / 1000] / 1e3);
+}
+
+typedef struct TraceOrder {
+    uint64_t time_ns;
+    uint64_t index;
+} TraceOrder;
+
+/* Equal timestamps keep their file order, which is the order one process issued them in. */
+static int trace_compare_order(const void* a, const void* b) {
+    const TraceOrder* x = (const TraceOrder*)a;
+    const TraceOrder* y = (const TraceOrder*)b;
+    if (x->time_ns != y->time_ns) return x->time_ns < y->time_ns ? -1 : 1;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+typedef struct TraceSubsystemStats {
+    uint64_t requests;
+    uint64_t blocks;
+    double total_ns;
+} TraceSubsystemStats;
+
+/* Metadata records go through the cache and checksums the way the original requests did. */
+static int trace_read_meta(IBFS_Context* ctx, uint32_t block, uint32_t count, char* buffer) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (read_meta_block(ctx, block + i, buffer + (size_t)i * ctx->sb.block_size) != 0) return -1;
+    }
+    return 0;
+}
+
+static int trace_write_meta(IBFS_Context* ctx, uint32_t block, uint32_t count, char* buffer) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (write_meta_block(ctx, block + i, buffer + (size_t)i * ctx->sb.block_size) != 0) return -1;
+    }
+    return 0;
+}
+
+int trace_replay(IBFS_Context* ctx, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror("replay Error: Opening trace file");
+        return -1;
+    }
+    IBFS_TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, IBFS_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "replay Error: '%s' is not an IBFS trace.\n", path);
+        fclose(file);
+        return -1;
+    }
+    if (ibfs_le32(header.block_size) != ctx->sb.block_size) {
+        fprintf(stderr, "replay Error: Trace uses %u-byte blocks, the image %u-byte blocks.\n",
+                ibfs_le32(header.block_size), ctx->sb.block_size);
+        fclose(file);
+        return -1;
+    }
+
+    uint64_t capacity = 1 << 16, count = 0;
+    IBFS_TraceRecord* records = malloc(capacity * sizeof(IBFS_TraceRecord));
+    size_t n;
+    while (records && (n = fread(records + count, sizeof(IBFS_TraceRecord), (size_t)(capacity - count), file)) > 0) {
+        count += n;
+        if (count == capacity) {
+            IBFS_TraceRecord* grown = realloc(records, (size_t)(capacity * 2) * sizeof(IBFS_TraceRecord));
+            if (!grown) {
+                free(records);
+                records = NULL;
+                break;
+            }
+            records = grown;
+            capacity *= 2;
+        }
+    }
+    fclose(file);
+    /*
+     * Processes append their records in buffered chunks, so a trace shared by several of
+     * them is only ordered within each process. Replay follows the recorded timestamps.
+     */
+    TraceOrder* order = records ? malloc((size_t)(count + 1) * sizeof(TraceOrder)) : NULL;
+    uint32_t longest = 1;
+    for (uint64_t i = 0; order && i < count; i++) {
+        uint32_t length = ibfs_le16(records[i].count);
+        if (length > longest) longest = length;
+        order[i].time_ns = ibfs_le64(records[i].time_ns);
+        order[i].index = i;
+    }
+    double* reads = records ? malloc((size_t)(count + 1) * sizeof(double)) : NULL;
+    double* writes = records ? malloc((size_t)(count + 1) * sizeof(double)) : NULL;
+    char* buffer = alloc_block_buffer(ctx, longest);
+    if (!records || !order || !reads || !writes || !buffer) {
+        fprintf(stderr, "replay Error: Out of memory.\n");
+        free(records);
+        free(order);
+        free(reads);
+        free(writes);
+        free(buffer);
+        return -1;
+    }
+    qsort(order, count, sizeof(TraceOrder), trace_compare_order);
+
+    TraceSubsystemStats stats[IBFS_TRACE_SUBSYSTEMS];
+    memset(stats, 0, sizeof(stats));
+    uint64_t read_count = 0, write_count = 0, skipped = 0, blocks = 0;
+    double busy_ns = 0;
+    int result = 0;
+    uint64_t wall_start = trace_clock(CLOCK_MONOTONIC);
+    for (uint64_t i = 0; i < count; i++) {
+        const IBFS_TraceRecord* record = &records[order[i].index];
+        uint32_t block = ibfs_le32(record->block);
+        uint32_t length = ibfs_le16(record->count);
+        uint8_t op = record->op;
+        uint8_t subsystem = record->subsystem & ~IBFS_TRACE_META;
+        bool meta = (record->subsystem & IBFS_TRACE_META) != 0;
+        if ((op != IBFS_TRACE_READ && op != IBFS_TRACE_WRITE) || length == 0 || subsystem >= IBFS_TRACE_SUBSYSTEMS ||
+            (uint64_t)block + length > ctx->sb.block_count || (op == IBFS_TRACE_WRITE && ctx->read_only)) {
+            skipped++;
+            continue;
+        }
+        /* A write puts back what the blocks already hold, so replaying leaves the image as it was. */
+        if (op == IBFS_TRACE_WRITE && (meta ? trace_read_meta(ctx, block, length, buffer) : read_blocks(ctx, block, length, buffer)) != 0) {
+            result = -1;
+            break;
+        }
+        uint64_t start = trace_clock(CLOCK_MONOTONIC);
+        int rc;
+        if (meta) rc = op == IBFS_TRACE_READ ? trace_read_meta(ctx, block, length, buffer) : trace_write_meta(ctx, block, length, buffer);
+        else rc = op == IBFS_TRACE_READ ? read_blocks(ctx, block, length, buffer) : write_blocks(ctx, block, length, buffer);
+        double elapsed = (double)(trace_clock(CLOCK_MONOTONIC) - start);
+        if (rc != 0) {
+            result = -1;
+            break;
+        }
+        if (op == IBFS_TRACE_READ) reads[read_count++] = elapsed;
+        else writes[write_count++] = elapsed;
+        TraceSubsystemStats* s = &stats[subsystem];
+        s->requests++;
+        s->blocks += length;
+        s->total_ns += elapsed;
+        blocks += length;
+        busy_ns += elapsed;
+    }
+    double wall = (double)(trace_clock(CLOCK_MONOTONIC) - wall_start) / 1e9;
+    if (result == 0 && sync_disk(ctx) != 0) result = -1;
+
+    uint64_t replayed = read_count + write_count;
+    printf("Replayed %llu requests (%llu reads, %llu writes, %llu skipped) in %.3f s on the %s backend.\n",
+           (unsigned long long)replayed, (unsigned long long)read_count, (unsigned long long)write_count,
+           (unsigned long long)skipped, wall, ctx->device->ops->name);
+    if (count > 1) printf("  captured over:      %10.3f s\n", (double)(order[count - 1].time_ns - order[0].time_ns) / 1e9);
+    if (busy_ns > 0) {
+        printf("  throughput:         %10.0f requests/s, %.1f MiB/s\n", replayed / (busy_ns / 1e9),
+               (double)blocks * ctx->sb.block_size / (1024.0 * 1024.0) / (busy_ns / 1e9));
+    }
+    trace_print_latency("read ", reads, read_count);
+    trace_print_latency("write", writes, write_count);
+    printf("  %-14s %10s %10s %12s\n", "subsystem", "requests", "blocks", "mean us");
+    for (int s = 0; s < IBFS_TRACE_SUBSYSTEMS; s++) {
+        if (stats[s].requests == 0) continue;
+        printf("  %-14s %10llu %10llu %12.1f\n", trace_subsystem_names[s], (unsigned long long)stats[s].requests,
+               (unsigned long long)stats[s].blocks, stats[s].total_ns / stats[s].requests / 1e3);
+    }
+    free(records);
+    free(order);
+    free(reads);
+    free(writes);
+    free(buffer);
+    return result;
+}
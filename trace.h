@@ -0,0 +1,63 @@
+#pragma once
+#include "ibfs.h"
+
+/*
+ * Block access trace: a 32-byte header followed by one 16-byte record per
+ * block request, all little-endian. Processes tracing to the same file
+ * append to it; records carry wall-clock nanoseconds so they still sort.
+ * Requests are attributed to a subsystem by where the block lives. B+ tree
+ * nodes are told apart by their checksummed reads and writes; indirect
+ * blocks, refcount leaves and other blocks from the data area count as data.
+ * Single metadata blocks are recorded above the metadata cache, hits
+ * included, with IBFS_TRACE_META set in the subsystem byte; everything else
+ * is recorded as it reaches the device.
+ */
+#define IBFS_TRACE_MAGIC "IBFSTRC1"
+
+enum {
+    IBFS_TRACE_READ = 'R',
+    IBFS_TRACE_WRITE = 'W'
+};
+
+enum {
+    IBFS_TRACE_SUPERBLOCK,
+    IBFS_TRACE_INODE_BITMAP,
+    IBFS_TRACE_INODE_TABLE,
+    IBFS_TRACE_BLOCK_BITMAP,
+    IBFS_TRACE_BTREE,
+    IBFS_TRACE_REFCOUNT,
+    IBFS_TRACE_SNAPSHOT,
+    IBFS_TRACE_DEDUP,
+    IBFS_TRACE_DATA,
+    IBFS_TRACE_SUBSYSTEMS
+};
+
+#define IBFS_TRACE_META 0x80
+
+typedef struct IBFS_TraceHeader {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t reserved[4];
+} IBFS_TraceHeader;
+
+typedef struct IBFS_TraceRecord {
+    uint64_t time_ns;
+    uint32_t block;
+    uint16_t count;
+    uint8_t op;
+    uint8_t subsystem;
+} IBFS_TraceRecord;
+
+_Static_assert(sizeof(IBFS_TraceHeader) == 32, "IBFS_TraceHeader must stay 32 bytes");
+_Static_assert(sizeof(IBFS_TraceRecord) == 16, "IBFS_TraceRecord must stay 16 bytes");
+
+int trace_open(IBFS_Context* ctx, const char* path);
+void trace_close(IBFS_Context* ctx);
+uint8_t trace_subsystem(IBFS_Context* ctx, uint32_t block_num, bool meta);
+void trace_record(IBFS_Context* ctx, uint8_t op, uint32_t first_block, uint32_t count, uint8_t subsystem);
+/*
+ * Re-issues every request in the trace, in timestamp order, against ctx's device and prints throughput and latency.
+ * IBFS_TRACE_META records go through the metadata cache, so its size shapes the result.
+ */
+int trace_replay(IBFS_Context* ctx, const char* path);
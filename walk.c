@@ -0,0 +1,237 @@
+#include "walk.h"
+#include "inode.h"
+#include "io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct WalkDir {
+    uint32_t inode_num;
+    uint32_t depth;
+    char* path;
+} WalkDir;
+
+typedef struct WalkChild {
+    BPlusTreeKey key;
+    uint32_t inode_num;
+} WalkChild;
+
+typedef struct WalkChildren {
+    WalkChild* items;
+    uint32_t count;
+    uint32_t capacity;
+    int failed;
+} WalkChildren;
+
+typedef struct WalkState {
+    void (*callback)(const WalkEntry* entry, void* user_data);
+    void* user_data;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    WalkDir* queue;
+    uint32_t queue_count;
+    uint32_t queue_capacity;
+    int busy;
+    int failed;
+} WalkState;
+
+typedef struct WalkWorker {
+    WalkState* state;
+    IBFS_Context ctx;
+    WalkChildren children;
+} WalkWorker;
+
+static void walk_collect(BPlusTreeKey* key, uint32_t value, void* user_data) {
+    WalkChildren* children = (WalkChildren*)user_data;
+    if (children->failed) return;
+    if (children->count == children->capacity) {
+        uint32_t capacity = children->capacity ? children->capacity * 2 : 64;
+        WalkChild* items = realloc(children->items, capacity * sizeof(WalkChild));
+        if (!items) {
+            children->failed = 1;
+            return;
+        }
+        children->items = items;
+        children->capacity = capacity;
+    }
+    children->items[children->count].key = *key;
+    children->items[children->count].inode_num = value;
+    children->count++;
+}
+
+static int walk_compare_inode(const void* a, const void* b) {
+    uint32_t x = ((const WalkChild*)a)->inode_num, y = ((const WalkChild*)b)->inode_num;
+    return (x > y) - (x < y);
+}
+
+static int walk_push(WalkState* st, uint32_t inode_num, uint32_t depth, const char* path) {
+    char* copy = malloc(strlen(path) + 1);
+    if (!copy) return -1;
+    strcpy(copy, path);
+
+    pthread_mutex_lock(&st->lock);
+    if (st->queue_count == st->queue_capacity) {
+        uint32_t capacity = st->queue_capacity ? st->queue_capacity * 2 : 256;
+        WalkDir* queue = realloc(st->queue, capacity * sizeof(WalkDir));
+        if (!queue) {
+            pthread_mutex_unlock(&st->lock);
+            free(copy);
+            return -1;
+        }
+        st->queue = queue;
+        st->queue_capacity = capacity;
+    }
+    st->queue[st->queue_count].inode_num = inode_num;
+    st->queue[st->queue_count].depth = depth;
+    st->queue[st->queue_count].path = copy;
+    st->queue_count++;
+    pthread_cond_signal(&st->wake);
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static int walk_directory(WalkWorker* w, WalkDir* dir) {
+    WalkState* st = w->state;
+    IBFS_Context* ctx = &w->ctx;
+    WalkChildren* children = &w->children;
+
+    children->count = 0;
+    if (bpt_iterate(ctx, ctx->sb.root_bpt_block, dir->inode_num, walk_collect, children) != 0 || children->failed) {
+        fprintf(stderr, "walk: Failed to list directory inode %u\n", dir->inode_num);
+        return -1;
+    }
+
+    /* Visit children in inode order so each inode table block is read once. */
+    qsort(children->items, children->count, sizeof(WalkChild), walk_compare_inode);
+
+    uint32_t per_block = inodes_per_block(ctx);
+    uint32_t cached_block = 0;
+    IBFS_BLOCK_ALIGNED char table_block[ctx->sb.block_size];
+    size_t prefix = strlen(dir->path);
+    if (prefix == 1) prefix = 0;
+    char path[prefix + MAX_FILENAME_LENGTH + 2];
+    memcpy(path, dir->path, prefix);
+    path[prefix] = '/';
+
+    for (uint32_t i = 0; i < children->count; i++) {
+        WalkEntry entry;
+        entry.ctx = ctx;
+        entry.depth = dir->depth + 1;
+        entry.inode_num = children->items[i].inode_num;
+        entry.key = children->items[i].key;
+        if (entry.inode_num >= ctx->sb.inode_count) {
+            fprintf(stderr, "walk: Entry '%s' points at invalid inode %u\n", entry.key.name, entry.inode_num);
+            return -1;
+        }
+
+        uint32_t block = ctx->sb.inode_table_start + entry.inode_num / per_block;
+        if (block != cached_block) {
+            if (read_meta_block(ctx, block, table_block) != 0) return -1;
+            cached_block = block;
+        }
+        inode_unpack(ctx, table_block, entry.inode_num % per_block, &entry.inode);
+
+        strcpy(path + prefix + 1, entry.key.name);
+        entry.path = path;
+        st->callback(&entry, st->user_data);
+
+        if ((entry.inode.mode & S_IFDIR) == S_IFDIR &&
+            walk_push(st, entry.inode_num, entry.depth, path) != 0) {
+            fprintf(stderr, "walk: Out of memory queueing '%s'\n", path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void* walk_worker(void* arg) {
+    WalkWorker* w = (WalkWorker*)arg;
+    WalkState* st = w->state;
+
+    pthread_mutex_lock(&st->lock);
+    while (true) {
+        while (st->queue_count == 0 && st->busy > 0 && !st->failed) {
+            pthread_cond_wait(&st->wake, &st->lock);
+        }
+        if (st->queue_count == 0 || st->failed) break;
+
+        WalkDir dir = st->queue[--st->queue_count];
+        st->busy++;
+        pthread_mutex_unlock(&st->lock);
+
+        int rc = walk_directory(w, &dir);
+        free(dir.path);
+
+        pthread_mutex_lock(&st->lock);
+        st->busy--;
+        if (rc != 0) st->failed = 1;
+        if (st->failed || (st->busy == 0 && st->queue_count == 0)) {
+            pthread_cond_broadcast(&st->wake);
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+int ibfs_walk(IBFS_Context* ctx, uint32_t dir_inode_num, const char* dir_path,
+              int thread_count, void (*callback)(const WalkEntry* entry, void* user_data), void* user_data) {
+    if (thread_count < 1) thread_count = 1;
+
+    WalkState st;
+    memset(&st, 0, sizeof(WalkState));
+    st.callback = callback;
+    st.user_data = user_data;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.wake, NULL);
+
+    WalkWorker* workers = calloc(thread_count, sizeof(WalkWorker));
+    pthread_t* threads = calloc(thread_count, sizeof(pthread_t));
+    bool* started = calloc(thread_count, sizeof(bool));
+    int result = -1;
+    if (!workers || !threads || !started) {
+        fprintf(stderr, "walk: Out of memory\n");
+        goto out;
+    }
+    for (int t = 0; t < thread_count; t++) {
+        workers[t].state = &st;
+        workers[t].ctx = *ctx;
+        workers[t].ctx.device = ctx->device->ops->dup(ctx->device);
+        if (!workers[t].ctx.device) {
+            fprintf(stderr, "walk: Failed to open the image for a worker\n");
+            goto out;
+        }
+    }
+    if (walk_push(&st, dir_inode_num, 0, dir_path) != 0) goto out;
+
+    for (int t = 0; t < thread_count; t++) {
+        if (pthread_create(&threads[t], NULL, walk_worker, &workers[t]) != 0) {
+            fprintf(stderr, "walk: Failed to start worker %d\n", t);
+            pthread_mutex_lock(&st.lock);
+            st.failed = 1;
+            pthread_cond_broadcast(&st.wake);
+            pthread_mutex_unlock(&st.lock);
+            break;
+        }
+        started[t] = true;
+    }
+    for (int t = 0; t < thread_count; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+    }
+    result = st.failed ? -1 : 0;
+
+out:
+    for (int t = 0; workers && t < thread_count; t++) {
+        if (workers[t].ctx.device) workers[t].ctx.device->ops->close(workers[t].ctx.device);
+        free(workers[t].children.items);
+    }
+    for (uint32_t i = 0; i < st.queue_count; i++) free(st.queue[i].path);
+    free(st.queue);
+    free(workers);
+    free(threads);
+    free(started);
+    pthread_cond_destroy(&st.wake);
+    pthread_mutex_destroy(&st.lock);
+    return result;
+}
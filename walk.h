@@ -0,0 +1,20 @@
+#pragma once
+#include "ibfs.h"
+#include "bplustree.h"
+
+typedef struct WalkEntry {
+    IBFS_Context* ctx;
+    const char* path;
+    uint32_t depth;
+    uint32_t inode_num;
+    BPlusTreeKey key;
+    Inode inode;
+} WalkEntry;
+
+/*
+ * Visits every entry below dir_inode_num. Directories are handed out to
+ * thread_count workers, each reading through its own handle on the image
+ * (entry->ctx), so the callback runs concurrently and must lock shared state.
+ */
+int ibfs_walk(IBFS_Context* ctx, uint32_t dir_inode_num, const char* dir_path,
+              int thread_count, void (*callback)(const WalkEntry* entry, void* user_data), void* user_data);